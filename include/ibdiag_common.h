@@ -41,6 +41,7 @@
 
 #include <endian.h>
 
+#include <stdio.h>
 #include <stdarg.h>
 #include <infiniband/mad.h>
 #include <infiniband/iba/ib_types.h>
@@ -58,6 +59,8 @@ extern uint64_t ibd_mkey;
 extern uint64_t ibd_sakey;
 extern int show_keys;
 extern char *ibd_nd_format;
+extern unsigned ibd_mad_rate;
+extern unsigned ibd_mad_dest_rate;
 
 /*========================================================*/
 /*                External interface                      */
@@ -169,6 +172,7 @@ int snprint_field(char *buf, size_t n, enum MAD_FIELDS f, int spacing,
 		  const char *format, ...)
 	__attribute__((format(printf, 5, 6)));
 void dump_portinfo(void *pi, int tabs);
+void dump_discovery_stats(FILE *f, ibnd_fabric_t *fabric);
 
 /**
  * Some common command line parsing
@@ -1499,6 +1499,22 @@ MAD_EXPORT int mad_get_timeout(const struct ibmad_port *srcport,
 			       int override_ms);
 MAD_EXPORT int mad_get_retries(const struct ibmad_port *srcport);
 
+/* rate.c */
+/*
+ * Limit the MADs sent by mad_rpc() and libibnetdisc to rate per second
+ * overall and to dest_rate per second to any one destination (LID or DR
+ * path); 0 == no limit.  Process wide.
+ */
+MAD_EXPORT void madrpc_set_rate_limit(unsigned rate, unsigned dest_rate);
+#define MAD_RATE_LIMIT_GLOBAL	1
+#define MAD_RATE_LIMIT_DEST	2
+/*
+ * Returns 0 if a MAD may be sent to dport now, counting it against the
+ * limits.  Otherwise returns which limit it is held back by and sets
+ * *wait_us to how long that lasts.
+ */
+MAD_EXPORT int mad_rate_limit_take(ib_portid_t * dport, unsigned *wait_us);
+
 /* register.c */
 MAD_EXPORT int mad_register_port_client(int port_id, int mgmt,
 					uint8_t rmpp_version);
@@ -47,4 +47,7 @@ extern struct ibmad_port *ibmp;
 extern int madrpc_timeout;
 extern int madrpc_retries;
 
+/* rate.c; sleeps until mad_rate_limit_take() lets a MAD to dport go */
+void mad_rate_limit_wait(ib_portid_t * dport);
+
 #endif /* _MAD_INTERNAL_H_ */
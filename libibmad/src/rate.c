@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2011 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Token bucket limits on the MADs this process sends, shared by mad_rpc()
+ * and the libibnetdisc SMP engine.  Each bucket is kept as the time it will
+ * next be full (the GCRA form of a token bucket) so it can be updated with
+ * a single compare and swap by several threads.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+
+#include "mad_internal.h"
+
+/* a bucket holds MAD_RATE_BURST_NS worth of MADs, and at least one */
+#define MAD_RATE_BURST_NS 10000000ULL
+/* destinations hashing to the same bucket share its rate */
+#define MAD_RATE_DEST_BUCKETS 1024
+
+static unsigned rate_global, rate_dest;
+static uint64_t tat_global;
+static uint64_t tat_dest[MAD_RATE_DEST_BUCKETS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rate_interval(unsigned rate)
+{
+	return 1000000000ULL / rate;
+}
+
+/* returns 0 once a token is taken, otherwise the ns until one is there */
+static uint64_t bucket_take(uint64_t * tat, unsigned rate, uint64_t now)
+{
+	uint64_t interval = rate_interval(rate);
+	uint64_t depth = interval > MAD_RATE_BURST_NS ?
+			 interval : MAD_RATE_BURST_NS;
+	uint64_t old, new;
+
+	do {
+		old = *(volatile uint64_t *)tat;
+		new = (old > now ? old : now) + interval;
+		if (new > now + depth)
+			return new - now - depth;
+	} while (!__sync_bool_compare_and_swap(tat, old, new));
+	return 0;
+}
+
+static uint64_t *dest_bucket(ib_portid_t * dport)
+{
+	uint32_t hash = 2166136261U;	/* FNV-1a */
+	int i;
+
+	hash = (hash ^ (dport->lid & 0xff)) * 16777619U;
+	hash = (hash ^ ((dport->lid >> 8) & 0xff)) * 16777619U;
+	/* DR paths beyond a LID routed part count too */
+	for (i = 1; i <= dport->drpath.cnt; i++)
+		hash = (hash ^ dport->drpath.p[i]) * 16777619U;
+	return &tat_dest[hash % MAD_RATE_DEST_BUCKETS];
+}
+
+void madrpc_set_rate_limit(unsigned rate, unsigned dest_rate)
+{
+	rate_global = rate;
+	rate_dest = dest_rate;
+}
+
+int mad_rate_limit_take(ib_portid_t * dport, unsigned *wait_us)
+{
+	unsigned rate = rate_global, dest_rate = rate_dest;
+	uint64_t now, wait, *dest = NULL;
+
+	if (!rate && !dest_rate)
+		return 0;
+
+	now = now_ns();
+	if (dest_rate && dport) {
+		dest = dest_bucket(dport);
+		if ((wait = bucket_take(dest, dest_rate, now))) {
+			*wait_us = (unsigned)((wait + 999) / 1000);
+			return MAD_RATE_LIMIT_DEST;
+		}
+	}
+	if (rate && (wait = bucket_take(&tat_global, rate, now))) {
+		/* give the destination token back */
+		if (dest)
+			__sync_fetch_and_sub(dest, rate_interval(dest_rate));
+		*wait_us = (unsigned)((wait + 999) / 1000);
+		return MAD_RATE_LIMIT_GLOBAL;
+	}
+	return 0;
+}
+
+void mad_rate_limit_wait(ib_portid_t * dport)
+{
+	unsigned wait_us;
+
+	while (mad_rate_limit_take(dport, &wait_us))
+		usleep(wait_us);
+}
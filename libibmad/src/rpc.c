@@ -122,7 +122,7 @@ int mad_rpc_class_agent(struct ibmad_port *port, int class)
 
 static int
 _do_madrpc(int port_id, void *sndbuf, void *rcvbuf, int agentid, int len,
-	   int timeout, int max_retries, int *p_error)
+	   int timeout, int max_retries, int *p_error, ib_portid_t * dport)
 {
 	uint32_t trid;		/* only low 32 bits - see mad_trid() */
 	int retries;
@@ -153,6 +153,7 @@ _do_madrpc(int port_id, void *sndbuf, void *rcvbuf, int agentid, int len,
 		if (retries)
 			ERRS("retry %d (timeout %d ms)", retries, timeout);
 
+		mad_rate_limit_wait(dport);
 		length = len;
 		if (umad_send(port_id, agentid, sndbuf, length, timeout, 0) < 0) {
 			IBWARN("send failed; %s", strerror(errno));
@@ -233,7 +234,7 @@ void *mad_rpc(const struct ibmad_port *port, ib_rpc_t * rpc,
 		if ((len = _do_madrpc(port->port_id, sndbuf, rcvbuf,
 				      port->class_agents[rpc->mgtclass & 0xff],
 				      len, mad_get_timeout(port, rpc->timeout),
-				      mad_get_retries(port), &error)) < 0) {
+				      mad_get_retries(port), &error, dport)) < 0) {
 			if ((rpc->mgtclass & IB_MAD_RPC_VERSION_MASK) ==
 			    IB_MAD_RPC_VERSION1)
 				rpcv1->error = error;
@@ -293,7 +294,7 @@ void *mad_rpc_rmpp(const struct ibmad_port *port, ib_rpc_t * rpc,
 	if ((len = _do_madrpc(port->port_id, sndbuf, rcvbuf,
 			      port->class_agents[rpc->mgtclass & 0xff],
 			      len, mad_get_timeout(port, rpc->timeout),
-			      mad_get_retries(port), &error)) < 0) {
+			      mad_get_retries(port), &error, dport)) < 0) {
 		if ((rpc->mgtclass & IB_MAD_RPC_VERSION_MASK) == IB_MAD_RPC_VERSION1)
 			rpcv1->error = error;
 		IBWARN("_do_madrpc failed; dport (%s)", portid2str(dport));
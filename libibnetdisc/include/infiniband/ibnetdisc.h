@@ -97,13 +97,44 @@ typedef struct ibnd_node {
 
 	/* internal use only */
 	unsigned char ch_found;
-	struct ibnd_node *htnext;	/* hash table list */
+	struct ibnd_node *htnext;	/* nodes sharing a GUID */
 	struct ibnd_node *type_next;	/* next based on type */
+
+	/* NodeInfo, NodeDesc and SwitchInfo were queried by the last
+	 * discovery; always set by ibnd_discover_fabric() */
+	unsigned char refetched;
+	/* internal use only */
+	unsigned char visited;
 } ibnd_node_t;
 
 /** =========================================================================
  * Port
  */
+
+/* The PortInfo and MlnxExtPortInfo fields most tools print, decoded from
+ * info and ext_info once when the fabric is discovered, rediscovered or
+ * loaded, and again by ibnd_node_fetch_attrs().
+ */
+typedef struct ibnd_port_attrs {
+	uint32_t cap_mask;	/* host order; a switch port has the
+				 * CapabilityMask of port 0, or 0 when
+				 * port 0 is unknown */
+	uint8_t state;
+	uint8_t phys_state;
+	uint8_t width_active;
+	uint8_t width_supported;
+	uint8_t speed_active;
+	uint8_t speed_supported;
+	/* 0 unless cap_mask has IB_PORT_CAP_HAS_EXT_SPEEDS */
+	uint8_t espeed_active;
+	uint8_t espeed_supported;
+	/* MlnxExtPortInfo LinkSpeedActive/Supported, 0 if not queried */
+	uint8_t mlnx_speed_active;
+	uint8_t mlnx_speed_supported;
+	uint8_t vl_cap;
+	uint8_t hoq_life;
+	uint8_t vl_stall_count;
+} ibnd_port_attrs_t;
 typedef struct ibnd_port {
 	uint64_t guid;
 	int portnum;
@@ -118,7 +149,14 @@ typedef struct ibnd_port {
 	uint8_t ext_info[IB_SMP_DATA_SIZE];
 
 	/* internal use only */
-	struct ibnd_port *htnext;
+	struct ibnd_port *htnext;	/* ports sharing a GUID */
+
+	/* the link on this port was probed with NodeInfo, changed or went
+	 * down in the last discovery */
+	unsigned char refetched;
+
+	/* decoded copy of the hot fields of info and ext_info */
+	ibnd_port_attrs_t attrs;
 } ibnd_port_t;
 
 /** =========================================================================
@@ -138,12 +176,28 @@ typedef struct ibnd_chassis {
 #define LINES_MAX_NUM 36
 	ibnd_node_t *spinenode[SPINES_MAX_NUM + 1];
 	ibnd_node_t *linenode[LINES_MAX_NUM + 1];
+
+	/* internal use only */
+	struct ibnd_chassis *htnext;	/* chassis sharing a GUID */
 } ibnd_chassis_t;
 
 #define HTSZ 137
 
 /* define config flags */
 #define IBND_CONFIG_MLX_EPI (1 << 0)
+#define IBND_CONFIG_HYBRID_LID (1 << 1)	/* once a switch LID is known send
+						 * the rest of its queries LID
+						 * routed, falling back to DR */
+#define IBND_CONFIG_TOPOLOGY_ONLY (1 << 2)	/* nodes, ports and links
+						 * only; no NodeDesc,
+						 * SwitchInfo or
+						 * MlnxExtPortInfo */
+
+/* define SMP window modes */
+#define IBND_SMP_WINDOW_STATIC   0	/* always keep max_smps on the wire */
+#define IBND_SMP_WINDOW_ADAPTIVE 1	/* start at max_smps, grow while
+					 * responses are prompt, halve on
+					 * timeouts and errors */
 
 typedef struct ibnd_config {
 	unsigned max_smps;
@@ -154,9 +208,25 @@ typedef struct ibnd_config {
 	unsigned retries;
 	uint32_t flags;
 	uint64_t mkey;
-	uint8_t pad[44];
+	unsigned smp_window_mode;
+	unsigned min_smps;	/* adaptive window floor */
+	unsigned max_smps_limit;	/* adaptive window ceiling */
+	unsigned max_smps_per_target;	/* outstanding SMP's to any one
+					 * node, 0 == no limit */
+	unsigned deadline_ms;	/* give up on the SMP's still outstanding
+				 * this long after the scan started and
+				 * return what was found, 0 == no limit */
+	uint8_t pad[24];
 } ibnd_config_t;
 
+/* A port of a partial fabric the scan did not get past: either the
+ * PortInfo of node:portnum or the node behind it was never read.  portnum
+ * 0 of a switch means none of its ports were read. */
+typedef struct ibnd_frontier_port {
+	ibnd_node_t *node;
+	int portnum;
+} ibnd_frontier_port_t;
+
 /** =========================================================================
  * Fabric
  * Main fabric object which is returned and represents the data discovered
@@ -177,11 +247,23 @@ typedef struct ibnd_fabric {
 	unsigned total_mads_used;
 
 	/* internal use only */
+	/* no longer filled in; nodes and ports are found through
+	 * ibnd_find_node_guid() and ibnd_find_port_guid() */
 	ibnd_node_t *nodestbl[HTSZ];
 	ibnd_port_t *portstbl[HTSZ];
 	ibnd_node_t *switches;
 	ibnd_node_t *ch_adapters;
 	ibnd_node_t *routers;
+
+	/* SMP window at the end of the scan and the largest it reached */
+	unsigned smp_window_final;
+	unsigned smp_window_peak;
+
+	/* set when ibnd_config.deadline_ms expired before the scan was
+	 * done; frontier lists where it stopped */
+	int partial;
+	ibnd_frontier_port_t *frontier;
+	unsigned num_frontier;
 } ibnd_fabric_t;
 
 /** =========================================================================
@@ -199,16 +281,161 @@ IBND_EXPORT ibnd_fabric_t *ibnd_discover_fabric(char * ca_name,
 	 *       If NULL start from the CA/CA port specified
 	 * config: (optional) additional config options for the scan
 	 */
+
+typedef struct ibnd_local_port {
+	char *ca_name;
+	int ca_port;
+} ibnd_local_port_t;
+
+IBND_EXPORT ibnd_fabric_t *ibnd_discover_fabric_ports(ibnd_local_port_t * ports,
+						     int num_ports,
+						     struct ibnd_config *config);
+	/**
+	 * ports: local ports attached to the same fabric; each is scanned
+	 *        from by its own thread and the results are merged.
+	 *        DR paths in the fabric are relative to ports[0]
+	 * num_ports: number of entries in ports
+	 * config: (optional) additional config options for the scan,
+	 *         max_smps applies to each port
+	 */
+
+IBND_EXPORT ibnd_fabric_t *ibnd_discover_fabric_sa(char * ca_name,
+						  int ca_port,
+						  struct ibnd_config *config);
+	/**
+	 * Build the fabric from the NodeRecord, PortInfoRecord,
+	 * SwitchInfoRecord and LinkRecord tables of the SA instead of
+	 * sweeping it with SMPs.  It is only as current as the last SM
+	 * sweep and nodes or ports without a LID are not reported.
+	 *
+	 * ca_name: (optional) name of the CA to use
+	 * ca_port: (optional) CA port to use
+	 * config: (optional) timeout_ms, retries and mkey are used; the
+	 *         SMP window, max_hops and flags do not apply
+	 */
+IBND_EXPORT int ibnd_rediscover_fabric(ibnd_fabric_t * fabric,
+				      char * ca_name, int ca_port,
+				      struct ibnd_config *config);
+	/**
+	 * Bring fabric, from an earlier discovery or a cache, up to date.
+	 * Links which are still up are checked with a NodeInfo of the far
+	 * end, and NodeDesc and SwitchInfo are only queried for new links
+	 * and for links whose node GUID, port GUID or port number changed.
+	 * The ports of the other nodes are queried again.  Nodes which can no
+	 * longer be reached are removed.  refetched is set on the nodes and
+	 * ports which changed.
+	 *
+	 * returns 0 or -errno; on failure fabric should be destroyed
+	 */
+/* attributes for ibnd_node_fetch_attrs() */
+#define IBND_FETCH_NODE_DESC		(1 << 0)
+#define IBND_FETCH_SWITCH_INFO		(1 << 1)
+#define IBND_FETCH_MLNX_EXT_PORT_INFO	(1 << 2)
+#define IBND_FETCH_ALL			(IBND_FETCH_NODE_DESC | \
+					 IBND_FETCH_SWITCH_INFO | \
+					 IBND_FETCH_MLNX_EXT_PORT_INFO)
+
+IBND_EXPORT int ibnd_node_fetch_attrs(ibnd_fabric_t * fabric,
+				     ibnd_node_t * node, unsigned mask,
+				     char * ca_name, int ca_port,
+				     struct ibnd_config *config);
+	/**
+	 * Query the attributes in mask which IBND_CONFIG_TOPOLOGY_ONLY left
+	 * out, for node or for every node of fabric if node is NULL.  The
+	 * queries go out together through the SMP engine along the DR
+	 * paths of the nodes.  SwitchInfo is only asked of switches and
+	 * MlnxExtPortInfo only of the ports a full discovery would ask.
+	 * The DR paths of a fabric loaded from a cache are first rebuilt
+	 * from its from_node, so ca_name and ca_port should be the port it
+	 * was discovered from.
+	 *
+	 * returns 0 or -errno
+	 */
 IBND_EXPORT void ibnd_destroy_fabric(ibnd_fabric_t * fabric);
 
 IBND_EXPORT ibnd_fabric_t *ibnd_load_fabric(const char *file,
 					   unsigned int flags);
+	/**
+	 * Read a fabric written by ibnd_cache_fabric(), in either cache
+	 * format.  Version 2 caches are mmap()ed and read in place, by
+	 * as many threads as IBND_LOAD_FABRIC_THREADS() in flags asks for.
+	 */
 
 IBND_EXPORT int ibnd_cache_fabric(ibnd_fabric_t * fabric, const char *file,
 				 unsigned int flags);
+	/**
+	 * The cache is built in memory, written to a temporary file next
+	 * to file and renamed over it once it is on disk, so a reader sees
+	 * either the previous cache or the complete new one.
+	 */
+
+IBND_EXPORT int ibnd_cache_fabric_delta(ibnd_fabric_t * base,
+				       ibnd_fabric_t * fabric,
+				       const char *file, unsigned int flags);
+	/**
+	 * Cache only how fabric differs from base: the nodes and ports
+	 * added, removed or changed, PortInfo included.  flags are those of
+	 * ibnd_cache_fabric().
+	 */
+IBND_EXPORT ibnd_fabric_t *ibnd_load_fabric_delta(ibnd_fabric_t * base,
+						 const char *file,
+						 unsigned int flags);
+	/**
+	 * Apply a delta to the fabric it was taken against, or to one loaded
+	 * from a version 2 cache of it, and return the fabric it was taken
+	 * of.  base is left as it is.  Nodes keep the order of base; added
+	 * nodes follow.  flags must be 0; otherwise NULL is returned with
+	 * errno set to EINVAL.
+	 */
+IBND_EXPORT ibnd_fabric_t *ibnd_load_fabric_chain(const char *file,
+						 char *const *deltas,
+						 unsigned num_deltas,
+						 unsigned int flags);
+	/**
+	 * Load the cache file and apply num_deltas deltas to it in turn,
+	 * each taken against the fabric the previous one leads to.  flags
+	 * are those of ibnd_load_fabric() for loading file.
+	 */
+
+typedef struct ibnd_cache ibnd_cache_t;
+
+IBND_EXPORT ibnd_cache_t *ibnd_cache_open(const char *file,
+					 unsigned int flags);
+	/**
+	 * Open a version 2 cache to read its records one at a time without
+	 * building the fabric; memory use stays the same whatever its size.
+	 * Older caches are refused, load those with ibnd_load_fabric().
+	 */
+IBND_EXPORT ibnd_node_t *ibnd_cache_next_node(ibnd_cache_t * cache);
+	/**
+	 * Return the next node in the order it was cached, or NULL at the
+	 * end.  The node is owned by the cursor and valid until the next
+	 * call; it has no chassis and no links to other nodes.  Its ports
+	 * array only holds the port last returned and, for a switch, port 0.
+	 */
+IBND_EXPORT ibnd_port_t *ibnd_cache_next_port(ibnd_cache_t * cache);
+	/**
+	 * Return the next port of the node last returned, or NULL after its
+	 * last one.  remoteport and its node are read from the cache as
+	 * well and are valid until the next call.
+	 */
+IBND_EXPORT int ibnd_cache_close(ibnd_cache_t * cache);
+	/**
+	 * returns 0, or -1 if a record could not be read or was invalid
+	 * and the cursor stopped early
+	 */
 
 #define IBND_CACHE_FABRIC_FLAG_DEFAULT      0x0000
 #define IBND_CACHE_FABRIC_FLAG_NO_OVERWRITE 0x0001
+#define IBND_CACHE_FABRIC_FLAG_V1           0x0002	/* write the version 1
+							 * format older
+							 * libibnetdisc reads */
+
+/* ibnd_load_fabric() flags; the thread count is 1 to 255, 0 means 1 */
+#define IBND_LOAD_FABRIC_THREADS_SHIFT	8
+#define IBND_LOAD_FABRIC_THREADS_MASK	0xff00
+#define IBND_LOAD_FABRIC_THREADS(n)	(((n) & 0xff) << \
+					 IBND_LOAD_FABRIC_THREADS_SHIFT)
 
 /** =========================================================================
  * Node operations
@@ -238,6 +465,64 @@ typedef void (*ibnd_iter_port_func_t) (ibnd_port_t * port, void *user_data);
 IBND_EXPORT void ibnd_iter_ports(ibnd_fabric_t * fabric,
 				ibnd_iter_port_func_t func, void *user_data);
 
+/** =========================================================================
+ * Discovery statistics
+ */
+#define IBND_RTT_BUCKETS 24
+
+typedef struct ibnd_rtt_hist {
+	unsigned count;
+	unsigned max_us;
+	uint64_t total_us;
+	/* bucket 0: 0us, bucket n: [2^(n-1), 2^n) us, the last bucket
+	 * holds everything slower */
+	unsigned buckets[IBND_RTT_BUCKETS];
+} ibnd_rtt_hist_t;
+
+/* attributes with their own RTT histogram */
+enum ibnd_stats_attr {
+	IBND_STATS_ATTR_NODE_INFO,
+	IBND_STATS_ATTR_NODE_DESC,
+	IBND_STATS_ATTR_PORT_INFO,
+	IBND_STATS_ATTR_SWITCH_INFO,
+	IBND_STATS_ATTR_MLNX_EXT_PORT_INFO,
+	IBND_STATS_ATTR_OTHER,
+	IBND_STATS_NUM_ATTRS
+};
+
+#define IBND_STATS_MAX_HOPS 64
+
+/* New counters are only ever appended; callers pass the size of the
+ * struct they were built with to ibnd_get_discovery_stats(). */
+typedef struct ibnd_discovery_stats {
+	unsigned smps_sent;
+	unsigned responses;
+	unsigned timeouts;
+	unsigned retries;
+	unsigned status_errors;	/* umad or MAD status errors */
+	unsigned stale_responses;
+	unsigned dead_targets;
+	unsigned fast_failed;
+	unsigned peak_queue_depth;	/* SMP's waiting for the window */
+	unsigned peak_window;
+	unsigned lid_routed;	/* see IBND_CONFIG_HYBRID_LID */
+	unsigned lid_fallbacks;	/* LID routed SMP's resent DR */
+	ibnd_rtt_hist_t attr_rtt[IBND_STATS_NUM_ATTRS];
+	ibnd_rtt_hist_t hop_rtt[IBND_STATS_MAX_HOPS];	/* by DR hop count,
+							 * DR SMP's only */
+	unsigned rate_holds;	/* SMP's held back by the MAD rate limits */
+} ibnd_discovery_stats_t;
+
+IBND_EXPORT int ibnd_get_discovery_stats(ibnd_fabric_t * fabric,
+					ibnd_discovery_stats_t * stats,
+					size_t size);
+	/**
+	 * Fill the first size bytes of stats, sizeof(*stats) as the caller
+	 * was built, with what the SMP engine recorded while discovering
+	 * fabric.  Everything is zero for a fabric loaded from a cache.
+	 * Returns 0 or -EINVAL.
+	 */
+
 /** =========================================================================
  * Chassis queries
  */
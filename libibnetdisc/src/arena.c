@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2010 Lawrence Livermore National Laboratory
+ * Copyright (c) 2011 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Fabric objects are carved out of large zeroed chunks and freed all
+ * together, see ibnd_destroy_fabric().  The nodes a rediscovery drops are
+ * kept on free lists, one per size, for the nodes it adds next.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+#define ARENA_CHUNK_SIZE (256 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+#define ARENA_CHUNK_HDR ARENA_ALIGN(sizeof(struct arena_chunk))
+
+/* written over a freed block; the first block of each size heads a list
+ * of the others and links to the block of the next size */
+struct arena_free {
+	struct arena_free *next;
+	struct arena_free *next_size;
+	size_t size;
+};
+
+static struct arena_chunk *new_chunk(ibnd_arena_t * arena, size_t size)
+{
+	struct arena_chunk *chunk = calloc(1, ARENA_CHUNK_HDR + size);
+
+	if (!chunk)
+		return NULL;
+	chunk->size = size;
+	arena->num_chunks++;
+	arena->bytes += ARENA_CHUNK_HDR + size;
+	return chunk;
+}
+
+static void *arena_reuse(ibnd_arena_t * arena, size_t size)
+{
+	struct arena_free **head, *f;
+
+	for (head = &arena->free; (f = *head); head = &f->next_size)
+		if (f->size == size) {
+			if (f->next) {
+				f->next->next_size = f->next_size;
+				*head = f->next;
+			} else
+				*head = f->next_size;
+			memset(f, 0, size);
+			return f;
+		}
+	return NULL;
+}
+
+void *arena_alloc(ibnd_arena_t * arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *p;
+
+	size = ARENA_ALIGN(size);
+	if (arena->free && (p = arena_reuse(arena, size)))
+		return p;
+	if (!chunk || chunk->size - chunk->used < size) {
+		/* big objects get a chunk of their own behind the current
+		 * one, which keeps its free space */
+		if (size > ARENA_CHUNK_SIZE / 4 && chunk) {
+			struct arena_chunk *big = new_chunk(arena, size);
+
+			if (!big)
+				return NULL;
+			big->used = size;
+			big->next = chunk->next;
+			chunk->next = big;
+			return (uint8_t *)big + ARENA_CHUNK_HDR;
+		}
+		chunk = new_chunk(arena, size > ARENA_CHUNK_SIZE ?
+				  size : ARENA_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	p = (uint8_t *)chunk + ARENA_CHUNK_HDR + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+void arena_free(ibnd_arena_t * arena, void *p, size_t size)
+{
+	struct arena_free **head, *f = p;
+
+	size = ARENA_ALIGN(size);
+	/* too small to track; it stays lost until arena_destroy() */
+	if (size < sizeof(*f))
+		return;
+	for (head = &arena->free; *head && (*head)->size != size;
+	     head = &(*head)->next_size)
+		;
+	f->size = size;
+	f->next = *head;
+	f->next_size = *head ? (*head)->next_size : NULL;
+	*head = f;
+}
+
+/* take over the chunks of from, keeping the current chunk of arena */
+void arena_merge(ibnd_arena_t * arena, ibnd_arena_t * from)
+{
+	struct arena_free *head, *next_head, *f, *next;
+	struct arena_chunk *last;
+
+	for (head = from->free; head; head = next_head) {
+		next_head = head->next_size;
+		for (f = head; f; f = next) {
+			next = f->next;
+			arena_free(arena, f, f->size);
+		}
+	}
+	from->free = NULL;
+	if (!from->chunks)
+		return;
+	if (arena->chunks) {
+		for (last = from->chunks; last->next; last = last->next)
+			;
+		last->next = arena->chunks->next;
+		arena->chunks->next = from->chunks;
+	} else
+		arena->chunks = from->chunks;
+	arena->num_chunks += from->num_chunks;
+	arena->bytes += from->bytes;
+	memset(from, 0, sizeof(*from));
+}
+
+void arena_destroy(ibnd_arena_t * arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+	arena->num_chunks = 0;
+	arena->bytes = 0;
+	arena->free = NULL;
+}
@@ -43,6 +43,7 @@
 #endif				/* HAVE_CONFIG_H */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <inttypes.h>
 
 #include <infiniband/mad.h>
@@ -236,18 +237,15 @@ static uint64_t get_chassisguid(ibnd_node_t * node)
 		return sysimgguid;
 }
 
-static ibnd_chassis_t *find_chassisguid(ibnd_fabric_t * fabric,
-					ibnd_node_t * node)
+/* the first chassis listed with the chassis GUID of node */
+static ibnd_chassis_t *find_chassisguid(guid_tbl_t * tbl, ibnd_node_t * node)
 {
 	ibnd_chassis_t *current;
-	uint64_t chguid;
 
-	chguid = get_chassisguid(node);
-	for (current = fabric->chassis; current; current = current->next)
-		if (current->chassisguid == chguid)
-			return current;
-
-	return NULL;
+	current = guid_tbl_find(tbl, get_chassisguid(node));
+	while (current && current->htnext)
+		current = current->htnext;
+	return current;
 }
 
 uint64_t ibnd_get_chassis_guid(ibnd_fabric_t * fabric, unsigned char chassisnum)
@@ -1237,8 +1235,10 @@ int group_nodes(ibnd_fabric_t * fabric)
 	ibnd_chassis_t *chassis;
 	ibnd_chassis_t *ch, *ch_next;
 	chassis_scan_t chassis_scan;
+	guid_tbl_t chassis_tbl;
 	int vendor_id;
 
+	guid_tbl_init(&chassis_tbl, offsetof(ibnd_chassis_t, htnext));
 	chassis_scan.first_chassis = NULL;
 	chassis_scan.current_chassis = NULL;
 	chassis_scan.last_chassis = NULL;
@@ -1277,6 +1277,11 @@ int group_nodes(ibnd_fabric_t * fabric)
 			goto cleanup;
 	}
 
+	/* chassis are looked up by GUID in the order they are listed */
+	for (ch = chassis_scan.first_chassis; ch; ch = ch->next)
+		if (guid_tbl_add(&chassis_tbl, ch->chassisguid, ch) < 0)
+			goto cleanup;
+
 	/* now make pass on nodes for chassis which are not Voltaire */
 	/* grouped by common SystemImageGUID */
 	for (node = fabric->nodes; node; node = node->next) {
@@ -1284,7 +1289,7 @@ int group_nodes(ibnd_fabric_t * fabric)
 				  IB_NODE_VENDORID_F) == VTR_VENDOR_ID)
 			continue;
 		if (mad_get_field64(node->info, 0, IB_NODE_SYSTEM_GUID_F)) {
-			chassis = find_chassisguid(fabric, node);
+			chassis = find_chassisguid(&chassis_tbl, node);
 			if (chassis)
 				chassis->nodecount++;
 			else {
@@ -1294,6 +1299,10 @@ int group_nodes(ibnd_fabric_t * fabric)
 				chassis_scan.current_chassis->chassisguid =
 				    get_chassisguid(node);
 				chassis_scan.current_chassis->nodecount = 1;
+				if (guid_tbl_add(&chassis_tbl,
+						 get_chassisguid(node),
+						 chassis_scan.current_chassis) < 0)
+					goto cleanup;
 				if (!fabric->chassis)
 					fabric->chassis = chassis_scan.first_chassis;
 			}
@@ -1309,7 +1318,7 @@ int group_nodes(ibnd_fabric_t * fabric)
 		if (vendor_id == VTR_VENDOR_ID)
 			continue;
 		if (mad_get_field64(node->info, 0, IB_NODE_SYSTEM_GUID_F)) {
-			chassis = find_chassisguid(fabric, node);
+			chassis = find_chassisguid(&chassis_tbl, node);
 			if (chassis && chassis->nodecount > 1) {
 				if (!chassis->chassisnum)
 					chassis->chassisnum = ++chassisnum;
@@ -1324,10 +1333,12 @@ int group_nodes(ibnd_fabric_t * fabric)
 		}
 	}
 
+	guid_tbl_destroy(&chassis_tbl);
 	fabric->chassis = chassis_scan.first_chassis;
 	return 0;
 
 cleanup:
+	guid_tbl_destroy(&chassis_tbl);
 	ch = chassis_scan.first_chassis;
 	while (ch) {
 		ch_next = ch->next;
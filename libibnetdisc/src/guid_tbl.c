@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2010 Lawrence Livermore National Laboratory
+ * Copyright (c) 2011 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "internal.h"
+
+#define GUID_TBL_MIN_SIZE 64
+
+/* the murmur3 finalizer; GUIDs of one vendor differ in their low bits
+ * only, which must still spread over the whole table */
+static inline uint64_t guid_mix(uint64_t guid)
+{
+	guid ^= guid >> 33;
+	guid *= 0xff51afd7ed558ccdULL;
+	guid ^= guid >> 33;
+	guid *= 0xc4ceb9fe1a85ec53ULL;
+	guid ^= guid >> 33;
+	return guid;
+}
+
+static inline void **item_next(guid_tbl_t * tbl, void *item)
+{
+	return (void **)((char *)item + tbl->next_offs);
+}
+
+static guid_tbl_ent_t *find_slot(guid_tbl_t * tbl, uint64_t guid)
+{
+	unsigned mask = tbl->size - 1;
+	unsigned i = (unsigned)guid_mix(guid) & mask;
+
+	while (tbl->ents[i].item && tbl->ents[i].guid != guid)
+		i = (i + 1) & mask;
+	return &tbl->ents[i];
+}
+
+static int resize(guid_tbl_t * tbl, unsigned size)
+{
+	guid_tbl_ent_t *old = tbl->ents;
+	unsigned old_size = tbl->size, i;
+
+	if (!(tbl->ents = calloc(size, sizeof(*tbl->ents)))) {
+		tbl->ents = old;
+		return -ENOMEM;
+	}
+	tbl->size = size;
+	for (i = 0; i < old_size; i++)
+		if (old[i].item)
+			*find_slot(tbl, old[i].guid) = old[i];
+	free(old);
+	return 0;
+}
+
+static int grow(guid_tbl_t * tbl)
+{
+	return resize(tbl, tbl->size ? tbl->size * 2 : GUID_TBL_MIN_SIZE);
+}
+
+void guid_tbl_init(guid_tbl_t * tbl, size_t next_offs)
+{
+	memset(tbl, 0, sizeof(*tbl));
+	tbl->next_offs = next_offs;
+}
+
+void guid_tbl_destroy(guid_tbl_t * tbl)
+{
+	free(tbl->ents);
+	guid_tbl_init(tbl, tbl->next_offs);
+}
+
+/* size the table for count distinct GUIDs up front */
+int guid_tbl_reserve(guid_tbl_t * tbl, unsigned count)
+{
+	unsigned size = GUID_TBL_MIN_SIZE;
+
+	while (size < 2 * count)
+		size *= 2;
+	if (size <= tbl->size)
+		return 0;
+	return resize(tbl, size);
+}
+
+int guid_tbl_add(guid_tbl_t * tbl, uint64_t guid, void *item)
+{
+	guid_tbl_ent_t *ent;
+	void *cur;
+
+	/* keep the load at or below 1/2 */
+	if (2 * (tbl->count + 1) > tbl->size && grow(tbl))
+		return -ENOMEM;
+
+	ent = find_slot(tbl, guid);
+	if (!ent->item) {
+		ent->guid = guid;
+		ent->item = item;
+		*item_next(tbl, item) = NULL;
+		tbl->count++;
+		return 0;
+	}
+
+	for (cur = ent->item; cur; cur = *item_next(tbl, cur))
+		if (cur == item)
+			return 1;
+	*item_next(tbl, item) = ent->item;
+	ent->item = item;
+	return 0;
+}
+
+/* one thread of guid_tbl_add_all(): the items whose GUIDs hash into its
+ * range of slots, which ends at hi, leaving those that would probe past hi
+ * for later.  idx holds the indexes of just those items, in order. */
+typedef struct guid_tbl_part {
+	pthread_t thread;
+	guid_tbl_t *tbl;
+	void **items;
+	unsigned *idx;
+	unsigned count;
+	size_t guid_offs;
+	unsigned hi;
+	unsigned added;		/* distinct GUIDs */
+	unsigned *spill;
+	unsigned num_spill, max_spill;
+	int rc;
+} guid_tbl_part_t;
+
+static inline uint64_t item_guid(size_t guid_offs, void *item)
+{
+	return *(uint64_t *)((char *)item + guid_offs);
+}
+
+static int spill_item(guid_tbl_part_t * part, unsigned i)
+{
+	unsigned *spill;
+
+	if (part->num_spill == part->max_spill) {
+		part->max_spill = part->max_spill ? part->max_spill * 2 : 64;
+		spill = realloc(part->spill,
+				part->max_spill * sizeof(*part->spill));
+		if (!spill)
+			return -ENOMEM;
+		part->spill = spill;
+	}
+	part->spill[part->num_spill++] = i;
+	return 0;
+}
+
+static void *fill_part(void *arg)
+{
+	guid_tbl_part_t *part = arg;
+	guid_tbl_t *tbl = part->tbl;
+	unsigned mask = tbl->size - 1, i, s;
+	uint64_t guid;
+	void *item, *cur;
+
+	for (i = 0; i < part->count; i++) {
+		item = part->items[part->idx[i]];
+		guid = item_guid(part->guid_offs, item);
+		s = (unsigned)guid_mix(guid) & mask;
+		while (s < part->hi && tbl->ents[s].item &&
+		       tbl->ents[s].guid != guid)
+			s++;
+		/* Every later item with this GUID ends up here as well, so
+		 * they are still added in order. */
+		if (s == part->hi) {
+			if ((part->rc = spill_item(part, part->idx[i])))
+				break;
+			continue;
+		}
+		if (!tbl->ents[s].item) {
+			tbl->ents[s].guid = guid;
+			tbl->ents[s].item = item;
+			*item_next(tbl, item) = NULL;
+			part->added++;
+			continue;
+		}
+		for (cur = tbl->ents[s].item; cur; cur = *item_next(tbl, cur))
+			if (cur == item)
+				break;
+		if (!cur) {
+			*item_next(tbl, item) = tbl->ents[s].item;
+			tbl->ents[s].item = item;
+		}
+	}
+	return NULL;
+}
+
+static inline unsigned item_part(guid_tbl_t * tbl, size_t guid_offs,
+				  void *item, unsigned step, unsigned threads)
+{
+	unsigned s = (unsigned)guid_mix(item_guid(guid_offs, item)) &
+		     (tbl->size - 1);
+
+	return s / step < threads ? s / step : threads - 1;
+}
+
+/* Add count items as guid_tbl_add() would one after the other, their
+ * GUIDs at guid_offs, with up to threads threads each filling its own
+ * range of slots; reserve the table first.  One pass sorts the items by
+ * range, keeping their order, so each thread only sees its own.  Items
+ * probing past the end of a range are added afterwards, and as slots are
+ * only ever filled they still find theirs. */
+int guid_tbl_add_all(guid_tbl_t * tbl, void **items, unsigned count,
+		     size_t guid_offs, unsigned threads)
+{
+	guid_tbl_part_t *parts;
+	unsigned *idx, i, j, p, started, step;
+	void *item;
+	int rc = 0;
+
+	/* the parts do not grow the table, which must not fill up */
+	if (threads > tbl->size / GUID_TBL_MIN_SIZE)
+		threads = tbl->size / GUID_TBL_MIN_SIZE;
+	if (threads < 2 || count < threads ||
+	    tbl->count + count >= tbl->size) {
+		for (i = 0; i < count; i++)
+			if ((rc = guid_tbl_add(tbl, item_guid(guid_offs,
+							      items[i]),
+					       items[i])) < 0)
+				return rc;
+		return 0;
+	}
+
+	parts = calloc(threads, sizeof(*parts));
+	idx = malloc(count * sizeof(*idx));
+	if (!parts || !idx) {
+		free(parts);
+		free(idx);
+		return -ENOMEM;
+	}
+	step = tbl->size / threads;
+	for (i = 0; i < count; i++)
+		parts[item_part(tbl, guid_offs, items[i], step,
+				threads)].count++;
+	for (i = 0, j = 0; i < threads; i++) {
+		parts[i].tbl = tbl;
+		parts[i].items = items;
+		parts[i].idx = idx + j;
+		j += parts[i].count;
+		parts[i].count = 0;
+		parts[i].guid_offs = guid_offs;
+		parts[i].hi = i == threads - 1 ? tbl->size : (i + 1) * step;
+	}
+	for (i = 0; i < count; i++) {
+		p = item_part(tbl, guid_offs, items[i], step, threads);
+		parts[p].idx[parts[p].count++] = i;
+	}
+	for (started = 1; started < threads; started++)
+		if (pthread_create(&parts[started].thread, NULL, fill_part,
+				   &parts[started]))
+			break;
+	/* the calling thread takes the first part, and any that did not
+	 * get a thread of their own */
+	fill_part(&parts[0]);
+	for (i = started; i < threads; i++)
+		fill_part(&parts[i]);
+	for (i = 1; i < started; i++)
+		pthread_join(parts[i].thread, NULL);
+
+	for (i = 0; i < threads; i++) {
+		tbl->count += parts[i].added;
+		if (!rc)
+			rc = parts[i].rc;
+	}
+	for (i = 0; i < threads && rc >= 0; i++)
+		for (j = 0; j < parts[i].num_spill && rc >= 0; j++) {
+			item = items[parts[i].spill[j]];
+			rc = guid_tbl_add(tbl, item_guid(guid_offs, item), item);
+		}
+	for (i = 0; i < threads; i++)
+		free(parts[i].spill);
+	free(parts);
+	free(idx);
+	return rc < 0 ? rc : 0;
+}
+
+void *guid_tbl_find(guid_tbl_t * tbl, uint64_t guid)
+{
+	if (!tbl->count)
+		return NULL;
+	return find_slot(tbl, guid)->item;
+}
+
+/* stops at, and returns, the first non zero return of func */
+int guid_tbl_iter(guid_tbl_t * tbl, int (*func) (void *item, void *arg),
+		  void *arg)
+{
+	void *item, *next;
+	unsigned i;
+	int rc;
+
+	for (i = 0; i < tbl->size; i++)
+		for (item = tbl->ents[i].item; item; item = next) {
+			next = *item_next(tbl, item);
+			if ((rc = func(item, arg)))
+				return rc;
+		}
+	return 0;
+}
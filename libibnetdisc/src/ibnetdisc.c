@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <inttypes.h>
 
@@ -68,6 +69,23 @@ static int query_node_info(smp_engine_t * engine, ib_portid_t * portid,
 			   struct ni_cbdata * cbdata);
 static int query_port_info(smp_engine_t * engine, ib_portid_t * portid,
 			   ibnd_node_t * node, int portnum);
+static int recv_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
+			  uint8_t * mad, void *cb_data);
+
+/* With IBND_CONFIG_HYBRID_LID queries to a switch whose LID is known go
+ * LID routed (the engine falls back to portid if that fails).  Returns
+ * the LID to use or 0 to stay directed route. */
+static int hybrid_lid(smp_engine_t * engine, ib_portid_t * portid,
+		      ibnd_node_t * node)
+{
+	ibnd_scan_t *scan = engine->user_data;
+
+	if (!(scan->cfg->flags & IBND_CONFIG_HYBRID_LID) ||
+	    node->type != IB_NODE_SWITCH || portid->lid ||
+	    !scan->selfportid.lid)
+		return 0;
+	return node->smalid;
+}
 
 static int recv_switch_info(smp_engine_t * engine, ibnd_smp_t * smp,
 			    uint8_t * mad, void *cb_data)
@@ -84,8 +102,9 @@ static int query_switch_info(smp_engine_t * engine, ib_portid_t * portid,
 			     ibnd_node_t * node)
 {
 	node->smaenhsp0 = 0;	/* assume base SP0 */
-	return issue_smp(engine, portid, IB_ATTR_SWITCH_INFO, 0,
-			 recv_switch_info, node);
+	return issue_smp_lid(engine, portid, hybrid_lid(engine, portid, node),
+			     IB_ATTR_SWITCH_INFO, 0, SMP_PRIO_ATTR,
+			     recv_switch_info, node);
 }
 
 static int add_port_to_dpath(ib_dr_path_t * path, int nextport)
@@ -158,8 +177,9 @@ static int recv_node_desc(smp_engine_t * engine, ibnd_smp_t * smp,
 static int query_node_desc(smp_engine_t * engine, ib_portid_t * portid,
 			   ibnd_node_t * node)
 {
-	return issue_smp(engine, portid, IB_ATTR_NODE_DESC, 0,
-			 recv_node_desc, node);
+	return issue_smp_lid(engine, portid, hybrid_lid(engine, portid, node),
+			     IB_ATTR_NODE_DESC, 0, SMP_PRIO_ATTR,
+			     recv_node_desc, node);
 }
 
 static void debug_port(ib_portid_t * portid, ibnd_port_t * port)
@@ -195,6 +215,102 @@ static void debug_port(ib_portid_t * portid, ibnd_port_t * port)
 	     mad_dump_val(IB_PORT_LINK_SPEED_EXT_ACTIVE_F, speed, 64, &espeed));
 }
 
+/* The port SMPs along node's DR path enter it by.  PortInfo reports this
+ * as LocalPortNum but a LID routed query may arrive through another port,
+ * so for switches take it from the NodeInfo read along that path. */
+static uint8_t entry_port(ibnd_node_t * node, uint8_t * port_info)
+{
+	if (node->type == IB_NODE_SWITCH)
+		return (uint8_t) mad_get_field(node->info, 0,
+					       IB_NODE_LOCAL_PORT_F);
+	return (uint8_t) mad_get_field(port_info, 0, IB_PORT_LOCAL_PORT_F);
+}
+
+static int recv_verify_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
+				 uint8_t * mad, void *cb_data);
+
+/* Rediscovery checks that a link which was up and still is leads to the
+ * same node and port as before, see recv_verify_node_info(). */
+static int verify_node(smp_engine_t * engine, ib_portid_t * path,
+		       ibnd_node_t * node, int port_num)
+{
+	ibnd_port_t *remport = node->ports[port_num]->remoteport;
+	ibnd_node_t *remnode = remport->node;
+	struct ni_cbdata *cbdata;
+
+	/* confirmed through another link already; parallel links still being
+	 * verified are each asked so that they follow a replaced node */
+	if (remnode->visited == NODE_CONFIRMED)
+		return 0;
+
+	cbdata = malloc(sizeof(*cbdata));
+	if (!cbdata) {
+		IBND_ERROR("OOM: failed to verify 0x%" PRIx64 "\n",
+			   remnode->guid);
+		return -ENOMEM;
+	}
+	cbdata->node = node;
+	cbdata->port_num = port_num;
+	remnode->visited = NODE_VERIFYING;
+	/* DR; a LID routed query would find the LID whatever is there */
+	return issue_smp(engine, path, IB_ATTR_NODE_INFO, 0, SMP_PRIO_LINK,
+			 recv_verify_node_info, cbdata);
+}
+
+/* Find out what is at the other end of port_num of node if the link is up
+ * and DR can follow it. */
+static void follow_port(smp_engine_t * engine, ib_portid_t * portid,
+			ibnd_node_t * node, int port_num)
+{
+	ibnd_scan_t *scan = engine->user_data;
+	ibnd_port_t *port = node->ports[port_num];
+	int up = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F) ==
+		 IB_PORT_PHYS_STATE_LINKUP;
+	uint8_t local_port = entry_port(node, port->info);
+	struct ni_cbdata *cbdata;
+	ib_portid_t path = *portid;
+	int rc = 0;
+
+	/* only filling in attributes, see ibnd_node_fetch_attrs() */
+	if (scan->fetch_attrs)
+		return;
+
+	if (scan->rediscover && port_num && !up && port->remoteport) {
+		IBND_DEBUG("0x%" PRIx64 ":%d link went down\n", node->guid,
+			   port_num);
+		port->refetched = port->remoteport->refetched = 1;
+		port->remoteport->remoteport = NULL;
+		port->remoteport = NULL;
+	}
+
+	if (!port_num || !up ||
+	    !((node->type == IB_NODE_SWITCH && port_num != local_port) ||
+	      (node == scan->from_node && port_num == scan->from_portnum)))
+		return;
+
+	if (node->type != IB_NODE_SWITCH &&
+	    node == scan->from_node &&
+	    path.drpath.cnt > 1)
+		rc = retract_dpath(engine, &path);
+	else {
+		/* we can't proceed through an HCA with DR */
+		if (path.lid == 0 || node->type == IB_NODE_SWITCH)
+			rc = extend_dpath(engine, &path, port_num);
+	}
+	if (rc <= 0)
+		return;
+
+	if (scan->rediscover && port->remoteport) {
+		verify_node(engine, &path, node, port_num);
+		return;
+	}
+
+	cbdata = malloc(sizeof(*cbdata));
+	cbdata->node = node;
+	cbdata->port_num = port_num;
+	query_node_info(engine, &path, cbdata);
+}
+
 static int is_mlnx_ext_port_info_supported(ibnd_port_t * port)
 {
 	uint16_t devid = (uint16_t) mad_get_field(port->node->info, 0, IB_NODE_DEVID_F);
@@ -231,12 +347,12 @@ static int is_mlnx_ext_port_info_supported(ibnd_port_t * port)
 int mlnx_ext_port_info_err(smp_engine_t * engine, ibnd_smp_t * smp,
 			   uint8_t * mad, void *cb_data)
 {
-	f_internal_t *f_int = ((ibnd_scan_t *) engine->user_data)->f_int;
 	ibnd_node_t *node = cb_data;
 	ibnd_port_t *port;
-	uint8_t port_num, local_port;
+	uint8_t port_num;
 
-	port_num = (uint8_t) mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
+	/* mad may be NULL if the SMP was never answered */
+	port_num = (uint8_t) smp->rpc.attr.mod;
 	port = node->ports[port_num];
 	if (!port) {
 		IBND_ERROR("Failed to find 0x%" PRIx64 " port %u\n",
@@ -244,45 +360,18 @@ int mlnx_ext_port_info_err(smp_engine_t * engine, ibnd_smp_t * smp,
 		return -1;
 	}
 
-	local_port = (uint8_t) mad_get_field(port->info, 0, IB_PORT_LOCAL_PORT_F);
 	debug_port(&smp->path, port);
-
-	if (port_num && mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F)
-	    == IB_PORT_PHYS_STATE_LINKUP
-	    && ((node->type == IB_NODE_SWITCH && port_num != local_port) ||
-		(node == f_int->fabric.from_node && port_num == f_int->fabric.from_portnum))) {
-		int rc = 0;
-		ib_portid_t path = smp->path;
-
-		if (node->type != IB_NODE_SWITCH &&
-		    node == f_int->fabric.from_node &&
-		    path.drpath.cnt > 1)
-			rc = retract_dpath(engine, &path);
-		else {
-			/* we can't proceed through an HCA with DR */
-			if (path.lid == 0 || node->type == IB_NODE_SWITCH)
-				rc = extend_dpath(engine, &path, port_num);
-		}
-
-		if (rc > 0) {
-			struct ni_cbdata * cbdata = malloc(sizeof(*cbdata));
-			cbdata->node = node;
-			cbdata->port_num = port_num;
-			query_node_info(engine, &path, cbdata);
-		}
-	}
-
+	follow_port(engine, &smp->path, node, port_num);
 	return 0;
 }
 
 static int recv_mlnx_ext_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 				   uint8_t * mad, void *cb_data)
 {
-	f_internal_t *f_int = ((ibnd_scan_t *) engine->user_data)->f_int;
 	ibnd_node_t *node = cb_data;
 	ibnd_port_t *port;
 	uint8_t *ext_port_info = mad + IB_SMP_DATA_OFFS;
-	uint8_t port_num, local_port;
+	uint8_t port_num;
 
 	port_num = (uint8_t) mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
 	port = node->ports[port_num];
@@ -293,35 +382,36 @@ static int recv_mlnx_ext_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 	}
 
 	memcpy(port->ext_info, ext_port_info, sizeof(port->ext_info));
-	local_port = (uint8_t) mad_get_field(port->info, 0, IB_PORT_LOCAL_PORT_F);
 	debug_port(&smp->path, port);
+	follow_port(engine, &smp->path, node, port_num);
+	return 0;
+}
 
-	if (port_num && mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F)
-	    == IB_PORT_PHYS_STATE_LINKUP
-	    && ((node->type == IB_NODE_SWITCH && port_num != local_port) ||
-		(node == f_int->fabric.from_node && port_num == f_int->fabric.from_portnum))) {
-		int rc = 0;
-		ib_portid_t path = smp->path;
-
-		if (node->type != IB_NODE_SWITCH &&
-		    node == f_int->fabric.from_node &&
-		    path.drpath.cnt > 1)
-			rc = retract_dpath(engine, &path);
-		else {
-			/* we can't proceed through an HCA with DR */
-			if (path.lid == 0 || node->type == IB_NODE_SWITCH)
-				rc = extend_dpath(engine, &path, port_num);
-		}
+/* LinkUp/QDR ports of devices which may be running FDR10 */
+static int wants_mlnx_ext_port_info(ibnd_port_t * port)
+{
+	int phystate, ispeed, espeed;
+	uint8_t *info;
+	uint32_t cap_mask;
 
-		if (rc > 0) {
-			struct ni_cbdata * cbdata = malloc(sizeof(*cbdata));
-			cbdata->node = node;
-			cbdata->port_num = port_num;
-			query_node_info(engine, &path, cbdata);
-		}
-	}
+	if (!is_mlnx_ext_port_info_supported(port))
+		return 0;
 
-	return 0;
+	phystate = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F);
+	ispeed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
+	if (port->node->type == IB_NODE_SWITCH)
+		info = (uint8_t *)&port->node->ports[0]->info;
+	else
+		info = (uint8_t *)&port->info;
+	cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
+	if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
+		espeed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
+	else
+		espeed = 0;
+
+	return phystate == IB_PORT_PHYS_STATE_LINKUP &&
+	       ispeed == IB_LINK_SPEED_ACTIVE_10 &&
+	       espeed == IB_LINK_SPEED_EXT_ACTIVE_NONE;
 }
 
 static int query_mlnx_ext_port_info(smp_engine_t * engine, ib_portid_t * portid,
@@ -329,8 +419,20 @@ static int query_mlnx_ext_port_info(smp_engine_t * engine, ib_portid_t * portid,
 {
 	IBND_DEBUG("Query MLNX Extended Port Info; %s (0x%" PRIx64 "):%d\n",
 		   portid2str(portid), node->guid, portnum);
-	return issue_smp(engine, portid, IB_ATTR_MLNX_EXT_PORT_INFO, portnum,
-			 recv_mlnx_ext_port_info, node);
+	return issue_smp_lid(engine, portid, hybrid_lid(engine, portid, node),
+			     IB_ATTR_MLNX_EXT_PORT_INFO, portnum, SMP_PRIO_ATTR,
+			     recv_mlnx_ext_port_info, node);
+}
+
+static int port_hashed(ibnd_port_t * port, f_internal_t * f_int)
+{
+	ibnd_port_t *tblport;
+
+	for (tblport = guid_tbl_find(&f_int->ports_tbl, port->guid); tblport;
+	     tblport = tblport->htnext)
+		if (tblport == port)
+			return 1;
+	return 0;
 }
 
 static int recv_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
@@ -341,18 +443,14 @@ static int recv_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 	ibnd_node_t *node = cb_data;
 	ibnd_port_t *port;
 	uint8_t *port_info = mad + IB_SMP_DATA_OFFS;
-	uint8_t port_num, local_port;
-	int phystate, ispeed, espeed;
-	uint8_t *info;
-	uint32_t cap_mask;
+	uint8_t port_num;
 
 	port_num = (uint8_t) mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
-	local_port = (uint8_t) mad_get_field(port_info, 0, IB_PORT_LOCAL_PORT_F);
 
 	/* this may have been created before */
 	port = node->ports[port_num];
 	if (!port) {
-		port = node->ports[port_num] = calloc(1, sizeof(*port));
+		port = alloc_port(f_int, node, port_num);
 		if (!port) {
 			IBND_ERROR("Failed to allocate 0x%" PRIx64 " port %u\n",
 				    node->guid, port_num);
@@ -377,75 +475,43 @@ static int recv_port_info(smp_engine_t * engine, ibnd_smp_t * smp,
 		port->lmc = node->smalmc;
 	}
 
-	int rc1 = add_to_portguid_hash(port, f_int->fabric.portstbl);
-	if (rc1)
-		IBND_ERROR("Error Occurred when trying"
-			   " to insert new port guid 0x%016" PRIx64 " to DB\n",
-			   port->guid);
-
-	add_to_portlid_hash(port, f_int);
+	/* with several scans the same port may be queried more than once */
+	if (!port_hashed(port, f_int)) {
+		int rc1 = add_to_portguid_hash(port, f_int);
+		if (rc1)
+			IBND_ERROR("Error Occurred when trying"
+				   " to insert new port guid 0x%016" PRIx64
+				   " to DB\n", port->guid);
 
-	if ((scan->cfg->flags & IBND_CONFIG_MLX_EPI)
-	    && is_mlnx_ext_port_info_supported(port)) {
-		phystate = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F);
-		ispeed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
-		if (port->node->type == IB_NODE_SWITCH)
-			info = (uint8_t *)&port->node->ports[0]->info;
-		else
-			info = (uint8_t *)&port->info;
-		cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
-		if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
-			espeed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
-		else
-			espeed = 0;
-
-		if (phystate == IB_PORT_PHYS_STATE_LINKUP &&
-		    ispeed == IB_LINK_SPEED_ACTIVE_10 &&
-		    espeed == IB_LINK_SPEED_EXT_ACTIVE_NONE) {	/* LinkUp/QDR */
-			query_mlnx_ext_port_info(engine, &smp->path,
-						 node, port_num);
-			return 0;
-		}
+		add_to_portlid_hash(port, f_int);
 	}
 
-	debug_port(&smp->path, port);
-
-	if (port_num && mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F)
-	    == IB_PORT_PHYS_STATE_LINKUP
-	    && ((node->type == IB_NODE_SWITCH && port_num != local_port) ||
-		(node == f_int->fabric.from_node && port_num == f_int->fabric.from_portnum))) {
-
-		int rc = 0;
-		ib_portid_t path = smp->path;
-
-		if (node->type != IB_NODE_SWITCH &&
-		    node == f_int->fabric.from_node &&
-		    path.drpath.cnt > 1)
-			rc = retract_dpath(engine, &path);
-		else {
-			/* we can't proceed through an HCA with DR */
-			if (path.lid == 0 || node->type == IB_NODE_SWITCH)
-				rc = extend_dpath(engine, &path, port_num);
-		}
-
-		if (rc > 0) {
-			struct ni_cbdata * cbdata = malloc(sizeof(*cbdata));
-			cbdata->node = node;
-			cbdata->port_num = port_num;
-			query_node_info(engine, &path, cbdata);
-		}
+	if ((scan->cfg->flags & IBND_CONFIG_MLX_EPI) &&
+	    !(scan->cfg->flags & IBND_CONFIG_TOPOLOGY_ONLY) &&
+	    wants_mlnx_ext_port_info(port)) {
+		query_mlnx_ext_port_info(engine, &smp->path, node, port_num);
+		return 0;
 	}
 
+	debug_port(&smp->path, port);
+	follow_port(engine, &smp->path, node, port_num);
 	return 0;
 }
 
 static int recv_port0_info(smp_engine_t * engine, ibnd_smp_t * smp,
 			   uint8_t * mad, void *cb_data)
 {
+	ibnd_scan_t *scan = engine->user_data;
 	ibnd_node_t *node = cb_data;
 	int i, status;
 
 	status = recv_port_info(engine, smp, mad, cb_data);
+	/* held back by recv_node_info() until the switch LID was known */
+	if ((scan->cfg->flags & IBND_CONFIG_HYBRID_LID) &&
+	    !(scan->cfg->flags & IBND_CONFIG_TOPOLOGY_ONLY) && node->refetched) {
+		query_node_desc(engine, &smp->path, node);
+		query_switch_info(engine, &smp->path, node);
+	}
 	/* Query PortInfo on switch external/physical ports */
 	for (i = 1; i <= node->numports; i++)
 		query_port_info(engine, &smp->path, node, i);
@@ -453,20 +519,136 @@ static int recv_port0_info(smp_engine_t * engine, ibnd_smp_t * smp,
 	return status;
 }
 
+/* A link which still ends at the node GUID, port GUID and port number it
+ * did is taken to lead to the same node, and only its ports are checked
+ * again; otherwise the NodeInfo is handled like that of any new link. */
+static int recv_verify_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
+				 uint8_t * mad, void *cb_data)
+{
+	struct ni_cbdata *cbdata = cb_data;
+	ibnd_port_t *remport = cbdata->node->ports[cbdata->port_num]->remoteport;
+	uint8_t *node_info = mad + IB_SMP_DATA_OFFS;
+	ibnd_node_t *node;
+
+	if (!remport)
+		return recv_node_info(engine, smp, mad, cbdata);
+
+	node = remport->node;
+	if (mad_get_field64(node_info, 0, IB_NODE_GUID_F) != node->guid ||
+	    mad_get_field64(node_info, 0, IB_NODE_PORT_GUID_F) !=
+	    remport->guid ||
+	    mad_get_field(node_info, 0, IB_NODE_LOCAL_PORT_F) !=
+	    remport->portnum) {
+		IBND_DEBUG("%s: not 0x%" PRIx64 ":%d any more\n",
+			   portid2str(&smp->path), node->guid,
+			   remport->portnum);
+		if (node->visited != NODE_CONFIRMED)
+			node->visited = NODE_UNSEEN;
+		return recv_node_info(engine, smp, mad, cbdata);
+	}
+
+	free(cbdata);
+	if (node->visited == NODE_CONFIRMED)
+		return 0;
+	node->visited = NODE_CONFIRMED;
+	node->path_portid = smp->path;
+	/* entered by another port than last time, maybe */
+	memcpy(node->info, node_info, sizeof(node->info));
+	return query_port_info(engine, &smp->path, node,
+			       node->type == IB_NODE_SWITCH ? 0 :
+			       remport->portnum);
+}
+
 static int query_port_info(smp_engine_t * engine, ib_portid_t * portid,
 			   ibnd_node_t * node, int portnum)
 {
 	IBND_DEBUG("Query Port Info; %s (0x%" PRIx64 "):%d\n",
 		   portid2str(portid), node->guid, portnum);
-	return issue_smp(engine, portid, IB_ATTR_PORT_INFO, portnum,
-			 portnum ? recv_port_info : recv_port0_info, node);
+	return issue_smp_lid(engine, portid, hybrid_lid(engine, portid, node),
+			     IB_ATTR_PORT_INFO, portnum,
+			     node->type == IB_NODE_SWITCH ? SMP_PRIO_PORT :
+			     SMP_PRIO_ATTR,
+			     portnum ? recv_port_info : recv_port0_info, node);
+}
+
+/* The node and its ports array come out of the arena in one piece.  A
+ * switch, all of whose ports are normally found, gets room for them right
+ * behind; CA and router ports are only allocated once seen, as often
+ * just one of them is cabled. */
+static size_t ports_array_size(int numports)
+{
+	return ARENA_ALIGN((numports + 1) * sizeof(ibnd_port_t *));
+}
+
+static size_t node_size(int type, int numports)
+{
+	size_t size = ARENA_ALIGN(sizeof(ibnd_node_t)) +
+		      ports_array_size(numports);
+
+	if (type == IB_NODE_SWITCH)
+		size += (numports + 1) * sizeof(ibnd_port_t);
+	return size;
+}
+
+ibnd_node_t *alloc_node(f_internal_t * f_int, int type, int numports)
+{
+	ibnd_node_t *node;
+
+	node = arena_alloc(&f_int->arena, node_size(type, numports));
+	if (!node)
+		return NULL;
+	node->type = type;
+	node->numports = numports;
+	node->ports = (ibnd_port_t **)((uint8_t *)node +
+				       ARENA_ALIGN(sizeof(ibnd_node_t)));
+	return node;
 }
 
-static ibnd_node_t *create_node(smp_engine_t * engine, ib_portid_t * path,
-				uint8_t * node_info)
+/* give node and its ports back to the arena for the next alloc_node() and
+ * alloc_port(); nothing may point at them any more */
+void free_node(f_internal_t * f_int, ibnd_node_t * node)
 {
-	f_internal_t *f_int = ((ibnd_scan_t *) engine->user_data)->f_int;
-	ibnd_node_t *rc = calloc(1, sizeof(*rc));
+	int p;
+
+	if (node->type != IB_NODE_SWITCH)
+		for (p = 0; p <= node->numports; p++)
+			if (node->ports[p])
+				arena_free(&f_int->arena, node->ports[p],
+					   sizeof(ibnd_port_t));
+	arena_free(&f_int->arena, node,
+		   node_size(node->type, node->numports));
+}
+
+/* returns the port if it was allocated already, NULL if the node has no
+ * such port */
+ibnd_port_t *alloc_port(f_internal_t * f_int, ibnd_node_t * node,
+			int portnum)
+{
+	ibnd_port_t *port;
+
+	if (portnum < 0 || portnum > node->numports)
+		return NULL;
+	if (node->ports[portnum])
+		return node->ports[portnum];
+
+	if (node->type == IB_NODE_SWITCH)
+		port = (ibnd_port_t *)((uint8_t *)node->ports +
+			ports_array_size(node->numports)) + portnum;
+	else if (!(port = arena_alloc(&f_int->arena, sizeof(*port))))
+		return NULL;
+	port->node = node;
+	port->portnum = portnum;
+	node->ports[portnum] = port;
+	return port;
+}
+
+ibnd_node_t *create_node(f_internal_t * f_int, ib_portid_t * path,
+			 uint8_t * node_info)
+{
+	ibnd_node_t *rc;
+
+	rc = alloc_node(f_int, mad_get_field(node_info, 0, IB_NODE_TYPE_F),
+			mad_get_field(node_info, 0, IB_NODE_NPORTS_F));
 	if (!rc) {
 		IBND_ERROR("OOM: node creation failed\n");
 		return NULL;
@@ -474,20 +656,11 @@ static ibnd_node_t *create_node(smp_engine_t * engine, ib_portid_t * path,
 
 	/* decode just a couple of fields for quicker reference. */
 	mad_decode_field(node_info, IB_NODE_GUID_F, &rc->guid);
-	mad_decode_field(node_info, IB_NODE_TYPE_F, &rc->type);
-	mad_decode_field(node_info, IB_NODE_NPORTS_F, &rc->numports);
-
-	rc->ports = calloc(rc->numports + 1, sizeof(*rc->ports));
-	if (!rc->ports) {
-		free(rc);
-		IBND_ERROR("OOM: Failed to allocate the ports array\n");
-		return NULL;
-	}
 
 	rc->path_portid = *path;
 	memcpy(rc->info, node_info, sizeof(rc->info));
 
-	int rc1 = add_to_nodeguid_hash(rc, f_int->fabric.nodestbl);
+	int rc1 = add_to_nodeguid_hash(rc, f_int);
 	if (rc1)
 		IBND_ERROR("Error Occurred when trying"
 			   " to insert new node guid 0x%016" PRIx64 " to DB\n",
@@ -502,8 +675,8 @@ static ibnd_node_t *create_node(smp_engine_t * engine, ib_portid_t * path,
 	return rc;
 }
 
-static void link_ports(ibnd_node_t * node, ibnd_port_t * port,
-		       ibnd_node_t * remotenode, ibnd_port_t * remoteport)
+void link_ports(ibnd_node_t * node, ibnd_port_t * port,
+		ibnd_node_t * remotenode, ibnd_port_t * remoteport)
 {
 	IBND_DEBUG("linking: 0x%" PRIx64 " %p->%p:%u and 0x%" PRIx64
 		   " %p->%p:%u\n", node->guid, node, port, port->portnum,
@@ -539,7 +712,7 @@ static int recv_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
 	ibnd_node_t *rem_node = NULL;
 	int rem_port_num = 0;
 	ibnd_node_t *node;
-	int node_is_new = 0;
+	int node_is_new = 0, rescan = 0;
 	uint64_t node_guid = mad_get_field64(node_info, 0, IB_NODE_GUID_F);
 	uint64_t port_guid = mad_get_field64(node_info, 0, IB_NODE_PORT_GUID_F);
 	int port_num = mad_get_field(node_info, 0, IB_NODE_LOCAL_PORT_F);
@@ -553,23 +726,34 @@ static int recv_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
 
 	node = ibnd_find_node_guid(&f_int->fabric, node_guid);
 	if (!node) {
-		node = create_node(engine, &smp->path, node_info);
+		node = create_node(f_int, &smp->path, node_info);
 		if (!node)
 			return -1;
 		node_is_new = 1;
+	} else if (scan->rediscover && node->visited != NODE_CONFIRMED) {
+		/* a known node reached by NodeInfo is new at the end of this
+		 * link, or failed verify_node(), so it is fetched again; the
+		 * start node only has its ports checked */
+		memcpy(node->info, node_info, sizeof(node->info));
+		node->path_portid = smp->path;
+		if (rem_node)
+			node_is_new = 1;
+		else
+			rescan = 1;
 	}
+	if (node_is_new)
+		node->refetched = 1;
+	node->visited = NODE_CONFIRMED;
 	IBND_DEBUG("Found %s node GUID 0x%" PRIx64 " (%s)\n",
 		   node_is_new ? "new" : "old", node->guid,
 		   portid2str(&smp->path));
 
-	port = node->ports[port_num];
+	/* If we have not see this port before create a shell for it */
+	port = alloc_port(f_int, node, port_num);
 	if (!port) {
-		/* If we have not see this port before create a shell for it */
-		port = node->ports[port_num] = calloc(1, sizeof(*port));
-		if (!port)
-			return -1;
-		port->node = node;
-		port->portnum = port_num;
+		IBND_ERROR("Failed to allocate 0x%" PRIx64 " port %d\n",
+			   node->guid, port_num);
+		return -1;
 	}
 	port->guid = port_guid;
 
@@ -578,8 +762,8 @@ static int recv_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
 			     node, port);
 
 	if (rem_node == NULL) {	/* this is the start node */
-		f_int->fabric.from_node = node;
-		f_int->fabric.from_portnum = port_num;
+		scan->from_node = node;
+		scan->from_portnum = port_num;
 	} else {
 		/* link ports... */
 		if (!rem_node->ports[rem_port_num]) {
@@ -590,18 +774,31 @@ static int recv_node_info(smp_engine_t * engine, ibnd_smp_t * smp,
 			return -1;
 		}
 
+		if (port->remoteport != rem_node->ports[rem_port_num])
+			port->refetched = 1;
+		rem_node->ports[rem_port_num]->refetched = port->refetched;
 		link_ports(node, port, rem_node, rem_node->ports[rem_port_num]);
 	}
 
 	if (node_is_new) {
-		query_node_desc(engine, &smp->path, node);
+		/* in hybrid mode a switch is asked for its LID first, see
+		 * recv_port0_info() */
+		int defer = node->type == IB_NODE_SWITCH &&
+			    (scan->cfg->flags & IBND_CONFIG_HYBRID_LID);
+		/* or left to ibnd_node_fetch_attrs() */
+		int attrs = !(scan->cfg->flags & IBND_CONFIG_TOPOLOGY_ONLY);
+
+		if (attrs && !defer)
+			query_node_desc(engine, &smp->path, node);
 
 		if (node->type == IB_NODE_SWITCH) {
-			query_switch_info(engine, &smp->path, node);
+			if (attrs && !defer)
+				query_switch_info(engine, &smp->path, node);
 			/* Query PortInfo on Switch Port 0 first */
 			query_port_info(engine, &smp->path, node, 0);
 		}
-	}
+	} else if (rescan && node->type == IB_NODE_SWITCH)
+		query_port_info(engine, &smp->path, node, 0);
 
 	if (node->type != IB_NODE_SWITCH)
 		query_port_info(engine, &smp->path, node, port_num);
@@ -613,25 +810,97 @@ static int query_node_info(smp_engine_t * engine, ib_portid_t * portid,
 			   struct ni_cbdata * cbdata)
 {
 	IBND_DEBUG("Query Node Info; %s\n", portid2str(portid));
-	return issue_smp(engine, portid, IB_ATTR_NODE_INFO, 0,
+	return issue_smp(engine, portid, IB_ATTR_NODE_INFO, 0, SMP_PRIO_LINK,
 			 recv_node_info, (void *)cbdata);
 }
 
-ibnd_node_t *ibnd_find_node_guid(ibnd_fabric_t * fabric, uint64_t guid)
+static int add_frontier(f_internal_t * f_int, ibnd_node_t * node, int portnum)
 {
-	int hash = HASHGUID(guid) % HTSZ;
-	ibnd_node_t *node;
+	ibnd_fabric_t *fabric = &f_int->fabric;
+	ibnd_frontier_port_t *frontier;
+	unsigned n = fabric->num_frontier;
+
+	/* grow by doubling */
+	if (!n || (n >= 16 && !(n & (n - 1)))) {
+		frontier = realloc(fabric->frontier,
+				   (n ? 2 * n : 16) * sizeof(*frontier));
+		if (!frontier) {
+			IBND_ERROR("OOM: failed to grow frontier list\n");
+			return -ENOMEM;
+		}
+		fabric->frontier = frontier;
+	}
+	fabric->frontier[n].node = node;
+	fabric->frontier[n].portnum = portnum;
+	fabric->num_frontier++;
+	return 0;
+}
+
+/* Note which port each SMP left unanswered at the deadline would have
+ * led on from. */
+static int abandon_smp(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	ibnd_scan_t *scan = engine->user_data;
+	struct ni_cbdata *cbdata;
+	int rc = 0;
+
+	if (smp->cb == recv_node_info || smp->cb == recv_verify_node_info) {
+		cbdata = smp->cb_data;
+		/* NULL for the node the scan starts from */
+		if (!cbdata)
+			return 0;
+		rc = add_frontier(scan->f_int, cbdata->node, cbdata->port_num);
+		free(cbdata);
+	} else if (smp->cb == recv_port_info || smp->cb == recv_port0_info ||
+		   smp->cb == recv_mlnx_ext_port_info)
+		rc = add_frontier(scan->f_int, smp->cb_data,
+				  (int)smp->rpc.attr.mod);
+	return rc;
+}
 
+/* The deadline expired: keep what was found */
+static int stop_scan(smp_engine_t * engine)
+{
+	ibnd_scan_t *scan = engine->user_data;
+
+	scan->f_int->fabric.partial = 1;
+	return smp_engine_abandon(engine, abandon_smp);
+}
+
+/* With several scans one may have got past a port another gave up on */
+static void prune_frontier(f_internal_t * f_int)
+{
+	ibnd_fabric_t *fabric = &f_int->fabric;
+	ibnd_frontier_port_t *fp;
+	ibnd_port_t *port;
+	unsigned i, n = 0;
+
+	for (i = 0; i < fabric->num_frontier; i++) {
+		fp = &fabric->frontier[i];
+		port = fp->node->ports[fp->portnum];
+		if (fp->portnum && port && port->remoteport)
+			continue;
+		fabric->frontier[n++] = *fp;
+	}
+	fabric->num_frontier = n;
+}
+
+static void reset_frontier(ibnd_fabric_t * fabric)
+{
+	free(fabric->frontier);
+	fabric->frontier = NULL;
+	fabric->num_frontier = 0;
+	fabric->partial = 0;
+}
+
+ibnd_node_t *ibnd_find_node_guid(ibnd_fabric_t * fabric, uint64_t guid)
+{
 	if (!fabric) {
 		IBND_DEBUG("fabric parameter NULL\n");
 		return NULL;
 	}
 
-	for (node = fabric->nodestbl[hash]; node; node = node->htnext)
-		if (node->guid == guid)
-			return node;
-
-	return NULL;
+	return guid_tbl_find(&((f_internal_t *)fabric)->nodes_tbl, guid);
 }
 
 ibnd_node_t *ibnd_find_node_dr(ibnd_fabric_t * fabric, char *dr_str)
@@ -640,87 +909,113 @@ ibnd_node_t *ibnd_find_node_dr(ibnd_fabric_t * fabric, char *dr_str)
 	return rc->node;
 }
 
-int add_to_nodeguid_hash(ibnd_node_t * node, ibnd_node_t * hash[])
+int add_to_nodeguid_hash(ibnd_node_t * node, f_internal_t * f_int)
 {
-	int rc = 0;
-	ibnd_node_t *tblnode;
-	int hash_idx = HASHGUID(node->guid) % HTSZ;
-
-	for (tblnode = hash[hash_idx]; tblnode; tblnode = tblnode->htnext) {
-		if (tblnode == node) {
-			IBND_ERROR("Duplicate Node: Node with guid 0x%016"
-				   PRIx64 " already exists in nodes DB\n",
-				   node->guid);
-			return 1;
-		}
-	}
-	node->htnext = hash[hash_idx];
-	hash[hash_idx] = node;
+	int rc = guid_tbl_add(&f_int->nodes_tbl, node->guid, node);
+
+	if (rc > 0)
+		IBND_ERROR("Duplicate Node: Node with guid 0x%016"
+			   PRIx64 " already exists in nodes DB\n",
+			   node->guid);
+	else if (rc < 0)
+		IBND_ERROR("OOM: failed to grow nodes DB\n");
 	return rc;
 }
 
-int add_to_portguid_hash(ibnd_port_t * port, ibnd_port_t * hash[])
+int add_to_portguid_hash(ibnd_port_t * port, f_internal_t * f_int)
 {
-	int rc = 0;
-	ibnd_port_t *tblport;
-	int hash_idx = HASHGUID(port->guid) % HTSZ;
+	int rc = guid_tbl_add(&f_int->ports_tbl, port->guid, port);
 
-	for (tblport = hash[hash_idx]; tblport; tblport = tblport->htnext) {
-		if (tblport == port) {
-			IBND_ERROR("Duplicate Port: Port with guid 0x%016"
-				   PRIx64 " already exists in ports DB\n",
-				   port->guid);
-			return 1;
-		}
-	}
-	port->htnext = hash[hash_idx];
-	hash[hash_idx] = port;
+	if (rc > 0)
+		IBND_ERROR("Duplicate Port: Port with guid 0x%016"
+			   PRIx64 " already exists in ports DB\n",
+			   port->guid);
+	else if (rc < 0)
+		IBND_ERROR("OOM: failed to grow ports DB\n");
 	return rc;
 }
 
-struct lid2guid_item {
-	cl_map_item_t cl_map;
-	ibnd_port_t *port;
-};
-
-void create_lid2guid(f_internal_t *f_int)
+void destroy_lid2port(f_internal_t *f_int)
 {
-	cl_qmap_init(&f_int->lid2guid);
-}
-
-void destroy_lid2guid(f_internal_t *f_int)
-{
-	cl_map_item_t *item;
-
-	for (item = cl_qmap_head(&f_int->lid2guid); item != cl_qmap_end(&f_int->lid2guid);
-	     item = cl_qmap_head(&f_int->lid2guid)) {
-		cl_qmap_remove_item(&f_int->lid2guid, item);
-		free(container_of(item, struct lid2guid_item, cl_map));
-	}
+	free(f_int->lid2port);
+	f_int->lid2port = NULL;
 }
 
 void add_to_portlid_hash(ibnd_port_t * port, f_internal_t *f_int)
 {
 	uint16_t base_lid = port->base_lid;
 	uint16_t lid_mask = ((1 << port->lmc) -1);
-	uint16_t lid = 0;
+	unsigned lid = 0;
 	/* 0 < valid lid <= 0xbfff */
-	if (base_lid > 0 && base_lid <= 0xbfff) {
-		/* We add the port for all lids
-		 * so it is easier to find any "random" lid specified */
-		for (lid = base_lid; lid <= (base_lid + lid_mask); lid++) {
-			struct lid2guid_item *item;
-
-			item = malloc(sizeof(*item));
-			if (item) {
-				item->port = port;
-				cl_qmap_insert(&f_int->lid2guid, lid,
-					       &item->cl_map);
+	if (base_lid > 0 && base_lid < IBND_LID_TBL_SIZE) {
+		if (!f_int->lid2port) {
+			f_int->lid2port = calloc(IBND_LID_TBL_SIZE,
+						 sizeof(*f_int->lid2port));
+			if (!f_int->lid2port) {
+				IBND_ERROR("OOM: failed to allocate LID table\n");
+				return;
 			}
 		}
+		/* We add the port for all lids
+		 * so it is easier to find any "random" lid specified */
+		for (lid = base_lid;
+		     lid <= (unsigned)(base_lid + lid_mask) &&
+		     lid < IBND_LID_TBL_SIZE; lid++)
+			if (!f_int->lid2port[lid])
+				f_int->lid2port[lid] = port;
 	}
 }
 
+void decode_port(ibnd_port_t * port)
+{
+	ibnd_port_attrs_t *a = &port->attrs;
+	ibnd_port_t *port0 = port->node->ports[0];
+	uint8_t *info = port->info;
+
+	memset(a, 0, sizeof(*a));
+	if (port->node->type != IB_NODE_SWITCH)
+		a->cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
+	else if (port0)
+		a->cap_mask = mad_get_field(port0->info, 0, IB_PORT_CAPMASK_F);
+
+	a->state = mad_get_field(info, 0, IB_PORT_STATE_F);
+	a->phys_state = mad_get_field(info, 0, IB_PORT_PHYS_STATE_F);
+	a->width_active = mad_get_field(info, 0, IB_PORT_LINK_WIDTH_ACTIVE_F);
+	a->width_supported = mad_get_field(info, 0,
+					   IB_PORT_LINK_WIDTH_SUPPORTED_F);
+	a->speed_active = mad_get_field(info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
+	a->speed_supported = mad_get_field(info, 0,
+					   IB_PORT_LINK_SPEED_SUPPORTED_F);
+	if (a->cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS)) {
+		a->espeed_active = mad_get_field(info, 0,
+					IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
+		a->espeed_supported = mad_get_field(info, 0,
+					IB_PORT_LINK_SPEED_EXT_SUPPORTED_F);
+	}
+	a->mlnx_speed_active = mad_get_field(port->ext_info, 0,
+					IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F);
+	a->mlnx_speed_supported = mad_get_field(port->ext_info, 0,
+					IB_MLNX_EXT_PORT_LINK_SPEED_SUPPORTED_F);
+	a->vl_cap = mad_get_field(info, 0, IB_PORT_VL_CAP_F);
+	a->hoq_life = mad_get_field(info, 0, IB_PORT_HOQ_LIFE_F);
+	a->vl_stall_count = mad_get_field(info, 0, IB_PORT_VL_STALL_COUNT_F);
+}
+
+/* Fill in ibnd_port_t.attrs once info and ext_info are final.  Done as a
+ * pass over the whole fabric since a switch port needs port 0, which may
+ * arrive after it.
+ */
+void decode_ports(f_internal_t * f_int, ibnd_node_t * node)
+{
+	ibnd_node_t *n = node ? node : f_int->fabric.nodes;
+	int p;
+
+	for (; n; n = node ? NULL : n->next)
+		for (p = 0; p <= n->numports; p++)
+			if (n->ports[p])
+				decode_port(n->ports[p]);
+}
+
 void add_to_type_list(ibnd_node_t * node, f_internal_t * f_int)
 {
 	ibnd_fabric_t *fabric = &f_int->fabric;
@@ -740,7 +1035,7 @@ void add_to_type_list(ibnd_node_t * node, f_internal_t * f_int)
 	}
 }
 
-static int set_config(struct ibnd_config *config, struct ibnd_config *cfg)
+int set_config(struct ibnd_config *config, struct ibnd_config *cfg)
 {
 	if (!config)
 		return (-EINVAL);
@@ -755,18 +1050,70 @@ static int set_config(struct ibnd_config *config, struct ibnd_config *cfg)
 	if (!config->retries)
 		config->retries = DEFAULT_RETRIES;
 
+	if (config->smp_window_mode == IBND_SMP_WINDOW_ADAPTIVE) {
+		if (!config->min_smps)
+			config->min_smps = DEFAULT_MIN_SMP_WINDOW;
+		if (!config->max_smps_limit)
+			config->max_smps_limit = DEFAULT_MAX_SMP_WINDOW;
+		if (config->max_smps_limit < config->min_smps)
+			config->max_smps_limit = config->min_smps;
+		if (config->max_smps < config->min_smps)
+			config->max_smps = config->min_smps;
+		if (config->max_smps > config->max_smps_limit)
+			config->max_smps = config->max_smps_limit;
+	} else if (config->smp_window_mode != IBND_SMP_WINDOW_STATIC)
+		return (-EINVAL);
+
 	return (0);
 }
 
 f_internal_t *allocate_fabric_internal(void)
 {
 	f_internal_t *f = calloc(1, sizeof(*f));
-	if (f)
-		create_lid2guid(f);
+	if (f) {
+		guid_tbl_init(&f->nodes_tbl, offsetof(ibnd_node_t, htnext));
+		guid_tbl_init(&f->ports_tbl, offsetof(ibnd_port_t, htnext));
+	}
 
 	return (f);
 }
 
+static int init_scan(ibnd_scan_t * scan, f_internal_t * f_int,
+		     char * ca_name, int ca_port, ib_portid_t * from,
+		     struct ibnd_config *config)
+{
+	struct ibmad_port *ibmad_port;
+	int nc = 2;
+	int mc[2] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS };
+
+	memset(scan, 0, sizeof(*scan));
+	scan->f_int = f_int;
+	scan->cfg = config;
+	scan->initial_hops = from->drpath.cnt;
+
+	if (ibnd_test_ports)
+		return ibnd_test_ports->resolve_self(ibnd_test_ports, ca_name,
+						     ca_port, &scan->selfportid);
+
+	ibmad_port = mad_rpc_open_port(ca_name, ca_port, mc, nc);
+	if (!ibmad_port) {
+		IBND_ERROR("can't open MAD port (%s:%d)\n", ca_name, ca_port);
+		return -EIO;
+	}
+	mad_rpc_set_timeout(ibmad_port, config->timeout_ms);
+	mad_rpc_set_retries(ibmad_port, config->retries);
+	smp_mkey_set(ibmad_port, config->mkey);
+
+	if (ib_resolve_self_via(&scan->selfportid,
+				NULL, NULL, ibmad_port) < 0) {
+		IBND_ERROR("Failed to resolve self\n");
+		mad_rpc_close_port(ibmad_port);
+		return -EIO;
+	}
+	mad_rpc_close_port(ibmad_port);
+	return 0;
+}
+
 ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
 				    ib_portid_t * from,
 				    struct ibnd_config *cfg)
@@ -776,9 +1123,7 @@ ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
 	ib_portid_t my_portid = { 0 };
 	smp_engine_t engine;
 	ibnd_scan_t scan;
-	struct ibmad_port *ibmad_port;
-	int nc = 2;
-	int mc[2] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS };
+	int rc;
 
 	/* If not specified start from "my" port */
 	if (!from)
@@ -795,27 +1140,10 @@ ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
 		return NULL;
 	}
 
-	memset(&scan.selfportid, 0, sizeof(scan.selfportid));
-	scan.f_int = f_int;
-	scan.cfg = &config;
-	scan.initial_hops = from->drpath.cnt;
-
-	ibmad_port = mad_rpc_open_port(ca_name, ca_port, mc, nc);
-	if (!ibmad_port) {
-		IBND_ERROR("can't open MAD port (%s:%d)\n", ca_name, ca_port);
-		return (NULL);
-	}
-	mad_rpc_set_timeout(ibmad_port, cfg->timeout_ms);
-	mad_rpc_set_retries(ibmad_port, cfg->retries);
-	smp_mkey_set(ibmad_port, cfg->mkey);
-
-	if (ib_resolve_self_via(&scan.selfportid,
-				NULL, NULL, ibmad_port) < 0) {
-		IBND_ERROR("Failed to resolve self\n");
-		mad_rpc_close_port(ibmad_port);
+	if (init_scan(&scan, f_int, ca_name, ca_port, from, &config)) {
+		ibnd_destroy_fabric(&f_int->fabric);
 		return NULL;
 	}
-	mad_rpc_close_port(ibmad_port);
 
 	if (smp_engine_init(&engine, ca_name, ca_port, &scan, &config)) {
 		free(f_int);
@@ -824,13 +1152,32 @@ ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
 
 	IBND_DEBUG("from %s\n", portid2str(from));
 
-	if (!query_node_info(&engine, from, NULL))
-		if (process_mads(&engine) != 0)
+	if (!query_node_info(&engine, from, NULL)) {
+		rc = process_mads(&engine);
+		if (rc == -ETIMEDOUT)
+			rc = stop_scan(&engine);
+		if (rc != 0)
+			goto error;
+	}
+	if (f_int->fabric.partial) {
+		if (!scan.from_node) {
+			IBND_ERROR("deadline expired before %s was found\n",
+				   portid2str(from));
 			goto error;
+		}
+		prune_frontier(f_int);
+	}
 
+	f_int->fabric.from_node = scan.from_node;
+	f_int->fabric.from_portnum = scan.from_portnum;
 	f_int->fabric.total_mads_used = engine.total_smps;
 	f_int->fabric.maxhops_discovered += scan.initial_hops;
+	f_int->dr_paths = 1;
+	f_int->smp_stats = engine.stats;
+	f_int->fabric.smp_window_final = engine.window;
+	f_int->fabric.smp_window_peak = engine.stats.peak_window;
 
+	decode_ports(f_int, NULL);
 	if (group_nodes(&f_int->fabric))
 		goto error;
 
@@ -842,22 +1189,492 @@ error:
 	return NULL;
 }
 
-void destroy_node(ibnd_node_t * node)
+static int fetch_attrs(smp_engine_t * engine, ibnd_node_t * node,
+		       unsigned mask)
+{
+	ib_portid_t *path = &node->path_portid;
+	int p, rc = 0;
+
+	if (mask & IBND_FETCH_NODE_DESC)
+		rc = query_node_desc(engine, path, node);
+	if (!rc && (mask & IBND_FETCH_SWITCH_INFO) &&
+	    node->type == IB_NODE_SWITCH)
+		rc = query_switch_info(engine, path, node);
+	if (mask & IBND_FETCH_MLNX_EXT_PORT_INFO)
+		for (p = 1; !rc && p <= node->numports; p++)
+			if (node->ports[p] &&
+			    wants_mlnx_ext_port_info(node->ports[p]))
+				rc = query_mlnx_ext_port_info(engine, path,
+							      node, p);
+	return rc;
+}
+
+int ibnd_node_fetch_attrs(ibnd_fabric_t * fabric, ibnd_node_t * node,
+			  unsigned mask, char * ca_name, int ca_port,
+			  struct ibnd_config *cfg)
+{
+	struct ibnd_config config = { 0 };
+	f_internal_t *f_int = (f_internal_t *)fabric;
+	ib_portid_t my_portid = { 0 };
+	smp_engine_t engine;
+	ibnd_scan_t scan;
+	ibnd_node_t *n;
+	int rc;
+
+	if (!fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return -EINVAL;
+	}
+
+	if (set_config(&config, cfg)) {
+		IBND_ERROR("Invalid ibnd_config\n");
+		return -EINVAL;
+	}
+
+	/* a cache does not keep them */
+	if (!f_int->dr_paths && (rc = set_dr_paths(f_int)) != 0)
+		return rc;
+
+	rc = init_scan(&scan, f_int, ca_name, ca_port, &my_portid, &config);
+	if (rc)
+		return rc;
+	scan.fetch_attrs = 1;
+
+	if (smp_engine_init(&engine, ca_name, ca_port, &scan, &config))
+		return -EIO;
+
+	/* queue the lot and let the engine window them */
+	for (n = node ? node : fabric->nodes; n; n = node ? NULL : n->next) {
+		rc = fetch_attrs(&engine, n, mask);
+		if (rc)
+			break;
+	}
+	if (!rc && (rc = process_mads(&engine)) != 0) {
+		if (rc == -ETIMEDOUT)
+			smp_engine_abandon(&engine, NULL);
+		else
+			rc = -EIO;
+	}
+	decode_ports(f_int, node);
+
+	fabric->total_mads_used += engine.total_smps;
+	smp_engine_destroy(&engine);
+	return rc;
+}
+
+static ibnd_node_t **type_list(ibnd_fabric_t * fabric, ibnd_node_t * node)
+{
+	switch (node->type) {
+	case IB_NODE_CA:
+		return &fabric->ch_adapters;
+	case IB_NODE_SWITCH:
+		return &fabric->switches;
+	case IB_NODE_ROUTER:
+		return &fabric->routers;
+	}
+	return NULL;
+}
+
+/* Drop the nodes a rediscovery did not reach, then rebuild the GUID and
+ * LID indexes and the chassis from what is left. */
+static int reindex_fabric(f_internal_t * f_int)
 {
-	int p = 0;
+	ibnd_fabric_t *fabric = &f_int->fabric;
+	ibnd_node_t **pnode, **ptype, *node, *gone = NULL;
+	ibnd_chassis_t *ch, *ch_next;
+	ibnd_port_t *port;
+	int p;
+
+	for (node = fabric->nodes; node; node = node->next) {
+		if (node->visited == NODE_CONFIRMED)
+			continue;
+		for (p = 0; p <= node->numports; p++) {
+			port = node->ports[p];
+			if (port && port->remoteport) {
+				port->remoteport->refetched = 1;
+				port->remoteport->remoteport = NULL;
+			}
+		}
+	}
+	for (pnode = &fabric->nodes; (node = *pnode);) {
+		if (node->visited == NODE_CONFIRMED) {
+			pnode = &node->next;
+			continue;
+		}
+		IBND_DEBUG("node 0x%" PRIx64 " is gone\n", node->guid);
+		*pnode = node->next;
+		ptype = type_list(fabric, node);
+		while (ptype && *ptype != node)
+			ptype = &(*ptype)->type_next;
+		if (ptype)
+			*ptype = node->type_next;
+		node->next = gone;
+		gone = node;
+	}
+	/* once all are unlinked, as they may link to each other */
+	for (node = gone; node; node = gone) {
+		gone = node->next;
+		free_node(f_int, node);
+	}
+
+	for (ch = fabric->chassis; ch; ch = ch_next) {
+		ch_next = ch->next;
+		free(ch);
+	}
+	fabric->chassis = NULL;
+	destroy_lid2port(f_int);
+	guid_tbl_destroy(&f_int->nodes_tbl);
+	guid_tbl_destroy(&f_int->ports_tbl);
+
+	for (node = fabric->nodes; node; node = node->next) {
+		node->next_chassis_node = NULL;
+		node->chassis = NULL;
+		node->ch_type = 0;
+		node->ch_type_str[0] = '\0';
+		node->ch_anafanum = 0;
+		node->ch_slotnum = 0;
+		node->ch_slot = 0;
+		node->ch_found = 0;
+		if (add_to_nodeguid_hash(node, f_int) < 0)
+			return -ENOMEM;
+		for (p = 0; p <= node->numports; p++) {
+			port = node->ports[p];
+			if (!port)
+				continue;
+			if (add_to_portguid_hash(port, f_int) < 0)
+				return -ENOMEM;
+			add_to_portlid_hash(port, f_int);
+		}
+	}
+
+	decode_ports(f_int, NULL);
+	return group_nodes(fabric);
+}
+
+int ibnd_rediscover_fabric(ibnd_fabric_t * fabric, char * ca_name,
+			   int ca_port, struct ibnd_config *cfg)
+{
+	struct ibnd_config config = { 0 };
+	f_internal_t *f_int = (f_internal_t *)fabric;
+	ib_portid_t my_portid = { 0 };
+	smp_engine_t engine;
+	ibnd_scan_t scan;
+	ibnd_node_t *node;
+	int p, rc;
+
+	if (!fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return -EINVAL;
+	}
 
-	if (node->ports) {
+	if (set_config(&config, cfg)) {
+		IBND_ERROR("Invalid ibnd_config\n");
+		return -EINVAL;
+	}
+
+	for (node = fabric->nodes; node; node = node->next) {
+		node->refetched = 0;
+		node->visited = NODE_UNSEEN;
 		for (p = 0; p <= node->numports; p++)
-			free(node->ports[p]);
-		free(node->ports);
+			if (node->ports[p])
+				node->ports[p]->refetched = 0;
+	}
+
+	reset_frontier(fabric);
+	rc = init_scan(&scan, f_int, ca_name, ca_port, &my_portid, &config);
+	if (rc)
+		return rc;
+	scan.rediscover = 1;
+
+	if (smp_engine_init(&engine, ca_name, ca_port, &scan, &config))
+		return -EIO;
+
+	fabric->maxhops_discovered = 0;
+	rc = query_node_info(&engine, &my_portid, NULL);
+	if (!rc)
+		rc = process_mads(&engine);
+	/* a part checked fabric is no use */
+	if (rc == -ETIMEDOUT)
+		stop_scan(&engine);
+	if (!rc && !scan.from_node)
+		rc = -EIO;
+	if (rc) {
+		smp_engine_destroy(&engine);
+		return rc < 0 ? rc : -EIO;
+	}
+
+	fabric->from_node = scan.from_node;
+	fabric->from_portnum = scan.from_portnum;
+	fabric->total_mads_used = engine.total_smps;
+	f_int->dr_paths = 1;
+	f_int->smp_stats = engine.stats;
+	fabric->smp_window_final = engine.window;
+	fabric->smp_window_peak = engine.stats.peak_window;
+	smp_engine_destroy(&engine);
+
+	return reindex_fabric(f_int);
+}
+
+/* one local port of a multi port discovery */
+struct port_scan {
+	ibnd_scan_t scan;
+	smp_engine_t engine;
+	pthread_t thread;
+	int rc;
+};
+
+static void *port_scan_thread(void *arg)
+{
+	struct port_scan *ps = arg;
+	ib_portid_t my_portid = { 0 };
+
+	ps->rc = 0;
+	if (!query_node_info(&ps->engine, &my_portid, NULL))
+		ps->rc = process_mads(&ps->engine);
+	return NULL;
+}
+
+static void add_rtt_hist(ibnd_rtt_hist_t * sum, ibnd_rtt_hist_t * h)
+{
+	int b;
+
+	sum->count += h->count;
+	sum->total_us += h->total_us;
+	if (h->max_us > sum->max_us)
+		sum->max_us = h->max_us;
+	for (b = 0; b < IBND_RTT_BUCKETS; b++)
+		sum->buckets[b] += h->buckets[b];
+}
+
+static void add_smp_stats(smp_engine_stats_t * sum, smp_engine_stats_t * s)
+{
+	int i;
+
+	if (s->peak_live_smps > sum->peak_live_smps)
+		sum->peak_live_smps = s->peak_live_smps;
+	if (s->peak_window > sum->peak_window)
+		sum->peak_window = s->peak_window;
+	if (s->peak_rx_batch > sum->peak_rx_batch)
+		sum->peak_rx_batch = s->peak_rx_batch;
+	sum->smp_pool_size += s->smp_pool_size;
+	sum->stale_responses += s->stale_responses;
+	sum->timeouts += s->timeouts;
+	sum->retries += s->retries;
+	sum->dead_targets += s->dead_targets;
+	sum->fast_failed += s->fast_failed;
+	sum->rx_wakeups += s->rx_wakeups;
+	sum->responses += s->responses;
+	sum->status_errors += s->status_errors;
+	sum->peak_queued += s->peak_queued;
+	sum->lid_routed += s->lid_routed;
+	sum->lid_fallbacks += s->lid_fallbacks;
+	sum->rate_holds += s->rate_holds;
+	for (i = 0; i < IBND_STATS_NUM_ATTRS; i++)
+		add_rtt_hist(&sum->attr_rtt[i], &s->attr_rtt[i]);
+	for (i = 0; i < IBND_STATS_MAX_HOPS; i++)
+		add_rtt_hist(&sum->hop_rtt[i], &s->hop_rtt[i]);
+}
+
+/* Each scan recorded the DR paths of the nodes it found relative to its
+ * own port, and a fabric read from the SA has none at all.  Rebuild them
+ * breadth first from the primary port so that path_portid means the same
+ * thing as for a single port discovery.  ibnd_node_t.visited marks the
+ * nodes queued; every node is left NODE_CONFIRMED, as a discovery leaves
+ * them. */
+int set_dr_paths(f_internal_t * f_int)
+{
+	ibnd_fabric_t *fabric = &f_int->fabric;
+	ibnd_node_t *node, *remnode, **queue;
+	ib_portid_t path;
+	unsigned n = 0, head = 0, tail = 0;
+	int p;
+
+	for (node = fabric->nodes; node; node = node->next) {
+		node->visited = NODE_UNSEEN;
+		n++;
+	}
+	if (!(queue = calloc(n, sizeof(*queue)))) {
+		IBND_ERROR("OOM: failed to rebuild DR paths\n");
+		return -ENOMEM;
+	}
+
+	node = fabric->from_node;
+	memset(&node->path_portid, 0, sizeof(node->path_portid));
+	node->visited = NODE_CONFIRMED;
+	queue[tail++] = node;
+	fabric->maxhops_discovered = 0;
+
+	while (head < tail) {
+		node = queue[head++];
+		/* we can't proceed through an HCA with DR */
+		if (node != fabric->from_node && node->type != IB_NODE_SWITCH)
+			continue;
+		for (p = 1; p <= node->numports; p++) {
+			if (!node->ports[p] || !node->ports[p]->remoteport)
+				continue;
+			if (node == fabric->from_node &&
+			    node->type != IB_NODE_SWITCH &&
+			    p != fabric->from_portnum)
+				continue;
+			remnode = node->ports[p]->remoteport->node;
+			if (remnode->visited == NODE_CONFIRMED)
+				continue;
+
+			path = node->path_portid;
+			if (add_port_to_dpath(&path.drpath, p) < 0)
+				continue;
+			remnode->path_portid = path;
+			if ((unsigned)path.drpath.cnt >
+			    fabric->maxhops_discovered)
+				fabric->maxhops_discovered = path.drpath.cnt;
+			remnode->visited = NODE_CONFIRMED;
+			queue[tail++] = remnode;
+		}
+	}
+
+	if (tail != n) {
+		IBND_DEBUG("%u of %u nodes not reachable from the primary "
+			   "port; keeping their DR paths\n", n - tail, n);
+		for (node = fabric->nodes; node; node = node->next)
+			node->visited = NODE_CONFIRMED;
+	}
+	free(queue);
+	f_int->dr_paths = 1;
+	return 0;
+}
+
+ibnd_fabric_t *ibnd_discover_fabric_ports(ibnd_local_port_t * ports,
+					  int num_ports,
+					  struct ibnd_config *cfg)
+{
+	struct ibnd_config config = { 0 };
+	ib_portid_t my_portid = { 0 };
+	f_internal_t *f_int = NULL;
+	struct port_scan *ps;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int i, engines = 0, threads = 0;
+
+	if (!ports || num_ports < 1) {
+		IBND_ERROR("no local ports to discover from\n");
+		return NULL;
+	}
+	if (num_ports == 1)
+		return ibnd_discover_fabric(ports[0].ca_name,
+					    ports[0].ca_port, NULL, cfg);
+
+	if (set_config(&config, cfg)) {
+		IBND_ERROR("Invalid ibnd_config\n");
+		return NULL;
+	}
+
+	ps = calloc(num_ports, sizeof(*ps));
+	f_int = allocate_fabric_internal();
+	if (!ps || !f_int) {
+		IBND_ERROR("OOM: failed to calloc ibnd_fabric_t\n");
+		goto error;
 	}
-	free(node);
+
+	for (engines = 0; engines < num_ports; engines++) {
+		i = engines;
+		if (init_scan(&ps[i].scan, f_int, ports[i].ca_name,
+			      ports[i].ca_port, &my_portid, &config))
+			goto error;
+		if (smp_engine_init(&ps[i].engine, ports[i].ca_name,
+				    ports[i].ca_port, &ps[i].scan, &config))
+			goto error;
+		ps[i].engine.cb_lock = &lock;
+	}
+
+	/* Every port starts a BFS of its own.  The first scan to reach a
+	 * node owns it and queries its ports; the others only link to it.
+	 * So the frontier is split between the ports by DR distance. */
+	for (threads = 0; threads < num_ports; threads++)
+		if (pthread_create(&ps[threads].thread, NULL,
+				   port_scan_thread, &ps[threads])) {
+			IBND_ERROR("failed to start scan of %s:%d\n",
+				   ports[threads].ca_name,
+				   ports[threads].ca_port);
+			break;
+		}
+	for (i = 0; i < threads; i++)
+		pthread_join(ps[i].thread, NULL);
+	if (threads < num_ports)
+		goto error;
+
+	for (i = 0; i < num_ports; i++) {
+		if (ps[i].rc == -ETIMEDOUT)
+			ps[i].rc = stop_scan(&ps[i].engine);
+		if (ps[i].rc)
+			goto error;
+		f_int->fabric.total_mads_used += ps[i].engine.total_smps;
+		add_smp_stats(&f_int->smp_stats, &ps[i].engine.stats);
+		f_int->fabric.smp_window_final += ps[i].engine.window;
+	}
+	f_int->fabric.smp_window_peak = f_int->smp_stats.peak_window;
+
+	f_int->fabric.from_node = ps[0].scan.from_node;
+	f_int->fabric.from_portnum = ps[0].scan.from_portnum;
+	if (!f_int->fabric.from_node) {
+		IBND_ERROR("Failed to discover the node of %s:%d\n",
+			   ports[0].ca_name, ports[0].ca_port);
+		goto error;
+	}
+	if (f_int->fabric.partial)
+		prune_frontier(f_int);
+
+	decode_ports(f_int, NULL);
+	if (set_dr_paths(f_int) || group_nodes(&f_int->fabric))
+		goto error;
+
+	for (i = 0; i < num_ports; i++)
+		smp_engine_destroy(&ps[i].engine);
+	free(ps);
+	return (ibnd_fabric_t *)f_int;
+error:
+	for (i = 0; i < engines; i++)
+		smp_engine_destroy(&ps[i].engine);
+	free(ps);
+	if (f_int)
+		ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
+
+int ibnd_get_discovery_stats(ibnd_fabric_t * fabric,
+			     ibnd_discovery_stats_t * stats, size_t size)
+{
+	ibnd_discovery_stats_t all;
+	smp_engine_stats_t *s;
+
+	if (!fabric || !stats) {
+		IBND_DEBUG("fabric or stats parameter NULL\n");
+		return -EINVAL;
+	}
+
+	s = &((f_internal_t *)fabric)->smp_stats;
+	memset(&all, 0, sizeof(all));
+	all.smps_sent = fabric->total_mads_used;
+	all.responses = s->responses;
+	all.timeouts = s->timeouts;
+	all.retries = s->retries;
+	all.status_errors = s->status_errors;
+	all.stale_responses = s->stale_responses;
+	all.dead_targets = s->dead_targets;
+	all.fast_failed = s->fast_failed;
+	all.peak_queue_depth = s->peak_queued;
+	all.peak_window = s->peak_window;
+	all.lid_routed = s->lid_routed;
+	all.lid_fallbacks = s->lid_fallbacks;
+	memcpy(all.attr_rtt, s->attr_rtt, sizeof(all.attr_rtt));
+	memcpy(all.hop_rtt, s->hop_rtt, sizeof(all.hop_rtt));
+	all.rate_holds = s->rate_holds;
+
+	/* a caller built against an older, shorter struct gets its prefix */
+	memcpy(stats, &all, size < sizeof(all) ? size : sizeof(all));
+	return 0;
 }
 
 void ibnd_destroy_fabric(ibnd_fabric_t * fabric)
 {
-	ibnd_node_t *node = NULL;
-	ibnd_node_t *next = NULL;
 	ibnd_chassis_t *ch, *ch_next;
 
 	if (!fabric)
@@ -869,13 +1686,12 @@ void ibnd_destroy_fabric(ibnd_fabric_t * fabric)
 		free(ch);
 		ch = ch_next;
 	}
-	node = fabric->nodes;
-	while (node) {
-		next = node->next;
-		destroy_node(node);
-		node = next;
-	}
-	destroy_lid2guid((f_internal_t *)fabric);
+	free(fabric->frontier);
+	/* all nodes and ports */
+	arena_destroy(&((f_internal_t *)fabric)->arena);
+	destroy_lid2port((f_internal_t *)fabric);
+	guid_tbl_destroy(&((f_internal_t *)fabric)->nodes_tbl);
+	guid_tbl_destroy(&((f_internal_t *)fabric)->ports_tbl);
 	free(fabric);
 }
 
@@ -938,26 +1754,25 @@ ibnd_port_t *ibnd_find_port_lid(ibnd_fabric_t * fabric,
 {
 	f_internal_t *f = (f_internal_t *)fabric;
 
-	return container_of(cl_qmap_get(&f->lid2guid, lid),
-			    struct lid2guid_item, cl_map)
-		->port;
+	if (!fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return NULL;
+	}
+
+	if (!f->lid2port || lid >= IBND_LID_TBL_SIZE)
+		return NULL;
+
+	return f->lid2port[lid];
 }
 
 ibnd_port_t *ibnd_find_port_guid(ibnd_fabric_t * fabric, uint64_t guid)
 {
-	int hash = HASHGUID(guid) % HTSZ;
-	ibnd_port_t *port;
-
 	if (!fabric) {
 		IBND_DEBUG("fabric parameter NULL\n");
 		return NULL;
 	}
 
-	for (port = fabric->portstbl[hash]; port; port = port->htnext)
-		if (port->guid == guid)
-			return port;
-
-	return NULL;
+	return guid_tbl_find(&((f_internal_t *)fabric)->ports_tbl, guid);
 }
 
 ibnd_port_t *ibnd_find_port_dr(ibnd_fabric_t * fabric, char *dr_str)
@@ -1000,11 +1815,23 @@ ibnd_port_t *ibnd_find_port_dr(ibnd_fabric_t * fabric, char *dr_str)
 	return rc;
 }
 
+struct iter_ports_data {
+	ibnd_iter_port_func_t func;
+	void *user_data;
+};
+
+static int iter_port(void *item, void *arg)
+{
+	struct iter_ports_data *data = arg;
+
+	data->func(item, data->user_data);
+	return 0;
+}
+
 void ibnd_iter_ports(ibnd_fabric_t * fabric, ibnd_iter_port_func_t func,
 			void *user_data)
 {
-	int i = 0;
-	ibnd_port_t *cur = NULL;
+	struct iter_ports_data data = { func, user_data };
 
 	if (!fabric) {
 		IBND_DEBUG("fabric parameter NULL\n");
@@ -1016,7 +1843,5 @@ void ibnd_iter_ports(ibnd_fabric_t * fabric, ibnd_iter_port_func_t func,
 		return;
 	}
 
-	for (i = 0; i<HTSZ; i++)
-		for (cur = fabric->portstbl[i]; cur; cur = cur->htnext)
-			func(cur, user_data);
+	guid_tbl_iter(&((f_internal_t *)fabric)->ports_tbl, iter_port, &data);
 }
@@ -42,9 +42,11 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <inttypes.h>
 
@@ -98,6 +100,98 @@
  * 1 byte - port num remotely connected to
  */
 
+/* Version 2 is laid out to be used from an mmap() of the file: a section
+ * table, then arrays of fixed size records which refer to each other by
+ * index.  Every section starts 8 byte aligned; a reader skips sections it
+ * does not know and the bytes of a record past those it knows.
+ *
+ * Bytes 1-4 - magic number
+ * Bytes 5-8 - version number (2)
+ * Bytes 9-12 - number of sections
+ * Bytes 13-16 - maxhops discovered
+ * Bytes 17-24 - "from node" guid
+ * Bytes 25-28 - "from node" index
+ * Bytes 29-32 - "from node" port number
+ * Bytes 33-40 - reserved
+ *
+ * followed by a section table entry for each section
+ *
+ * 4 bytes - section id
+ * 4 bytes - record size
+ * 4 bytes - record count
+ * 4 bytes - reserved
+ * 8 bytes - file offset
+ *
+ * Node records (IBND_CACHE_SECT_NODES)
+ *
+ * 8 bytes - guid
+ * 4 bytes - index of the first of its port records
+ * 1 byte - number of port records
+ * 1 byte - type
+ * 1 byte - numports
+ * 1 byte - smalmc
+ * 2 bytes - smalid
+ * 1 byte - smaenhsp0 flag
+ * 5 bytes - reserved
+ * IB_SMP_DATA_SIZE bytes - info
+ * IB_SMP_DATA_SIZE bytes - nodedesc
+ * IB_SMP_DATA_SIZE bytes - switchinfo
+ *
+ * Port records (IBND_CACHE_SECT_PORTS), those of a node together and in
+ * port number order
+ *
+ * 8 bytes - guid
+ * 4 bytes - index of its node
+ * 4 bytes - index of the port remotely connected to, or
+ *           IBND_CACHE_NO_INDEX
+ * 2 bytes - base lid
+ * 1 byte - portnum
+ * 1 byte - external portnum
+ * 1 byte - lmc
+ * 3 bytes - reserved
+ * IB_SMP_DATA_SIZE bytes - info
+ * IB_SMP_DATA_SIZE bytes - ext_info
+ *
+ * GUID index records (IBND_CACHE_SECT_NODE_GUIDS, IBND_CACHE_SECT_PORT_GUIDS),
+ * one per node or port record, sorted by guid and then index
+ *
+ * 8 bytes - guid
+ * 4 bytes - node or port index
+ * 4 bytes - reserved
+ *
+ * A delta (version IBND_FABRIC_CACHE_DELTA) has the same header and
+ * section table; it records how a fabric differs from the one it was
+ * taken against, its base.  The "from node" index is unused.
+ *
+ * Delta info (IBND_CACHE_SECT_DELTA), one record
+ *
+ * 8 bytes - digest of the base
+ * 8 bytes - digest of the fabric the delta leads to
+ *
+ * Node records (IBND_CACHE_SECT_NODES) of nodes added or changed, with
+ * no port records of their own
+ *
+ * Removed nodes (IBND_CACHE_SECT_NODE_DELS), with all their ports
+ *
+ * 8 bytes - node guid
+ * 8 bytes - reserved
+ *
+ * Removed ports (IBND_CACHE_SECT_PORT_DELS)
+ *
+ * 8 bytes - node guid
+ * 1 byte - portnum
+ * 7 bytes - reserved
+ *
+ * Ports added or changed (IBND_CACHE_SECT_PORT_SETS), a port record with
+ * both indexes IBND_CACHE_NO_INDEX followed by
+ *
+ * 8 bytes - node guid
+ * 8 bytes - guid of the node remotely connected to
+ * 1 byte - port num remotely connected to
+ * 1 byte - flag indicating if remote port exists
+ * 6 bytes - reserved
+ */
+
 /* Structs that hold cache info temporarily before
  * the real structs can be reconstructed.
  */
@@ -131,8 +225,8 @@ typedef struct ibnd_fabric_cache {
 	uint64_t from_node_guid;
 	ibnd_node_cache_t *nodes_cache;
 	ibnd_port_cache_t *ports_cache;
-	ibnd_node_cache_t *nodescachetbl[HTSZ];
-	ibnd_port_cache_t *portscachetbl[HTSZ];
+	guid_tbl_t nodescachetbl;
+	guid_tbl_t portscachetbl;
 } ibnd_fabric_cache_t;
 
 #define IBND_FABRIC_CACHE_BUFLEN  4096
@@ -146,6 +240,51 @@ typedef struct ibnd_fabric_cache {
 #define IBND_PORT_CACHE_KEY_LEN        (8 + 1)
 #define IBND_PORT_CACHE_LEN            (31 + IB_SMP_DATA_SIZE)
 
+#define IBND_FABRIC_CACHE_VERSION_2    0x00000002
+#define IBND_CACHE_HEADER_LEN          40
+#define IBND_CACHE_SECTION_LEN         24
+#define IBND_CACHE_NODE_LEN            (24 + IB_SMP_DATA_SIZE*3)
+#define IBND_CACHE_PORT_LEN            (24 + IB_SMP_DATA_SIZE*2)
+#define IBND_CACHE_GUID_LEN            16
+#define IBND_CACHE_NO_INDEX            0xFFFFFFFF
+#define IBND_CACHE_V2_SECTS            4
+
+#define IBND_FABRIC_CACHE_DELTA        0x00010002
+#define IBND_CACHE_DELTA_SECTS         5
+#define IBND_CACHE_DELTA_LEN           16
+#define IBND_CACHE_PORT_SET_LEN        (IBND_CACHE_PORT_LEN + 24)
+
+enum ibnd_cache_sect {
+	IBND_CACHE_SECT_NODES = 1,
+	IBND_CACHE_SECT_PORTS,
+	IBND_CACHE_SECT_NODE_GUIDS,
+	IBND_CACHE_SECT_PORT_GUIDS,
+	IBND_CACHE_SECT_DELTA,
+	IBND_CACHE_SECT_NODE_DELS,
+	IBND_CACHE_SECT_PORT_DELS,
+	IBND_CACHE_SECT_PORT_SETS,
+	IBND_CACHE_NUM_SECTS
+};
+
+typedef struct ibnd_cache_sect_info {
+	uint32_t stride;
+	uint32_t count;
+	uint64_t offset;
+} ibnd_cache_sect_info_t;
+
+/* a version 2 cache or a delta mapped into memory */
+typedef struct ibnd_cache_map {
+	uint8_t *base;
+	size_t len;
+	uint32_t version;
+	uint32_t maxhops;
+	uint64_t from_node_guid;
+	uint32_t from_node;
+	uint32_t from_portnum;
+	/* indexed by section id; count is 0 for a missing section */
+	ibnd_cache_sect_info_t sect[IBND_CACHE_NUM_SECTS];
+} ibnd_cache_map_t;
+
 static ssize_t ibnd_read(int fd, void *buf, size_t count)
 {
 	size_t count_done = 0;
@@ -174,6 +313,35 @@ static ssize_t ibnd_read(int fd, void *buf, size_t count)
 	return count_done;
 }
 
+static ssize_t ibnd_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	size_t count_done = 0;
+	ssize_t ret;
+
+	while ((count - count_done) > 0) {
+		ret = pread(fd, ((char *) buf) + count_done, count - count_done,
+			    offset + count_done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			else {
+				IBND_DEBUG("pread: %s\n", strerror(errno));
+				return -1;
+			}
+		}
+		if (!ret)
+			break;
+		count_done += ret;
+	}
+
+	if (count_done != count) {
+		IBND_DEBUG("pread: read short\n");
+		return -1;
+	}
+
+	return count_done;
+}
+
 static size_t _unmarshall8(uint8_t * inbuf, uint8_t * num)
 {
 	(*num) = inbuf[0];
@@ -257,9 +425,8 @@ static int _load_header_info(int fd, ibnd_fabric_cache_t * fabric_cache,
 
 static void _destroy_ibnd_node_cache(ibnd_node_cache_t * node_cache)
 {
+	/* the node itself is in the fabric arena */
 	free(node_cache->port_cache_keys);
-	if (!node_cache->node_stored_to_fabric && node_cache->node)
-		destroy_node(node_cache->node);
 	free(node_cache);
 }
 
@@ -293,26 +460,30 @@ static void _destroy_ibnd_fabric_cache(ibnd_fabric_cache_t * fabric_cache)
 		port_cache = port_cache_next;
 	}
 
+	guid_tbl_destroy(&fabric_cache->nodescachetbl);
+	guid_tbl_destroy(&fabric_cache->portscachetbl);
 	free(fabric_cache);
 }
 
-static void store_node_cache(ibnd_node_cache_t * node_cache,
-			     ibnd_fabric_cache_t * fabric_cache)
+static int store_node_cache(ibnd_node_cache_t * node_cache,
+			    ibnd_fabric_cache_t * fabric_cache)
 {
-	int hash_indx = HASHGUID(node_cache->node->guid) % HTSZ;
+	if (guid_tbl_add(&fabric_cache->nodescachetbl, node_cache->node->guid,
+			 node_cache) < 0) {
+		IBND_DEBUG("OOM: nodescachetbl\n");
+		return -1;
+	}
 
 	node_cache->next = fabric_cache->nodes_cache;
 	fabric_cache->nodes_cache = node_cache;
-
-	node_cache->htnext = fabric_cache->nodescachetbl[hash_indx];
-	fabric_cache->nodescachetbl[hash_indx] = node_cache;
+	return 0;
 }
 
 static int _load_node(int fd, ibnd_fabric_cache_t * fabric_cache)
 {
 	uint8_t buf[IBND_FABRIC_CACHE_BUFLEN];
 	ibnd_node_cache_t *node_cache = NULL;
-	ibnd_node_t *node = NULL;
+	ibnd_node_t tmp_node, *node = &tmp_node;
 	size_t offset = 0;
 	uint8_t tmp8;
 
@@ -322,17 +493,8 @@ static int _load_node(int fd, ibnd_fabric_cache_t * fabric_cache)
 		return -1;
 	}
 	memset(node_cache, '\0', sizeof(ibnd_node_cache_t));
-
-	node = (ibnd_node_t *) malloc(sizeof(ibnd_node_t));
-	if (!node) {
-		IBND_DEBUG("OOM: node\n");
-		free(node_cache);
-		return -1;
-	}
 	memset(node, '\0', sizeof(ibnd_node_t));
 
-	node_cache->node = node;
-
 	if (ibnd_read(fd, buf, IBND_NODE_CACHE_HEADER_LEN) < 0)
 		goto cleanup;
 
@@ -351,6 +513,17 @@ static int _load_node(int fd, ibnd_fabric_cache_t * fabric_cache)
 	offset += _unmarshall_buf(buf + offset, node->nodedesc,
 				  IB_SMP_DATA_SIZE);
 
+	/* now that numports is known */
+	node = alloc_node(fabric_cache->f_int, tmp_node.type,
+			  tmp_node.numports);
+	if (!node) {
+		IBND_DEBUG("OOM: node\n");
+		goto cleanup;
+	}
+	tmp_node.ports = node->ports;
+	*node = tmp_node;
+	node_cache->node = node;
+
 	offset += _unmarshall8(buf + offset, &node_cache->ports_stored_count);
 
 	if (node_cache->ports_stored_count) {
@@ -388,7 +561,8 @@ static int _load_node(int fd, ibnd_fabric_cache_t * fabric_cache)
 		}
 	}
 
-	store_node_cache(node_cache, fabric_cache);
+	if (store_node_cache(node_cache, fabric_cache) < 0)
+		goto cleanup;
 
 	return 0;
 
@@ -397,16 +571,18 @@ cleanup:
 	return -1;
 }
 
-static void store_port_cache(ibnd_port_cache_t * port_cache,
-			     ibnd_fabric_cache_t * fabric_cache)
+static int store_port_cache(ibnd_port_cache_t * port_cache,
+			    ibnd_fabric_cache_t * fabric_cache)
 {
-	int hash_indx = HASHGUID(port_cache->port->guid) % HTSZ;
+	if (guid_tbl_add(&fabric_cache->portscachetbl, port_cache->port->guid,
+			 port_cache) < 0) {
+		IBND_DEBUG("OOM: portscachetbl\n");
+		return -1;
+	}
 
 	port_cache->next = fabric_cache->ports_cache;
 	fabric_cache->ports_cache = port_cache;
-
-	port_cache->htnext = fabric_cache->portscachetbl[hash_indx];
-	fabric_cache->portscachetbl[hash_indx] = port_cache;
+	return 0;
 }
 
 static int _load_port(int fd, ibnd_fabric_cache_t * fabric_cache)
@@ -453,7 +629,8 @@ static int _load_port(int fd, ibnd_fabric_cache_t * fabric_cache)
 	    _unmarshall8(buf + offset,
 			 &port_cache->remoteport_cache_key.portnum);
 
-	store_port_cache(port_cache, fabric_cache);
+	if (store_port_cache(port_cache, fabric_cache) < 0)
+		goto cleanup;
 
 	return 0;
 
@@ -466,10 +643,10 @@ cleanup:
 static ibnd_port_cache_t *_find_port(ibnd_fabric_cache_t * fabric_cache,
 				     ibnd_port_cache_key_t * port_cache_key)
 {
-	int hash_indx = HASHGUID(port_cache_key->guid) % HTSZ;
 	ibnd_port_cache_t *port_cache;
 
-	for (port_cache = fabric_cache->portscachetbl[hash_indx];
+	for (port_cache = guid_tbl_find(&fabric_cache->portscachetbl,
+					port_cache_key->guid);
 	     port_cache; port_cache = port_cache->htnext) {
 		if (port_cache->port->guid == port_cache_key->guid
 		    && port_cache->port->portnum == port_cache_key->portnum)
@@ -482,22 +659,14 @@ static ibnd_port_cache_t *_find_port(ibnd_fabric_cache_t * fabric_cache,
 static ibnd_node_cache_t *_find_node(ibnd_fabric_cache_t * fabric_cache,
 				     uint64_t guid)
 {
-	int hash_indx = HASHGUID(guid) % HTSZ;
-	ibnd_node_cache_t *node_cache;
-
-	for (node_cache = fabric_cache->nodescachetbl[hash_indx];
-	     node_cache; node_cache = node_cache->htnext) {
-		if (node_cache->node->guid == guid)
-			return node_cache;
-	}
-
-	return NULL;
+	return guid_tbl_find(&fabric_cache->nodescachetbl, guid);
 }
 
 static int _fill_port(ibnd_fabric_cache_t * fabric_cache, ibnd_node_t * node,
 		      ibnd_port_cache_key_t * port_cache_key)
 {
 	ibnd_port_cache_t *port_cache;
+	ibnd_port_t *port;
 
 	if (!(port_cache = _find_port(fabric_cache, port_cache_key))) {
 		IBND_DEBUG("Cache invalid: cannot find port\n");
@@ -509,14 +678,23 @@ static int _fill_port(ibnd_fabric_cache_t * fabric_cache, ibnd_node_t * node,
 		return -1;
 	}
 
-	node->ports[port_cache->port->portnum] = port_cache->port;
+	/* move it into the node's slot */
+	port = node->ports[port_cache->port->portnum] ? NULL :
+	       alloc_port(fabric_cache->f_int, node,
+			  port_cache->port->portnum);
+	if (!port) {
+		IBND_DEBUG("Cache invalid: bad port number\n");
+		return -1;
+	}
+	*port = *port_cache->port;
+	free(port_cache->port);
+	port_cache->port = port;
 	port_cache->port_stored_to_fabric++;
 
 	/* achu: needed if user wishes to re-cache a loaded fabric.
 	 * Otherwise, mostly unnecessary to do this.
 	 */
-	int rc = add_to_portguid_hash(port_cache->port,
-				      fabric_cache->f_int->fabric.portstbl);
+	int rc = add_to_portguid_hash(port_cache->port, fabric_cache->f_int);
 	if (rc) {
 		IBND_DEBUG("Error Occurred when trying"
 			   " to insert new port guid 0x%016" PRIx64 " to DB\n",
@@ -545,9 +723,7 @@ static int _rebuild_nodes(ibnd_fabric_cache_t * fabric_cache)
 		fabric_cache->f_int->fabric.nodes = node;
 
 		int rc = add_to_nodeguid_hash(node_cache->node,
-					      fabric_cache->
-					      f_int->
-					      fabric.nodestbl);
+					      fabric_cache->f_int);
 		if (rc) {
 			IBND_DEBUG("Error Occurred when trying"
 				   " to insert new node guid 0x%016" PRIx64 " to DB\n",
@@ -559,13 +735,6 @@ static int _rebuild_nodes(ibnd_fabric_cache_t * fabric_cache)
 		node_cache->node_stored_to_fabric++;
 
 		/* Rebuild node ports array */
-
-		if (!(node->ports =
-		      calloc(sizeof(*node->ports), node->numports + 1))) {
-			IBND_DEBUG("OOM: node->ports\n");
-			return -1;
-		}
-
 		for (i = 0; i < node_cache->ports_stored_count; i++) {
 			if (_fill_port(fabric_cache, node,
 				       &node_cache->port_cache_keys[i]) < 0)
@@ -621,26 +790,15 @@ static int _rebuild_ports(ibnd_fabric_cache_t * fabric_cache)
 	return 0;
 }
 
-ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
+static ibnd_fabric_t *_load_fabric_v1(int fd)
 {
 	unsigned int node_count = 0;
 	unsigned int port_count = 0;
 	ibnd_fabric_cache_t *fabric_cache = NULL;
 	f_internal_t *f_int = NULL;
 	ibnd_node_cache_t *node_cache = NULL;
-	int fd = -1;
 	unsigned int i;
 
-	if (!file) {
-		IBND_DEBUG("file parameter NULL\n");
-		return NULL;
-	}
-
-	if ((fd = open(file, O_RDONLY)) < 0) {
-		IBND_DEBUG("open: %s\n", strerror(errno));
-		return NULL;
-	}
-
 	fabric_cache =
 	    (ibnd_fabric_cache_t *) malloc(sizeof(ibnd_fabric_cache_t));
 	if (!fabric_cache) {
@@ -648,6 +806,10 @@ ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
 		goto cleanup;
 	}
 	memset(fabric_cache, '\0', sizeof(ibnd_fabric_cache_t));
+	guid_tbl_init(&fabric_cache->nodescachetbl,
+		      offsetof(ibnd_node_cache_t, htnext));
+	guid_tbl_init(&fabric_cache->portscachetbl,
+		      offsetof(ibnd_port_cache_t, htnext));
 
 	f_int = allocate_fabric_internal();
 	if (!f_int) {
@@ -684,180 +846,998 @@ ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
 	if (_rebuild_ports(fabric_cache) < 0)
 		goto cleanup;
 
+	decode_ports(f_int, NULL);
 	if (group_nodes(&f_int->fabric))
 		goto cleanup;
 
 	_destroy_ibnd_fabric_cache(fabric_cache);
-	close(fd);
 	return (ibnd_fabric_t *)&f_int->fabric;
 
 cleanup:
 	ibnd_destroy_fabric((ibnd_fabric_t *)f_int);
 	_destroy_ibnd_fabric_cache(fabric_cache);
-	close(fd);
 	return NULL;
 }
 
-static ssize_t ibnd_write(int fd, const void *buf, size_t count)
+/* Check the header and section table of a version 2 cache at base */
+static int _map_cache(ibnd_cache_map_t * map, uint8_t * base, size_t len)
 {
-	size_t count_done = 0;
-	ssize_t ret;
+	static const uint32_t min_stride[IBND_CACHE_NUM_SECTS] = {
+		[IBND_CACHE_SECT_NODES] = IBND_CACHE_NODE_LEN,
+		[IBND_CACHE_SECT_PORTS] = IBND_CACHE_PORT_LEN,
+		[IBND_CACHE_SECT_NODE_GUIDS] = IBND_CACHE_GUID_LEN,
+		[IBND_CACHE_SECT_PORT_GUIDS] = IBND_CACHE_GUID_LEN,
+		[IBND_CACHE_SECT_DELTA] = IBND_CACHE_DELTA_LEN,
+		[IBND_CACHE_SECT_NODE_DELS] = IBND_CACHE_GUID_LEN,
+		[IBND_CACHE_SECT_PORT_DELS] = IBND_CACHE_GUID_LEN,
+		[IBND_CACHE_SECT_PORT_SETS] = IBND_CACHE_PORT_SET_LEN,
+	};
+	ibnd_cache_sect_info_t info;
+	uint32_t magic, num_sects, id, i;
+	size_t offset = 0;
 
-	while ((count - count_done) > 0) {
-		ret = write(fd, ((char *) buf) + count_done, count - count_done);
-		if (ret < 0) {
-			if (errno == EINTR)
-				continue;
-			else {
-				IBND_DEBUG("write: %s\n", strerror(errno));
-				return -1;
-			}
-		}
-		count_done += ret;
+	memset(map, 0, sizeof(*map));
+	map->base = base;
+	map->len = len;
+
+	if (len < IBND_CACHE_HEADER_LEN)
+		goto invalid;
+	offset += _unmarshall32(base + offset, &magic);
+	offset += _unmarshall32(base + offset, &map->version);
+	if (magic != IBND_FABRIC_CACHE_MAGIC ||
+	    (map->version != IBND_FABRIC_CACHE_VERSION_2 &&
+	     map->version != IBND_FABRIC_CACHE_DELTA))
+		goto invalid;
+	offset += _unmarshall32(base + offset, &num_sects);
+	offset += _unmarshall32(base + offset, &map->maxhops);
+	offset += _unmarshall64(base + offset, &map->from_node_guid);
+	offset += _unmarshall32(base + offset, &map->from_node);
+	offset += _unmarshall32(base + offset, &map->from_portnum);
+
+	if (num_sects > (len - IBND_CACHE_HEADER_LEN) / IBND_CACHE_SECTION_LEN)
+		goto invalid;
+	for (i = 0; i < num_sects; i++) {
+		offset = IBND_CACHE_HEADER_LEN + i * IBND_CACHE_SECTION_LEN;
+		offset += _unmarshall32(base + offset, &id);
+		offset += _unmarshall32(base + offset, &info.stride);
+		offset += _unmarshall32(base + offset, &info.count);
+		offset += 4;
+		offset += _unmarshall64(base + offset, &info.offset);
+		if (id >= IBND_CACHE_NUM_SECTS || !id)
+			continue;
+		if (info.stride < min_stride[id] || info.offset > len ||
+		    (uint64_t) info.stride * info.count > len - info.offset)
+			goto invalid;
+		map->sect[id] = info;
 	}
-	return count_done;
-}
 
-static size_t _marshall8(uint8_t * outbuf, uint8_t num)
-{
-	outbuf[0] = num;
+	if (map->version == IBND_FABRIC_CACHE_DELTA ?
+	    map->sect[IBND_CACHE_SECT_DELTA].count != 1 :
+	    map->sect[IBND_CACHE_SECT_NODES].count <= map->from_node)
+		goto invalid;
+	return 0;
 
-	return (sizeof(num));
+invalid:
+	IBND_DEBUG("invalid fabric cache file\n");
+	return -1;
 }
 
-static size_t _marshall16(uint8_t * outbuf, uint16_t num)
+static uint8_t *_cache_rec(ibnd_cache_map_t * map, int sect, uint32_t index)
 {
-	outbuf[0] = num & 0x00FF;
-	outbuf[1] = (num & 0xFF00) >> 8;
-
-	return (sizeof(num));
+	return map->base + map->sect[sect].offset +
+	       (size_t) index * map->sect[sect].stride;
 }
 
-static size_t _marshall32(uint8_t * outbuf, uint32_t num)
+/* number of distinct GUIDs in a GUID index */
+static unsigned _cache_guid_count(ibnd_cache_map_t * map, int sect)
 {
-	outbuf[0] = num & 0x000000FF;
-	outbuf[1] = (num & 0x0000FF00) >> 8;
-	outbuf[2] = (num & 0x00FF0000) >> 16;
-	outbuf[3] = (num & 0xFF000000) >> 24;
-
-	return (sizeof(num));
+	uint64_t guid, last = 0;
+	unsigned i, count = 0;
+
+	for (i = 0; i < map->sect[sect].count; i++) {
+		_unmarshall64(_cache_rec(map, sect, i), &guid);
+		if (!i || guid != last)
+			count++;
+		last = guid;
+	}
+	return count;
 }
 
-static size_t _marshall64(uint8_t * outbuf, uint64_t num)
+/* fill in what a node record holds besides type, numports and its ports */
+static void _unmarshall_node_v2(ibnd_node_t * node, uint8_t * rec)
 {
-	outbuf[0] = (uint8_t) num;
-	outbuf[1] = (uint8_t) (num >> 8);
-	outbuf[2] = (uint8_t) (num >> 16);
-	outbuf[3] = (uint8_t) (num >> 24);
-	outbuf[4] = (uint8_t) (num >> 32);
-	outbuf[5] = (uint8_t) (num >> 40);
-	outbuf[6] = (uint8_t) (num >> 48);
-	outbuf[7] = (uint8_t) (num >> 56);
+	uint8_t tmp8;
 
-	return (sizeof(num));
+	_unmarshall64(rec, &node->guid);
+	_unmarshall8(rec + 15, &node->smalmc);
+	_unmarshall16(rec + 16, &node->smalid);
+	_unmarshall8(rec + 18, &tmp8);
+	node->smaenhsp0 = tmp8;
+	_unmarshall_buf(rec + 24, node->info, IB_SMP_DATA_SIZE);
+	_unmarshall_buf(rec + 24 + IB_SMP_DATA_SIZE, node->nodedesc,
+			IB_SMP_DATA_SIZE);
+	_unmarshall_buf(rec + 24 + IB_SMP_DATA_SIZE * 2, node->switchinfo,
+			IB_SMP_DATA_SIZE);
 }
 
-static size_t _marshall_buf(void *outbuf, const void *inbuf, unsigned int len)
+static void _unmarshall_port_v2(ibnd_port_t * port, uint8_t * rec)
 {
-	memcpy(outbuf, inbuf, len);
+	uint8_t tmp8;
 
-	return len;
+	_unmarshall64(rec, &port->guid);
+	_unmarshall16(rec + 16, &port->base_lid);
+	_unmarshall8(rec + 19, &tmp8);
+	port->ext_portnum = tmp8;
+	_unmarshall8(rec + 20, &port->lmc);
+	_unmarshall_buf(rec + 24, port->info, IB_SMP_DATA_SIZE);
+	_unmarshall_buf(rec + 24 + IB_SMP_DATA_SIZE, port->ext_info,
+			IB_SMP_DATA_SIZE);
 }
 
-static int _cache_header_info(int fd, ibnd_fabric_t * fabric)
+static ibnd_node_t *_load_node_v2(f_internal_t * f_int, uint8_t * rec,
+				  uint32_t * first_port, uint8_t * num_ports)
 {
-	uint8_t buf[IBND_FABRIC_CACHE_BUFLEN];
-	size_t offset = 0;
-
-	/* Store magic number, version, and other important info */
-	/* For this caching lib, we always assume cached as little endian */
-
-	offset += _marshall32(buf + offset, IBND_FABRIC_CACHE_MAGIC);
-	offset += _marshall32(buf + offset, IBND_FABRIC_CACHE_VERSION);
-	/* save space for node count */
-	offset += _marshall32(buf + offset, 0);
-	/* save space for port count */
-	offset += _marshall32(buf + offset, 0);
-	offset += _marshall64(buf + offset, fabric->from_node->guid);
-	offset += _marshall32(buf + offset, fabric->maxhops_discovered);
+	ibnd_node_t *node;
+	uint8_t type, numports;
 
-	if (ibnd_write(fd, buf, offset) < 0)
-		return -1;
+	_unmarshall32(rec + 8, first_port);
+	_unmarshall8(rec + 12, num_ports);
+	_unmarshall8(rec + 13, &type);
+	_unmarshall8(rec + 14, &numports);
 
-	return 0;
+	if (!(node = alloc_node(f_int, type, numports))) {
+		IBND_DEBUG("OOM: node\n");
+		return NULL;
+	}
+	_unmarshall_node_v2(node, rec);
+	return node;
 }
 
-static int _cache_header_counts(int fd, unsigned int node_count,
-				unsigned int port_count)
+static ibnd_port_t *_load_port_v2(f_internal_t * f_int, ibnd_node_t * node,
+				  uint32_t node_index, uint8_t * rec)
 {
-	uint8_t buf[IBND_FABRIC_CACHE_BUFLEN];
-	size_t offset = 0;
-
-	offset += _marshall32(buf + offset, node_count);
-	offset += _marshall32(buf + offset, port_count);
+	ibnd_port_t *port;
+	uint32_t index;
+	uint8_t portnum;
 
-	if (lseek(fd, IBND_FABRIC_CACHE_COUNT_OFFSET, SEEK_SET) < 0) {
-		IBND_DEBUG("lseek: %s\n", strerror(errno));
-		return -1;
+	_unmarshall32(rec + 8, &index);
+	_unmarshall8(rec + 18, &portnum);
+	if (index != node_index || portnum > node->numports ||
+	    node->ports[portnum] || !(port = alloc_port(f_int, node, portnum))) {
+		IBND_DEBUG("Cache invalid: bad port\n");
+		return NULL;
 	}
 
-	if (ibnd_write(fd, buf, offset) < 0)
-		return -1;
-
-	return 0;
+	_unmarshall_port_v2(port, rec);
+	return port;
 }
 
-static int _cache_node(int fd, ibnd_node_t * node)
+/* threads of a version 2 load get at least this many nodes each */
+#define IBND_CACHE_MIN_THREAD_NODES 256
+
+/* A thread of a version 2 load: first it loads nodes [first, last) with
+ * their ports into an arena of its own, then it links ports [first, last) */
+typedef struct cache_load_part {
+	pthread_t thread;
+	ibnd_cache_map_t *map;
+	f_internal_t *f_int;	/* only its arena is used */
+	ibnd_node_t **nodes;
+	ibnd_port_t **ports;
+	unsigned first, last;
+	int rc;
+} cache_load_part_t;
+
+static void *_load_nodes_v2(void *arg)
 {
-	uint8_t buf[IBND_FABRIC_CACHE_BUFLEN];
-	size_t offset = 0;
-	size_t ports_stored_offset = 0;
-	uint8_t ports_stored_count = 0;
-	int i;
+	cache_load_part_t *part = arg;
+	ibnd_cache_map_t *map = part->map;
+	unsigned port_count = map->sect[IBND_CACHE_SECT_PORTS].count;
+	ibnd_node_t *node;
+	ibnd_port_t *port;
+	uint32_t first_port;
+	uint8_t num_ports;
+	unsigned i, j;
+
+	for (i = part->first; i < part->last; i++) {
+		node = _load_node_v2(part->f_int,
+				     _cache_rec(map, IBND_CACHE_SECT_NODES, i),
+				     &first_port, &num_ports);
+		if (!node)
+			goto error;
+		part->nodes[i] = node;
+		if (first_port > port_count ||
+		    num_ports > port_count - first_port) {
+			IBND_DEBUG("Cache invalid: bad port index\n");
+			goto error;
+		}
+		for (j = first_port; j < first_port + num_ports; j++) {
+			port = _load_port_v2(part->f_int, node, i,
+					     _cache_rec(map,
+							IBND_CACHE_SECT_PORTS,
+							j));
+			if (!port)
+				goto error;
+			/* a node of another thread may list it too */
+			if (!__sync_bool_compare_and_swap(&part->ports[j], NULL,
+							  port)) {
+				IBND_DEBUG("Cache invalid: duplicate port\n");
+				goto error;
+			}
+		}
+		decode_ports(part->f_int, node);
+	}
+	return NULL;
 
-	offset += _marshall16(buf + offset, node->smalid);
-	offset += _marshall8(buf + offset, node->smalmc);
-	offset += _marshall8(buf + offset, (uint8_t) node->smaenhsp0);
-	offset += _marshall_buf(buf + offset, node->switchinfo,
-				IB_SMP_DATA_SIZE);
-	offset += _marshall64(buf + offset, node->guid);
-	offset += _marshall8(buf + offset, (uint8_t) node->type);
-	offset += _marshall8(buf + offset, (uint8_t) node->numports);
-	offset += _marshall_buf(buf + offset, node->info, IB_SMP_DATA_SIZE);
-	offset += _marshall_buf(buf + offset, node->nodedesc, IB_SMP_DATA_SIZE);
-	/* need to come back later and store number of stored ports
-	 * because port entries can be NULL or (in the case of switches)
-	 * there is an additional port 0 not accounted for in numports.
-	 */
-	ports_stored_offset = offset;
-	offset += sizeof(uint8_t);
+error:
+	part->rc = -1;
+	return NULL;
+}
 
-	for (i = 0; i <= node->numports; i++) {
-		if (node->ports[i]) {
-			offset += _marshall64(buf + offset,
-					      node->ports[i]->guid);
-			offset += _marshall8(buf + offset,
-					     (uint8_t) node->ports[i]->portnum);
-			ports_stored_count++;
+static void *_link_ports_v2(void *arg)
+{
+	cache_load_part_t *part = arg;
+	unsigned port_count = part->map->sect[IBND_CACHE_SECT_PORTS].count;
+	uint32_t remote;
+	unsigned j;
+
+	for (j = part->first; j < part->last; j++) {
+		if (!part->ports[j]) {
+			IBND_DEBUG("Cache invalid: port without a node\n");
+			goto error;
+		}
+		_unmarshall32(_cache_rec(part->map, IBND_CACHE_SECT_PORTS, j) +
+			      12, &remote);
+		if (remote == IBND_CACHE_NO_INDEX)
+			continue;
+		if (remote >= port_count) {
+			IBND_DEBUG("Cache invalid: cannot find remote port\n");
+			goto error;
 		}
+		part->ports[j]->remoteport = part->ports[remote];
 	}
+	return NULL;
 
-	/* go back and store number of port keys stored */
-	_marshall8(buf + ports_stored_offset, ports_stored_count);
+error:
+	part->rc = -1;
+	return NULL;
+}
 
-	if (ibnd_write(fd, buf, offset) < 0)
-		return -1;
+/* Split count records evenly between the parts and run func over them.
+ * The calling thread takes the first part, and any a thread could not be
+ * started for. */
+static int _run_load_parts(void *(*func) (void *), cache_load_part_t * parts,
+			   unsigned num_parts, unsigned count)
+{
+	unsigned i, started;
+	int rc = 0;
 
-	return 0;
+	for (i = 0; i < num_parts; i++) {
+		parts[i].first = (uint64_t) count * i / num_parts;
+		parts[i].last = (uint64_t) count * (i + 1) / num_parts;
+		parts[i].rc = 0;
+	}
+	for (started = 1; started < num_parts; started++)
+		if (pthread_create(&parts[started].thread, NULL, func,
+				   &parts[started]))
+			break;
+	func(&parts[0]);
+	for (i = started; i < num_parts; i++)
+		func(&parts[i]);
+	for (i = 1; i < started; i++)
+		pthread_join(parts[i].thread, NULL);
+
+	for (i = 0; i < num_parts; i++)
+		if (parts[i].rc)
+			rc = -1;
+	return rc;
 }
 
-static int _cache_port(int fd, ibnd_port_t * port)
+/* Nodes and ports come straight out of the mapped records, in one pass
+ * each; links are resolved by index without any lookups.  With threads,
+ * each pass and the filling of the GUID tables is split between them. */
+static ibnd_fabric_t *_load_fabric_v2(ibnd_cache_map_t * map,
+				      unsigned threads)
 {
-	uint8_t buf[IBND_FABRIC_CACHE_BUFLEN];
-	size_t offset = 0;
+	unsigned node_count = map->sect[IBND_CACHE_SECT_NODES].count;
+	unsigned port_count = map->sect[IBND_CACHE_SECT_PORTS].count;
+	cache_load_part_t *parts = NULL;
+	ibnd_node_t **nodes = NULL;
+	ibnd_port_t **ports = NULL;
+	f_internal_t *f_int;
+	ibnd_node_t *node;
+	unsigned i, j;
+	int rc;
 
-	offset += _marshall64(buf + offset, port->guid);
-	offset += _marshall8(buf + offset, (uint8_t) port->portnum);
+	if (threads > node_count / IBND_CACHE_MIN_THREAD_NODES)
+		threads = node_count / IBND_CACHE_MIN_THREAD_NODES;
+	if (!threads)
+		threads = 1;
+
+	if (!(f_int = allocate_fabric_internal())) {
+		IBND_DEBUG("OOM: fabric\n");
+		return NULL;
+	}
+	nodes = calloc(node_count + 1, sizeof(*nodes));
+	ports = calloc(port_count + 1, sizeof(*ports));
+	parts = calloc(threads, sizeof(*parts));
+	if (!nodes || !ports || !parts ||
+	    guid_tbl_reserve(&f_int->nodes_tbl,
+			     _cache_guid_count(map,
+					       IBND_CACHE_SECT_NODE_GUIDS)) ||
+	    guid_tbl_reserve(&f_int->ports_tbl,
+			     _cache_guid_count(map,
+					       IBND_CACHE_SECT_PORT_GUIDS))) {
+		IBND_DEBUG("OOM: fabric cache tables\n");
+		goto cleanup;
+	}
+	for (i = 0; i < threads; i++) {
+		parts[i].map = map;
+		parts[i].nodes = nodes;
+		parts[i].ports = ports;
+		parts[i].f_int = i ? calloc(1, sizeof(*f_int)) : f_int;
+		if (!parts[i].f_int) {
+			IBND_DEBUG("OOM: fabric cache threads\n");
+			goto cleanup;
+		}
+	}
+
+	rc = _run_load_parts(_load_nodes_v2, parts, threads, node_count);
+	for (i = 1; i < threads; i++) {
+		arena_merge(&f_int->arena, &parts[i].f_int->arena);
+		free(parts[i].f_int);
+		parts[i].f_int = NULL;
+	}
+	if (rc || _run_load_parts(_link_ports_v2, parts, threads, port_count))
+		goto cleanup;
+
+	/* listed in the order they were cached */
+	for (i = node_count; i-- > 0;) {
+		node = nodes[i];
+		node->next = f_int->fabric.nodes;
+		f_int->fabric.nodes = node;
+		add_to_type_list(node, f_int);
+	}
+	f_int->fabric.from_node = nodes[map->from_node];
+	f_int->fabric.from_portnum = map->from_portnum;
+	f_int->fabric.maxhops_discovered = map->maxhops;
+
+	/* nodes go into their table in the same order, the last first */
+	for (i = 0; i < node_count / 2; i++) {
+		node = nodes[i];
+		nodes[i] = nodes[node_count - 1 - i];
+		nodes[node_count - 1 - i] = node;
+	}
+	if (guid_tbl_add_all(&f_int->nodes_tbl, (void **)nodes, node_count,
+			     offsetof(ibnd_node_t, guid), threads) ||
+	    guid_tbl_add_all(&f_int->ports_tbl, (void **)ports, port_count,
+			     offsetof(ibnd_port_t, guid), threads)) {
+		IBND_DEBUG("OOM: fabric cache tables\n");
+		goto cleanup;
+	}
+	for (j = 0; j < port_count; j++)
+		add_to_portlid_hash(ports[j], f_int);
+
+	free(nodes);
+	free(ports);
+	free(parts);
+	if (group_nodes(&f_int->fabric)) {
+		ibnd_destroy_fabric(&f_int->fabric);
+		return NULL;
+	}
+	return &f_int->fabric;
+
+cleanup:
+	for (i = 1; parts && i < threads; i++)
+		if (parts[i].f_int) {
+			arena_merge(&f_int->arena, &parts[i].f_int->arena);
+			free(parts[i].f_int);
+		}
+	free(nodes);
+	free(ports);
+	free(parts);
+	ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
+
+static void *_mmap_cache(int fd, size_t * len)
+{
+	struct stat statbuf;
+	void *base;
+
+	if (fstat(fd, &statbuf) < 0) {
+		IBND_DEBUG("fstat: %s\n", strerror(errno));
+		return NULL;
+	}
+	*len = statbuf.st_size;
+	base = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		IBND_DEBUG("mmap: %s\n", strerror(errno));
+		return NULL;
+	}
+	return base;
+}
+
+ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
+{
+	ibnd_fabric_t *fabric = NULL;
+	ibnd_cache_map_t map;
+	unsigned threads = (flags & IBND_LOAD_FABRIC_THREADS_MASK) >>
+			   IBND_LOAD_FABRIC_THREADS_SHIFT;
+	uint8_t buf[8];
+	uint32_t version;
+	size_t len;
+	void *base;
+	int fd;
+
+	if (!file) {
+		IBND_DEBUG("file parameter NULL\n");
+		return NULL;
+	}
+
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		IBND_DEBUG("open: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (ibnd_read(fd, buf, sizeof(buf)) < 0)
+		goto out;
+	_unmarshall32(buf + 4, &version);
+
+	if (version != IBND_FABRIC_CACHE_VERSION_2 &&
+	    version != IBND_FABRIC_CACHE_DELTA) {
+		/* _load_header_info() checks magic and version */
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			IBND_DEBUG("lseek: %s\n", strerror(errno));
+			goto out;
+		}
+		fabric = _load_fabric_v1(fd);
+		goto out;
+	}
+
+	if (!(base = _mmap_cache(fd, &len)))
+		goto out;
+	if (!_map_cache(&map, base, len)) {
+		if (map.version == IBND_FABRIC_CACHE_VERSION_2)
+			fabric = _load_fabric_v2(&map, threads);
+		else
+			IBND_DEBUG("'%s' is a delta; load it with "
+				   "ibnd_load_fabric_delta()\n", file);
+	}
+	munmap(base, len);
+
+out:
+	close(fd);
+	return fabric;
+}
+
+/* The cursor reads records a window at a time: a large one for each
+ * section it walks and a small one each for the far ends of links, which
+ * tend to be near each other.  Its memory does not grow with the cache. */
+#define IBND_CACHE_WINDOW_LEN		(64 * 1024)
+#define IBND_CACHE_REMOTE_WINDOW_LEN	(16 * 1024)
+
+typedef struct cache_window {
+	uint8_t *buf;
+	size_t len;
+	uint32_t first;
+	uint32_t count;
+} cache_window_t;
+
+struct ibnd_cache {
+	int fd;
+	int error;
+	/* only the header and section table; base is NULL */
+	ibnd_cache_map_t map;
+	cache_window_t node_win;
+	cache_window_t port_win;
+	cache_window_t remote_node_win;
+	cache_window_t remote_port_win;
+	uint32_t next_node;
+	uint32_t node_index;
+	uint32_t next_port;
+	uint32_t end_port;
+	uint8_t seen[(UINT8_MAX + 1) / 8];
+	ibnd_node_t node;
+	ibnd_port_t port;
+	ibnd_port_t port0;
+	ibnd_port_t *ports[UINT8_MAX + 1];
+	ibnd_node_t remote_node;
+	ibnd_port_t remote_port;
+	ibnd_port_t remote_port0;
+	ibnd_port_t *remote_ports[UINT8_MAX + 1];
+};
+
+static int _cache_window_init(cache_window_t * w, size_t len)
+{
+	w->len = len;
+	return (w->buf = malloc(len)) ? 0 : -1;
+}
+
+/* record index of sect, refilling the window from there if it is not in it */
+static uint8_t *_cache_window_rec(ibnd_cache_t * cache, cache_window_t * w,
+				  int sect, uint32_t index)
+{
+	ibnd_cache_sect_info_t *s = &cache->map.sect[sect];
+	uint32_t count;
+
+	if (index - w->first < w->count)
+		return w->buf + (size_t) (index - w->first) * s->stride;
+
+	count = w->len / s->stride;
+	if (count > s->count - index)
+		count = s->count - index;
+	w->count = 0;
+	if (ibnd_pread(cache->fd, w->buf, (size_t) count * s->stride,
+		       s->offset + (uint64_t) index * s->stride) < 0) {
+		cache->error = 1;
+		return NULL;
+	}
+	w->first = index;
+	w->count = count;
+	return w->buf;
+}
+
+/* a far end record, out of the walking window w if it is there already */
+static uint8_t *_cache_remote_rec(ibnd_cache_t * cache, cache_window_t * w,
+				  cache_window_t * remote_w, int sect,
+				  uint32_t index)
+{
+	uint32_t stride = cache->map.sect[sect].stride;
+
+	if (index - w->first < w->count)
+		return w->buf + (size_t) (index - w->first) * stride;
+	return _cache_window_rec(cache, remote_w, sect, index);
+}
+
+static int _cache_invalid(ibnd_cache_t * cache, const char *what)
+{
+	IBND_DEBUG("Cache invalid: %s\n", what);
+	cache->error = 1;
+	return -1;
+}
+
+/* Fill in the far end of a link: the port, its node and, for a switch,
+ * port 0 so decode_port() sees the switch capabilities. */
+static int _cache_remote(ibnd_cache_t * cache, uint32_t remote)
+{
+	uint8_t *rec, portnum, type, numports, num_ports;
+	uint32_t index, first_port;
+	ibnd_node_t *node = &cache->remote_node;
+	ibnd_port_t *port = &cache->remote_port;
+
+	if (!(rec = _cache_remote_rec(cache, &cache->port_win,
+				      &cache->remote_port_win,
+				      IBND_CACHE_SECT_PORTS, remote)))
+		return -1;
+	_unmarshall32(rec + 8, &index);
+	_unmarshall8(rec + 18, &portnum);
+	if (index >= cache->map.sect[IBND_CACHE_SECT_NODES].count)
+		return _cache_invalid(cache, "bad remote port");
+
+	cache->remote_ports[port->portnum] = NULL;
+	cache->remote_ports[0] = NULL;
+	memset(port, 0, sizeof(*port));
+	port->portnum = portnum;
+	port->node = node;
+	_unmarshall_port_v2(port, rec);
+
+	if (!(rec = _cache_remote_rec(cache, &cache->node_win,
+				      &cache->remote_node_win,
+				      IBND_CACHE_SECT_NODES, index)))
+		return -1;
+	_unmarshall32(rec + 8, &first_port);
+	_unmarshall8(rec + 12, &num_ports);
+	_unmarshall8(rec + 13, &type);
+	_unmarshall8(rec + 14, &numports);
+	if (portnum > numports)
+		return _cache_invalid(cache, "bad remote port");
+
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->numports = numports;
+	node->ports = cache->remote_ports;
+	_unmarshall_node_v2(node, rec);
+	node->ports[portnum] = port;
+
+	/* port 0 comes first among the ports of a switch */
+	if (type == IB_NODE_SWITCH && portnum && num_ports &&
+	    first_port < cache->map.sect[IBND_CACHE_SECT_PORTS].count) {
+		if (!(rec = _cache_remote_rec(cache, &cache->port_win,
+					      &cache->remote_port_win,
+					      IBND_CACHE_SECT_PORTS,
+					      first_port)))
+			return -1;
+		_unmarshall32(rec + 8, &first_port);
+		if (first_port == index && !rec[18]) {
+			memset(&cache->remote_port0, 0,
+			       sizeof(cache->remote_port0));
+			cache->remote_port0.node = node;
+			_unmarshall_port_v2(&cache->remote_port0, rec);
+			node->ports[0] = &cache->remote_port0;
+		}
+	}
+
+	decode_port(port);
+	return 0;
+}
+
+ibnd_cache_t *ibnd_cache_open(const char *file, unsigned int flags)
+{
+	uint8_t head[IBND_CACHE_HEADER_LEN], *table = NULL;
+	ibnd_cache_t *cache;
+	struct stat statbuf;
+	uint32_t magic, version, num_sects;
+	size_t len;
+	int rc;
+
+	if (!file) {
+		IBND_DEBUG("file parameter NULL\n");
+		return NULL;
+	}
+
+	if (!(cache = calloc(1, sizeof(*cache)))) {
+		IBND_DEBUG("OOM: cache cursor\n");
+		return NULL;
+	}
+	if ((cache->fd = open(file, O_RDONLY)) < 0) {
+		IBND_DEBUG("open: %s\n", strerror(errno));
+		free(cache);
+		return NULL;
+	}
+	if (fstat(cache->fd, &statbuf) < 0) {
+		IBND_DEBUG("fstat: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	len = statbuf.st_size;
+
+	if (ibnd_pread(cache->fd, head, sizeof(head), 0) < 0)
+		goto cleanup;
+	_unmarshall32(head, &magic);
+	_unmarshall32(head + 4, &version);
+	_unmarshall32(head + 8, &num_sects);
+	if (magic != IBND_FABRIC_CACHE_MAGIC ||
+	    version != IBND_FABRIC_CACHE_VERSION_2) {
+		IBND_DEBUG("'%s' is not a version 2 cache\n", file);
+		goto cleanup;
+	}
+	if (num_sects >
+	    (len - IBND_CACHE_HEADER_LEN) / IBND_CACHE_SECTION_LEN) {
+		IBND_DEBUG("invalid fabric cache file\n");
+		goto cleanup;
+	}
+
+	len = IBND_CACHE_HEADER_LEN + num_sects * IBND_CACHE_SECTION_LEN;
+	if (!(table = malloc(len))) {
+		IBND_DEBUG("OOM: cache section table\n");
+		goto cleanup;
+	}
+	memcpy(table, head, sizeof(head));
+	if (ibnd_pread(cache->fd, table + sizeof(head), len - sizeof(head),
+		       sizeof(head)) < 0)
+		goto cleanup;
+	/* _map_cache() checks the sections against the length of the file */
+	rc = _map_cache(&cache->map, table, statbuf.st_size);
+	cache->map.base = NULL;
+	free(table);
+	table = NULL;
+	if (rc)
+		goto cleanup;
+
+	if (cache->map.sect[IBND_CACHE_SECT_NODES].stride >
+	    IBND_CACHE_REMOTE_WINDOW_LEN ||
+	    cache->map.sect[IBND_CACHE_SECT_PORTS].stride >
+	    IBND_CACHE_REMOTE_WINDOW_LEN) {
+		IBND_DEBUG("cache records too large to stream\n");
+		goto cleanup;
+	}
+	if (_cache_window_init(&cache->node_win, IBND_CACHE_WINDOW_LEN) ||
+	    _cache_window_init(&cache->port_win, IBND_CACHE_WINDOW_LEN) ||
+	    _cache_window_init(&cache->remote_node_win,
+			       IBND_CACHE_REMOTE_WINDOW_LEN) ||
+	    _cache_window_init(&cache->remote_port_win,
+			       IBND_CACHE_REMOTE_WINDOW_LEN)) {
+		IBND_DEBUG("OOM: cache windows\n");
+		goto cleanup;
+	}
+	cache->node.ports = cache->ports;
+	cache->remote_node.ports = cache->remote_ports;
+	return cache;
+
+cleanup:
+	free(table);
+	ibnd_cache_close(cache);
+	return NULL;
+}
+
+ibnd_node_t *ibnd_cache_next_node(ibnd_cache_t * cache)
+{
+	unsigned port_count = cache->map.sect[IBND_CACHE_SECT_PORTS].count;
+	ibnd_node_t *node = &cache->node;
+	uint8_t *rec, type, numports, num_ports;
+	uint32_t first_port;
+
+	if (cache->error ||
+	    cache->next_node >= cache->map.sect[IBND_CACHE_SECT_NODES].count)
+		return NULL;
+	if (!(rec = _cache_window_rec(cache, &cache->node_win,
+				      IBND_CACHE_SECT_NODES, cache->next_node)))
+		return NULL;
+
+	_unmarshall32(rec + 8, &first_port);
+	_unmarshall8(rec + 12, &num_ports);
+	_unmarshall8(rec + 13, &type);
+	_unmarshall8(rec + 14, &numports);
+	if (first_port > port_count || num_ports > port_count - first_port) {
+		_cache_invalid(cache, "bad port index");
+		return NULL;
+	}
+
+	cache->ports[cache->port.portnum] = NULL;
+	cache->ports[0] = NULL;
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->numports = numports;
+	node->ports = cache->ports;
+	_unmarshall_node_v2(node, rec);
+
+	cache->node_index = cache->next_node++;
+	cache->next_port = first_port;
+	cache->end_port = first_port + num_ports;
+	memset(cache->seen, 0, sizeof(cache->seen));
+	return node;
+}
+
+ibnd_port_t *ibnd_cache_next_port(ibnd_cache_t * cache)
+{
+	ibnd_node_t *node = &cache->node;
+	ibnd_port_t *port;
+	uint32_t index, remote;
+	uint8_t *rec, portnum;
+
+	if (cache->error || cache->next_port >= cache->end_port)
+		return NULL;
+	if (!(rec = _cache_window_rec(cache, &cache->port_win,
+				      IBND_CACHE_SECT_PORTS, cache->next_port)))
+		return NULL;
+
+	_unmarshall32(rec + 8, &index);
+	_unmarshall32(rec + 12, &remote);
+	_unmarshall8(rec + 18, &portnum);
+	if (index != cache->node_index || portnum > node->numports ||
+	    cache->seen[portnum / 8] & (1 << (portnum % 8))) {
+		_cache_invalid(cache, "bad port");
+		return NULL;
+	}
+	cache->seen[portnum / 8] |= 1 << (portnum % 8);
+
+	/* port 0 stays in place for the other ports of a switch */
+	if (portnum)
+		port = &cache->port;
+	else
+		port = &cache->port0;
+	if (cache->port.portnum)
+		node->ports[cache->port.portnum] = NULL;
+	memset(port, 0, sizeof(*port));
+	port->portnum = portnum;
+	port->node = node;
+	_unmarshall_port_v2(port, rec);
+	node->ports[portnum] = port;
+
+	if (remote != IBND_CACHE_NO_INDEX) {
+		if (remote >= cache->map.sect[IBND_CACHE_SECT_PORTS].count) {
+			_cache_invalid(cache, "cannot find remote port");
+			return NULL;
+		}
+		if (_cache_remote(cache, remote))
+			return NULL;
+		port->remoteport = &cache->remote_port;
+	}
+
+	decode_port(port);
+	cache->next_port++;
+	return port;
+}
+
+int ibnd_cache_close(ibnd_cache_t * cache)
+{
+	int rc;
+
+	if (!cache)
+		return 0;
+	rc = cache->error ? -1 : 0;
+	if (cache->fd >= 0)
+		close(cache->fd);
+	free(cache->node_win.buf);
+	free(cache->port_win.buf);
+	free(cache->remote_node_win.buf);
+	free(cache->remote_port_win.buf);
+	free(cache);
+	return rc;
+}
+
+static ssize_t ibnd_write(int fd, const void *buf, size_t count)
+{
+	size_t count_done = 0;
+	ssize_t ret;
+
+	while ((count - count_done) > 0) {
+		ret = write(fd, ((char *) buf) + count_done, count - count_done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			else {
+				IBND_DEBUG("write: %s\n", strerror(errno));
+				return -1;
+			}
+		}
+		count_done += ret;
+	}
+	return count_done;
+}
+
+static size_t _marshall8(uint8_t * outbuf, uint8_t num)
+{
+	outbuf[0] = num;
+
+	return (sizeof(num));
+}
+
+static size_t _marshall16(uint8_t * outbuf, uint16_t num)
+{
+	outbuf[0] = num & 0x00FF;
+	outbuf[1] = (num & 0xFF00) >> 8;
+
+	return (sizeof(num));
+}
+
+static size_t _marshall32(uint8_t * outbuf, uint32_t num)
+{
+	outbuf[0] = num & 0x000000FF;
+	outbuf[1] = (num & 0x0000FF00) >> 8;
+	outbuf[2] = (num & 0x00FF0000) >> 16;
+	outbuf[3] = (num & 0xFF000000) >> 24;
+
+	return (sizeof(num));
+}
+
+static size_t _marshall64(uint8_t * outbuf, uint64_t num)
+{
+	outbuf[0] = (uint8_t) num;
+	outbuf[1] = (uint8_t) (num >> 8);
+	outbuf[2] = (uint8_t) (num >> 16);
+	outbuf[3] = (uint8_t) (num >> 24);
+	outbuf[4] = (uint8_t) (num >> 32);
+	outbuf[5] = (uint8_t) (num >> 40);
+	outbuf[6] = (uint8_t) (num >> 48);
+	outbuf[7] = (uint8_t) (num >> 56);
+
+	return (sizeof(num));
+}
+
+static size_t _marshall_buf(void *outbuf, const void *inbuf, unsigned int len)
+{
+	memcpy(outbuf, inbuf, len);
+
+	return len;
+}
+
+/* The cache is built in memory and written out with a single write() */
+typedef struct cache_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+} cache_buf_t;
+
+/* room for len more bytes at cb->data + cb->len; the caller adds what it
+ * used to cb->len */
+static uint8_t *_cache_buf_space(cache_buf_t * cb, size_t len)
+{
+	size_t size = cb->size ? cb->size : IBND_FABRIC_CACHE_BUFLEN * 16;
+	uint8_t *data;
+
+	if (cb->len + len <= cb->size)
+		return cb->data + cb->len;
+	while (size < cb->len + len)
+		size *= 2;
+	if (!(data = realloc(cb->data, size))) {
+		IBND_DEBUG("OOM: fabric cache buffer of %zu bytes\n", size);
+		return NULL;
+	}
+	cb->data = data;
+	cb->size = size;
+	return cb->data + cb->len;
+}
+
+static int _cache_header_info(cache_buf_t * cb, ibnd_fabric_t * fabric)
+{
+	uint8_t *buf = _cache_buf_space(cb, IBND_FABRIC_CACHE_HEADER_LEN);
+	size_t offset = 0;
+
+	if (!buf)
+		return -1;
+
+	/* Store magic number, version, and other important info */
+	/* For this caching lib, we always assume cached as little endian */
+
+	offset += _marshall32(buf + offset, IBND_FABRIC_CACHE_MAGIC);
+	offset += _marshall32(buf + offset, IBND_FABRIC_CACHE_VERSION);
+	/* save space for node count */
+	offset += _marshall32(buf + offset, 0);
+	/* save space for port count */
+	offset += _marshall32(buf + offset, 0);
+	offset += _marshall64(buf + offset, fabric->from_node->guid);
+	offset += _marshall32(buf + offset, fabric->maxhops_discovered);
+
+	cb->len += offset;
+	return 0;
+}
+
+static void _cache_header_counts(cache_buf_t * cb, unsigned int node_count,
+				 unsigned int port_count)
+{
+	size_t offset = IBND_FABRIC_CACHE_COUNT_OFFSET;
+
+	offset += _marshall32(cb->data + offset, node_count);
+	offset += _marshall32(cb->data + offset, port_count);
+}
+
+static int _cache_node(cache_buf_t * cb, ibnd_node_t * node)
+{
+	uint8_t *buf;
+	size_t offset = 0;
+	size_t ports_stored_offset = 0;
+	uint8_t ports_stored_count = 0;
+	int i;
+
+	buf = _cache_buf_space(cb, IBND_NODE_CACHE_HEADER_LEN +
+			       (node->numports + 1) * IBND_PORT_CACHE_KEY_LEN);
+	if (!buf)
+		return -1;
+
+	offset += _marshall16(buf + offset, node->smalid);
+	offset += _marshall8(buf + offset, node->smalmc);
+	offset += _marshall8(buf + offset, (uint8_t) node->smaenhsp0);
+	offset += _marshall_buf(buf + offset, node->switchinfo,
+				IB_SMP_DATA_SIZE);
+	offset += _marshall64(buf + offset, node->guid);
+	offset += _marshall8(buf + offset, (uint8_t) node->type);
+	offset += _marshall8(buf + offset, (uint8_t) node->numports);
+	offset += _marshall_buf(buf + offset, node->info, IB_SMP_DATA_SIZE);
+	offset += _marshall_buf(buf + offset, node->nodedesc, IB_SMP_DATA_SIZE);
+	/* need to come back later and store number of stored ports
+	 * because port entries can be NULL or (in the case of switches)
+	 * there is an additional port 0 not accounted for in numports.
+	 */
+	ports_stored_offset = offset;
+	offset += sizeof(uint8_t);
+
+	for (i = 0; i <= node->numports; i++) {
+		if (node->ports[i]) {
+			offset += _marshall64(buf + offset,
+					      node->ports[i]->guid);
+			offset += _marshall8(buf + offset,
+					     (uint8_t) node->ports[i]->portnum);
+			ports_stored_count++;
+		}
+	}
+
+	/* go back and store number of port keys stored */
+	_marshall8(buf + ports_stored_offset, ports_stored_count);
+
+	cb->len += offset;
+	return 0;
+}
+
+static int _cache_port(cache_buf_t * cb, ibnd_port_t * port)
+{
+	uint8_t *buf = _cache_buf_space(cb, IBND_PORT_CACHE_LEN);
+	size_t offset = 0;
+
+	if (!buf)
+		return -1;
+
+	offset += _marshall64(buf + offset, port->guid);
+	offset += _marshall8(buf + offset, (uint8_t) port->portnum);
 	offset += _marshall8(buf + offset, (uint8_t) port->ext_portnum);
 	offset += _marshall16(buf + offset, port->base_lid);
 	offset += _marshall8(buf + offset, port->lmc);
@@ -873,24 +1853,399 @@ static int _cache_port(int fd, ibnd_port_t * port)
 		offset += _marshall8(buf + offset, 0);
 	}
 
-	if (ibnd_write(fd, buf, offset) < 0)
+	cb->len += offset;
+	return 0;
+}
+
+struct cache_port_data {
+	cache_buf_t *cb;
+	unsigned int port_count;
+};
+
+static int cache_port_iter(void *item, void *arg)
+{
+	struct cache_port_data *data = arg;
+
+	if (_cache_port(data->cb, item) < 0)
+		return -1;
+	data->port_count++;
+	return 0;
+}
+
+static int _cache_fabric_v1(cache_buf_t * cb, ibnd_fabric_t * fabric)
+{
+	ibnd_node_t *node;
+	unsigned int node_count = 0;
+	struct cache_port_data port_data;
+
+	if (_cache_header_info(cb, fabric) < 0)
+		return -1;
+
+	for (node = fabric->nodes; node; node = node->next) {
+		if (_cache_node(cb, node) < 0)
+			return -1;
+		node_count++;
+	}
+
+	port_data.cb = cb;
+	port_data.port_count = 0;
+	if (guid_tbl_iter(&((f_internal_t *)fabric)->ports_tbl,
+			  cache_port_iter, &port_data))
+		return -1;
+
+	_cache_header_counts(cb, node_count, port_data.port_count);
+	return 0;
+}
+
+/* Version 2 refers to nodes and ports by their index in the file.
+ * Nodes are numbered in fabric->nodes order and a node's ports follow
+ * each other in port number order, so the index of a port is that of the
+ * first port of its node plus the number of ports it has below it. */
+typedef struct cache_node_index {
+	ibnd_node_t *node;
+	uint32_t index;
+	uint32_t first_port;
+} cache_node_index_t;
+
+typedef struct cache_guid_index {
+	uint64_t guid;
+	uint32_t index;
+} cache_guid_index_t;
+
+static int cmp_node_index(const void *a, const void *b)
+{
+	const cache_node_index_t *x = a, *y = b;
+
+	return x->node < y->node ? -1 : x->node > y->node;
+}
+
+static int cmp_guid_index(const void *a, const void *b)
+{
+	const cache_guid_index_t *x = a, *y = b;
+
+	if (x->guid != y->guid)
+		return x->guid < y->guid ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static cache_node_index_t *_find_node_index(cache_node_index_t * index,
+					    unsigned count, ibnd_node_t * node)
+{
+	cache_node_index_t key = { node };
+
+	return bsearch(&key, index, count, sizeof(*index), cmp_node_index);
+}
+
+static uint32_t _port_index(cache_node_index_t * index, unsigned count,
+			    ibnd_port_t * port)
+{
+	cache_node_index_t *ni = _find_node_index(index, count, port->node);
+	uint32_t i = 0;
+	int p;
+
+	if (!ni)
+		return IBND_CACHE_NO_INDEX;
+	for (p = 0; p < port->portnum; p++)
+		if (port->node->ports[p])
+			i++;
+	return ni->first_port + i;
+}
+
+static size_t _cache_sect_entry(uint8_t * buf, uint32_t id, uint32_t stride,
+				uint32_t count, uint64_t offset)
+{
+	size_t len = 0;
+
+	len += _marshall32(buf + len, id);
+	len += _marshall32(buf + len, stride);
+	len += _marshall32(buf + len, count);
+	len += _marshall32(buf + len, 0);
+	len += _marshall64(buf + len, offset);
+	return len;
+}
+
+static size_t _cache_header_v2(uint8_t * buf, uint32_t version,
+			       uint32_t num_sects, ibnd_fabric_t * fabric,
+			       uint32_t from_index)
+{
+	size_t offset = 0;
+
+	offset += _marshall32(buf + offset, IBND_FABRIC_CACHE_MAGIC);
+	offset += _marshall32(buf + offset, version);
+	offset += _marshall32(buf + offset, num_sects);
+	offset += _marshall32(buf + offset, fabric->maxhops_discovered);
+	offset += _marshall64(buf + offset, fabric->from_node->guid);
+	offset += _marshall32(buf + offset, from_index);
+	offset += _marshall32(buf + offset, fabric->from_portnum);
+	offset += _marshall64(buf + offset, 0);
+	return offset;
+}
+
+static void _cache_node_v2(cache_buf_t * cb, ibnd_node_t * node,
+			   uint32_t first_port, uint8_t num_ports)
+{
+	uint8_t *buf = cb->data + cb->len;
+
+	memset(buf, 0, IBND_CACHE_NODE_LEN);
+	_marshall64(buf, node->guid);
+	_marshall32(buf + 8, first_port);
+	_marshall8(buf + 12, num_ports);
+	_marshall8(buf + 13, (uint8_t) node->type);
+	_marshall8(buf + 14, (uint8_t) node->numports);
+	_marshall8(buf + 15, node->smalmc);
+	_marshall16(buf + 16, node->smalid);
+	_marshall8(buf + 18, (uint8_t) node->smaenhsp0);
+	_marshall_buf(buf + 24, node->info, IB_SMP_DATA_SIZE);
+	_marshall_buf(buf + 24 + IB_SMP_DATA_SIZE, node->nodedesc,
+		      IB_SMP_DATA_SIZE);
+	_marshall_buf(buf + 24 + IB_SMP_DATA_SIZE * 2, node->switchinfo,
+		      IB_SMP_DATA_SIZE);
+	cb->len += IBND_CACHE_NODE_LEN;
+}
+
+static void _cache_port_v2(cache_buf_t * cb, ibnd_port_t * port,
+			   uint32_t node_index, uint32_t remote_index)
+{
+	uint8_t *buf = cb->data + cb->len;
+
+	memset(buf, 0, IBND_CACHE_PORT_LEN);
+	_marshall64(buf, port->guid);
+	_marshall32(buf + 8, node_index);
+	_marshall32(buf + 12, remote_index);
+	_marshall16(buf + 16, port->base_lid);
+	_marshall8(buf + 18, (uint8_t) port->portnum);
+	_marshall8(buf + 19, (uint8_t) port->ext_portnum);
+	_marshall8(buf + 20, port->lmc);
+	_marshall_buf(buf + 24, port->info, IB_SMP_DATA_SIZE);
+	_marshall_buf(buf + 24 + IB_SMP_DATA_SIZE, port->ext_info,
+		      IB_SMP_DATA_SIZE);
+	cb->len += IBND_CACHE_PORT_LEN;
+}
+
+static void _cache_guid_index(cache_buf_t * cb, cache_guid_index_t * index,
+			      unsigned count)
+{
+	uint8_t *buf = cb->data + cb->len;
+	unsigned i;
+
+	qsort(index, count, sizeof(*index), cmp_guid_index);
+	memset(buf, 0, (size_t) count * IBND_CACHE_GUID_LEN);
+	for (i = 0; i < count; i++, buf += IBND_CACHE_GUID_LEN) {
+		_marshall64(buf, index[i].guid);
+		_marshall32(buf + 8, index[i].index);
+	}
+	cb->len += (size_t) count * IBND_CACHE_GUID_LEN;
+}
+
+/* The size of a version 2 cache is known before it is built, so the
+ * buffer is sized once and records are marshalled straight into it. */
+static int _cache_fabric_v2(cache_buf_t * cb, ibnd_fabric_t * fabric)
+{
+	uint8_t *buf;
+	cache_node_index_t *index = NULL, *ni, *from;
+	cache_guid_index_t *node_guids = NULL, *port_guids = NULL;
+	unsigned node_count = 0, port_count = 0, i;
+	uint64_t offset;
+	ibnd_node_t *node;
+	ibnd_port_t *port;
+	uint8_t num_ports;
+	int p, rc = -1;
+
+	for (node = fabric->nodes; node; node = node->next)
+		node_count++;
+	if (!(index = calloc(node_count + 1, sizeof(*index))))
+		goto oom;
+	for (node = fabric->nodes, i = 0; node; node = node->next, i++) {
+		index[i].node = node;
+		index[i].index = i;
+		index[i].first_port = port_count;
+		for (p = 0; p <= node->numports; p++)
+			if (node->ports[p])
+				port_count++;
+	}
+	node_guids = calloc(node_count + 1, sizeof(*node_guids));
+	port_guids = calloc(port_count + 1, sizeof(*port_guids));
+	if (!node_guids || !port_guids)
+		goto oom;
+	qsort(index, node_count, sizeof(*index), cmp_node_index);
+
+	if (!(from = _find_node_index(index, node_count, fabric->from_node))) {
+		IBND_DEBUG("from node not in fabric\n");
+		goto cleanup;
+	}
+
+	offset = IBND_CACHE_HEADER_LEN +
+		 IBND_CACHE_V2_SECTS * IBND_CACHE_SECTION_LEN +
+		 (uint64_t) node_count * (IBND_CACHE_NODE_LEN +
+					  IBND_CACHE_GUID_LEN) +
+		 (uint64_t) port_count * (IBND_CACHE_PORT_LEN +
+					  IBND_CACHE_GUID_LEN);
+	if (offset != (size_t) offset || !(buf = _cache_buf_space(cb, offset)))
+		goto cleanup;
+
+	_cache_header_v2(buf, IBND_FABRIC_CACHE_VERSION_2, IBND_CACHE_V2_SECTS,
+			 fabric, from->index);
+
+	offset = IBND_CACHE_HEADER_LEN +
+		 IBND_CACHE_V2_SECTS * IBND_CACHE_SECTION_LEN;
+	i = IBND_CACHE_HEADER_LEN;
+	i += _cache_sect_entry(buf + i, IBND_CACHE_SECT_NODES,
+			       IBND_CACHE_NODE_LEN, node_count, offset);
+	offset += (uint64_t) node_count * IBND_CACHE_NODE_LEN;
+	i += _cache_sect_entry(buf + i, IBND_CACHE_SECT_PORTS,
+			       IBND_CACHE_PORT_LEN, port_count, offset);
+	offset += (uint64_t) port_count * IBND_CACHE_PORT_LEN;
+	i += _cache_sect_entry(buf + i, IBND_CACHE_SECT_NODE_GUIDS,
+			       IBND_CACHE_GUID_LEN, node_count, offset);
+	offset += (uint64_t) node_count * IBND_CACHE_GUID_LEN;
+	i += _cache_sect_entry(buf + i, IBND_CACHE_SECT_PORT_GUIDS,
+			       IBND_CACHE_GUID_LEN, port_count, offset);
+	cb->len += i;
+
+	for (node = fabric->nodes; node; node = node->next) {
+		ni = _find_node_index(index, node_count, node);
+		num_ports = 0;
+		for (p = 0; p <= node->numports; p++)
+			if (node->ports[p])
+				num_ports++;
+		_cache_node_v2(cb, node, ni->first_port, num_ports);
+		node_guids[ni->index].guid = node->guid;
+		node_guids[ni->index].index = ni->index;
+	}
+
+	port_count = 0;
+	for (node = fabric->nodes; node; node = node->next) {
+		ni = _find_node_index(index, node_count, node);
+		for (p = 0; p <= node->numports; p++) {
+			uint32_t remote = IBND_CACHE_NO_INDEX;
+
+			if (!(port = node->ports[p]))
+				continue;
+			if (port->remoteport &&
+			    (remote = _port_index(index, node_count,
+						  port->remoteport)) ==
+			    IBND_CACHE_NO_INDEX) {
+				IBND_DEBUG("remote port 0x%016" PRIx64
+					   " not in fabric\n",
+					   port->remoteport->guid);
+				goto cleanup;
+			}
+			_cache_port_v2(cb, port, ni->index, remote);
+			port_guids[port_count].guid = port->guid;
+			port_guids[port_count].index = port_count;
+			port_count++;
+		}
+	}
+
+	_cache_guid_index(cb, node_guids, node_count);
+	_cache_guid_index(cb, port_guids, port_count);
+
+	rc = 0;
+	goto cleanup;
+oom:
+	IBND_DEBUG("OOM: fabric cache index\n");
+cleanup:
+	free(index);
+	free(node_guids);
+	free(port_guids);
+	return rc;
+}
+
+/* a new file next to file for the cache to be written to */
+static int _cache_tmp_open(const char *file, char **tmp)
+{
+	static unsigned seq;
+	size_t len = strlen(file) + 32;
+	int fd, tries;
+
+	if (!(*tmp = malloc(len))) {
+		IBND_DEBUG("OOM: temporary file name\n");
+		return -1;
+	}
+	/* O_EXCL and another name if a concurrent writer got there first */
+	for (tries = 0; tries < 100; tries++) {
+		snprintf(*tmp, len, "%s.tmp.%d.%u", file, (int)getpid(), seq++);
+		if ((fd = open(*tmp, O_CREAT | O_EXCL | O_WRONLY, 0644)) >= 0)
+			return fd;
+		if (errno != EEXIST)
+			break;
+	}
+	IBND_DEBUG("open '%s': %s\n", *tmp, strerror(errno));
+	free(*tmp);
+	*tmp = NULL;
+	return -1;
+}
+
+/* Readers see either the old file or the complete new one */
+static int _cache_replace(const char *tmp, const char *file,
+			  unsigned int flags)
+{
+	struct stat statbuf;
+
+	if (flags & IBND_CACHE_FABRIC_FLAG_NO_OVERWRITE) {
+		/* link() will not replace a file which appeared meanwhile */
+		if (!link(tmp, file)) {
+			unlink(tmp);
+			return 0;
+		}
+		if (errno == EEXIST || !stat(file, &statbuf)) {
+			IBND_DEBUG("file '%s' already exists\n", file);
+			return -1;
+		}
+		/* no hard links on this file system */
+	}
+
+	if (rename(tmp, file) < 0) {
+		IBND_DEBUG("rename '%s' to '%s': %s\n", tmp, file,
+			   strerror(errno));
 		return -1;
-
+	}
 	return 0;
 }
 
+static int _cache_write_file(cache_buf_t * cb, const char *file,
+			     unsigned int flags)
+{
+	char *tmp = NULL;
+	int fd = -1, rc = -1;
+
+	if ((fd = _cache_tmp_open(file, &tmp)) < 0)
+		goto cleanup;
+
+	if (ibnd_write(fd, cb->data, cb->len) < 0)
+		goto cleanup;
+
+	if (fsync(fd) < 0) {
+		IBND_DEBUG("fsync: %s\n", strerror(errno));
+		goto cleanup;
+	}
+
+	rc = close(fd);
+	fd = -1;
+	if (rc < 0) {
+		IBND_DEBUG("close: %s\n", strerror(errno));
+		goto cleanup;
+	}
+
+	rc = _cache_replace(tmp, file, flags);
+
+cleanup:
+	if (fd >= 0)
+		close(fd);
+	if (tmp) {
+		if (rc < 0)
+			unlink(tmp);
+		free(tmp);
+	}
+	return rc;
+}
+
 int ibnd_cache_fabric(ibnd_fabric_t * fabric, const char *file,
 		      unsigned int flags)
 {
 	struct stat statbuf;
-	ibnd_node_t *node = NULL;
-	ibnd_node_t *node_next = NULL;
-	unsigned int node_count = 0;
-	ibnd_port_t *port = NULL;
-	ibnd_port_t *port_next = NULL;
-	unsigned int port_count = 0;
-	int fd;
-	int i;
+	cache_buf_t cb = { NULL, 0, 0 };
+	int rc = -1;
 
 	if (!fabric) {
 		IBND_DEBUG("fabric parameter NULL\n");
@@ -902,66 +2257,677 @@ int ibnd_cache_fabric(ibnd_fabric_t * fabric, const char *file,
 		return -1;
 	}
 
-	if (!(flags & IBND_CACHE_FABRIC_FLAG_NO_OVERWRITE)) {
-		if (!stat(file, &statbuf)) {
-			if (unlink(file) < 0) {
-				IBND_DEBUG("error removing '%s': %s\n",
-					   file, strerror(errno));
-				return -1;
-			}
-		}
+	if ((flags & IBND_CACHE_FABRIC_FLAG_NO_OVERWRITE) &&
+	    !stat(file, &statbuf)) {
+		IBND_DEBUG("file '%s' already exists\n", file);
+		return -1;
 	}
-	else {
-		if (!stat(file, &statbuf)) {
-			IBND_DEBUG("file '%s' already exists\n", file);
-			return -1;
+
+	if (flags & IBND_CACHE_FABRIC_FLAG_V1) {
+		if (_cache_fabric_v1(&cb, fabric) < 0)
+			goto cleanup;
+	} else if (_cache_fabric_v2(&cb, fabric) < 0)
+		goto cleanup;
+
+	rc = _cache_write_file(&cb, file, flags);
+
+cleanup:
+	free(cb.data);
+	return rc;
+}
+
+/* A delta holds the records of the nodes and ports which differ, in the
+ * form a version 2 cache keeps them; nodes and ports are compared and
+ * digested through those records as well, so a delta reproduces exactly
+ * what a cache of the fabric would. */
+static void _cache_port_set(cache_buf_t * cb, ibnd_port_t * port)
+{
+	uint8_t *buf;
+
+	_cache_port_v2(cb, port, IBND_CACHE_NO_INDEX, IBND_CACHE_NO_INDEX);
+	buf = cb->data + cb->len;
+	memset(buf, 0, IBND_CACHE_PORT_SET_LEN - IBND_CACHE_PORT_LEN);
+	_marshall64(buf, port->node->guid);
+	if (port->remoteport) {
+		_marshall64(buf + 8, port->remoteport->node->guid);
+		_marshall8(buf + 16, (uint8_t) port->remoteport->portnum);
+		_marshall8(buf + 17, 1);
+	}
+	cb->len += IBND_CACHE_PORT_SET_LEN - IBND_CACHE_PORT_LEN;
+}
+
+static void _node_rec(uint8_t * buf, ibnd_node_t * node)
+{
+	cache_buf_t cb = { buf, 0, IBND_CACHE_NODE_LEN };
+
+	_cache_node_v2(&cb, node, 0, 0);
+}
+
+static void _port_rec(uint8_t * buf, ibnd_port_t * port)
+{
+	cache_buf_t cb = { buf, 0, IBND_CACHE_PORT_SET_LEN };
+
+	_cache_port_set(&cb, port);
+}
+
+/* FNV-1a a little endian word at a time; records are multiples of 8
+ * bytes long */
+static uint64_t _digest_rec(uint8_t * buf, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL, w;
+	size_t i;
+
+	for (i = 0; i < len; i += 8) {
+		_unmarshall64(buf + i, &w);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+/* the sum over all records does not depend on the order of the nodes */
+static uint64_t _fabric_digest(ibnd_fabric_t * fabric)
+{
+	uint8_t nrec[IBND_CACHE_NODE_LEN], prec[IBND_CACHE_PORT_SET_LEN];
+	uint64_t digest = 0;
+	ibnd_node_t *node;
+	int p;
+
+	for (node = fabric->nodes; node; node = node->next) {
+		_node_rec(nrec, node);
+		digest += _digest_rec(nrec, sizeof(nrec));
+		for (p = 0; p <= node->numports; p++) {
+			if (!node->ports[p])
+				continue;
+			_port_rec(prec, node->ports[p]);
+			digest += _digest_rec(prec, sizeof(prec));
 		}
 	}
+	return digest;
+}
 
-	if ((fd = open(file, O_CREAT | O_EXCL | O_WRONLY, 0644)) < 0) {
-		IBND_DEBUG("open: %s\n", strerror(errno));
+typedef struct cache_delta_bufs {
+	cache_buf_t nodes;
+	cache_buf_t node_dels;
+	cache_buf_t port_dels;
+	cache_buf_t port_sets;
+} cache_delta_bufs_t;
+
+static int _delta_node_set(cache_delta_bufs_t * d, ibnd_node_t * node)
+{
+	if (!_cache_buf_space(&d->nodes, IBND_CACHE_NODE_LEN))
+		return -1;
+	_cache_node_v2(&d->nodes, node, 0, 0);
+	return 0;
+}
+
+static int _delta_port_set(cache_delta_bufs_t * d, ibnd_port_t * port)
+{
+	if (!_cache_buf_space(&d->port_sets, IBND_CACHE_PORT_SET_LEN))
+		return -1;
+	_cache_port_set(&d->port_sets, port);
+	return 0;
+}
+
+static int _delta_del(cache_buf_t * cb, uint64_t guid, int portnum)
+{
+	uint8_t *buf = _cache_buf_space(cb, IBND_CACHE_GUID_LEN);
+
+	if (!buf)
 		return -1;
+	memset(buf, 0, IBND_CACHE_GUID_LEN);
+	_marshall64(buf, guid);
+	_marshall8(buf + 8, (uint8_t) portnum);
+	cb->len += IBND_CACHE_GUID_LEN;
+	return 0;
+}
+
+static int _delta_node(cache_delta_bufs_t * d, ibnd_node_t * base,
+		       ibnd_node_t * node)
+{
+	uint8_t a[IBND_CACHE_NODE_LEN], b[IBND_CACHE_NODE_LEN];
+	ibnd_port_t *port, *bport;
+	int p, numports;
+
+	if (base) {
+		_node_rec(a, node);
+		_node_rec(b, base);
 	}
+	if ((!base || memcmp(a, b, IBND_CACHE_NODE_LEN)) &&
+	    _delta_node_set(d, node) < 0)
+		return -1;
 
-	if (_cache_header_info(fd, fabric) < 0)
-		goto cleanup;
+	numports = node->numports;
+	if (base && base->numports > numports)
+		numports = base->numports;
+	for (p = 0; p <= numports; p++) {
+		port = p <= node->numports ? node->ports[p] : NULL;
+		bport = base && p <= base->numports ? base->ports[p] : NULL;
+		if (!port) {
+			if (bport && _delta_del(&d->port_dels, node->guid, p))
+				return -1;
+			continue;
+		}
+		if (bport) {
+			_port_rec(a, port);
+			_port_rec(b, bport);
+			if (!memcmp(a, b, IBND_CACHE_PORT_SET_LEN))
+				continue;
+		}
+		if (_delta_port_set(d, port) < 0)
+			return -1;
+	}
+	return 0;
+}
 
-	node = fabric->nodes;
-	while (node) {
-		node_next = node->next;
+/* The nodes of a fabric by the GUID they have now.  The GUID tables are
+ * keyed by the GUID a node had when it was added, which ibcacheedit may
+ * since have changed in place. */
+typedef struct cache_guid_node {
+	uint64_t guid;
+	ibnd_node_t *node;
+} cache_guid_node_t;
 
-		if (_cache_node(fd, node) < 0)
-			goto cleanup;
+static int cmp_guid_node(const void *a, const void *b)
+{
+	const cache_guid_node_t *x = a, *y = b;
 
-		node_count++;
-		node = node_next;
+	return x->guid < y->guid ? -1 : x->guid > y->guid;
+}
+
+static cache_guid_node_t *_guid_node_index(ibnd_fabric_t * fabric,
+					   unsigned *count)
+{
+	cache_guid_node_t *index;
+	ibnd_node_t *node;
+	unsigned i = 0;
+
+	for (node = fabric->nodes; node; node = node->next)
+		i++;
+	if (!(index = calloc(i + 1, sizeof(*index))))
+		return NULL;
+	for (node = fabric->nodes, i = 0; node; node = node->next, i++) {
+		index[i].guid = node->guid;
+		index[i].node = node;
 	}
+	qsort(index, i, sizeof(*index), cmp_guid_node);
+	*count = i;
+	return index;
+}
+
+static ibnd_node_t *_find_guid_node(cache_guid_node_t * index,
+				    unsigned count, uint64_t guid)
+{
+	cache_guid_node_t key = { guid }, *gn;
 
-	for (i = 0; i < HTSZ; i++) {
-		port = fabric->portstbl[i];
-		while (port) {
-			port_next = port->htnext;
+	gn = bsearch(&key, index, count, sizeof(*index), cmp_guid_node);
+	return gn ? gn->node : NULL;
+}
 
-			if (_cache_port(fd, port) < 0)
-				goto cleanup;
+/* enter a section in the table at *i and copy it to offset */
+static uint64_t _cache_delta_sect(uint8_t * buf, size_t * i, uint32_t id,
+				  uint32_t stride, cache_buf_t * cb,
+				  uint64_t offset)
+{
+	*i += _cache_sect_entry(buf + *i, id, stride, cb->len / stride,
+				offset);
+	if (cb->len)
+		memcpy(buf + offset, cb->data, cb->len);
+	return offset + cb->len;
+}
 
-			port_count++;
-			port = port_next;
-		}
+int ibnd_cache_fabric_delta(ibnd_fabric_t * base, ibnd_fabric_t * fabric,
+			    const char *file, unsigned int flags)
+{
+	cache_delta_bufs_t d;
+	cache_buf_t cb = { NULL, 0, 0 };
+	cache_guid_node_t *base_index = NULL, *index = NULL;
+	unsigned base_count, count;
+	struct stat statbuf;
+	ibnd_node_t *node;
+	uint64_t offset;
+	uint8_t *buf;
+	size_t i;
+	int rc = -1;
+
+	if (!base || !fabric) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return -1;
+	}
+
+	if (!file) {
+		IBND_DEBUG("file parameter NULL\n");
+		return -1;
+	}
+
+	if ((flags & IBND_CACHE_FABRIC_FLAG_NO_OVERWRITE) &&
+	    !stat(file, &statbuf)) {
+		IBND_DEBUG("file '%s' already exists\n", file);
+		return -1;
 	}
 
-	if (_cache_header_counts(fd, node_count, port_count) < 0)
+	memset(&d, 0, sizeof(d));
+	if (!(base_index = _guid_node_index(base, &base_count)) ||
+	    !(index = _guid_node_index(fabric, &count))) {
+		IBND_DEBUG("OOM: failed to index the nodes\n");
 		goto cleanup;
+	}
+	for (node = fabric->nodes; node; node = node->next)
+		if (_delta_node(&d, _find_guid_node(base_index, base_count,
+						    node->guid), node) < 0)
+			goto cleanup;
+	for (node = base->nodes; node; node = node->next)
+		if (!_find_guid_node(index, count, node->guid) &&
+		    _delta_del(&d.node_dels, node->guid, 0) < 0)
+			goto cleanup;
 
-	if (close(fd) < 0) {
-		IBND_DEBUG("close: %s\n", strerror(errno));
+	offset = IBND_CACHE_HEADER_LEN +
+		 IBND_CACHE_DELTA_SECTS * IBND_CACHE_SECTION_LEN;
+	if (!(buf = _cache_buf_space(&cb, offset + IBND_CACHE_DELTA_LEN +
+				     d.nodes.len + d.node_dels.len +
+				     d.port_dels.len + d.port_sets.len)))
 		goto cleanup;
+
+	i = _cache_header_v2(buf, IBND_FABRIC_CACHE_DELTA,
+			     IBND_CACHE_DELTA_SECTS, fabric,
+			     IBND_CACHE_NO_INDEX);
+	i += _cache_sect_entry(buf + i, IBND_CACHE_SECT_DELTA,
+			       IBND_CACHE_DELTA_LEN, 1, offset);
+	_marshall64(buf + offset, _fabric_digest(base));
+	_marshall64(buf + offset + 8, _fabric_digest(fabric));
+	offset += IBND_CACHE_DELTA_LEN;
+	offset = _cache_delta_sect(buf, &i, IBND_CACHE_SECT_NODES,
+				   IBND_CACHE_NODE_LEN, &d.nodes, offset);
+	offset = _cache_delta_sect(buf, &i, IBND_CACHE_SECT_NODE_DELS,
+				   IBND_CACHE_GUID_LEN, &d.node_dels, offset);
+	offset = _cache_delta_sect(buf, &i, IBND_CACHE_SECT_PORT_DELS,
+				   IBND_CACHE_GUID_LEN, &d.port_dels, offset);
+	cb.len = _cache_delta_sect(buf, &i, IBND_CACHE_SECT_PORT_SETS,
+				   IBND_CACHE_PORT_SET_LEN, &d.port_sets,
+				   offset);
+
+	rc = _cache_write_file(&cb, file, flags);
+
+cleanup:
+	free(base_index);
+	free(index);
+	free(d.nodes.data);
+	free(d.node_dels.data);
+	free(d.port_dels.data);
+	free(d.port_sets.data);
+	free(cb.data);
+	return rc;
+}
+
+/* The records of a delta by the GUID of the node they belong to */
+typedef struct delta_port {
+	struct delta_port *next;
+	uint8_t *rec;		/* NULL if the port was removed */
+	uint8_t portnum;
+} delta_port_t;
+
+typedef struct delta_node {
+	struct delta_node *htnext;
+	uint8_t *rec;		/* NULL unless the node was added or changed */
+	delta_port_t *ports;
+	int removed;
+	int applied;
+} delta_node_t;
+
+typedef struct delta {
+	ibnd_cache_map_t *map;
+	guid_tbl_t tbl;
+	delta_node_t *nodes;
+	unsigned num_nodes;
+	delta_port_t *ports;
+	unsigned num_ports;
+} delta_t;
+
+typedef struct delta_link {
+	ibnd_port_t *port;
+	uint64_t guid;
+	uint8_t portnum;
+} delta_link_t;
+
+static delta_node_t *_delta_find(delta_t * d, uint64_t guid)
+{
+	delta_node_t *dn = guid_tbl_find(&d->tbl, guid);
+
+	if (dn)
+		return dn;
+	dn = &d->nodes[d->num_nodes++];
+	if (guid_tbl_add(&d->tbl, guid, dn) < 0) {
+		IBND_DEBUG("OOM: delta table\n");
+		return NULL;
 	}
+	return dn;
+}
+
+static int _delta_add_port(delta_t * d, uint8_t * key, uint8_t portnum,
+			   uint8_t * rec)
+{
+	delta_port_t *dp = &d->ports[d->num_ports++];
+	delta_node_t *dn;
+	uint64_t guid;
 
+	_unmarshall64(key, &guid);
+	if (!(dn = _delta_find(d, guid)))
+		return -1;
+	dp->rec = rec;
+	dp->portnum = portnum;
+	dp->next = dn->ports;
+	dn->ports = dp;
 	return 0;
+}
 
-cleanup:
-	unlink(file);
+static int _delta_init(delta_t * d, ibnd_cache_map_t * map)
+{
+	unsigned num_nodes = map->sect[IBND_CACHE_SECT_NODES].count +
+			     map->sect[IBND_CACHE_SECT_NODE_DELS].count;
+	unsigned num_ports = map->sect[IBND_CACHE_SECT_PORT_DELS].count +
+			     map->sect[IBND_CACHE_SECT_PORT_SETS].count;
+	delta_node_t *dn;
+	uint8_t *rec;
+	uint64_t guid;
+	unsigned i;
+
+	memset(d, 0, sizeof(*d));
+	d->map = map;
+	guid_tbl_init(&d->tbl, offsetof(delta_node_t, htnext));
+	d->nodes = calloc(num_nodes + num_ports + 1, sizeof(*d->nodes));
+	d->ports = calloc(num_ports + 1, sizeof(*d->ports));
+	if (!d->nodes || !d->ports) {
+		IBND_DEBUG("OOM: delta\n");
+		return -1;
+	}
+
+	/* added nodes keep the order they are listed in */
+	for (i = 0; i < map->sect[IBND_CACHE_SECT_NODES].count; i++) {
+		rec = _cache_rec(map, IBND_CACHE_SECT_NODES, i);
+		_unmarshall64(rec, &guid);
+		if (!(dn = _delta_find(d, guid)))
+			return -1;
+		dn->rec = rec;
+	}
+	for (i = 0; i < map->sect[IBND_CACHE_SECT_NODE_DELS].count; i++) {
+		rec = _cache_rec(map, IBND_CACHE_SECT_NODE_DELS, i);
+		_unmarshall64(rec, &guid);
+		if (!(dn = _delta_find(d, guid)))
+			return -1;
+		dn->removed = 1;
+	}
+	for (i = 0; i < map->sect[IBND_CACHE_SECT_PORT_DELS].count; i++) {
+		rec = _cache_rec(map, IBND_CACHE_SECT_PORT_DELS, i);
+		if (_delta_add_port(d, rec, rec[8], NULL))
+			return -1;
+	}
+	for (i = 0; i < map->sect[IBND_CACHE_SECT_PORT_SETS].count; i++) {
+		rec = _cache_rec(map, IBND_CACHE_SECT_PORT_SETS, i);
+		if (_delta_add_port(d, rec + IBND_CACHE_PORT_LEN, rec[18], rec))
+			return -1;
+	}
+	return 0;
+}
+
+static void _delta_destroy(delta_t * d)
+{
+	guid_tbl_destroy(&d->tbl);
+	free(d->nodes);
+	free(d->ports);
+}
+
+static int _delta_link(delta_link_t ** links, unsigned *num, unsigned *max,
+		       ibnd_port_t * port, uint8_t * key)
+{
+	delta_link_t *l;
+
+	if (!key[17])
+		return 0;
+	if (*num == *max) {
+		*max = *max ? *max * 2 : 1024;
+		if (!(l = realloc(*links, *max * sizeof(*l)))) {
+			IBND_DEBUG("OOM: delta links\n");
+			return -1;
+		}
+		*links = l;
+	}
+	l = &(*links)[(*num)++];
+	l->port = port;
+	_unmarshall64(key + 8, &l->guid);
+	l->portnum = key[16];
+	return 0;
+}
+
+/* A node of the new fabric, from the delta's record if it has one and
+ * from that of base otherwise, and so for each of its ports. */
+static ibnd_node_t *_delta_apply_node(f_internal_t * f_int,
+				      ibnd_node_t * base, delta_node_t * dn,
+				      delta_link_t ** links,
+				      unsigned *num_links, unsigned *max_links)
+{
+	uint8_t nrec[IBND_CACHE_NODE_LEN], prec[IBND_CACHE_PORT_SET_LEN];
+	uint8_t *rec, num_ports;
+	uint32_t first_port;
+	ibnd_node_t *node;
+	ibnd_port_t *port;
+	delta_port_t *dp;
+	int p;
+
+	if (dn && dn->rec)
+		rec = dn->rec;
+	else {
+		_node_rec(nrec, base);
+		rec = nrec;
+	}
+	if (!(node = _load_node_v2(f_int, rec, &first_port, &num_ports)))
+		return NULL;
+
+	for (p = 0; p <= node->numports; p++) {
+		for (dp = dn ? dn->ports : NULL; dp; dp = dp->next)
+			if (dp->portnum == p)
+				break;
+		if (dp)
+			rec = dp->rec;
+		else if (base && p <= base->numports && base->ports[p]) {
+			_port_rec(prec, base->ports[p]);
+			rec = prec;
+		} else
+			rec = NULL;
+		if (!rec)
+			continue;
+		if (!(port = _load_port_v2(f_int, node, IBND_CACHE_NO_INDEX,
+					   rec)) ||
+		    _delta_link(links, num_links, max_links, port,
+				rec + IBND_CACHE_PORT_LEN))
+			return NULL;
+	}
+
+	if (add_to_nodeguid_hash(node, f_int))
+		IBND_DEBUG("Error Occurred when trying"
+			   " to insert new node guid 0x%016" PRIx64
+			   " to DB\n", node->guid);
+	add_to_type_list(node, f_int);
+	return node;
+}
+
+/* digest is that of base on entry and that of the new fabric on return */
+static ibnd_fabric_t *_delta_apply(ibnd_fabric_t * base, delta_t * d,
+				   uint64_t * digest)
+{
+	ibnd_cache_map_t *map = d->map;
+	delta_link_t *links = NULL;
+	unsigned num_links = 0, max_links = 0, i;
+	uint64_t base_digest, new_digest;
+	ibnd_node_t *node, *new, **tail;
+	delta_node_t *dn;
+	f_internal_t *f_int;
+	int p;
+
+	_unmarshall64(_cache_rec(map, IBND_CACHE_SECT_DELTA, 0), &base_digest);
+	_unmarshall64(_cache_rec(map, IBND_CACHE_SECT_DELTA, 0) + 8,
+		      &new_digest);
+	if (*digest != base_digest) {
+		IBND_DEBUG("delta was not taken against this fabric\n");
+		return NULL;
+	}
+
+	if (!(f_int = allocate_fabric_internal())) {
+		IBND_DEBUG("OOM: fabric\n");
+		return NULL;
+	}
+	if (guid_tbl_reserve(&f_int->nodes_tbl,
+			     ((f_internal_t *) base)->nodes_tbl.count +
+			     d->num_nodes) ||
+	    guid_tbl_reserve(&f_int->ports_tbl,
+			     ((f_internal_t *) base)->ports_tbl.count +
+			     d->num_ports)) {
+		IBND_DEBUG("OOM: fabric tables\n");
+		goto error;
+	}
+
+	/* nodes stay in the order of base, added ones follow */
+	tail = &f_int->fabric.nodes;
+	for (node = base->nodes; node; node = node->next) {
+		dn = guid_tbl_find(&d->tbl, node->guid);
+		if (dn && dn->removed)
+			continue;
+		if (dn)
+			dn->applied = 1;
+		if (!(new = _delta_apply_node(f_int, node, dn, &links,
+					      &num_links, &max_links)))
+			goto error;
+		*tail = new;
+		tail = &new->next;
+	}
+	for (i = 0; i < d->num_nodes; i++) {
+		dn = &d->nodes[i];
+		if (dn->applied || dn->removed || !dn->rec)
+			continue;
+		if (!(new = _delta_apply_node(f_int, NULL, dn, &links,
+					      &num_links, &max_links)))
+			goto error;
+		*tail = new;
+		tail = &new->next;
+	}
+
+	for (i = 0; i < num_links; i++) {
+		node = ibnd_find_node_guid(&f_int->fabric, links[i].guid);
+		if (node && links[i].portnum <= node->numports)
+			links[i].port->remoteport =
+			    node->ports[links[i].portnum];
+	}
+	for (node = f_int->fabric.nodes; node; node = node->next)
+		for (p = 0; p <= node->numports; p++) {
+			if (!node->ports[p])
+				continue;
+			if (add_to_portguid_hash(node->ports[p], f_int))
+				IBND_DEBUG("Error Occurred when trying"
+					   " to insert new port guid 0x%016"
+					   PRIx64 " to DB\n",
+					   node->ports[p]->guid);
+			add_to_portlid_hash(node->ports[p], f_int);
+		}
+
+	f_int->fabric.from_node = ibnd_find_node_guid(&f_int->fabric,
+						      map->from_node_guid);
+	f_int->fabric.from_portnum = map->from_portnum;
+	f_int->fabric.maxhops_discovered = map->maxhops;
+	if (!f_int->fabric.from_node ||
+	    (*digest = _fabric_digest(&f_int->fabric)) != new_digest) {
+		IBND_DEBUG("Cache invalid: delta does not lead to the fabric "
+			   "it was taken of\n");
+		goto error;
+	}
+
+	free(links);
+	decode_ports(f_int, NULL);
+	if (group_nodes(&f_int->fabric)) {
+		ibnd_destroy_fabric(&f_int->fabric);
+		return NULL;
+	}
+	return &f_int->fabric;
+
+error:
+	free(links);
+	ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
+
+static ibnd_fabric_t *_load_delta(ibnd_fabric_t * base, const char *file,
+				   uint64_t * digest)
+{
+	ibnd_fabric_t *fabric = NULL;
+	ibnd_cache_map_t map;
+	delta_t d;
+	size_t len;
+	void *addr;
+	int fd;
+
+	if (!file) {
+		IBND_DEBUG("file parameter NULL\n");
+		return NULL;
+	}
+
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		IBND_DEBUG("open: %s\n", strerror(errno));
+		return NULL;
+	}
+	addr = _mmap_cache(fd, &len);
 	close(fd);
-	return -1;
+	if (!addr)
+		return NULL;
+
+	if (_map_cache(&map, addr, len))
+		goto out;
+	if (map.version != IBND_FABRIC_CACHE_DELTA) {
+		IBND_DEBUG("'%s' is not a delta\n", file);
+		goto out;
+	}
+	if (!_delta_init(&d, &map))
+		fabric = _delta_apply(base, &d, digest);
+	_delta_destroy(&d);
+
+out:
+	munmap(addr, len);
+	return fabric;
+}
+
+ibnd_fabric_t *ibnd_load_fabric_delta(ibnd_fabric_t * base, const char *file,
+				      unsigned int flags)
+{
+	uint64_t digest;
+
+	if (!base) {
+		IBND_DEBUG("fabric parameter NULL\n");
+		return NULL;
+	}
+	/* a delta is applied by one thread; there is nothing to ask for */
+	if (flags) {
+		IBND_DEBUG("unknown flags 0x%x\n", flags);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	digest = _fabric_digest(base);
+	return _load_delta(base, file, &digest);
+}
+
+ibnd_fabric_t *ibnd_load_fabric_chain(const char *file, char *const *deltas,
+				      unsigned num_deltas, unsigned int flags)
+{
+	ibnd_fabric_t *fabric, *next;
+	uint64_t digest;
+	unsigned i;
+
+	if (!(fabric = ibnd_load_fabric(file, flags)))
+		return NULL;
+	/* each delta leaves the digest the next one checks */
+	digest = _fabric_digest(fabric);
+	for (i = 0; i < num_deltas; i++) {
+		next = _load_delta(fabric, deltas[i], &digest);
+		ibnd_destroy_fabric(fabric);
+		if (!(fabric = next))
+			return NULL;
+	}
+	return fabric;
 }
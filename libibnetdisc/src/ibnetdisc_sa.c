@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2010 Lawrence Livermore National Laboratory
+ * Copyright (c) 2011 Mellanox Technologies LTD.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Build a fabric from the SA rather than a DR sweep.  Four GetTable
+ * queries (NodeRecord, PortInfoRecord, SwitchInfoRecord and LinkRecord)
+ * return what the SM already knows; the kernel does the RMPP.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+
+#include <infiniband/ibnetdisc.h>
+
+#include "internal.h"
+#include "chassis.h"
+
+/* record layouts, IBA 15.2.5 */
+#define SA_NR_INFO_OFFS		4	/* NodeInfo */
+#define SA_NR_DESC_OFFS		44	/* NodeDescription */
+#define SA_PIR_INFO_OFFS	4	/* PortInfo */
+#define SA_SIR_INFO_OFFS	4	/* SwitchInfo */
+#define SA_LR_MIN_SIZE		6
+
+#define SA_STATUS_NO_RECORDS	(3 << 8)
+
+typedef struct sa_scan {
+	char *ca_name;
+	int ca_port;
+	int fd;
+	int agent;
+	ib_portid_t selfportid;
+	ib_portid_t sm_portid;
+	struct ibnd_config *cfg;
+	f_internal_t *f_int;
+	unsigned mads;
+	/* base LID to node, only while the tables are merged */
+	ibnd_node_t **lid2node;
+} sa_scan_t;
+
+typedef struct sa_table {
+	void *umad;
+	uint8_t *recs;
+	unsigned rec_size;
+	unsigned num_recs;
+} sa_table_t;
+
+static uint16_t rec_lid(uint8_t * rec, int offs)
+{
+	return (uint16_t) (rec[offs] << 8 | rec[offs + 1]);
+}
+
+static void rec_copy(void *dst, size_t dst_size, sa_table_t * tbl,
+		     uint8_t * rec, unsigned offs)
+{
+	unsigned n = tbl->rec_size > offs ? tbl->rec_size - offs : 0;
+
+	if (n > dst_size)
+		n = dst_size;
+	memcpy(dst, rec + offs, n);
+}
+
+static int sa_open(sa_scan_t * scan, char *ca_name, int ca_port)
+{
+	struct ibmad_port *ibmad_port;
+	int mc[2] = { IB_SMI_CLASS, IB_SMI_DIRECT_CLASS };
+
+	scan->ca_name = ca_name;
+	scan->ca_port = ca_port;
+	if (ibnd_test_ports)
+		return ibnd_test_ports->resolve_self(ibnd_test_ports, ca_name,
+						     ca_port,
+						     &scan->selfportid);
+
+	ibmad_port = mad_rpc_open_port(ca_name, ca_port, mc, 2);
+	if (!ibmad_port) {
+		IBND_ERROR("can't open MAD port (%s:%d)\n", ca_name, ca_port);
+		return -EIO;
+	}
+	mad_rpc_set_timeout(ibmad_port, scan->cfg->timeout_ms);
+	mad_rpc_set_retries(ibmad_port, scan->cfg->retries);
+	smp_mkey_set(ibmad_port, scan->cfg->mkey);
+
+	if (ib_resolve_self_via(&scan->selfportid, NULL, NULL,
+				ibmad_port) < 0) {
+		IBND_ERROR("Failed to resolve self\n");
+		mad_rpc_close_port(ibmad_port);
+		return -EIO;
+	}
+	if (ib_resolve_smlid_via(&scan->sm_portid, scan->cfg->timeout_ms,
+				 ibmad_port) < 0 || !scan->sm_portid.lid) {
+		IBND_ERROR("No SM/SA found on port %s:%d\n",
+			   ca_name ? ca_name : "", ca_port);
+		mad_rpc_close_port(ibmad_port);
+		return -EIO;
+	}
+	mad_rpc_close_port(ibmad_port);
+
+	scan->sm_portid.qp = 1;
+	scan->sm_portid.qkey = IB_DEFAULT_QP1_QKEY;
+
+	if ((scan->fd = umad_open_port(ca_name, ca_port)) < 0) {
+		IBND_ERROR("can't open UMAD port (%s:%d)\n", ca_name, ca_port);
+		return -EIO;
+	}
+	if ((scan->agent = umad_register(scan->fd, IB_SA_CLASS, 2, 1,
+					 NULL)) < 0) {
+		IBND_ERROR("Failed to register for the SA class\n");
+		umad_close_port(scan->fd);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void sa_close(sa_scan_t * scan)
+{
+	if (ibnd_test_ports)
+		return;
+	umad_unregister(scan->fd, scan->agent);
+	umad_close_port(scan->fd);
+}
+
+static void sa_free_table(sa_table_t * tbl)
+{
+	free(tbl->umad);
+	tbl->umad = NULL;
+}
+
+/* same exchange as sa_query() in the diags, for GetTable of every record
+ * of attr; the response umad is returned in *umad_out, its MAD length in
+ * *len_out */
+static int sa_exchange(sa_scan_t * scan, uint16_t attr, void **umad_out,
+		       int *len_out)
+{
+	ib_rpc_t rpc;
+	void *umad, *tmp;
+	int len = IB_MAD_SIZE;
+
+	memset(&rpc, 0, sizeof(rpc));
+	rpc.mgtclass = IB_SA_CLASS;
+	rpc.method = IB_MAD_METHOD_GET_TABLE;
+	rpc.attr.id = attr;
+	rpc.dataoffs = IB_SA_DATA_OFFS;
+
+	umad = calloc(1, umad_size() + len);
+	if (!umad) {
+		IBND_ERROR("OOM: failed to allocate SA MAD\n");
+		return -ENOMEM;
+	}
+	if (mad_build_pkt(umad, &rpc, &scan->sm_portid, NULL, NULL) < 0) {
+		free(umad);
+		return -EINVAL;
+	}
+
+	IBND_DEBUG("SA GetTable attr 0x%x from %s\n", attr,
+		   portid2str(&scan->sm_portid));
+	scan->mads++;
+	if (umad_send(scan->fd, scan->agent, umad, len,
+		      scan->cfg->timeout_ms, scan->cfg->retries) < 0) {
+		IBND_ERROR("SA GetTable attr 0x%x send failed: %s\n", attr,
+			   strerror(errno));
+		free(umad);
+		return -EIO;
+	}
+
+	/* a lost request comes back as a send status, so there is no need
+	 * to guess how long a large RMPP transfer may take */
+	while (umad_recv(scan->fd, umad, &len, -1) < 0) {
+		if (errno != ENOSPC) {
+			IBND_ERROR("SA GetTable attr 0x%x recv failed: %s\n",
+				   attr, strerror(errno));
+			free(umad);
+			return -EIO;
+		}
+		tmp = realloc(umad, umad_size() + len);
+		if (!tmp) {
+			IBND_ERROR("OOM: failed to allocate %d byte SA "
+				   "response\n", len);
+			free(umad);
+			return -ENOMEM;
+		}
+		umad = tmp;
+	}
+
+	*umad_out = umad;
+	*len_out = len;
+	return 0;
+}
+
+static int sa_get_table(sa_scan_t * scan, uint16_t attr, sa_table_t * tbl)
+{
+	void *umad;
+	uint8_t *mad;
+	int len, rc, status, offs;
+
+	memset(tbl, 0, sizeof(*tbl));
+	if (ibnd_test_ports) {
+		scan->mads++;
+		umad = ibnd_test_ports->sa_get_table(ibnd_test_ports,
+						     scan->ca_name,
+						     scan->ca_port, attr,
+						     &len);
+		if (!umad)
+			return -EIO;
+	} else if ((rc = sa_exchange(scan, attr, &umad, &len)))
+		return rc;
+
+	if ((status = umad_status(umad))) {
+		IBND_ERROR("SA GetTable attr 0x%x failed: %s\n", attr,
+			   strerror(status));
+		free(umad);
+		return -EIO;
+	}
+
+	mad = umad_get_mad(umad);
+	status = mad_get_field(mad, 0, IB_MAD_STATUS_F);
+	offs = mad_get_field(mad, 0, IB_SA_ATTROFFS_F);
+	tbl->umad = umad;
+	if (status == SA_STATUS_NO_RECORDS)
+		return 0;
+	if (status) {
+		IBND_ERROR("SA GetTable attr 0x%x returned status 0x%04x\n",
+			   attr, status);
+		sa_free_table(tbl);
+		return -EIO;
+	}
+	if (offs && len > IB_SA_DATA_OFFS) {
+		tbl->recs = mad + IB_SA_DATA_OFFS;
+		tbl->rec_size = offs << 3;
+		tbl->num_recs = (len - IB_SA_DATA_OFFS) / tbl->rec_size;
+	}
+	IBND_DEBUG("SA attr 0x%x: %u records of %u bytes\n", attr,
+		   tbl->num_recs, tbl->rec_size);
+	return 0;
+}
+
+static ibnd_port_t *sa_get_port(sa_scan_t * scan, ibnd_node_t * node,
+				int portnum)
+{
+	ibnd_port_t *port;
+
+	if (portnum < 0 || portnum > node->numports)
+		return NULL;
+	if ((port = node->ports[portnum]))
+		return port;
+
+	port = alloc_port(scan->f_int, node, portnum);
+	if (!port) {
+		IBND_ERROR("Failed to allocate 0x%" PRIx64 " port %u\n",
+			   node->guid, portnum);
+		return NULL;
+	}
+	port->guid = mad_get_field64(node->info, 0, IB_NODE_PORT_GUID_F);
+	return port;
+}
+
+static ibnd_node_t *sa_lid2node(sa_scan_t * scan, uint16_t lid)
+{
+	if (!lid || lid >= IBND_LID_TBL_SIZE)
+		return NULL;
+	return scan->lid2node[lid];
+}
+
+/* One NodeRecord per port with a LID; a CA appears once per port.  The
+ * LocalPortNum of a switch is whichever port the SM came in through, the
+ * record is for port 0. */
+static int sa_add_nodes(sa_scan_t * scan, sa_table_t * tbl)
+{
+	ibnd_fabric_t *fabric = &scan->f_int->fabric;
+	ibnd_node_t *node;
+	ibnd_port_t *port;
+	ib_portid_t path;
+	uint8_t *rec, info[IB_SMP_DATA_SIZE];
+	uint16_t lid;
+	unsigned i;
+
+	for (i = 0; i < tbl->num_recs; i++) {
+		rec = tbl->recs + i * tbl->rec_size;
+		/* NodeInfo is followed by NodeDescription, not zeros as in
+		 * the SMP */
+		memset(info, 0, sizeof(info));
+		memcpy(info, rec + SA_NR_INFO_OFFS,
+		       SA_NR_DESC_OFFS - SA_NR_INFO_OFFS);
+		lid = (uint16_t) mad_get_field(rec, 0, IB_SA_NR_LID_F);
+		if (!lid || lid >= IBND_LID_TBL_SIZE)
+			continue;
+
+		node = ibnd_find_node_guid(fabric,
+					   mad_get_field64(info, 0,
+							   IB_NODE_GUID_F));
+		if (!node) {
+			/* until set_dr_paths() finds a DR path */
+			memset(&path, 0, sizeof(path));
+			ib_portid_set(&path, lid, 0, 0);
+			node = create_node(scan->f_int, &path, info);
+			if (!node)
+				return -ENOMEM;
+			rec_copy(node->nodedesc, sizeof(node->nodedesc), tbl,
+				 rec, SA_NR_DESC_OFFS);
+			if (node->type == IB_NODE_SWITCH)
+				node->smalid = lid;
+		}
+		scan->lid2node[lid] = node;
+
+		port = sa_get_port(scan, node,
+				   node->type == IB_NODE_SWITCH ? 0 :
+				   mad_get_field(info, 0,
+						 IB_NODE_LOCAL_PORT_F));
+		if (!port)
+			continue;
+		port->guid = mad_get_field64(info, 0, IB_NODE_PORT_GUID_F);
+		port->base_lid = lid;
+	}
+	return 0;
+}
+
+static int sa_add_ports(sa_scan_t * scan, sa_table_t * tbl)
+{
+	ibnd_node_t *node;
+	ibnd_port_t *port;
+	uint8_t *rec;
+	unsigned i;
+
+	for (i = 0; i < tbl->num_recs; i++) {
+		rec = tbl->recs + i * tbl->rec_size;
+		if (!(node = sa_lid2node(scan, rec_lid(rec, 0))) ||
+		    !(port = sa_get_port(scan, node, rec[2])))
+			continue;
+
+		rec_copy(port->info, sizeof(port->info), tbl, rec,
+			 SA_PIR_INFO_OFFS);
+		port->base_lid = (uint16_t) mad_get_field(port->info, 0,
+							  IB_PORT_LID_F);
+		port->lmc = (uint8_t) mad_get_field(port->info, 0,
+						    IB_PORT_LMC_F);
+		if (port->portnum == 0) {
+			node->smalid = port->base_lid;
+			node->smalmc = port->lmc;
+		}
+	}
+	return 0;
+}
+
+static int sa_add_switches(sa_scan_t * scan, sa_table_t * tbl)
+{
+	ibnd_node_t *node;
+	uint8_t *rec;
+	unsigned i;
+
+	for (i = 0; i < tbl->num_recs; i++) {
+		rec = tbl->recs + i * tbl->rec_size;
+		node = sa_lid2node(scan, rec_lid(rec, 0));
+		if (!node || node->type != IB_NODE_SWITCH)
+			continue;
+
+		rec_copy(node->switchinfo, sizeof(node->switchinfo), tbl, rec,
+			 SA_SIR_INFO_OFFS);
+		mad_decode_field(node->switchinfo, IB_SW_ENHANCED_PORT0_F,
+				 &node->smaenhsp0);
+	}
+	return 0;
+}
+
+/* Every link is reported in both directions; linking twice is harmless. */
+static int sa_add_links(sa_scan_t * scan, sa_table_t * tbl)
+{
+	ibnd_node_t *node, *remnode;
+	ibnd_port_t *port, *remport;
+	uint8_t *rec;
+	unsigned i;
+
+	if (tbl->num_recs && tbl->rec_size < SA_LR_MIN_SIZE)
+		return -EINVAL;
+
+	for (i = 0; i < tbl->num_recs; i++) {
+		rec = tbl->recs + i * tbl->rec_size;
+		node = sa_lid2node(scan, rec_lid(rec, 0));
+		remnode = sa_lid2node(scan, rec_lid(rec, 4));
+		if (!node || !remnode ||
+		    !(port = sa_get_port(scan, node, rec[2])) ||
+		    !(remport = sa_get_port(scan, remnode, rec[3]))) {
+			IBND_DEBUG("skipping link %u:%u -> %u:%u\n",
+				   rec_lid(rec, 0), rec[2], rec_lid(rec, 4),
+				   rec[3]);
+			continue;
+		}
+		link_ports(node, port, remnode, remport);
+	}
+	return 0;
+}
+
+/* Switch external ports answer to the LID of port 0, as in a DR sweep. */
+static int sa_hash_ports(sa_scan_t * scan)
+{
+	f_internal_t *f_int = scan->f_int;
+	ibnd_node_t *node;
+	ibnd_port_t *port;
+	int p;
+
+	for (node = f_int->fabric.nodes; node; node = node->next)
+		for (p = 0; p <= node->numports; p++) {
+			if (!(port = node->ports[p]))
+				continue;
+			if (p && node->type == IB_NODE_SWITCH) {
+				port->base_lid = node->smalid;
+				port->lmc = node->smalmc;
+			}
+			if (add_to_portguid_hash(port, f_int) < 0)
+				return -ENOMEM;
+			add_to_portlid_hash(port, f_int);
+		}
+	return 0;
+}
+
+ibnd_fabric_t *ibnd_discover_fabric_sa(char * ca_name, int ca_port,
+				       struct ibnd_config * cfg)
+{
+	static const struct {
+		uint16_t attr;
+		int (*add) (sa_scan_t * scan, sa_table_t * tbl);
+	} tables[] = {
+		/* nodes first; the other records refer to them by LID */
+		{ IB_SA_ATTR_NODERECORD, sa_add_nodes },
+		{ IB_SA_ATTR_PORTINFORECORD, sa_add_ports },
+		{ IB_SA_ATTR_SWITCHINFORECORD, sa_add_switches },
+		{ IB_SA_ATTR_LINKRECORD, sa_add_links },
+	};
+	struct ibnd_config config = { 0 };
+	f_internal_t *f_int = NULL;
+	ibnd_port_t *self;
+	sa_table_t tbl;
+	sa_scan_t scan;
+	unsigned i;
+
+	if (set_config(&config, cfg)) {
+		IBND_ERROR("Invalid ibnd_config\n");
+		return NULL;
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	scan.cfg = &config;
+	f_int = allocate_fabric_internal();
+	scan.lid2node = calloc(IBND_LID_TBL_SIZE, sizeof(*scan.lid2node));
+	if (!f_int || !scan.lid2node) {
+		IBND_ERROR("OOM: failed to calloc ibnd_fabric_t\n");
+		free(scan.lid2node);
+		free(f_int);
+		return NULL;
+	}
+	scan.f_int = f_int;
+
+	if (sa_open(&scan, ca_name, ca_port))
+		goto error;
+
+	for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+		if (sa_get_table(&scan, tables[i].attr, &tbl)) {
+			sa_close(&scan);
+			goto error;
+		}
+		if (tables[i].add(&scan, &tbl)) {
+			IBND_ERROR("Failed to add SA records of attr 0x%x\n",
+				   tables[i].attr);
+			sa_free_table(&tbl);
+			sa_close(&scan);
+			goto error;
+		}
+		sa_free_table(&tbl);
+	}
+	sa_close(&scan);
+
+	if (sa_hash_ports(&scan))
+		goto error;
+
+	self = ibnd_find_port_lid(&f_int->fabric, scan.selfportid.lid);
+	if (!self) {
+		IBND_ERROR("SA does not know the local port (LID %u)\n",
+			   scan.selfportid.lid);
+		goto error;
+	}
+	f_int->fabric.from_node = self->node;
+	f_int->fabric.from_portnum = self->portnum;
+	f_int->fabric.total_mads_used = scan.mads;
+
+	decode_ports(f_int, NULL);
+	if (set_dr_paths(f_int) || group_nodes(&f_int->fabric))
+		goto error;
+
+	free(scan.lid2node);
+	return (ibnd_fabric_t *)f_int;
+error:
+	free(scan.lid2node);
+	ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
@@ -39,7 +39,9 @@
 #define _INTERNAL_H_
 
 #include <infiniband/ibnetdisc.h>
+#include <infiniband/umad.h>
 #include <complib/cl_qmap.h>
+#include <pthread.h>
 
 #define	IBND_DEBUG(fmt, ...) \
 	if (ibdebug) { \
@@ -48,70 +50,334 @@
 #define	IBND_ERROR(fmt, ...) \
 		fprintf(stderr, "%s:%u; " fmt, __FILE__, __LINE__, ## __VA_ARGS__)
 
-/* HASH table defines */
-#define HASHGUID(guid) ((uint32_t)(((uint32_t)(guid) * 101) ^ ((uint32_t)((guid) >> 32) * 103)))
+/* Open addressed tables keyed by GUID, grown as needed.  Items sharing a
+ * GUID (the ports of a switch) hang off one slot, chained through a
+ * pointer inside the item at next_offs; the most recently added comes
+ * first. */
+typedef struct guid_tbl_ent {
+	uint64_t guid;
+	void *item;
+} guid_tbl_ent_t;
+
+typedef struct guid_tbl {
+	guid_tbl_ent_t *ents;
+	unsigned size;		/* power of 2 */
+	unsigned count;		/* distinct GUIDs */
+	size_t next_offs;
+} guid_tbl_t;
+
+void guid_tbl_init(guid_tbl_t * tbl, size_t next_offs);
+void guid_tbl_destroy(guid_tbl_t * tbl);
+int guid_tbl_reserve(guid_tbl_t * tbl, unsigned count);
+/* returns 1 if item is in the table already */
+int guid_tbl_add(guid_tbl_t * tbl, uint64_t guid, void *item);
+int guid_tbl_add_all(guid_tbl_t * tbl, void **items, unsigned count,
+		     size_t guid_offs, unsigned threads);
+void *guid_tbl_find(guid_tbl_t * tbl, uint64_t guid);
+int guid_tbl_iter(guid_tbl_t * tbl, int (*func) (void *item, void *arg),
+		  void *arg);
+
+/* nodes and ports are allocated from a per fabric arena */
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+typedef struct ibnd_arena {
+	struct arena_chunk *chunks;
+	unsigned num_chunks;
+	size_t bytes;
+	/* blocks given back by arena_free(), by size */
+	struct arena_free *free;
+} ibnd_arena_t;
+
+/* zeroed; arena_destroy() releases everything */
+void *arena_alloc(ibnd_arena_t * arena, size_t size);
+/* keep p for the next arena_alloc() of the same size */
+void arena_free(ibnd_arena_t * arena, void *p, size_t size);
+void arena_merge(ibnd_arena_t * arena, ibnd_arena_t * from);
+void arena_destroy(ibnd_arena_t * arena);
 
 #define MAXHOPS         63
 
 #define DEFAULT_MAX_SMP_ON_WIRE 2
+#define DEFAULT_MIN_SMP_WINDOW 1
+#define DEFAULT_MAX_SMP_WINDOW 64
 #define DEFAULT_TIMEOUT 1000
 #define DEFAULT_RETRIES 3
 
+typedef struct smp_engine_stats {
+	unsigned peak_live_smps;
+	unsigned smp_pool_size;
+	unsigned stale_responses;
+	unsigned peak_window;
+	unsigned timeouts;
+	unsigned retries;
+	unsigned dead_targets;
+	unsigned fast_failed;
+	unsigned rx_wakeups;
+	unsigned peak_rx_batch;
+	unsigned responses;
+	unsigned status_errors;
+	unsigned peak_queued;
+	unsigned lid_routed;
+	unsigned lid_fallbacks;
+	unsigned rate_holds;	/* SMPs held back by the MAD rate limits */
+	ibnd_rtt_hist_t attr_rtt[IBND_STATS_NUM_ATTRS];
+	ibnd_rtt_hist_t hop_rtt[IBND_STATS_MAX_HOPS];
+} smp_engine_stats_t;
+
+/* unicast LID space is 0x0001 - 0xbfff */
+#define IBND_LID_TBL_SIZE 0xc000
+
 typedef struct f_internal {
 	ibnd_fabric_t fabric;
-	cl_qmap_t lid2guid;
+	/* these replace fabric.nodestbl and fabric.portstbl */
+	guid_tbl_t nodes_tbl;
+	guid_tbl_t ports_tbl;
+	/* Unicast LIDs index straight into lid2port.  The table is
+	 * allocated when the first port with a LID is added and costs
+	 * IBND_LID_TBL_SIZE pointers (384KB on 64 bit hosts) per fabric
+	 * regardless of how many LIDs are in use.
+	 */
+	ibnd_port_t **lid2port;
+	smp_engine_stats_t smp_stats;
+	ibnd_arena_t arena;
+	/* path_portid holds the DR path of every node; not so for a loaded
+	 * fabric until set_dr_paths() */
+	int dr_paths;
 } f_internal_t;
 f_internal_t *allocate_fabric_internal(void);
-void create_lid2guid(f_internal_t *f_int);
-void destroy_lid2guid(f_internal_t *f_int);
+void destroy_lid2port(f_internal_t *f_int);
 void add_to_portlid_hash(ibnd_port_t * port, f_internal_t *f_int);
+void decode_port(ibnd_port_t * port);
+void decode_ports(f_internal_t * f_int, ibnd_node_t * node);
 
 typedef struct ibnd_scan {
 	ib_portid_t selfportid;
 	f_internal_t *f_int;
 	struct ibnd_config *cfg;
 	unsigned initial_hops;
+	/* node and port this scan started from; several scans may share
+	 * one fabric, see ibnd_discover_fabric_ports() */
+	ibnd_node_t *from_node;
+	int from_portnum;
+	/* checking a known fabric, see ibnd_rediscover_fabric() */
+	int rediscover;
+	/* no traversal, see ibnd_node_fetch_attrs() */
+	int fetch_attrs;
 } ibnd_scan_t;
 
+/* ibnd_node_t.visited while rediscovering */
+#define NODE_UNSEEN	0
+#define NODE_VERIFYING	1
+#define NODE_CONFIRMED	2
+
 typedef struct ibnd_smp ibnd_smp_t;
 typedef struct smp_engine smp_engine_t;
 typedef int (*smp_comp_cb_t) (smp_engine_t * engine, ibnd_smp_t * smp,
 			      uint8_t * mad_resp, void *cb_data);
+typedef struct smp_target smp_target_t;
+
+/* Priority classes of issue_smp().  The engine sends whatever is queued in
+ * a lower class first, so the NodeInfo extending a scan to the next hop is
+ * not held up behind attributes of the nodes it has already found.
+ * Within a class SMPs go in the order issued. */
+enum smp_prio {
+	SMP_PRIO_LINK,		/* NodeInfo or link checks on new links */
+	SMP_PRIO_PORT,		/* switch PortInfo, finding new links */
+	SMP_PRIO_ATTR,		/* descriptive attributes, CA PortInfo */
+	SMP_NUM_PRIO
+};
+
 struct ibnd_smp {
-	cl_map_item_t on_wire;
 	struct ibnd_smp *qnext;
+	smp_target_t *target;
+	unsigned prio;
 	smp_comp_cb_t cb;
 	void *cb_data;
 	ib_portid_t path;
 	ib_rpc_t rpc;
+	uint64_t sent_us;
+	unsigned send_seq;
+	unsigned attempt;
+	/* LID routed SMPs keep the DR path they were issued with and are
+	 * sent again along it if the LID route fails */
+	unsigned lid_routed;
+	ib_portid_t dr_path;
+	/* timer wheel linkage while on the wire */
+	struct ibnd_smp *tnext;
+	struct ibnd_smp *tprev;
+	uint64_t deadline_us;
+};
+
+/* On wire SMPs are found through a ring indexed by the low trid_bits of
+ * the trid the engine hands out.  The remaining bits are a generation
+ * which is bumped every time a slot is reused, so a late or duplicate
+ * response never matches the SMP currently occupying its slot. */
+typedef struct smp_trid_slot {
+	ibnd_smp_t *smp;
+	uint32_t trid;
+} smp_trid_slot_t;
+
+/* SMPs are queued per destination (the LID or DR path they are sent to),
+ * ordered by priority class.  Targets with queued SMPs and room under
+ * max_smps_per_target sit on the engine ready list for the class of their
+ * first SMP.  Each list is served round robin so a wide window is spread
+ * across the fabric rather than piled onto one SMA. */
+#define SMP_TARGET_HTSZ 256
+
+struct smp_target {
+	smp_target_t *htnext;
+	smp_target_t *rnext;
+	smp_target_t *rprev;
+	ibnd_smp_t *queue_head;
+	ibnd_smp_t *prio_tail[SMP_NUM_PRIO];	/* last of each class */
+	unsigned on_wire;
+	int ready;		/* 1 + class of the ready list it is on */
+	int dead;		/* suspected dead; SMPs to it fail at once */
+	uint32_t hash;
+	int lid;
+	ib_dr_path_t drpath;
 };
 
+/* Timeouts and retries are handled by the engine rather than umad.  Each
+ * on wire SMP sits in the wheel slot of its deadline (1 tick == 1ms);
+ * every retry doubles the SMP timeout up to 1 << SMP_MAX_BACKOFF_SHIFT. */
+#define SMP_WHEEL_SIZE 1024
+#define SMP_WHEEL_TICK_US 1000
+#define SMP_MAX_BACKOFF_SHIFT 3
+
+/* LID routed SMPs are not retried; a failure sends them along their DR
+ * path instead.  After SMP_LID_FAIL_LIMIT such fallbacks the engine
+ * assumes LID routing does not work here and sends everything DR. */
+#define SMP_LID_FAIL_LIMIT 8
+
+/* The engine talks to the fabric through a transport; umad by default,
+ * smp_engine_init_transport() lets tests plug in a stand-in. */
+typedef struct smp_transport_ops {
+	int (*send) (smp_engine_t * engine, int agent, void *umad, int len,
+		     int timeout_ms);
+	/* never blocks; returns -EAGAIN if nothing is pending */
+	int (*recv) (smp_engine_t * engine, void *umad, int *len);
+	/* returns > 0 once recv has something, 0 after timeout_ms */
+	int (*wait) (smp_engine_t * engine, int timeout_ms);
+	void (*close) (smp_engine_t * engine);
+} smp_transport_ops_t;
+
+/* After each wakeup up to SMP_RX_BATCH responses are drained into the
+ * receive ring before any callback runs. */
+#define SMP_RX_BATCH 32
+#define SMP_RX_BUF_SIZE (sizeof(struct ib_user_mad) + IB_MAD_SIZE)
+
+/* Discovery only sends a handful of attributes.  Their encoded umad is
+ * kept per class (LID routed, DR) and copied for each send with only the
+ * trid, attribute modifier, M_Key, DR path and address patched in. */
+#define SMP_NUM_TEMPLATES IBND_STATS_ATTR_OTHER
+
+/* SMPs are carved out of slabs owned by the engine and recycled through
+ * smp_free; the slabs are only released by smp_engine_destroy() */
+typedef struct smp_slab {
+	struct smp_slab *next;
+	unsigned count;
+	ibnd_smp_t smps[0];
+} smp_slab_t;
+
 struct smp_engine {
 	int umad_fd;
 	int smi_agent;
 	int smi_dir_agent;
-	ibnd_smp_t *smp_queue_head;
-	ibnd_smp_t *smp_queue_tail;
+	const smp_transport_ops_t *transport;
+	void *transport_data;
+	smp_target_t *targets[SMP_TARGET_HTSZ];
+	smp_target_t *ready_head[SMP_NUM_PRIO];
+	smp_target_t *ready_tail[SMP_NUM_PRIO];
+	smp_target_t *target_free;
+	unsigned num_queued;
+	unsigned num_dead;
+	unsigned lid_failures;
+	ibnd_smp_t *wheel[SMP_WHEEL_SIZE];
+	uint64_t next_deadline_us;
+	uint8_t *rx_ring;
+	uint8_t smp_tmpl[2][SMP_NUM_TEMPLATES][SMP_RX_BUF_SIZE];
+	unsigned smp_tmpl_valid[2];
 	void *user_data;
-	cl_qmap_t smps_on_wire;
+	/* held around completion callbacks when several engines share a
+	 * fabric; NULL for a single engine */
+	pthread_mutex_t *cb_lock;
+	smp_trid_slot_t *trid_ring;
+	unsigned trid_bits;
+	unsigned trid_next;
+	unsigned num_on_wire;
+	unsigned window;
+	unsigned window_acks;
+	unsigned window_cut_seq;
 	struct ibnd_config *cfg;
 	unsigned total_smps;
+	smp_slab_t *smp_slabs;
+	ibnd_smp_t *smp_free;
+	unsigned live_smps;
+	smp_engine_stats_t stats;
+	/* cfg->deadline_ms after engine setup, 0 == none */
+	uint64_t expire_us;
+	/* sending stopped by madrpc_set_rate_limit() until then */
+	uint64_t rate_wake_us;
 };
 
+/* hands an SMP given up on to its issuer, which owns smp->cb_data */
+typedef int (*smp_abandon_cb_t) (smp_engine_t * engine, ibnd_smp_t * smp);
+
 int smp_engine_init(smp_engine_t * engine, char * ca_name, int ca_port,
 		    void *user_data, ibnd_config_t *cfg);
+int smp_engine_init_transport(smp_engine_t * engine,
+			      const smp_transport_ops_t * transport,
+			      void *transport_data, void *user_data,
+			      ibnd_config_t *cfg);
 int issue_smp(smp_engine_t * engine, ib_portid_t * portid,
-	      unsigned attrid, unsigned mod, smp_comp_cb_t cb, void *cb_data);
+	      unsigned attrid, unsigned mod, unsigned prio, smp_comp_cb_t cb,
+	      void *cb_data);
+int issue_smp_lid(smp_engine_t * engine, ib_portid_t * portid, int lid,
+		  unsigned attrid, unsigned mod, unsigned prio,
+		  smp_comp_cb_t cb, void *cb_data);
 int process_mads(smp_engine_t * engine);
+int smp_build_umad(smp_engine_t * engine, ibnd_smp_t * smp, uint8_t * umad);
+int smp_engine_abandon(smp_engine_t * engine, smp_abandon_cb_t cb);
 void smp_engine_destroy(smp_engine_t * engine);
 
-int add_to_nodeguid_hash(ibnd_node_t * node, ibnd_node_t * hash[]);
+/* While ibnd_test_ports is set the discovery entry points reach the local
+ * ports through it rather than umad and libibmad, so that the tests can
+ * run them against a simulated fabric. */
+typedef struct ibnd_test_ports ibnd_test_ports_t;
+struct ibnd_test_ports {
+	/* what ib_resolve_self_via() would find for ca_name:ca_port */
+	int (*resolve_self) (ibnd_test_ports_t * tp, char *ca_name,
+			     int ca_port, ib_portid_t * self);
+	/* the transport of an SMP engine on ca_name:ca_port; its close op
+	 * releases *data */
+	int (*open) (ibnd_test_ports_t * tp, char *ca_name, int ca_port,
+		     const smp_transport_ops_t ** ops, void **data);
+	/* the response to an SA GetTable of attr as umad_recv() would
+	 * return it, a malloc()ed umad with *len bytes of MAD */
+	void *(*sa_get_table) (ibnd_test_ports_t * tp, char *ca_name,
+			       int ca_port, uint16_t attr, int *len);
+};
+
+extern ibnd_test_ports_t *ibnd_test_ports;
+
+int add_to_nodeguid_hash(ibnd_node_t * node, f_internal_t * f_int);
 
-int add_to_portguid_hash(ibnd_port_t * port, ibnd_port_t * hash[]);
+int add_to_portguid_hash(ibnd_port_t * port, f_internal_t * f_int);
 
 void add_to_type_list(ibnd_node_t * node, f_internal_t * fabric);
 
-void destroy_node(ibnd_node_t * node);
+int set_config(struct ibnd_config *config, struct ibnd_config *cfg);
+ibnd_node_t *create_node(f_internal_t * f_int, ib_portid_t * path,
+			 uint8_t * node_info);
+void link_ports(ibnd_node_t * node, ibnd_port_t * port,
+		ibnd_node_t * remotenode, ibnd_port_t * remoteport);
+int set_dr_paths(f_internal_t * f_int);
+
+ibnd_node_t *alloc_node(f_internal_t * f_int, int type, int numports);
+void free_node(f_internal_t * f_int, ibnd_node_t * node);
+ibnd_port_t *alloc_port(f_internal_t * f_int, ibnd_node_t * node,
+			int portnum);
 
 int mlnx_ext_port_info_err(smp_engine_t *engine, ibnd_smp_t *smp, uint8_t *mad,
 			   void *cb_data);
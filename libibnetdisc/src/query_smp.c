@@ -37,44 +37,628 @@
 #endif				/* HAVE_CONFIG_H */
 
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <infiniband/ibnetdisc.h>
 #include <infiniband/umad.h>
 #include "internal.h"
 
+/* number of SMPs expected to sit in the queue behind the on wire window */
+#define SMP_POOL_QUEUE_DEPTH 64
+/* smallest trid ring; the ring is kept at least twice the window */
+#define SMP_TRID_RING_MIN_BITS 6
+
+#define TRID_RING_MASK(engine) ((1U << (engine)->trid_bits) - 1)
+
+/* an adaptive window only grows on responses faster than timeout / 4 */
+#define SMP_WINDOW_PROMPT_DIV 4
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* additive increase: one more SMP per window worth of prompt responses */
+static void window_ack(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	struct ibnd_config *cfg = engine->cfg;
+
+	if (cfg->smp_window_mode != IBND_SMP_WINDOW_ADAPTIVE)
+		return;
+
+	if (now_us() - smp->sent_us >
+	    (uint64_t) cfg->timeout_ms * 1000 / SMP_WINDOW_PROMPT_DIV)
+		return;
+
+	if (++engine->window_acks < engine->window ||
+	    engine->window >= cfg->max_smps_limit)
+		return;
+
+	engine->window_acks = 0;
+	engine->window++;
+	if (engine->window > engine->stats.peak_window)
+		engine->stats.peak_window = engine->window;
+}
+
+/* multiplicative decrease: halve the window, but only once for all the
+ * SMPs which were already on the wire when the window was last cut */
+static void window_cut(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	struct ibnd_config *cfg = engine->cfg;
+
+	if (cfg->smp_window_mode != IBND_SMP_WINDOW_ADAPTIVE ||
+	    smp->send_seq < engine->window_cut_seq)
+		return;
+
+	engine->window /= 2;
+	if (engine->window < cfg->min_smps)
+		engine->window = cfg->min_smps;
+	engine->window_acks = 0;
+	engine->window_cut_seq = engine->total_smps;
+	IBND_DEBUG("SMP window cut to %u\n", engine->window);
+}
+
+static int grow_smp_pool(smp_engine_t * engine, unsigned count)
+{
+	smp_slab_t *slab;
+	unsigned i;
+
+	slab = calloc(1, sizeof(*slab) + count * sizeof(slab->smps[0]));
+	if (!slab) {
+		IBND_ERROR("OOM: failed to grow SMP pool by %u\n", count);
+		return -ENOMEM;
+	}
+
+	slab->count = count;
+	slab->next = engine->smp_slabs;
+	engine->smp_slabs = slab;
+
+	for (i = 0; i < count; i++) {
+		slab->smps[i].qnext = engine->smp_free;
+		engine->smp_free = &slab->smps[i];
+	}
+	engine->stats.smp_pool_size += count;
+	return 0;
+}
+
+static ibnd_smp_t *alloc_smp(smp_engine_t * engine)
+{
+	ibnd_smp_t *smp;
+
+	/* double the pool each time it runs dry */
+	if (!engine->smp_free &&
+	    grow_smp_pool(engine, engine->stats.smp_pool_size) != 0)
+		return NULL;
+
+	smp = engine->smp_free;
+	engine->smp_free = smp->qnext;
+	memset(smp, 0, sizeof(*smp));
+
+	if (++engine->live_smps > engine->stats.peak_live_smps)
+		engine->stats.peak_live_smps = engine->live_smps;
+	return smp;
+}
+
+static void free_smp(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	smp->qnext = engine->smp_free;
+	engine->smp_free = smp;
+	engine->live_smps--;
+}
+
+static uint32_t target_hash(int lid, ib_dr_path_t * drpath)
+{
+	uint32_t hash = 2166136261U;	/* FNV-1a */
+	int i;
+
+	hash = (hash ^ (lid & 0xff)) * 16777619U;
+	hash = (hash ^ ((lid >> 8) & 0xff)) * 16777619U;
+	if (lid && !drpath->cnt)
+		return hash;
+	for (i = 1; i <= drpath->cnt; i++)
+		hash = (hash ^ drpath->p[i]) * 16777619U;
+	return hash;
+}
+
+static int target_match(smp_target_t * target, int lid,
+			ib_dr_path_t * drpath)
+{
+	if (target->lid != lid || target->drpath.cnt != drpath->cnt)
+		return 0;
+	return !memcmp(&target->drpath.p[1], &drpath->p[1], drpath->cnt);
+}
+
+static smp_target_t *find_target(smp_engine_t * engine, int lid,
+				 ib_dr_path_t * drpath, uint32_t hash)
+{
+	smp_target_t *target;
+
+	for (target = engine->targets[hash % SMP_TARGET_HTSZ]; target;
+	     target = target->htnext)
+		if (target->hash == hash && target_match(target, lid, drpath))
+			return target;
+	return NULL;
+}
+
+static int target_lid(ibnd_smp_t * smp)
+{
+	if (smp->rpc.mgtclass == IB_SMI_CLASS)
+		return smp->path.lid;
+	if (smp->path.lid > 0 && smp->path.drpath.drslid != 0xffff)
+		return smp->path.lid;	/* LID routed part of a DR path */
+	return 0;
+}
+
+static smp_target_t *get_target(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	int lid = target_lid(smp);
+	ib_dr_path_t *drpath = &smp->path.drpath;
+	uint32_t hash;
+	smp_target_t *target;
+
+	hash = target_hash(lid, drpath);
+	if ((target = find_target(engine, lid, drpath, hash)))
+		return target;
+
+	if ((target = engine->target_free))
+		engine->target_free = target->htnext;
+	else if (!(target = malloc(sizeof(*target)))) {
+		IBND_ERROR("OOM: failed to allocate SMP target\n");
+		return NULL;
+	}
+	memset(target, 0, sizeof(*target));
+	target->hash = hash;
+	target->lid = lid;
+	target->drpath.cnt = drpath->cnt;
+	memcpy(&target->drpath.p[1], &drpath->p[1], drpath->cnt);
+
+	target->htnext = engine->targets[hash % SMP_TARGET_HTSZ];
+	engine->targets[hash % SMP_TARGET_HTSZ] = target;
+	return target;
+}
+
+/* Is the target, or any switch on the DR path to it, suspected dead? */
+static int target_is_dead(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	ib_dr_path_t prefix;
+	smp_target_t *target;
+	int lid;
+
+	if (!engine->num_dead)
+		return 0;
+	if (smp->target->dead)
+		return 1;
+
+	lid = smp->target->lid;
+	prefix = smp->path.drpath;
+	for (prefix.cnt--; prefix.cnt >= 0; prefix.cnt--) {
+		target = find_target(engine, lid, &prefix,
+				     target_hash(lid, &prefix));
+		if (target && target->dead)
+			return 1;
+	}
+	return 0;
+}
+
+/* idle targets go back to the free list so the table only holds
+ * destinations with queued or on wire SMPs and those suspected dead */
+static void put_target(smp_engine_t * engine, smp_target_t * target)
+{
+	smp_target_t **prev;
+
+	if (target->queue_head || target->on_wire || target->ready ||
+	    target->dead)
+		return;
+
+	for (prev = &engine->targets[target->hash % SMP_TARGET_HTSZ];
+	     *prev != target; prev = &(*prev)->htnext)
+		;
+	*prev = target->htnext;
+	target->htnext = engine->target_free;
+	engine->target_free = target;
+}
+
+static void make_ready(smp_engine_t * engine, smp_target_t * target)
+{
+	unsigned limit = engine->cfg->max_smps_per_target;
+	unsigned prio;
+
+	if (target->ready || !target->queue_head ||
+	    (limit && target->on_wire >= limit))
+		return;
+
+	prio = target->queue_head->prio;
+	target->ready = prio + 1;
+	target->rnext = NULL;
+	target->rprev = engine->ready_tail[prio];
+	if (engine->ready_tail[prio])
+		engine->ready_tail[prio]->rnext = target;
+	else
+		engine->ready_head[prio] = target;
+	engine->ready_tail[prio] = target;
+}
+
+static void unready(smp_engine_t * engine, smp_target_t * target)
+{
+	unsigned prio = target->ready - 1;
+
+	if (target->rprev)
+		target->rprev->rnext = target->rnext;
+	else
+		engine->ready_head[prio] = target->rnext;
+	if (target->rnext)
+		target->rnext->rprev = target->rprev;
+	else
+		engine->ready_tail[prio] = target->rprev;
+	target->ready = 0;
+}
+
+/* Queue smp behind the SMPs of its class, or ahead of them if front is
+ * set, but always behind those of a lower class. */
+static void enqueue_smp(smp_engine_t * engine, ibnd_smp_t * smp, int front)
+{
+	smp_target_t *target = smp->target;
+	ibnd_smp_t **link = &target->queue_head;
+	int prio = smp->prio;
+	int i;
+
+	for (i = front ? prio - 1 : prio; i >= 0; i--)
+		if (target->prio_tail[i]) {
+			link = &target->prio_tail[i]->qnext;
+			break;
+		}
+	smp->qnext = *link;
+	*link = smp;
+	if (!front || !target->prio_tail[prio])
+		target->prio_tail[prio] = smp;
+
+	engine->num_queued++;
+	if (engine->num_queued > engine->stats.peak_queued)
+		engine->stats.peak_queued = engine->num_queued;
+	/* a target waiting behind lower classes moves up with its queue */
+	if (target->ready && target->queue_head->prio < target->ready - 1)
+		unready(engine, target);
+	make_ready(engine, target);
+}
+
 static void queue_smp(smp_engine_t * engine, ibnd_smp_t * smp)
 {
-	smp->qnext = NULL;
-	if (!engine->smp_queue_head) {
-		engine->smp_queue_head = smp;
-		engine->smp_queue_tail = smp;
-	} else {
-		engine->smp_queue_tail->qnext = smp;
-		engine->smp_queue_tail = smp;
+	enqueue_smp(engine, smp, 0);
+}
+
+/* put an SMP being retried at the front of its class */
+static void requeue_smp(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	enqueue_smp(engine, smp, 1);
+}
+
+static ibnd_smp_t *dequeue_smp(smp_engine_t * engine, smp_target_t * target)
+{
+	ibnd_smp_t *smp = target->queue_head;
+
+	target->queue_head = smp->qnext;
+	if (target->prio_tail[smp->prio] == smp)
+		target->prio_tail[smp->prio] = NULL;
+	engine->num_queued--;
+	return smp;
+}
+
+/* Count smp against the MAD rate limits shared with libibmad.  If it may
+ * not go yet, sending stops until the limit lets it. */
+static int rate_take(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	ib_portid_t lid_portid = { 0 };
+	ib_portid_t *dport = &smp->path;
+	unsigned wait_us;
+	uint64_t wake;
+	int rc;
+
+	if (smp->rpc.mgtclass == IB_SMI_CLASS) {
+		lid_portid.lid = smp->path.lid;
+		dport = &lid_portid;
 	}
+	if (!(rc = mad_rate_limit_take(dport, &wait_us)))
+		return 0;
+
+	engine->stats.rate_holds++;
+	wake = now_us() + wait_us;
+	if (!engine->rate_wake_us || wake < engine->rate_wake_us)
+		engine->rate_wake_us = wake;
+	return rc;
 }
 
+/* take the next SMP from the target at the head of the first non empty
+ * ready list and move that target to the tail */
 static ibnd_smp_t *get_smp(smp_engine_t * engine)
 {
-	ibnd_smp_t *head = engine->smp_queue_head;
-	ibnd_smp_t *tail = engine->smp_queue_tail;
-	ibnd_smp_t *rc = head;
-	if (head) {
-		if (tail == head)
-			engine->smp_queue_tail = NULL;
-		engine->smp_queue_head = head->qnext;
+	smp_target_t *target = NULL, *next, *held = NULL, **held_tail = &held;
+	ibnd_smp_t *smp;
+	unsigned prio;
+	int rc = 0;
+
+	for (prio = 0; prio < SMP_NUM_PRIO && !target &&
+	     rc != MAD_RATE_LIMIT_GLOBAL; prio++)
+		while ((target = engine->ready_head[prio])) {
+			unready(engine, target);
+			/* targets found dead while ready have had their
+			 * queue flushed */
+			if (!target->queue_head) {
+				put_target(engine, target);
+				continue;
+			}
+			if (!(rc = rate_take(engine, target->queue_head)))
+				break;
+			/* over its own rate; the other targets may still go */
+			target->rnext = NULL;
+			*held_tail = target;
+			held_tail = &target->rnext;
+			if (rc == MAD_RATE_LIMIT_GLOBAL) {
+				target = NULL;
+				break;
+			}
+		}
+	while ((next = held)) {
+		held = next->rnext;
+		make_ready(engine, next);
 	}
-	return rc;
+	if (!target)
+		return NULL;
+
+	smp = dequeue_smp(engine, target);
+	target->on_wire++;
+	make_ready(engine, target);
+	return smp;
+}
+
+/* an SMP to this target has left the wire */
+static void target_done(smp_engine_t * engine, smp_target_t * target)
+{
+	target->on_wire--;
+	make_ready(engine, target);
+	put_target(engine, target);
+}
+
+static int init_trid_ring(smp_engine_t * engine, unsigned window)
+{
+	unsigned i, size;
+	uint32_t gen;
+
+	engine->trid_bits = SMP_TRID_RING_MIN_BITS;
+	while ((1U << engine->trid_bits) < 2 * window)
+		engine->trid_bits++;
+	size = 1U << engine->trid_bits;
+
+	engine->trid_ring = calloc(size, sizeof(*engine->trid_ring));
+	if (!engine->trid_ring) {
+		IBND_ERROR("OOM: failed to allocate trid ring of %u\n", size);
+		return -ENOMEM;
+	}
+
+	/* start the generations at a random point so trids differ between
+	 * engines opened on the same port */
+	gen = (uint32_t) mad_trid();
+	for (i = 0; i < size; i++)
+		engine->trid_ring[i].trid = (gen << engine->trid_bits) | i;
+	return 0;
+}
+
+static int put_on_wire(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	unsigned mask = TRID_RING_MASK(engine);
+	unsigned i, idx;
+	smp_trid_slot_t *slot;
+	uint32_t gen;
+
+	for (i = 0; i <= mask; i++) {
+		idx = (engine->trid_next + i) & mask;
+		slot = &engine->trid_ring[idx];
+		if (slot->smp)
+			continue;
+
+		gen = (slot->trid >> engine->trid_bits) + 1;
+		/* mad_encode() replaces a 0 trid with one of its own */
+		if (((gen << engine->trid_bits) | idx) == 0)
+			gen++;
+		slot->trid = (gen << engine->trid_bits) | idx;
+		slot->smp = smp;
+		smp->rpc.trid = slot->trid;
+		engine->trid_next = idx + 1;
+		engine->num_on_wire++;
+		return 0;
+	}
+
+	IBND_ERROR("trid ring full (%u on wire)\n", engine->num_on_wire);
+	return -EAGAIN;
+}
+
+static void release_slot(smp_engine_t * engine, uint32_t trid)
+{
+	engine->trid_ring[trid & TRID_RING_MASK(engine)].smp = NULL;
+	engine->num_on_wire--;
+}
+
+static unsigned smp_timeout_ms(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	unsigned shift = smp->attempt < SMP_MAX_BACKOFF_SHIFT ?
+	    smp->attempt : SMP_MAX_BACKOFF_SHIFT;
+
+	return engine->cfg->timeout_ms << shift;
+}
+
+static void arm_timer(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	ibnd_smp_t **slot;
+
+	smp->deadline_us = smp->sent_us +
+	    (uint64_t) smp_timeout_ms(engine, smp) * 1000;
+	slot = &engine->wheel[(smp->deadline_us / SMP_WHEEL_TICK_US) %
+			      SMP_WHEEL_SIZE];
+
+	smp->tprev = NULL;
+	smp->tnext = *slot;
+	if (*slot)
+		(*slot)->tprev = smp;
+	*slot = smp;
+
+	if (!engine->next_deadline_us ||
+	    smp->deadline_us < engine->next_deadline_us)
+		engine->next_deadline_us = smp->deadline_us;
+}
+
+static void disarm_timer(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	if (smp->tprev)
+		smp->tprev->tnext = smp->tnext;
+	else
+		engine->wheel[(smp->deadline_us / SMP_WHEEL_TICK_US) %
+			      SMP_WHEEL_SIZE] = smp->tnext;
+	if (smp->tnext)
+		smp->tnext->tprev = smp->tprev;
+	smp->tnext = smp->tprev = NULL;
+}
+
+static uint64_t next_deadline(smp_engine_t * engine)
+{
+	uint64_t next = 0;
+	ibnd_smp_t *smp;
+	unsigned i;
+
+	for (i = 0; i < SMP_WHEEL_SIZE; i++)
+		for (smp = engine->wheel[i]; smp; smp = smp->tnext)
+			if (!next || smp->deadline_us < next)
+				next = smp->deadline_us;
+	return next;
+}
+
+/* ms until the earliest SMP or scan deadline or the rate limits let more
+ * SMPs go, -1 if there is none */
+static int next_timeout_ms(smp_engine_t * engine)
+{
+	uint64_t now, next = engine->next_deadline_us;
+
+	if (engine->expire_us && (!next || engine->expire_us < next))
+		next = engine->expire_us;
+	if (engine->rate_wake_us && (!next || engine->rate_wake_us < next))
+		next = engine->rate_wake_us;
+	if (!next)
+		return -1;
+	now = now_us();
+	if (now >= next)
+		return 0;
+	return (int)((next - now + 999) / 1000);
+}
+
+static ibnd_smp_t *take_off_wire(smp_engine_t * engine, uint32_t trid)
+{
+	smp_trid_slot_t *slot = &engine->trid_ring[trid & TRID_RING_MASK(engine)];
+	ibnd_smp_t *smp = slot->smp;
+
+	if (!smp || slot->trid != trid)
+		return NULL;
+
+	release_slot(engine, trid);
+	disarm_timer(engine, smp);
+	return smp;
+}
+
+static int smp_template_slot(unsigned attrid)
+{
+	switch (attrid) {
+	case IB_ATTR_NODE_INFO:
+		return IBND_STATS_ATTR_NODE_INFO;
+	case IB_ATTR_NODE_DESC:
+		return IBND_STATS_ATTR_NODE_DESC;
+	case IB_ATTR_PORT_INFO:
+		return IBND_STATS_ATTR_PORT_INFO;
+	case IB_ATTR_SWITCH_INFO:
+		return IBND_STATS_ATTR_SWITCH_INFO;
+	case IB_ATTR_MLNX_EXT_PORT_INFO:
+		return IBND_STATS_ATTR_MLNX_EXT_PORT_INFO;
+	}
+	return -1;
+}
+
+static uint8_t *get_smp_template(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	int dr = smp->rpc.mgtclass == IB_SMI_DIRECT_CLASS;
+	int slot = smp_template_slot(smp->rpc.attr.id);
+	uint8_t *tmpl;
+	ib_portid_t path;
+	ib_rpc_t rpc;
+
+	if (slot < 0)
+		return NULL;
+
+	tmpl = engine->smp_tmpl[dr][slot];
+	if (engine->smp_tmpl_valid[dr] & (1 << slot))
+		return tmpl;
+
+	/* encode once with an empty path; everything per SMP is patched */
+	rpc = smp->rpc;
+	rpc.attr.mod = 0;
+	memset(&path, 0, sizeof(path));
+	memset(tmpl, 0, SMP_RX_BUF_SIZE);
+	if (mad_build_pkt(tmpl, &rpc, &path, NULL, NULL) < 0)
+		return NULL;
+	engine->smp_tmpl_valid[dr] |= 1 << slot;
+	return tmpl;
+}
+
+int smp_build_umad(smp_engine_t * engine, ibnd_smp_t * smp, uint8_t * umad)
+{
+	ib_rpc_t *rpc = &smp->rpc;
+	ib_portid_t *path = &smp->path;
+	uint8_t *tmpl, *mad;
+	int rc;
+
+	if (!(tmpl = get_smp_template(engine, smp))) {
+		memset(umad, 0, SMP_RX_BUF_SIZE);
+		if ((rc = mad_build_pkt(umad, rpc, path, NULL, NULL)) < 0) {
+			IBND_ERROR("mad_build_pkt failed; %d\n", rc);
+			return rc;
+		}
+		return 0;
+	}
+
+	memcpy(umad, tmpl, SMP_RX_BUF_SIZE);
+	mad = umad_get_mad(umad);
+	mad_set_field64(mad, 0, IB_MAD_TRID_F, rpc->trid);
+	mad_set_field(mad, 0, IB_MAD_ATTRMOD_F, rpc->attr.mod);
+	mad_set_field64(mad, 0, IB_MAD_MKEY_F, rpc->mkey);
+
+	if (rpc->mgtclass != IB_SMI_DIRECT_CLASS) {
+		umad_set_addr(umad, path->lid, path->qp, 0, 0);
+		return 0;
+	}
+
+	if (path->drpath.cnt >= IB_SUBNET_PATH_HOPS_MAX) {
+		IBND_ERROR("dr path with hop count %d\n", path->drpath.cnt);
+		return -EINVAL;
+	}
+	mad_set_field(mad, 0, IB_DRSMP_HOPCNT_F, path->drpath.cnt);
+	mad_set_field(mad, 0, IB_DRSMP_DRDLID_F,
+		      path->drpath.drdlid ? path->drpath.drdlid : 0xffff);
+	mad_set_field(mad, 0, IB_DRSMP_DRSLID_F,
+		      path->drpath.drslid ? path->drpath.drslid : 0xffff);
+	mad_set_array(mad, 0, IB_DRSMP_PATH_F, path->drpath.p);
+	if (path->drpath.drslid != 0xffff && path->lid > 0)
+		umad_set_addr(umad, path->lid, 0, 0, 0);
+	else
+		umad_set_addr(umad, 0xffff, 0, 0, 0);
+	return 0;
 }
 
 static int send_smp(ibnd_smp_t * smp, smp_engine_t * engine)
 {
 	int rc = 0;
-	uint8_t umad[1024];
+	uint8_t umad[SMP_RX_BUF_SIZE];
 	ib_rpc_t *rpc = &smp->rpc;
 	int agent = 0;
 
-	memset(umad, 0, umad_size() + IB_MAD_SIZE);
-
 	if (rpc->mgtclass == IB_SMI_CLASS) {
 		agent = engine->smi_agent;
 	} else if (rpc->mgtclass == IB_SMI_DIRECT_CLASS) {
@@ -84,14 +668,11 @@ static int send_smp(ibnd_smp_t * smp, smp_engine_t * engine)
 		return (-EIO);
 	}
 
-	if ((rc = mad_build_pkt(umad, &smp->rpc, &smp->path, NULL, NULL))
-	    < 0) {
-		IBND_ERROR("mad_build_pkt failed; %d\n", rc);
+	if ((rc = smp_build_umad(engine, smp, umad)) < 0)
 		return rc;
-	}
 
-	if ((rc = umad_send(engine->umad_fd, agent, umad, IB_MAD_SIZE,
-			    engine->cfg->timeout_ms, engine->cfg->retries)) < 0) {
+	if ((rc = engine->transport->send(engine, agent, umad, IB_MAD_SIZE,
+					  smp_timeout_ms(engine, smp))) < 0) {
 		IBND_ERROR("send failed; %d\n", rc);
 		return rc;
 	}
@@ -103,46 +684,227 @@ static int process_smp_queue(smp_engine_t * engine)
 {
 	int rc = 0;
 	ibnd_smp_t *smp;
-	while (cl_qmap_count(&engine->smps_on_wire)
-	       < engine->cfg->max_smps) {
+	while (engine->num_on_wire < engine->window) {
 		smp = get_smp(engine);
 		if (!smp)
 			return 0;
 
+		if ((rc = put_on_wire(engine, smp)) != 0) {
+			target_done(engine, smp->target);
+			free_smp(engine, smp);
+			return rc;
+		}
+
 		if ((rc = send_smp(smp, engine)) != 0) {
-			free(smp);
+			release_slot(engine, (uint32_t) smp->rpc.trid);
+			target_done(engine, smp->target);
+			free_smp(engine, smp);
 			return rc;
 		}
-		cl_qmap_insert(&engine->smps_on_wire, (uint32_t) smp->rpc.trid,
-			       (cl_map_item_t *) smp);
-		engine->total_smps++;
+		smp->sent_us = now_us();
+		smp->send_seq = engine->total_smps++;
+		arm_timer(engine, smp);
 	}
 	return 0;
 }
 
-int issue_smp(smp_engine_t * engine, ib_portid_t * portid,
-	      unsigned attrid, unsigned mod, smp_comp_cb_t cb, void *cb_data)
+static void cb_lock(smp_engine_t * engine)
 {
-	ibnd_smp_t *smp = calloc(1, sizeof *smp);
-	if (!smp) {
-		IBND_ERROR("OOM\n");
-		return -ENOMEM;
+	if (engine->cb_lock)
+		pthread_mutex_lock(engine->cb_lock);
+}
+
+static void cb_unlock(smp_engine_t * engine)
+{
+	if (engine->cb_lock)
+		pthread_mutex_unlock(engine->cb_lock);
+}
+
+/* A LID routed SMP failed; queue it again on the DR path it was issued
+ * with.  Returns 1 if it was queued, 0 if it has to fail. */
+static int lid_fallback(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	if (!smp->lid_routed)
+		return 0;
+
+	IBND_DEBUG("LID %d Attr 0x%x:%u failed; falling back to %s\n",
+		   smp->path.lid, smp->rpc.attr.id, smp->rpc.attr.mod,
+		   portid2str(&smp->dr_path));
+	smp->lid_routed = 0;
+	smp->path = smp->dr_path;
+	smp->rpc.mgtclass = IB_SMI_DIRECT_CLASS;
+	smp->attempt = 0;
+	engine->stats.lid_fallbacks++;
+	if (++engine->lid_failures == SMP_LID_FAIL_LIMIT) {
+		IBND_DEBUG("%u LID routed SMPs failed; using DR only\n",
+			   engine->lid_failures);
+	}
+
+	if (!(smp->target = get_target(engine, smp)))
+		return 0;
+	if (target_is_dead(engine, smp)) {
+		engine->stats.fast_failed++;
+		put_target(engine, smp->target);
+		return 0;
+	}
+	queue_smp(engine, smp);
+	return 1;
+}
+
+/* An SMP which will never complete; give the error handlers a chance.
+ * Returns 1 if it was queued again DR routed instead. */
+static int fail_smp(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	int rc = 0;
+
+	if (lid_fallback(engine, smp))
+		return 1;
+	if (smp->rpc.attr.id == IB_ATTR_MLNX_EXT_PORT_INFO)
+		rc = mlnx_ext_port_info_err(engine, smp, NULL, smp->cb_data);
+	free_smp(engine, smp);
+	return rc;
+}
+
+/* The target did not answer any attempt: stop talking to it and fail
+ * everything queued for it, or for nodes behind it, right away instead of
+ * waiting out retries x timeout for each. */
+static int mark_dead(smp_engine_t * engine, smp_target_t * target)
+{
+	char dr_str[256];
+	ibnd_smp_t *smp;
+	int rc = 0;
+
+	if (target->lid && !target->drpath.cnt) {
+		IBND_DEBUG("LID %d not responding; suspected dead\n",
+			   target->lid);
+	} else {
+		IBND_ERROR("%s not responding; suspected dead\n",
+			   drpath2str(&target->drpath, dr_str,
+				      sizeof(dr_str)));
+	}
+	target->dead = 1;
+	engine->num_dead++;
+	engine->stats.dead_targets++;
+
+	while (target->queue_head) {
+		smp = dequeue_smp(engine, target);
+		engine->stats.fast_failed++;
+		if (fail_smp(engine, smp) < 0)
+			rc = -1;
+	}
+	return rc;
+}
+
+/* the SMP (already off the wire) got no response in time */
+static int smp_timeout(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	smp_target_t *target = smp->target;
+	int rc = 0;
+
+	engine->stats.timeouts++;
+	window_cut(engine, smp);
+
+	/* the DR path is the retry of a LID routed SMP */
+	if (!target->dead && !smp->lid_routed &&
+	    smp->attempt < engine->cfg->retries) {
+		IBND_DEBUG("retry %u (%s Attr 0x%x:%u) timeout %u ms\n",
+			   smp->attempt + 1, portid2str(&smp->path),
+			   smp->rpc.attr.id, smp->rpc.attr.mod,
+			   smp_timeout_ms(engine, smp) * 2);
+		smp->attempt++;
+		engine->stats.retries++;
+		requeue_smp(engine, smp);
+		target_done(engine, target);
+		return 0;
+	}
+
+	if (!smp->lid_routed) {
+		IBND_ERROR("timeout (%s Attr 0x%x:%u) after %u attempts\n",
+			   portid2str(&smp->path), smp->rpc.attr.id,
+			   smp->rpc.attr.mod, smp->attempt + 1);
+	}
+	cb_lock(engine);
+	if (!target->dead)
+		rc = mark_dead(engine, target);
+	if (fail_smp(engine, smp) < 0)
+		rc = -1;
+	cb_unlock(engine);
+	target_done(engine, target);
+	return rc;
+}
+
+static int expire_timers(smp_engine_t * engine)
+{
+	uint64_t now = now_us();
+	uint64_t tick, last;
+	ibnd_smp_t *smp, *next, *expired = NULL;
+	int rc = 0;
+
+	if (!engine->next_deadline_us || now < engine->next_deadline_us)
+		return 0;
+
+	tick = engine->next_deadline_us / SMP_WHEEL_TICK_US;
+	last = now / SMP_WHEEL_TICK_US;
+	if (last - tick >= SMP_WHEEL_SIZE)
+		last = tick + SMP_WHEEL_SIZE - 1;
+
+	for ( /* */ ; tick <= last; tick++)
+		for (smp = engine->wheel[tick % SMP_WHEEL_SIZE]; smp;
+		     smp = next) {
+			next = smp->tnext;
+			if (smp->deadline_us > now)
+				continue;
+			take_off_wire(engine, (uint32_t) smp->rpc.trid);
+			smp->tnext = expired;
+			expired = smp;
+		}
+	engine->next_deadline_us = next_deadline(engine);
+
+	for (smp = expired; smp; smp = next) {
+		next = smp->tnext;
+		smp->tnext = NULL;
+		if (smp_timeout(engine, smp))
+			rc = -1;
 	}
+	if (rc)
+		return rc;
+
+	return process_smp_queue(engine);
+}
+
+static int _issue_smp(smp_engine_t * engine, ib_portid_t * portid, int lid,
+		      unsigned attrid, unsigned mod, unsigned prio,
+		      smp_comp_cb_t cb, void *cb_data)
+{
+	int rc;
+	ibnd_smp_t *smp;
 
+	if (prio >= SMP_NUM_PRIO)
+		return -EINVAL;
+	if (!(smp = alloc_smp(engine)))
+		return -ENOMEM;
+
+	smp->prio = prio;
 	smp->cb = cb;
 	smp->cb_data = cb_data;
 	smp->path = *portid;
+	if (lid) {
+		smp->lid_routed = 1;
+		smp->dr_path = *portid;
+		memset(&smp->path, 0, sizeof(smp->path));
+		smp->path.lid = lid;
+		engine->stats.lid_routed++;
+	}
 	smp->rpc.method = IB_MAD_METHOD_GET;
 	smp->rpc.attr.id = attrid;
 	smp->rpc.attr.mod = mod;
 	smp->rpc.timeout = engine->cfg->timeout_ms;
 	smp->rpc.datasz = IB_SMP_DATA_SIZE;
 	smp->rpc.dataoffs = IB_SMP_DATA_OFFS;
-	smp->rpc.trid = mad_trid();
 	smp->rpc.mkey = engine->cfg->mkey;
 
-	if (portid->lid <= 0 || portid->drpath.drslid == 0xffff ||
-	    portid->drpath.drdlid == 0xffff)
+	if (smp->path.lid <= 0 || smp->path.drpath.drslid == 0xffff ||
+	    smp->path.drpath.drdlid == 0xffff)
 		smp->rpc.mgtclass = IB_SMI_DIRECT_CLASS;	/* direct SMI */
 	else
 		smp->rpc.mgtclass = IB_SMI_CLASS;	/* Lid routed SMI */
@@ -150,46 +912,143 @@ int issue_smp(smp_engine_t * engine, ib_portid_t * portid,
 	portid->sl = 0;
 	portid->qp = 0;
 
+	if (!(smp->target = get_target(engine, smp))) {
+		free_smp(engine, smp);
+		return -ENOMEM;
+	}
+
+	if (target_is_dead(engine, smp)) {
+		IBND_DEBUG("not sending to dead path %s Attr 0x%x:%u\n",
+			   portid2str(&smp->path), attrid, mod);
+		engine->stats.fast_failed++;
+		put_target(engine, smp->target);
+		if ((rc = fail_smp(engine, smp)) < 0)
+			return -1;
+		return rc ? process_smp_queue(engine) : -EHOSTUNREACH;
+	}
+
 	queue_smp(engine, smp);
 	return process_smp_queue(engine);
 }
 
-static int process_one_recv(smp_engine_t * engine)
+int issue_smp(smp_engine_t * engine, ib_portid_t * portid,
+	      unsigned attrid, unsigned mod, unsigned prio, smp_comp_cb_t cb,
+	      void *cb_data)
+{
+	return _issue_smp(engine, portid, 0, attrid, mod, prio, cb, cb_data);
+}
+
+/* Send the SMP LID routed to lid, falling back to the DR path in portid
+ * if that fails.  Completion callbacks always see the DR path. */
+int issue_smp_lid(smp_engine_t * engine, ib_portid_t * portid, int lid,
+		  unsigned attrid, unsigned mod, unsigned prio,
+		  smp_comp_cb_t cb, void *cb_data)
+{
+	if (lid <= 0 || lid >= 0xc000 ||
+	    engine->lid_failures >= SMP_LID_FAIL_LIMIT)
+		lid = 0;
+	return _issue_smp(engine, portid, lid, attrid, mod, prio, cb, cb_data);
+}
+
+static void rtt_add(ibnd_rtt_hist_t * hist, uint64_t rtt_us)
+{
+	unsigned b = 0;
+
+	while (b < IBND_RTT_BUCKETS - 1 && (rtt_us >> b))
+		b++;
+	hist->buckets[b]++;
+	hist->count++;
+	hist->total_us += rtt_us;
+	if (rtt_us > hist->max_us)
+		hist->max_us = (unsigned)rtt_us;
+}
+
+static void record_rtt(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	uint64_t rtt_us = now_us() - smp->sent_us;
+	int attr = smp_template_slot(smp->rpc.attr.id);
+	int hops = smp->path.drpath.cnt;
+
+	if (attr < 0)
+		attr = IBND_STATS_ATTR_OTHER;
+	if (hops >= IBND_STATS_MAX_HOPS)
+		hops = IBND_STATS_MAX_HOPS - 1;
+
+	engine->stats.responses++;
+	rtt_add(&engine->stats.attr_rtt[attr], rtt_us);
+	if (!smp->lid_routed)
+		rtt_add(&engine->stats.hop_rtt[hops], rtt_us);
+}
+
+/* drain whatever responses are pending into the receive ring */
+static int recv_batch(smp_engine_t * engine)
+{
+	int n, rc, length;
+
+	for (n = 0; n < SMP_RX_BATCH; n++) {
+		length = IB_MAD_SIZE;
+		rc = engine->transport->recv(engine,
+					     engine->rx_ring + n * SMP_RX_BUF_SIZE,
+					     &length);
+		if (rc == -EAGAIN || rc == -EWOULDBLOCK)
+			break;
+		if (rc < 0) {
+			IBND_ERROR("umad_recv failed: %d\n", rc);
+			return -1;
+		}
+	}
+	if (n > engine->stats.peak_rx_batch)
+		engine->stats.peak_rx_batch = n;
+	return n;
+}
+
+static int process_one_recv(smp_engine_t * engine, uint8_t * umad)
 {
 	int rc = 0;
 	int status = 0;
 	ibnd_smp_t *smp;
 	uint8_t *mad;
 	uint32_t trid;
-	uint8_t umad[sizeof(struct ib_user_mad) + IB_MAD_SIZE];
-	int length = umad_size() + IB_MAD_SIZE;
-
-	memset(umad, 0, sizeof(umad));
-
-	/* wait for the next message */
-	if ((rc = umad_recv(engine->umad_fd, umad, &length,
-			    -1)) < 0) {
-		IBND_ERROR("umad_recv failed: %d\n", rc);
-		return -1;
-	}
 
 	mad = umad_get_mad(umad);
 	trid = (uint32_t) mad_get_field64(mad, 0, IB_MAD_TRID_F);
 
-	smp = (ibnd_smp_t *) cl_qmap_remove(&engine->smps_on_wire, trid);
-	if ((cl_map_item_t *) smp == cl_qmap_end(&engine->smps_on_wire)) {
-		IBND_ERROR("Failed to find matching smp for trid (%x)\n", trid);
-		return -1;
+	smp = take_off_wire(engine, trid);
+	if (!smp) {
+		/* late response to an SMP which has already completed */
+		IBND_DEBUG("Dropping stale response for trid (%x)\n", trid);
+		engine->stats.stale_responses++;
+		return 0;
+	}
+
+	/* umad gave up on it before our own timer expired */
+	if (umad_status(umad) == ETIMEDOUT) {
+		if ((rc = smp_timeout(engine, smp)) == 0)
+			rc = process_smp_queue(engine);
+		return rc;
 	}
 
+	record_rtt(engine, smp);
+	target_done(engine, smp->target);
 	rc = process_smp_queue(engine);
 	if (rc)
 		goto error;
 
+	if (smp->lid_routed && (umad_status(umad) ||
+				mad_get_field(mad, 0, IB_DRSMP_STATUS_F))) {
+		cb_lock(engine);
+		rc = fail_smp(engine, smp);
+		cb_unlock(engine);
+		return rc < 0 ? rc : process_smp_queue(engine);
+	}
+
+	cb_lock(engine);
 	if ((status = umad_status(umad))) {
 		IBND_ERROR("umad (%s Attr 0x%x:%u) bad status %d; %s\n",
 			   portid2str(&smp->path), smp->rpc.attr.id,
 			   smp->rpc.attr.mod, status, strerror(status));
+		engine->stats.status_errors++;
+		window_cut(engine, smp);
 		if (smp->rpc.attr.id == IB_ATTR_MLNX_EXT_PORT_INFO)
 			rc = mlnx_ext_port_info_err(engine, smp, mad,
 						    smp->cb_data);
@@ -197,20 +1056,109 @@ static int process_one_recv(smp_engine_t * engine)
 		IBND_ERROR("mad (%s Attr 0x%x:%u) bad status 0x%x\n",
 			   portid2str(&smp->path), smp->rpc.attr.id,
 			   smp->rpc.attr.mod, status);
+		engine->stats.status_errors++;
+		window_cut(engine, smp);
 		if (smp->rpc.attr.id == IB_ATTR_MLNX_EXT_PORT_INFO)
 			rc = mlnx_ext_port_info_err(engine, smp, mad,
 						    smp->cb_data);
-	} else
+	} else {
+		window_ack(engine, smp);
+		if (smp->lid_routed)
+			smp->path = smp->dr_path;
 		rc = smp->cb(engine, smp, mad, smp->cb_data);
+	}
+	cb_unlock(engine);
 
 error:
-	free(smp);
+	free_smp(engine, smp);
 	return rc;
 }
 
+static int umad_transport_send(smp_engine_t * engine, int agent, void *umad,
+			       int len, int timeout_ms)
+{
+	/* retries are driven by the engine */
+	return umad_send(engine->umad_fd, agent, umad, len, timeout_ms, 0);
+}
+
+static int umad_transport_recv(smp_engine_t * engine, void *umad, int *len)
+{
+	/* the fd is non-blocking; a zero timeout skips umad's own poll */
+	return umad_recv(engine->umad_fd, umad, len, 0);
+}
+
+static int umad_transport_wait(smp_engine_t * engine, int timeout_ms)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = umad_get_fd(engine->umad_fd);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	rc = poll(&pfd, 1, timeout_ms);
+	if (rc < 0 && errno == EINTR)
+		return 0;
+	return rc < 0 ? -errno : rc;
+}
+
+static void umad_transport_close(smp_engine_t * engine)
+{
+	umad_close_port(engine->umad_fd);
+}
+
+static const smp_transport_ops_t umad_transport = {
+	umad_transport_send,
+	umad_transport_recv,
+	umad_transport_wait,
+	umad_transport_close
+};
+
+ibnd_test_ports_t *ibnd_test_ports;
+
+static int engine_setup(smp_engine_t * engine, void *user_data,
+			ibnd_config_t *cfg)
+{
+	engine->user_data = user_data;
+	engine->cfg = cfg;
+	engine->window = cfg->max_smps;
+	engine->stats.peak_window = engine->window;
+
+	if (init_trid_ring(engine,
+			   cfg->smp_window_mode == IBND_SMP_WINDOW_ADAPTIVE ?
+			   cfg->max_smps_limit : cfg->max_smps))
+		return -ENOMEM;
+
+	if (!(engine->rx_ring = malloc(SMP_RX_BATCH * SMP_RX_BUF_SIZE))) {
+		free(engine->trid_ring);
+		return -ENOMEM;
+	}
+
+	if (grow_smp_pool(engine, cfg->max_smps + SMP_POOL_QUEUE_DEPTH)) {
+		free(engine->rx_ring);
+		free(engine->trid_ring);
+		return -ENOMEM;
+	}
+
+	if (cfg->deadline_ms)
+		engine->expire_us = now_us() + cfg->deadline_ms * 1000ULL;
+	return 0;
+}
+
 int smp_engine_init(smp_engine_t * engine, char * ca_name, int ca_port,
 		    void *user_data, ibnd_config_t *cfg)
 {
+	const smp_transport_ops_t *ops;
+	void *data;
+	int flags;
+
+	if (ibnd_test_ports) {
+		if (ibnd_test_ports->open(ibnd_test_ports, ca_name, ca_port,
+					  &ops, &data))
+			return -EIO;
+		return smp_engine_init_transport(engine, ops, data, user_data,
+						 cfg);
+	}
+
 	memset(engine, 0, sizeof(*engine));
 
 	if (umad_init() < 0) {
@@ -238,9 +1186,17 @@ int smp_engine_init(smp_engine_t * engine, char * ca_name, int ca_port,
 		goto eio_close;
 	}
 
-	engine->user_data = user_data;
-	cl_qmap_init(&engine->smps_on_wire);
-	engine->cfg = cfg;
+	flags = fcntl(umad_get_fd(engine->umad_fd), F_GETFL);
+	if (flags < 0 || fcntl(umad_get_fd(engine->umad_fd), F_SETFL,
+			       flags | O_NONBLOCK) < 0) {
+		IBND_ERROR("can't make UMAD port (%s:%d) non-blocking\n",
+			   ca_name, ca_port);
+		goto eio_close;
+	}
+
+	engine->transport = &umad_transport;
+	if (engine_setup(engine, user_data, cfg))
+		goto eio_close;
 	return (0);
 
 eio_close:
@@ -248,36 +1204,163 @@ eio_close:
 	return (-EIO);
 }
 
+int smp_engine_init_transport(smp_engine_t * engine,
+			      const smp_transport_ops_t * transport,
+			      void *transport_data, void *user_data,
+			      ibnd_config_t *cfg)
+{
+	memset(engine, 0, sizeof(*engine));
+
+	engine->umad_fd = -1;
+	engine->smi_agent = IB_SMI_CLASS;
+	engine->smi_dir_agent = IB_SMI_DIRECT_CLASS;
+	engine->transport = transport;
+	engine->transport_data = transport_data;
+	return engine_setup(engine, user_data, cfg);
+}
+
+/* Give up on every SMP still queued or on the wire, passing each to cb,
+ * if any, first.  Nothing more can be processed; the engine is only good
+ * for smp_engine_destroy() afterwards.  Returns the first error from cb. */
+int smp_engine_abandon(smp_engine_t * engine, smp_abandon_cb_t cb)
+{
+	ibnd_smp_t *smp;
+	smp_target_t *target;
+	unsigned i;
+	int rc = 0, rc1;
+
+	IBND_DEBUG("abandoning %u queued and %u SMP's on wire\n",
+		   engine->num_queued, engine->num_on_wire);
+	for (i = 0; i < SMP_TARGET_HTSZ; i++)
+		for (target = engine->targets[i]; target;
+		     target = target->htnext) {
+			while (target->queue_head) {
+				smp = dequeue_smp(engine, target);
+				if (cb && (rc1 = cb(engine, smp)) != 0 &&
+				    !rc)
+					rc = rc1;
+				free_smp(engine, smp);
+			}
+		}
+
+	for (i = 0; engine->num_on_wire && i <= TRID_RING_MASK(engine); i++) {
+		smp = engine->trid_ring[i].smp;
+		if (!smp)
+			continue;
+		take_off_wire(engine, engine->trid_ring[i].trid);
+		if (cb && (rc1 = cb(engine, smp)) != 0 && !rc)
+			rc = rc1;
+		free_smp(engine, smp);
+	}
+	engine->next_deadline_us = 0;
+	return rc;
+}
+
 void smp_engine_destroy(smp_engine_t * engine)
 {
-	cl_map_item_t *item;
 	ibnd_smp_t *smp;
+	smp_slab_t *slab;
+	smp_target_t *target;
+	unsigned i;
 
 	/* remove queued smps */
-	smp = get_smp(engine);
-	if (smp)
+	if (engine->num_queued)
 		IBND_ERROR("outstanding SMP's\n");
-	for ( /* */ ; smp; smp = get_smp(engine))
-		free(smp);
+	for (i = 0; i < SMP_TARGET_HTSZ; i++)
+		for (target = engine->targets[i]; target;
+		     target = target->htnext)
+			while ((smp = target->queue_head)) {
+				target->queue_head = smp->qnext;
+				free_smp(engine, smp);
+			}
 
-	/* remove smps from the wire queue */
-	item = cl_qmap_head(&engine->smps_on_wire);
-	if (item != cl_qmap_end(&engine->smps_on_wire))
+	/* remove smps from the wire */
+	if (engine->num_on_wire)
 		IBND_ERROR("outstanding SMP's on wire\n");
-	for ( /* */ ; item != cl_qmap_end(&engine->smps_on_wire);
-	     item = cl_qmap_head(&engine->smps_on_wire)) {
-		cl_qmap_remove_item(&engine->smps_on_wire, item);
-		free(item);
+	for (i = 0; engine->num_on_wire && i <= TRID_RING_MASK(engine); i++) {
+		smp = engine->trid_ring[i].smp;
+		if (smp) {
+			take_off_wire(engine, engine->trid_ring[i].trid);
+			free_smp(engine, smp);
+		}
 	}
+	free(engine->trid_ring);
+	free(engine->rx_ring);
+	engine->trid_ring = NULL;
 
-	umad_close_port(engine->umad_fd);
+	for (i = 0; i < SMP_TARGET_HTSZ; i++)
+		while ((target = engine->targets[i])) {
+			engine->targets[i] = target->htnext;
+			free(target);
+		}
+	while ((target = engine->target_free)) {
+		engine->target_free = target->htnext;
+		free(target);
+	}
+
+	/* every SMP lives in a slab, release them all at once */
+	while ((slab = engine->smp_slabs)) {
+		engine->smp_slabs = slab->next;
+		free(slab);
+	}
+	engine->smp_free = NULL;
+
+	IBND_DEBUG("SMP pool: %u allocated, %u peak live, %u stale responses\n",
+		   engine->stats.smp_pool_size, engine->stats.peak_live_smps,
+		   engine->stats.stale_responses);
+	IBND_DEBUG("SMP timeouts %u, retries %u, dead targets %u, "
+		   "fast failed %u\n", engine->stats.timeouts,
+		   engine->stats.retries, engine->stats.dead_targets,
+		   engine->stats.fast_failed);
+	IBND_DEBUG("SMP receive: %u wakeups, peak batch %u\n",
+		   engine->stats.rx_wakeups, engine->stats.peak_rx_batch);
+	if (engine->stats.rate_holds)
+		IBND_DEBUG("SMP's held back by rate limits %u times\n",
+			   engine->stats.rate_holds);
+
+	engine->transport->close(engine);
 }
 
 int process_mads(smp_engine_t * engine)
 {
-	int rc;
-	while (!cl_is_qmap_empty(&engine->smps_on_wire))
-		if ((rc = process_one_recv(engine)) != 0)
+	int rc, n, i;
+
+	while (engine->num_on_wire || engine->rate_wake_us) {
+		/* out of time; the caller decides what to keep */
+		if (engine->expire_us && now_us() >= engine->expire_us) {
+			IBND_DEBUG("scan deadline of %u ms expired\n",
+				   engine->cfg->deadline_ms);
+			return -ETIMEDOUT;
+		}
+
+		if (engine->rate_wake_us && now_us() >= engine->rate_wake_us) {
+			engine->rate_wake_us = 0;
+			if ((rc = process_smp_queue(engine)) != 0)
+				return rc;
+		}
+
+		if ((n = recv_batch(engine)) < 0)
+			return n;
+
+		if (n == 0) {
+			/* nothing pending; sleep until a response or deadline */
+			engine->stats.rx_wakeups++;
+			rc = engine->transport->wait(engine,
+						     next_timeout_ms(engine));
+			if (rc < 0) {
+				IBND_ERROR("wait for SMP responses failed: %d\n",
+					   rc);
+				return -1;
+			}
+		}
+
+		for (i = 0; i < n; i++)
+			if ((rc = process_one_recv(engine, engine->rx_ring +
+						   i * SMP_RX_BUF_SIZE)) != 0)
+				return rc;
+
+		if ((rc = expire_timers(engine)) != 0)
 			return rc;
+	}
 	return 0;
 }
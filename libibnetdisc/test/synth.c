@@ -0,0 +1,599 @@
+/*
+ * Copyright (c) 2004-2007 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2007 Xsigo Systems Inc.  All rights reserved.
+ * Copyright (c) 2008 Lawrence Livermore National Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include <infiniband/mad.h>
+
+#include "synth.h"
+
+double synth_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* resident kB, after malloc has handed back what it holds free */
+long synth_rss_kb(void)
+{
+	FILE *f;
+	long size, rss = 0;
+
+	malloc_trim(0);
+	if (!(f = fopen("/proc/self/statm", "r")))
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &rss) != 2)
+		rss = 0;
+	fclose(f);
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* GUIDs in a vendor range, like a real fabric */
+uint64_t synth_guid(unsigned i)
+{
+	return 0x0002c90300000000ULL + 0x10 * (uint64_t)i;
+}
+
+void synth_fill(uint8_t * buf, uint64_t seed)
+{
+	int i;
+
+	for (i = 0; i < IB_SMP_DATA_SIZE; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		buf[i] = seed;
+	}
+}
+
+static ibnd_port_t *add_port(f_internal_t * f_int,
+			     const synth_alloc_t * alloc, ibnd_node_t * node,
+			     int portnum, unsigned lid, unsigned gen)
+{
+	ibnd_port_t *port = alloc ? alloc->port(f_int, node, portnum) :
+			    alloc_port(f_int, node, portnum);
+
+	if (!port)
+		return NULL;
+	port->guid = node->type == IB_NODE_SWITCH ? node->guid :
+		     node->guid + portnum;
+	synth_fill(port->info, port->guid + portnum + gen);
+	synth_fill(port->ext_info, ~port->guid + portnum);
+	mad_set_field(port->info, 0, IB_PORT_LID_F, lid);
+	mad_set_field(port->info, 0, IB_PORT_LMC_F, 0);
+	mad_set_field(port->info, 0, IB_PORT_LOCAL_PORT_F, portnum);
+	port->base_lid = lid;
+	if (add_to_portguid_hash(port, f_int) < 0)
+		return NULL;
+	add_to_portlid_hash(port, f_int);
+	return port;
+}
+
+/* Generation gen of a fabric differs from generation 0 in one CA in 89,
+ * whose PortInfo changed, and one in 101, replaced by another */
+static ibnd_node_t *add_node(f_internal_t * f_int,
+			     const synth_alloc_t * alloc, int type,
+			     unsigned i, unsigned gen)
+{
+	int numports = type == IB_NODE_SWITCH ? SYNTH_SW_PORTS : 1;
+	ibnd_node_t *node = alloc ? alloc->node(f_int, type, numports) :
+			    alloc_node(f_int, type, numports);
+	int p;
+
+	if (!node)
+		return NULL;
+	node->guid = synth_guid(i);
+	if (type == IB_NODE_CA && gen && i % 101 == gen)
+		node->guid += 0x100000000ULL * gen;
+	if (type != IB_NODE_CA || !gen || i % 89 != gen)
+		gen = 0;
+	node->type = type;
+	node->numports = numports;
+	synth_fill(node->info, node->guid);
+	mad_set_field(node->info, 0, IB_NODE_TYPE_F, type);
+	mad_set_field(node->info, 0, IB_NODE_NPORTS_F, numports);
+	mad_set_field64(node->info, 0, IB_NODE_GUID_F, node->guid);
+	snprintf(node->nodedesc, sizeof(node->nodedesc), "%s %u",
+		 type == IB_NODE_SWITCH ? "switch" : "ca", i);
+	if (type == IB_NODE_SWITCH)
+		synth_fill(node->switchinfo, ~node->guid);
+	for (p = type == IB_NODE_SWITCH ? 0 : 1; p <= numports; p++)
+		if (!add_port(f_int, alloc, node, p, type == IB_NODE_SWITCH ?
+			      i + 1 : i + 1 + p, gen))
+			return NULL;
+	node->smalid = node->ports[type == IB_NODE_SWITCH ? 0 : 1]->base_lid;
+	if (add_to_nodeguid_hash(node, f_int))
+		return NULL;
+	add_to_type_list(node, f_int);
+	node->next = f_int->fabric.nodes;
+	f_int->fabric.nodes = node;
+	return node;
+}
+
+/* A fabric of about num_ports ports, *nports exactly, discovered from
+ * the last CA.  Each switch is cabled to the 9 switches above it on ports
+ * 19-27 and to the 9 below it on ports 28-36. */
+ibnd_fabric_t *synth_build(unsigned num_ports, unsigned gen,
+			   const synth_alloc_t * alloc, unsigned *nports)
+{
+	unsigned num_sw = num_ports / (SYNTH_SW_PORTS + 1 + SYNTH_SW_CAS) + 1;
+	f_internal_t *f_int = allocate_fabric_internal();
+	ibnd_node_t **sw, *ca;
+	unsigned i, d;
+
+	if (!f_int)
+		return NULL;
+	if (!(sw = calloc(num_sw, sizeof(*sw)))) {
+		ibnd_destroy_fabric(&f_int->fabric);
+		return NULL;
+	}
+	for (i = 0; i < num_sw; i++)
+		if (!(sw[i] = add_node(f_int, alloc, IB_NODE_SWITCH, i, gen)))
+			goto error;
+	for (i = 0; i < num_sw; i++)
+		for (d = 1; d <= 9 && i + d < num_sw; d++)
+			link_ports(sw[i], sw[i]->ports[18 + d], sw[i + d],
+				   sw[i + d]->ports[27 + d]);
+	for (i = 0; i < num_sw * SYNTH_SW_CAS; i++) {
+		if (!(ca = add_node(f_int, alloc, IB_NODE_CA, num_sw + i,
+				    gen)))
+			goto error;
+		link_ports(ca, ca->ports[1], sw[i / SYNTH_SW_CAS],
+			   sw[i / SYNTH_SW_CAS]->ports[1 + i % SYNTH_SW_CAS]);
+	}
+	f_int->fabric.from_node = ca;
+	f_int->fabric.from_portnum = 1;
+	f_int->fabric.maxhops_discovered = num_sw / 9 + 2;
+	*nports = num_sw * (SYNTH_SW_PORTS + 1 + SYNTH_SW_CAS);
+	free(sw);
+	return &f_int->fabric;
+
+error:
+	free(sw);
+	ibnd_destroy_fabric(&f_int->fabric);
+	return NULL;
+}
+
+/* the parts of NodeInfo and SwitchInfo which are not reserved */
+#define SIM_NODE_INFO_SIZE 40
+#define SIM_SWITCH_INFO_SIZE 20
+
+/* SA record sizes, padded to 8 bytes, and offsets, IBA 15.2.5 */
+#define SIM_NR_SIZE 112
+#define SIM_NR_DESC_OFFS 44
+#define SIM_PIR_SIZE 72
+#define SIM_SIR_SIZE 24
+#define SIM_LR_SIZE 8
+
+#define SIM_STATUS_BAD_ATTR (3 << 2)
+#define SIM_STATUS_BAD_MOD (7 << 2)
+#define SIM_UMAD_LEN (sizeof(struct ib_user_mad) + IB_MAD_SIZE)
+
+typedef struct sim_resp {
+	uint64_t due_us;
+	uint8_t umad[SIM_UMAD_LEN];
+} sim_resp_t;
+
+/* the transport of one SMP engine */
+typedef struct sim_engine {
+	synth_sim_t *sim;
+	unsigned local;
+	sim_resp_t *resp;
+	unsigned num_resp, resp_size;
+} sim_engine_t;
+
+static uint64_t sim_now_us(void)
+{
+	return (uint64_t) (synth_now() * 1e6);
+}
+
+static int sim_local(synth_sim_t * sim, char *ca_name)
+{
+	unsigned i;
+
+	if (!ca_name)
+		return 0;
+	for (i = 1; i < sim->num_local; i++)
+		if (!strcmp(sim->local[i].ca_name, ca_name))
+			return i;
+	return 0;
+}
+
+/* switches answer to the LID of port 0 */
+static uint16_t sim_lid(ibnd_node_t * node, ibnd_port_t * port)
+{
+	if (node->type == IB_NODE_SWITCH)
+		return node->ports[0]->base_lid;
+	return port->base_lid;
+}
+
+static ibnd_node_t *sim_route(synth_sim_t * sim, unsigned local,
+			      uint8_t * p, int hops, int *entry)
+{
+	ibnd_port_t *port = sim->local[local].port;
+	ibnd_node_t *node = port->node;
+	int i;
+
+	for (i = 1; i <= hops; i++) {
+		/* DR only goes through switches, and out of the local CA */
+		if (i > 1 && node->type != IB_NODE_SWITCH)
+			return NULL;
+		if (p[i] > node->numports || !node->ports[p[i]] ||
+		    !node->ports[p[i]]->remoteport)
+			return NULL;
+		port = node->ports[p[i]]->remoteport;
+		node = port->node;
+	}
+	*entry = port->portnum;
+	return node;
+}
+
+ibnd_node_t *synth_sim_route(synth_sim_t * sim, unsigned local,
+			     ib_dr_path_t * drpath)
+{
+	int entry;
+
+	return sim_route(sim, local, drpath->p, drpath->cnt, &entry);
+}
+
+/* NodeInfo of node read through port entry; the vendor and device IDs,
+ * which would select vendor specific queries, are 0 */
+static void sim_node_info(ibnd_node_t * node, int entry, uint8_t * buf)
+{
+	ibnd_port_t *port = node->ports[entry];
+
+	memcpy(buf, node->info, SIM_NODE_INFO_SIZE);
+	mad_set_field(buf, 0, IB_NODE_VENDORID_F, 0);
+	mad_set_field(buf, 0, IB_NODE_DEVID_F, 0);
+	mad_set_field64(buf, 0, IB_NODE_PORT_GUID_F,
+			port ? port->guid : node->guid);
+	mad_set_field(buf, 0, IB_NODE_LOCAL_PORT_F, entry);
+}
+
+/* PortInfo of port read through port entry of its node */
+static void sim_port_info(ibnd_port_t * port, int entry, uint8_t * buf)
+{
+	int up = port->remoteport || !port->portnum;
+
+	memcpy(buf, port->info, IB_SMP_DATA_SIZE);
+	mad_set_field(buf, 0, IB_PORT_LOCAL_PORT_F, entry);
+	mad_set_field(buf, 0, IB_PORT_STATE_F,
+		      up ? IB_LINK_ACTIVE : IB_LINK_DOWN);
+	mad_set_field(buf, 0, IB_PORT_PHYS_STATE_F,
+		      up ? IB_PORT_PHYS_STATE_LINKUP :
+		      IB_PORT_PHYS_STATE_DISABLED);
+}
+
+static void sim_answer(ibnd_node_t * node, int entry, uint8_t * mad)
+{
+	uint8_t *data = mad + IB_SMP_DATA_OFFS;
+	unsigned mod = mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
+	int status = 0;
+
+	mad_set_field(mad, 0, IB_MAD_METHOD_F, IB_MAD_METHOD_GET_RESPONSE);
+	mad_set_field(mad, 0, IB_DRSMP_DIRECTION_F, 1);
+	memset(data, 0, IB_SMP_DATA_SIZE);
+	switch (mad_get_field(mad, 0, IB_MAD_ATTRID_F)) {
+	case IB_ATTR_NODE_INFO:
+		sim_node_info(node, entry, data);
+		break;
+	case IB_ATTR_NODE_DESC:
+		memcpy(data, node->nodedesc, sizeof(node->nodedesc));
+		break;
+	case IB_ATTR_PORT_INFO:
+		if (mod > (unsigned)node->numports || !node->ports[mod])
+			status = SIM_STATUS_BAD_MOD;
+		else
+			sim_port_info(node->ports[mod], entry, data);
+		break;
+	case IB_ATTR_SWITCH_INFO:
+		if (node->type == IB_NODE_SWITCH)
+			memcpy(data, node->switchinfo, SIM_SWITCH_INFO_SIZE);
+		else
+			status = SIM_STATUS_BAD_ATTR;
+		break;
+	default:
+		status = SIM_STATUS_BAD_ATTR;
+		break;
+	}
+	mad_set_field(mad, 0, IB_DRSMP_STATUS_F, status);
+}
+
+/* DR SMPs which reach a node are answered after base_us plus hop_us for
+ * each hop; the others, and LID routed SMPs, are lost */
+static int sim_send(smp_engine_t * engine, int agent, void *umad, int len,
+		    int timeout_ms)
+{
+	sim_engine_t *se = engine->transport_data;
+	synth_sim_t *sim = se->sim;
+	uint8_t *mad = umad_get_mad(umad), path[IB_SUBNET_PATH_HOPS_MAX];
+	ibnd_node_t *node;
+	sim_resp_t *r;
+	int hops, entry;
+
+	if (mad_get_field(mad, 0, IB_MAD_MGMTCLASS_F) != IB_SMI_DIRECT_CLASS)
+		return 0;
+	hops = mad_get_field(mad, 0, IB_DRSMP_HOPCNT_F);
+	mad_get_array(mad, 0, IB_DRSMP_PATH_F, path);
+	if (!(node = sim_route(sim, se->local, path, hops, &entry)))
+		return 0;
+
+	if (se->num_resp == se->resp_size) {
+		r = realloc(se->resp, 2 * se->resp_size * sizeof(*r));
+		if (!r)
+			return -ENOMEM;
+		se->resp = r;
+		se->resp_size *= 2;
+	}
+	r = &se->resp[se->num_resp++];
+	memcpy(r->umad, umad, SIM_UMAD_LEN);
+	sim_answer(node, entry, umad_get_mad(r->umad));
+	r->due_us = sim_now_us() + sim->base_us + hops * sim->hop_us;
+	__sync_fetch_and_add(&sim->smps, 1);
+	return 0;
+}
+
+/* the response due first, or NULL if there is none */
+static sim_resp_t *sim_next(sim_engine_t * se)
+{
+	sim_resp_t *next = NULL;
+	unsigned i;
+
+	for (i = 0; i < se->num_resp; i++)
+		if (!next || se->resp[i].due_us < next->due_us)
+			next = &se->resp[i];
+	return next;
+}
+
+static int sim_recv(smp_engine_t * engine, void *umad, int *len)
+{
+	sim_engine_t *se = engine->transport_data;
+	sim_resp_t *r = sim_next(se);
+
+	if (!r || r->due_us > sim_now_us())
+		return -EAGAIN;
+	memcpy(umad, r->umad, SIM_UMAD_LEN);
+	*r = se->resp[--se->num_resp];
+	*len = IB_MAD_SIZE;
+	return 0;
+}
+
+static int sim_wait(smp_engine_t * engine, int timeout_ms)
+{
+	sim_engine_t *se = engine->transport_data;
+	sim_resp_t *r = sim_next(se);
+	uint64_t now = sim_now_us(), wait_us;
+
+	wait_us = timeout_ms < 0 ? UINT64_MAX : timeout_ms * 1000ULL;
+	if (r && r->due_us <= now)
+		return 1;
+	if (r && r->due_us - now < wait_us) {
+		usleep(r->due_us - now);
+		return 1;
+	}
+	if (timeout_ms > 0)
+		usleep(wait_us);
+	return 0;
+}
+
+static void sim_close(smp_engine_t * engine)
+{
+	sim_engine_t *se = engine->transport_data;
+
+	free(se->resp);
+	free(se);
+}
+
+static const smp_transport_ops_t sim_ops = {
+	sim_send,
+	sim_recv,
+	sim_wait,
+	sim_close
+};
+
+static int sim_resolve_self(ibnd_test_ports_t * tp, char *ca_name,
+			    int ca_port, ib_portid_t * self)
+{
+	synth_sim_t *sim = (synth_sim_t *) tp;
+	ibnd_port_t *port = sim->local[sim_local(sim, ca_name)].port;
+
+	memset(self, 0, sizeof(*self));
+	self->lid = port->base_lid;
+	return 0;
+}
+
+static int sim_open(ibnd_test_ports_t * tp, char *ca_name, int ca_port,
+		    const smp_transport_ops_t ** ops, void **data)
+{
+	synth_sim_t *sim = (synth_sim_t *) tp;
+	sim_engine_t *se = calloc(1, sizeof(*se));
+
+	if (!se || !(se->resp = calloc(16, sizeof(*se->resp)))) {
+		free(se);
+		return -ENOMEM;
+	}
+	se->sim = sim;
+	se->local = sim_local(sim, ca_name);
+	se->resp_size = 16;
+	*ops = &sim_ops;
+	*data = se;
+	return 0;
+}
+
+/* Write the records of attr to rec, if not NULL; returns their number */
+static unsigned sim_sa_records(synth_sim_t * sim, uint16_t attr,
+			       uint8_t * rec, unsigned rec_size)
+{
+	ibnd_node_t *node;
+	ibnd_port_t *port, *rem;
+	unsigned n = 0;
+	uint16_t lid;
+	int p;
+
+	for (node = sim->model->nodes; node; node = node->next)
+		for (p = 0; p <= node->numports; p++) {
+			if (!(port = node->ports[p]))
+				continue;
+			lid = sim_lid(node, port);
+			rem = port->remoteport;
+			switch (attr) {
+			case IB_SA_ATTR_NODERECORD:
+				/* one per port with a LID */
+				if (node->type == IB_NODE_SWITCH && p)
+					continue;
+				if (!rec)
+					break;
+				sim_node_info(node, p, rec + 4);
+				memcpy(rec + SIM_NR_DESC_OFFS, node->nodedesc,
+				       sizeof(node->nodedesc));
+				break;
+			case IB_SA_ATTR_PORTINFORECORD:
+				if (!rec)
+					break;
+				rec[2] = p;
+				sim_port_info(port, p, rec + 4);
+				break;
+			case IB_SA_ATTR_SWITCHINFORECORD:
+				if (node->type != IB_NODE_SWITCH || p)
+					continue;
+				if (rec)
+					memcpy(rec + 4, node->switchinfo,
+					       SIM_SWITCH_INFO_SIZE);
+				break;
+			case IB_SA_ATTR_LINKRECORD:
+				if (!rem)
+					continue;
+				if (!rec)
+					break;
+				rec[2] = p;
+				rec[3] = rem->portnum;
+				rec[4] = sim_lid(rem->node, rem) >> 8;
+				rec[5] = sim_lid(rem->node, rem) & 0xff;
+				break;
+			}
+			if (rec) {
+				rec[0] = lid >> 8;
+				rec[1] = lid & 0xff;
+				rec += rec_size;
+			}
+			n++;
+		}
+	return n;
+}
+
+static void *sim_sa_get_table(ibnd_test_ports_t * tp, char *ca_name,
+			      int ca_port, uint16_t attr, int *len)
+{
+	synth_sim_t *sim = (synth_sim_t *) tp;
+	unsigned rec_size, n;
+	uint8_t *mad;
+	void *umad;
+
+	switch (attr) {
+	case IB_SA_ATTR_NODERECORD:
+		rec_size = SIM_NR_SIZE;
+		break;
+	case IB_SA_ATTR_PORTINFORECORD:
+		rec_size = SIM_PIR_SIZE;
+		break;
+	case IB_SA_ATTR_SWITCHINFORECORD:
+		rec_size = SIM_SIR_SIZE;
+		break;
+	case IB_SA_ATTR_LINKRECORD:
+		rec_size = SIM_LR_SIZE;
+		break;
+	default:
+		return NULL;
+	}
+
+	n = sim_sa_records(sim, attr, NULL, rec_size);
+	*len = IB_SA_DATA_OFFS + n * rec_size;
+	if (!(umad = calloc(1, umad_size() + *len)))
+		return NULL;
+	mad = umad_get_mad(umad);
+	mad_set_field(mad, 0, IB_MAD_METHOD_F,
+		      IB_MAD_METHOD_GET_TABLE_RESPONSE);
+	mad_set_field(mad, 0, IB_MAD_ATTRID_F, attr);
+	mad_set_field(mad, 0, IB_SA_ATTROFFS_F, rec_size / 8);
+	sim_sa_records(sim, attr, mad + IB_SA_DATA_OFFS, rec_size);
+	return umad;
+}
+
+synth_sim_t *synth_sim_open(ibnd_fabric_t * model)
+{
+	synth_sim_t *sim = calloc(1, sizeof(*sim));
+
+	if (!sim)
+		return NULL;
+	sim->ops.resolve_self = sim_resolve_self;
+	sim->ops.open = sim_open;
+	sim->ops.sa_get_table = sim_sa_get_table;
+	sim->model = model;
+	sim->local[0].port = model->from_node->ports[model->from_portnum];
+	sim->num_local = 1;
+	sim->base_us = 20;
+	sim->hop_us = 10;
+	ibnd_test_ports = &sim->ops;
+	return sim;
+}
+
+int synth_sim_add_port(synth_sim_t * sim, const char *ca_name,
+		       ibnd_port_t * port)
+{
+	if (sim->num_local == SYNTH_SIM_MAX_LOCAL)
+		return -ENOSPC;
+	sim->local[sim->num_local].ca_name = ca_name;
+	sim->local[sim->num_local].port = port;
+	return sim->num_local++;
+}
+
+void synth_sim_close(synth_sim_t * sim)
+{
+	ibnd_test_ports = NULL;
+	free(sim);
+}
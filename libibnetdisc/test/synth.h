@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2004-2007 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2007 Xsigo Systems Inc.  All rights reserved.
+ * Copyright (c) 2008 Lawrence Livermore National Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Synthetic fabrics and timers shared by the libibnetdisc tests.
+ */
+
+#ifndef _SYNTH_H_
+#define _SYNTH_H_
+
+#include <infiniband/ibnetdisc.h>
+
+#include "internal.h"
+
+/* 36 port switches, each with 18 single port CAs on ports 1-18 */
+#define SYNTH_SW_PORTS 36
+#define SYNTH_SW_CAS 18
+
+/* how synth_build() allocates nodes and ports; NULL for the fabric arena */
+typedef struct synth_alloc {
+	ibnd_node_t *(*node) (f_internal_t * f_int, int type, int numports);
+	ibnd_port_t *(*port) (f_internal_t * f_int, ibnd_node_t * node,
+			      int portnum);
+} synth_alloc_t;
+
+double synth_now(void);
+long synth_rss_kb(void);
+uint64_t synth_guid(unsigned i);
+void synth_fill(uint8_t * buf, uint64_t seed);
+ibnd_fabric_t *synth_build(unsigned num_ports, unsigned gen,
+			   const synth_alloc_t * alloc, unsigned *nports);
+
+/* A simulated fabric for the discovery entry points: while it is open
+ * ibnd_test_ports points at it, the nodes of model answer DR SMPs as their
+ * SMAs would and its SA answers GetTable from model.  A link is up where
+ * the ports of model are linked.  Local port 0 is the from port of model,
+ * opened by any name; more may be added by name. */
+#define SYNTH_SIM_MAX_LOCAL 4
+
+typedef struct synth_sim {
+	ibnd_test_ports_t ops;	/* first */
+	ibnd_fabric_t *model;
+	struct {
+		const char *ca_name;
+		ibnd_port_t *port;
+	} local[SYNTH_SIM_MAX_LOCAL];
+	unsigned num_local;
+	unsigned base_us, hop_us;	/* SMP response latency */
+	unsigned smps;		/* answered */
+} synth_sim_t;
+
+synth_sim_t *synth_sim_open(ibnd_fabric_t * model);
+int synth_sim_add_port(synth_sim_t * sim, const char *ca_name,
+		       ibnd_port_t * port);
+/* the node of model at the end of drpath from local port local */
+ibnd_node_t *synth_sim_route(synth_sim_t * sim, unsigned local,
+			     ib_dr_path_t * drpath);
+void synth_sim_close(synth_sim_t * sim);
+
+#endif				/* _SYNTH_H_ */
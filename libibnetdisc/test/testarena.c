@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2004-2007 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2007 Xsigo Systems Inc.  All rights reserved.
+ * Copyright (c) 2008 Lawrence Livermore National Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Check the fabric arena, and that it reuses the nodes free_node() gives
+ * back, and compare it with allocating every node, port array and port on
+ * its own, as libibnetdisc used to: resident memory, the time to build,
+ * walk and free the synthetic fabrics of synth.c.
+ * Each layout is measured in a child of its own so that neither sees the
+ * other's heap.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <infiniband/ibnetdisc.h>
+
+#include "internal.h"
+#include "synth.h"
+
+static const char *argv0 = "ibndtestarena";
+
+static ibnd_node_t *legacy_node(f_internal_t * f_int, int type, int numports)
+{
+	ibnd_node_t *node = calloc(1, sizeof(*node));
+
+	if (!node)
+		return NULL;
+	node->numports = numports;
+	node->ports = calloc(numports + 1, sizeof(*node->ports));
+	if (!node->ports) {
+		free(node);
+		return NULL;
+	}
+	return node;
+}
+
+static ibnd_port_t *legacy_port(f_internal_t * f_int, ibnd_node_t * node,
+				int portnum)
+{
+	ibnd_port_t *port = calloc(1, sizeof(*port));
+
+	if (port) {
+		port->node = node;
+		port->portnum = portnum;
+		node->ports[portnum] = port;
+	}
+	return port;
+}
+
+static void legacy_destroy(ibnd_fabric_t * fabric)
+{
+	ibnd_node_t *node, *next;
+	int p;
+
+	for (node = fabric->nodes; node; node = next) {
+		next = node->next;
+		for (p = 0; p <= node->numports; p++)
+			free(node->ports[p]);
+		free(node->ports);
+		free(node);
+	}
+	fabric->nodes = NULL;
+}
+
+/* what a tool does for every port */
+static uint64_t walk(ibnd_fabric_t * fabric)
+{
+	ibnd_node_t *node;
+	ibnd_port_t *port;
+	uint64_t sum = 0;
+	int p;
+
+	for (node = fabric->nodes; node; node = node->next)
+		for (p = 0; p <= node->numports; p++)
+			if ((port = node->ports[p]))
+				sum += port->base_lid + port->info[0] +
+				       port->node->guid;
+	return sum;
+}
+
+static int check(f_internal_t * f_int)
+{
+	ibnd_fabric_t *fabric = &f_int->fabric;
+	ibnd_node_t *node;
+	int p;
+
+	for (node = fabric->nodes; node; node = node->next)
+		for (p = 0; p <= node->numports; p++) {
+			ibnd_port_t *port = node->ports[p];
+
+			if (!port)
+				continue;
+			if (port->node != node || port->portnum != p ||
+			    (port->remoteport &&
+			     port->remoteport->remoteport != port)) {
+				fprintf(stderr, "port 0x%" PRIx64 ":%d broken\n",
+					node->guid, p);
+				return -1;
+			}
+			if (node->type == IB_NODE_SWITCH && p &&
+			    port != node->ports[p - 1] + 1) {
+				fprintf(stderr, "ports of 0x%" PRIx64
+					" are not contiguous\n", node->guid);
+				return -1;
+			}
+		}
+	node = fabric->nodes;
+	if (alloc_port(f_int, node, node->numports + 1) ||
+	    alloc_port(f_int, node, 1) != node->ports[1]) {
+		fprintf(stderr, "alloc_port() range or reuse broken\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* what free_node() gives back is handed out again, zeroed */
+static int check_reuse(f_internal_t * f_int)
+{
+	ibnd_node_t *ca = NULL, *sw = NULL;
+	size_t bytes = 0;
+	unsigned i;
+
+	for (i = 0; i < 10000; i++) {
+		if (ca) {
+			free_node(f_int, ca);
+			free_node(f_int, sw);
+		}
+		if (!(ca = alloc_node(f_int, IB_NODE_CA, 2)) ||
+		    !(sw = alloc_node(f_int, IB_NODE_SWITCH, 36)) ||
+		    ca->guid || ca->ports[1] || sw->guid ||
+		    !alloc_port(f_int, ca, 1) || ca->ports[1]->guid) {
+			fprintf(stderr, "alloc_node() after free_node() "
+				"broken\n");
+			return -1;
+		}
+		ca->guid = ca->ports[1]->guid = sw->guid = i + 1;
+		if (!i)
+			bytes = f_int->arena.bytes;
+	}
+	free_node(f_int, ca);
+	free_node(f_int, sw);
+	if (f_int->arena.bytes != bytes) {
+		fprintf(stderr, "free_node() memory is not reused\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int run(unsigned num_ports, int legacy, unsigned walks)
+{
+	static const synth_alloc_t legacy_alloc = { legacy_node, legacy_port };
+	ibnd_fabric_t *fabric;
+	ibnd_node_t *node;
+	unsigned i, n, num_nodes = 0;
+	double t, t_build, t_walk, t_free;
+	long rss, rss0 = synth_rss_kb();
+	uint64_t sum = 0;
+
+	t = synth_now();
+	fabric = synth_build(num_ports, 0, legacy ? &legacy_alloc : NULL, &n);
+	if (!fabric)
+		return -1;
+	t_build = synth_now() - t;
+	for (node = fabric->nodes; node; node = node->next)
+		num_nodes++;
+
+	if (!legacy && (check((f_internal_t *)fabric) ||
+			check_reuse((f_internal_t *)fabric)))
+		return -1;
+
+	t = synth_now();
+	for (i = 0; i < walks; i++)
+		sum += walk(fabric);
+	t_walk = synth_now() - t;
+
+	rss = synth_rss_kb() - rss0;
+
+	t = synth_now();
+	if (legacy)
+		legacy_destroy(fabric);
+	ibnd_destroy_fabric(fabric);
+	t_free = synth_now() - t;
+
+	printf("%7u ports %6u nodes %-6s: %8ld KB, build %7.2f ms, "
+	       "walk %6.2f ns/port, free %7.2f ms\n", n, num_nodes,
+	       legacy ? "malloc" : "arena", rss, t_build * 1e3,
+	       t_walk * 1e9 / walks / n, t_free * 1e3);
+	return sum ? 0 : -1;
+}
+
+/* each layout in a fresh process so RSS is its own */
+static int run_child(unsigned num_ports, int legacy, unsigned walks)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid)
+		exit(run(num_ports, legacy, walks) ? 1 : 0);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status) ? -1 : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-h -w <walks>] [<ports> ...]\n"
+		"   Check the fabric arena and compare it with malloc per\n"
+		"   object on fabrics of <ports> ports\n"
+		"   (default 1000 10000 45000 100000)\n"
+		"   -h This help message\n"
+		"   -w <walks> walks over all ports per fabric (default 20)\n",
+		argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned sizes[] = { 1000, 10000, 45000, 100000 };
+	unsigned walks = 20, i;
+	int ch, rc = 0;
+
+	argv0 = argv[0];
+	while ((ch = getopt(argc, argv, "w:h")) != -1) {
+		switch (ch) {
+		case 'w':
+			walks = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (!walks)
+		usage();
+
+	if (optind < argc) {
+		for (i = optind; i < (unsigned)argc; i++)
+			if (run_child(strtoul(argv[i], NULL, 0), 0, walks) ||
+			    run_child(strtoul(argv[i], NULL, 0), 1, walks))
+				rc = 1;
+	} else {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+			if (run_child(sizes[i], 0, walks) ||
+			    run_child(sizes[i], 1, walks))
+				rc = 1;
+	}
+	return rc;
+}
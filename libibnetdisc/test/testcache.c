@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) 2004-2007 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2007 Xsigo Systems Inc.  All rights reserved.
+ * Copyright (c) 2008 Lawrence Livermore National Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Check that the synthetic fabrics of synth.c survive ibnd_cache_fabric()
+ * and ibnd_load_fabric() in both cache formats, and a chain of deltas, and
+ * compare the time it takes to load them.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <infiniband/ibnetdisc.h>
+
+#include "internal.h"
+#include "synth.h"
+
+static const char *argv0 = "ibndtestcache";
+static unsigned max_threads = 4;
+static char cache_file[256];
+static char delta_file[2][264];
+
+/* version 1 keeps neither ext_info nor the port the scan started from */
+#define CMP_V1		(1 << 0)
+#define CMP_ANY_ORDER	(1 << 1)
+
+static int compare(ibnd_fabric_t * a, ibnd_fabric_t * b, int flags)
+{
+	ibnd_node_t *na, *nb, *next = b->nodes;
+	ibnd_port_t *pa, *pb;
+	int v1 = flags & CMP_V1;
+	int p;
+
+	if (a->maxhops_discovered != b->maxhops_discovered ||
+	    !b->from_node || a->from_node->guid != b->from_node->guid ||
+	    (!v1 && a->from_portnum != b->from_portnum)) {
+		fprintf(stderr, "fabric header differs\n");
+		return -1;
+	}
+	for (na = a->nodes; na; na = na->next, next = next->next) {
+		if (!next || !(nb = ibnd_find_node_guid(b, na->guid)) ||
+		    (!(flags & (CMP_V1 | CMP_ANY_ORDER)) &&
+		     next->guid != na->guid)) {
+			fprintf(stderr, "node 0x%" PRIx64 " missing or out"
+				" of order\n", na->guid);
+			return -1;
+		}
+		if (nb->type != na->type || nb->numports != na->numports ||
+		    nb->smalid != na->smalid ||
+		    memcmp(nb->info, na->info, sizeof(na->info)) ||
+		    memcmp(nb->switchinfo, na->switchinfo,
+			   sizeof(na->switchinfo)) ||
+		    strcmp(nb->nodedesc, na->nodedesc)) {
+			fprintf(stderr, "node 0x%" PRIx64 " differs\n",
+				na->guid);
+			return -1;
+		}
+		for (p = 0; p <= na->numports; p++) {
+			pa = na->ports[p];
+			pb = nb->ports[p];
+			if (!pa != !pb)
+				goto port_error;
+			if (!pa)
+				continue;
+			if (pb->guid != pa->guid || pb->portnum != p ||
+			    pb->node != nb || pb->base_lid != pa->base_lid ||
+			    memcmp(pb->info, pa->info, sizeof(pa->info)) ||
+			    (!v1 && memcmp(pb->ext_info, pa->ext_info,
+					   sizeof(pa->ext_info))) ||
+			    !pa->remoteport != !pb->remoteport)
+				goto port_error;
+			if (pa->remoteport &&
+			    (pb->remoteport->node->guid !=
+			     pa->remoteport->node->guid ||
+			     pb->remoteport->portnum !=
+			     pa->remoteport->portnum ||
+			     pb->remoteport->remoteport != pb))
+				goto port_error;
+		}
+	}
+	if (next) {
+		fprintf(stderr, "node 0x%" PRIx64 " should not be there\n",
+			next->guid);
+		return -1;
+	}
+	return 0;
+
+port_error:
+	fprintf(stderr, "port 0x%" PRIx64 ":%d differs\n", na->guid, p);
+	return -1;
+}
+
+static int run_format(ibnd_fabric_t * fabric, unsigned nports, int v1,
+		      unsigned loads)
+{
+	ibnd_fabric_t *loaded;
+	ibnd_cache_t *cache;
+	struct stat st;
+	double t, t_write, t_load = 0;
+	unsigned i;
+
+	t = synth_now();
+	if (ibnd_cache_fabric(fabric, cache_file,
+			      v1 ? IBND_CACHE_FABRIC_FLAG_V1 : 0)) {
+		fprintf(stderr, "failed to cache the fabric\n");
+		return -1;
+	}
+	t_write = synth_now() - t;
+	if (stat(cache_file, &st))
+		return -1;
+	if (!ibnd_cache_fabric(fabric, cache_file,
+			       IBND_CACHE_FABRIC_FLAG_NO_OVERWRITE)) {
+		fprintf(stderr, "cache overwritten despite NO_OVERWRITE\n");
+		return -1;
+	}
+	if (v1 && (cache = ibnd_cache_open(cache_file, 0))) {
+		fprintf(stderr, "cursor opened a version 1 cache\n");
+		ibnd_cache_close(cache);
+		return -1;
+	}
+
+	for (i = 0; i < loads; i++) {
+		t = synth_now();
+		loaded = ibnd_load_fabric(cache_file, 0);
+		t_load += synth_now() - t;
+		if (!loaded) {
+			fprintf(stderr, "failed to load the fabric\n");
+			return -1;
+		}
+		if (!i && compare(fabric, loaded, v1 ? CMP_V1 : 0)) {
+			ibnd_destroy_fabric(loaded);
+			return -1;
+		}
+		ibnd_destroy_fabric(loaded);
+	}
+
+	printf("%7u ports v%d: %9lld bytes, write %8.2f ms, load %8.2f ms\n",
+	       nports, v1 ? 1 : 2, (long long)st.st_size, t_write * 1e3,
+	       t_load * 1e3 / loads);
+	return 0;
+}
+
+static int cmp_node(ibnd_node_t * a, ibnd_node_t * b)
+{
+	return a->guid != b->guid || a->type != b->type ||
+	       a->numports != b->numports || a->smalid != b->smalid ||
+	       memcmp(a->info, b->info, sizeof(a->info)) ||
+	       strcmp(a->nodedesc, b->nodedesc);
+}
+
+static int cmp_port(ibnd_port_t * a, ibnd_port_t * b)
+{
+	return a->guid != b->guid || a->portnum != b->portnum ||
+	       a->base_lid != b->base_lid ||
+	       memcmp(a->info, b->info, sizeof(a->info)) ||
+	       memcmp(&a->attrs, &b->attrs, sizeof(a->attrs));
+}
+
+/* the cursor must see what ibnd_load_fabric() builds, in the same order */
+static int check_cursor(ibnd_fabric_t * loaded)
+{
+	ibnd_cache_t *cache;
+	ibnd_node_t *node, *n = loaded->nodes;
+	ibnd_port_t *port, *pl;
+	int p;
+
+	if (!(cache = ibnd_cache_open(cache_file, 0)))
+		return -1;
+	while ((node = ibnd_cache_next_node(cache))) {
+		if (!n || cmp_node(node, n))
+			goto error;
+		for (p = 0; p <= n->numports; p++) {
+			if (!(pl = n->ports[p]))
+				continue;
+			port = ibnd_cache_next_port(cache);
+			if (!port || cmp_port(port, pl) || port->node != node ||
+			    node->ports[p] != port ||
+			    !port->remoteport != !pl->remoteport)
+				goto error;
+			if (pl->remoteport &&
+			    (cmp_port(port->remoteport, pl->remoteport) ||
+			     cmp_node(port->remoteport->node,
+				      pl->remoteport->node)))
+				goto error;
+		}
+		if (ibnd_cache_next_port(cache))
+			goto error;
+		n = n->next;
+	}
+	if (n)
+		goto error;
+	return ibnd_cache_close(cache);
+
+error:
+	fprintf(stderr, "cursor differs at node 0x%" PRIx64 "\n",
+		n ? n->guid : 0);
+	ibnd_cache_close(cache);
+	return -1;
+}
+
+/* scan the version 2 cache with the cursor against loading it whole */
+static int run_cursor(ibnd_fabric_t * fabric, unsigned nports,
+		      unsigned loads)
+{
+	ibnd_fabric_t *loaded;
+	ibnd_cache_t *cache;
+	double t, t_nodes = 0, t_ports = 0, t_load = 0;
+	long rss, rss_cursor = 0, rss_load = 0;
+	unsigned i;
+
+	if (ibnd_cache_fabric(fabric, cache_file, 0) ||
+	    !(loaded = ibnd_load_fabric(cache_file, 0))) {
+		fprintf(stderr, "failed to cache the fabric\n");
+		return -1;
+	}
+	if (check_cursor(loaded)) {
+		ibnd_destroy_fabric(loaded);
+		return -1;
+	}
+	ibnd_destroy_fabric(loaded);
+
+	for (i = 0; i < loads; i++) {
+		rss = synth_rss_kb();
+		t = synth_now();
+		loaded = ibnd_load_fabric(cache_file, 0);
+		t_load += synth_now() - t;
+		if (!loaded)
+			return -1;
+		rss_load = synth_rss_kb() - rss;
+		ibnd_destroy_fabric(loaded);
+
+		t = synth_now();
+		if (!(cache = ibnd_cache_open(cache_file, 0)))
+			return -1;
+		while (ibnd_cache_next_node(cache))
+			;
+		if (ibnd_cache_close(cache))
+			return -1;
+		t_nodes += synth_now() - t;
+
+		rss = synth_rss_kb();
+		t = synth_now();
+		if (!(cache = ibnd_cache_open(cache_file, 0)))
+			return -1;
+		while (ibnd_cache_next_node(cache))
+			while (ibnd_cache_next_port(cache))
+				;
+		t_ports += synth_now() - t;
+		rss_cursor = synth_rss_kb() - rss;
+		if (ibnd_cache_close(cache))
+			return -1;
+	}
+
+	printf("%7u ports cursor: nodes %8.2f ms, ports %8.2f ms, %6ld kB;"
+	       " load %8.2f ms, %6ld kB\n", nports, t_nodes * 1e3 / loads,
+	       t_ports * 1e3 / loads, rss_cursor, t_load * 1e3 / loads,
+	       rss_load);
+	return 0;
+}
+
+/* time loading the version 2 cache with 1 to max_threads threads */
+static int run_threads(ibnd_fabric_t * fabric, unsigned nports,
+		       unsigned loads)
+{
+	ibnd_fabric_t *loaded;
+	double t, t_load;
+	unsigned i, n = 1;
+
+	if (ibnd_cache_fabric(fabric, cache_file, 0)) {
+		fprintf(stderr, "failed to cache the fabric\n");
+		return -1;
+	}
+	for (;;) {
+		t_load = 0;
+		for (i = 0; i < loads; i++) {
+			t = synth_now();
+			loaded = ibnd_load_fabric(cache_file,
+						  IBND_LOAD_FABRIC_THREADS(n));
+			t_load += synth_now() - t;
+			if (!loaded) {
+				fprintf(stderr, "failed to load the fabric\n");
+				return -1;
+			}
+			if (!i && compare(fabric, loaded, 0)) {
+				ibnd_destroy_fabric(loaded);
+				return -1;
+			}
+			ibnd_destroy_fabric(loaded);
+		}
+		printf("%7u ports v2 %3u threads: load %8.2f ms\n", nports, n,
+		       t_load * 1e3 / loads);
+		if (n == max_threads)
+			break;
+		n = n * 2 < max_threads ? n * 2 : max_threads;
+	}
+	return 0;
+}
+
+/* generation 2 as a chain of two deltas onto a cache of generation 0 */
+static int run_delta(ibnd_fabric_t * base, unsigned num_ports,
+		     unsigned nports, unsigned loads)
+{
+	ibnd_fabric_t *gen[3] = { base }, *loaded;
+	char *deltas[2] = { delta_file[0], delta_file[1] };
+	struct stat st[2];
+	double t, t_load = 0;
+	unsigned i;
+	int rc = -1;
+
+	for (i = 1; i < 3; i++)
+		if (!(gen[i] = synth_build(num_ports, i, NULL, &nports)))
+			goto out;
+	if (ibnd_cache_fabric(base, cache_file, 0) ||
+	    ibnd_cache_fabric_delta(gen[0], gen[1], delta_file[0], 0) ||
+	    ibnd_cache_fabric_delta(gen[1], gen[2], delta_file[1], 0) ||
+	    stat(delta_file[0], &st[0]) || stat(delta_file[1], &st[1])) {
+		fprintf(stderr, "failed to cache the deltas\n");
+		goto out;
+	}
+	if ((loaded = ibnd_load_fabric_chain(cache_file, deltas + 1, 1, 0))) {
+		fprintf(stderr, "delta applied to the wrong fabric\n");
+		ibnd_destroy_fabric(loaded);
+		goto out;
+	}
+	errno = 0;
+	if ((loaded = ibnd_load_fabric_delta(gen[0], delta_file[0],
+					     IBND_LOAD_FABRIC_THREADS(2))) ||
+	    errno != EINVAL) {
+		fprintf(stderr, "delta loaded with flags\n");
+		if (loaded)
+			ibnd_destroy_fabric(loaded);
+		goto out;
+	}
+
+	for (i = 0; i < loads; i++) {
+		t = synth_now();
+		loaded = ibnd_load_fabric_chain(cache_file, deltas, 2, 0);
+		t_load += synth_now() - t;
+		if (!loaded) {
+			fprintf(stderr, "failed to load the chain\n");
+			goto out;
+		}
+		if (!i && compare(gen[2], loaded, CMP_ANY_ORDER)) {
+			ibnd_destroy_fabric(loaded);
+			goto out;
+		}
+		ibnd_destroy_fabric(loaded);
+	}
+
+	printf("%7u ports v2+2 deltas: %6lld + %6lld bytes, load %8.2f ms\n",
+	       nports, (long long)st[0].st_size, (long long)st[1].st_size,
+	       t_load * 1e3 / loads);
+	rc = 0;
+out:
+	for (i = 1; i < 3; i++)
+		if (gen[i])
+			ibnd_destroy_fabric(gen[i]);
+	return rc;
+}
+
+/* A delta to a fabric whose switch 0 had its GUID changed in place, as
+ * ibcacheedit --switchguid does after loading it; the GUID tables still
+ * hold the old one. */
+static int run_rename(ibnd_fabric_t * base, unsigned num_ports)
+{
+	ibnd_fabric_t *fabric, *loaded = NULL;
+	char *deltas[1] = { delta_file[0] };
+	ibnd_node_t *node;
+	unsigned nports;
+	int p, rc = -1;
+
+	if (!(fabric = synth_build(num_ports, 0, NULL, &nports)))
+		return -1;
+	node = ibnd_find_node_guid(fabric, synth_guid(0));
+	node->guid = ~node->guid;
+	for (p = 0; p <= node->numports; p++)
+		node->ports[p]->guid = node->guid;
+
+	if (ibnd_cache_fabric(base, cache_file, 0) ||
+	    ibnd_cache_fabric_delta(base, fabric, delta_file[0], 0)) {
+		fprintf(stderr, "failed to cache the renamed delta\n");
+		goto out;
+	}
+	if (!(loaded = ibnd_load_fabric_chain(cache_file, deltas, 1, 0))) {
+		fprintf(stderr, "failed to load the renamed delta\n");
+		goto out;
+	}
+	if (ibnd_find_node_guid(loaded, synth_guid(0))) {
+		fprintf(stderr, "renamed node still there\n");
+		goto out;
+	}
+	rc = compare(fabric, loaded, CMP_ANY_ORDER);
+out:
+	if (loaded)
+		ibnd_destroy_fabric(loaded);
+	ibnd_destroy_fabric(fabric);
+	return rc;
+}
+
+static int run(unsigned num_ports, unsigned loads)
+{
+	ibnd_fabric_t *fabric;
+	unsigned nports;
+	int rc;
+
+	if (!(fabric = synth_build(num_ports, 0, NULL, &nports))) {
+		fprintf(stderr, "failed to build a fabric of %u ports\n",
+			num_ports);
+		return -1;
+	}
+	rc = run_format(fabric, nports, 1, loads) ||
+	     run_format(fabric, nports, 0, loads) ||
+	     run_cursor(fabric, nports, loads) ||
+	     run_threads(fabric, nports, loads) ||
+	     run_delta(fabric, num_ports, nports, loads) ||
+	     run_rename(fabric, num_ports);
+	ibnd_destroy_fabric(fabric);
+	return rc ? -1 : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-h -n <loads> -t <threads>] [<ports> ...]\n"
+		"   Round trip fabrics of <ports> ports through both cache\n"
+		"   formats, the cache cursor and a chain of deltas and time\n"
+		"   writing and reading them\n"
+		"   (default 1000 10000 45000 100000)\n"
+		"   -h This help message\n"
+		"   -n <loads> loads per fabric and format (default 5)\n"
+		"   -t <threads> time version 2 loads with 1 up to <threads>\n"
+		"      threads (default 4)\n",
+		argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned sizes[] = { 1000, 10000, 45000, 100000 };
+	const char *tmpdir = getenv("TMPDIR");
+	unsigned loads = 5, i;
+	int ch, fd, rc = 0;
+
+	argv0 = argv[0];
+	while ((ch = getopt(argc, argv, "n:t:h")) != -1) {
+		switch (ch) {
+		case 'n':
+			loads = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (!loads || !max_threads || max_threads > 255)
+		usage();
+
+	snprintf(cache_file, sizeof(cache_file), "%s/ibndtestcache.XXXXXX",
+		 tmpdir ? tmpdir : "/tmp");
+	if ((fd = mkstemp(cache_file)) < 0) {
+		perror(cache_file);
+		return 1;
+	}
+	close(fd);
+	for (i = 0; i < 2; i++)
+		snprintf(delta_file[i], sizeof(delta_file[i]), "%s.%u",
+			 cache_file, i + 1);
+
+	if (optind < argc) {
+		for (i = optind; i < (unsigned)argc; i++)
+			if (run(strtoul(argv[i], NULL, 0), loads))
+				rc = 1;
+	} else {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+			if (run(sizes[i], loads))
+				rc = 1;
+	}
+	unlink(cache_file);
+	unlink(delta_file[0]);
+	unlink(delta_file[1]);
+	return rc;
+}
@@ -0,0 +1,1433 @@
+/*
+ * Copyright (c) 2004-2007 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2007 Xsigo Systems Inc.  All rights reserved.
+ * Copyright (c) 2008 Lawrence Livermore National Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Drive the SMP engine through a stand-in transport which answers every
+ * SMP locally, except for a "flaky" destination which loses the first
+ * attempt and a "dead" destination which never answers, and check that a
+ * scan deadline cuts processing short, that the adaptive window gives way
+ * to losses and recovers, that destinations take turns and that one held
+ * back by the MAD rate limits does not hold up the others.  Then discover
+ * a simulated fabric, see synth_sim_open(), from one port, from two ports
+ * and through the SA and compare the results, fetch attributes into it
+ * once cached and rediscover it as it changes.  With -b, measure the
+ * receive path against a loopback socket instead, with -p the cost of
+ * building SMP packets and with -f how long a simulated fabric takes to
+ * discover with and without SMP priority classes.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <infiniband/umad.h>
+#include <infiniband/mad.h>
+#include <infiniband/ibnetdisc.h>
+
+#include "internal.h"
+#include "synth.h"
+
+#define MAX_TARGETS 256
+#define UMAD_LEN (sizeof(struct ib_user_mad) + IB_MAD_SIZE)
+
+/* the attribute modifier of each test SMP names its destination */
+enum { TARGET_OK, TARGET_FLAKY, TARGET_DEAD };
+
+typedef struct test_transport {
+	int behaviour[MAX_TARGETS];
+	int sent[MAX_TARGETS];
+	int completed[MAX_TARGETS];
+	int drop_lid;	/* LID routed SMPs are lost */
+	unsigned lid_sent;
+	/* destinations in the order SMPs were sent, while there is room */
+	uint8_t order[MAX_TARGETS];
+	unsigned num_order;
+	uint8_t (*resp)[UMAD_LEN];
+	unsigned resp_head, resp_tail, resp_size;
+} test_transport_t;
+
+static const char *argv0 = "ibndtestengine";
+
+static int test_send(smp_engine_t * engine, int agent, void *umad, int len,
+		     int timeout_ms)
+{
+	test_transport_t *t = engine->transport_data;
+	uint8_t *mad = umad_get_mad(umad);
+	unsigned mod = mad_get_field(mad, 0, IB_MAD_ATTRMOD_F);
+	int dr = mad_get_field(mad, 0, IB_MAD_MGMTCLASS_F) ==
+		 IB_SMI_DIRECT_CLASS;
+	uint8_t *resp;
+
+	if (mod >= MAX_TARGETS)
+		return -EINVAL;
+	if (t->num_order < MAX_TARGETS)
+		t->order[t->num_order++] = mod;
+	if (!dr) {
+		t->lid_sent++;
+		if (t->drop_lid)
+			return 0;
+	}
+	if (t->behaviour[mod] == TARGET_DEAD ||
+	    (t->behaviour[mod] == TARGET_FLAKY && t->sent[mod]++ == 0))
+		return 0;
+
+	if (t->resp_tail - t->resp_head == t->resp_size)
+		return -ENOBUFS;
+	resp = t->resp[t->resp_tail++ % t->resp_size];
+	memcpy(resp, umad, UMAD_LEN);
+	mad = umad_get_mad(resp);
+	mad_set_field(mad, 0, IB_MAD_METHOD_F, IB_MAD_METHOD_GET_RESPONSE);
+	if (dr)
+		mad_set_field(mad, 0, IB_DRSMP_DIRECTION_F, 1);
+	return 0;
+}
+
+static int test_recv(smp_engine_t * engine, void *umad, int *len)
+{
+	test_transport_t *t = engine->transport_data;
+
+	if (t->resp_head == t->resp_tail)
+		return -EAGAIN;
+	memcpy(umad, t->resp[t->resp_head++ % t->resp_size], UMAD_LEN);
+	*len = IB_MAD_SIZE;
+	return 0;
+}
+
+static int test_wait(smp_engine_t * engine, int timeout_ms)
+{
+	test_transport_t *t = engine->transport_data;
+
+	if (t->resp_head != t->resp_tail)
+		return 1;
+	if (timeout_ms > 0)
+		usleep(timeout_ms * 1000);
+	return 0;
+}
+
+static void test_close(smp_engine_t * engine)
+{
+}
+
+static const smp_transport_ops_t test_ops = {
+	test_send,
+	test_recv,
+	test_wait,
+	test_close
+};
+
+/* Loopback transport for the receive path benchmark: every SMP is turned
+ * into its response and written to one end of a socket pair, the engine
+ * polls and reads the other end like it would a umad fd. */
+typedef struct loop_transport {
+	int fd[2];
+	unsigned issued, completed, total;
+} loop_transport_t;
+
+static int loop_send(smp_engine_t * engine, int agent, void *umad, int len,
+		     int timeout_ms)
+{
+	loop_transport_t *l = engine->transport_data;
+	uint8_t *mad = umad_get_mad(umad);
+
+	mad_set_field(mad, 0, IB_MAD_METHOD_F, IB_MAD_METHOD_GET_RESPONSE);
+	mad_set_field(mad, 0, IB_DRSMP_DIRECTION_F, 1);
+	if (write(l->fd[1], umad, UMAD_LEN) != UMAD_LEN)
+		return -errno;
+	return 0;
+}
+
+static int loop_recv(smp_engine_t * engine, void *umad, int *len)
+{
+	loop_transport_t *l = engine->transport_data;
+
+	if (read(l->fd[0], umad, UMAD_LEN) < 0)
+		return -errno;
+	*len = IB_MAD_SIZE;
+	return 0;
+}
+
+static int loop_wait(smp_engine_t * engine, int timeout_ms)
+{
+	loop_transport_t *l = engine->transport_data;
+	struct pollfd pfd = { l->fd[0], POLLIN, 0 };
+
+	return poll(&pfd, 1, timeout_ms);
+}
+
+static void loop_close(smp_engine_t * engine)
+{
+}
+
+static const smp_transport_ops_t loop_ops = {
+	loop_send,
+	loop_recv,
+	loop_wait,
+	loop_close
+};
+
+static int test_cb(smp_engine_t * engine, ibnd_smp_t * smp, uint8_t * mad,
+		   void *cb_data)
+{
+	test_transport_t *t = engine->transport_data;
+
+	t->completed[smp->rpc.attr.mod]++;
+	return 0;
+}
+
+static int test_issue_cb(smp_engine_t * engine, const char *dr, unsigned mod,
+			 smp_comp_cb_t cb)
+{
+	ib_portid_t portid;
+
+	memset(&portid, 0, sizeof(portid));
+	str2drpath(&portid.drpath, (char *)dr, 0, 0);
+	return issue_smp(engine, &portid, IB_ATTR_NODE_INFO, mod, SMP_PRIO_LINK,
+			 cb, NULL);
+}
+
+static int test_issue(smp_engine_t * engine, const char *dr, unsigned mod)
+{
+	return test_issue_cb(engine, dr, mod, test_cb);
+}
+
+/* callbacks see the DR path even when the SMP went LID routed */
+static int lid_cb(smp_engine_t * engine, ibnd_smp_t * smp, uint8_t * mad,
+		  void *cb_data)
+{
+	if (smp->path.lid || smp->path.drpath.cnt != 2) {
+		fprintf(stderr, "LID routed SMP completed with %s\n",
+			portid2str(&smp->path));
+		return -1;
+	}
+	return test_cb(engine, smp, mad, cb_data);
+}
+
+static int test_issue_lid(smp_engine_t * engine, int lid, unsigned mod)
+{
+	ib_portid_t portid;
+
+	memset(&portid, 0, sizeof(portid));
+	str2drpath(&portid.drpath, "0,1,6", 0, 0);
+	return issue_smp_lid(engine, &portid, lid, IB_ATTR_NODE_INFO, mod,
+			     SMP_PRIO_LINK, lid_cb, NULL);
+}
+
+static int loop_cb(smp_engine_t * engine, ibnd_smp_t * smp, uint8_t * mad,
+		   void *cb_data)
+{
+	loop_transport_t *l = engine->transport_data;
+
+	l->completed++;
+	/* keep the window full like a discovery would */
+	if (l->issued < l->total) {
+		l->issued++;
+		return test_issue_cb(engine, "0,1", 0, loop_cb);
+	}
+	return 0;
+}
+
+static int abandon_cb(smp_engine_t * engine, ibnd_smp_t * smp)
+{
+	unsigned *abandoned = engine->user_data;
+
+	(*abandoned)++;
+	return 0;
+}
+
+/* A scan deadline ends process_mads() long before the SMP timeouts would
+ * and everything still outstanding can be handed back. */
+static int deadline_test(struct ibnd_config *cfg, unsigned dead)
+{
+	struct ibnd_config config = *cfg;
+	test_transport_t t;
+	smp_engine_t engine;
+	unsigned abandoned = 0, i;
+	char dr[64];
+	double start;
+	long ms;
+	int rc;
+
+	memset(&t, 0, sizeof(t));
+	t.behaviour[dead] = TARGET_DEAD;
+	config.timeout_ms = 1000;
+	config.deadline_ms = 50;
+	if (smp_engine_init_transport(&engine, &test_ops, &t, &abandoned,
+				      &config)) {
+		fprintf(stderr, "engine init failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < 2 * config.max_smps; i++) {
+		snprintf(dr, sizeof(dr), "0,1,7,%u", i + 1);
+		test_issue(&engine, dr, dead);
+	}
+
+	start = synth_now();
+	rc = process_mads(&engine);
+	ms = (synth_now() - start) * 1000;
+	if (rc != -ETIMEDOUT || ms < 40 || ms >= config.timeout_ms) {
+		fprintf(stderr, "deadline: process_mads returned %d after "
+			"%ld ms\n", rc, ms);
+		rc = 1;
+	} else
+		rc = 0;
+
+	if (smp_engine_abandon(&engine, abandon_cb) ||
+	    abandoned != 2 * config.max_smps || engine.num_on_wire ||
+	    engine.num_queued) {
+		fprintf(stderr, "deadline: %u SMP's abandoned, %u left\n",
+			abandoned, engine.num_on_wire + engine.num_queued);
+		rc = 1;
+	}
+	smp_engine_destroy(&engine);
+	return rc;
+}
+
+/* queue count SMPs spread over targets ok destinations */
+static void issue_many(smp_engine_t * engine, unsigned count, unsigned targets)
+{
+	char dr[64];
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		snprintf(dr, sizeof(dr), "0,1,5,%u", i % targets + 1);
+		test_issue(engine, dr, i % targets);
+	}
+}
+
+/* The adaptive window grows by one for every window of prompt responses,
+ * is halved once for a burst of losses and then grows back. */
+static int window_test(struct ibnd_config *cfg)
+{
+	struct ibnd_config config = *cfg;
+	test_transport_t t;
+	smp_engine_t engine;
+	unsigned grown, cut, i;
+	int rc = 0;
+
+	config.smp_window_mode = IBND_SMP_WINDOW_ADAPTIVE;
+	config.max_smps = 8;
+	config.min_smps = 2;
+	config.max_smps_limit = 64;
+	config.max_smps_per_target = 0;
+	config.retries = 1;
+
+	memset(&t, 0, sizeof(t));
+	t.resp_size = 2 * config.max_smps_limit;
+	if (!(t.resp = calloc(t.resp_size, UMAD_LEN)) ||
+	    smp_engine_init_transport(&engine, &test_ops, &t, NULL, &config)) {
+		fprintf(stderr, "window: engine init failed\n");
+		free(t.resp);
+		return 1;
+	}
+
+	issue_many(&engine, 1000, 32);
+	if (process_mads(&engine) || engine.window <= 16 ||
+	    engine.stats.peak_window != engine.window) {
+		fprintf(stderr, "window: grew from %u to %u (peak %u)\n",
+			config.max_smps, engine.window,
+			engine.stats.peak_window);
+		rc = 1;
+	}
+	grown = engine.window;
+
+	/* fewer losses than the window; all were on the wire together */
+	for (i = 0; i < 16; i++)
+		t.behaviour[i] = TARGET_FLAKY;
+	issue_many(&engine, 16, 16);
+	if (process_mads(&engine))
+		rc = 1;
+	cut = engine.window;
+	if (engine.stats.timeouts != 16 || cut != grown / 2) {
+		fprintf(stderr, "window: %u after %u losses, was %u\n",
+			cut, engine.stats.timeouts, grown);
+		rc = 1;
+	}
+
+	for (i = 0; i < 16; i++)
+		t.behaviour[i] = TARGET_OK;
+	issue_many(&engine, 1000, 32);
+	if (process_mads(&engine) || engine.window <= cut) {
+		fprintf(stderr, "window: %u after the losses, was %u\n",
+			engine.window, cut);
+		rc = 1;
+	}
+
+	smp_engine_destroy(&engine);
+	free(t.resp);
+	return rc;
+}
+
+/* While several destinations have SMPs queued, none is sent to a second
+ * time before each of the others has had its turn. */
+static int check_round_robin(test_transport_t * t, unsigned targets)
+{
+	unsigned last[MAX_TARGETS], later[MAX_TARGETS];
+	unsigned i, x, y;
+
+	memset(later, 0, sizeof(later));
+	for (i = 0; i < t->num_order; i++)
+		later[t->order[i]]++;
+	for (x = 0; x < targets; x++)
+		last[x] = t->num_order;
+
+	for (i = 0; i < t->num_order; i++) {
+		x = t->order[i];
+		later[x]--;
+		for (y = 0; y < targets && last[x] < i; y++)
+			if (y != x && later[y] &&
+			    memchr(&t->order[last[x] + 1], y,
+				   i - last[x] - 1) == NULL) {
+				fprintf(stderr, "fairness: send %u went to %u "
+					"again before %u\n", i, x, y);
+				return 1;
+			}
+		last[x] = i;
+	}
+	return 0;
+}
+
+/* One destination with a deep queue does not hold up the others, with
+ * one SMP on the wire at a time and with several. */
+static int fairness_test(struct ibnd_config *cfg, unsigned window)
+{
+	static const unsigned queued[] = { 40, 8, 8, 3 };
+	unsigned targets = sizeof(queued) / sizeof(queued[0]);
+	struct ibnd_config config = *cfg;
+	test_transport_t t;
+	smp_engine_t engine;
+	unsigned i, j;
+	char dr[64];
+	int rc = 0;
+
+	config.max_smps = window;
+	config.max_smps_per_target = 1;
+
+	memset(&t, 0, sizeof(t));
+	t.resp_size = 2 * window;
+	if (!(t.resp = calloc(t.resp_size, UMAD_LEN)) ||
+	    smp_engine_init_transport(&engine, &test_ops, &t, NULL, &config)) {
+		fprintf(stderr, "fairness: engine init failed\n");
+		free(t.resp);
+		return 1;
+	}
+
+	/* all of the deep queue first, as a switch with many ports is */
+	for (i = 0; i < targets; i++)
+		for (j = 0; j < queued[i]; j++) {
+			snprintf(dr, sizeof(dr), "0,1,6,%u", i + 1);
+			test_issue(&engine, dr, i);
+		}
+	if (process_mads(&engine))
+		rc = 1;
+	for (i = 0; i < targets; i++)
+		if (t.completed[i] != queued[i]) {
+			fprintf(stderr, "fairness: target %u completed %d of "
+				"%u\n", i, t.completed[i], queued[i]);
+			rc = 1;
+		}
+	if (check_round_robin(&t, targets))
+		rc = 1;
+
+	smp_engine_destroy(&engine);
+	free(t.resp);
+	return rc;
+}
+
+/* A destination over its MAD rate limit is passed over for the others
+ * rather than holding up the engine, and gets its SMPs out at the rate. */
+static int rate_test(struct ibnd_config *cfg)
+{
+	struct ibnd_config config = *cfg;
+	test_transport_t t;
+	smp_engine_t engine;
+	ib_portid_t held;
+	unsigned i, first_held, wait_us, rate = 1000, queued = 20;
+	double start, ms;
+	int rc = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.resp_size = 2 * config.max_smps;
+	if (!(t.resp = calloc(t.resp_size, UMAD_LEN)) ||
+	    smp_engine_init_transport(&engine, &test_ops, &t, NULL, &config)) {
+		fprintf(stderr, "rate: engine init failed\n");
+		free(t.resp);
+		return 1;
+	}
+
+	/* someone else used up what destination 0 had */
+	madrpc_set_rate_limit(0, rate);
+	memset(&held, 0, sizeof(held));
+	str2drpath(&held.drpath, "0,1,6,1", 0, 0);
+	while (!mad_rate_limit_take(&held, &wait_us))
+		;
+
+	for (i = 0; i < queued; i++)
+		test_issue(&engine, "0,1,6,1", 0);
+	for (i = 0; i < 5; i++)
+		test_issue(&engine, "0,1,6,2", 1);
+	start = synth_now();
+	if (process_mads(&engine))
+		rc = 1;
+	ms = (synth_now() - start) * 1e3;
+	madrpc_set_rate_limit(0, 0);
+
+	for (first_held = 0; first_held < t.num_order &&
+	     t.order[first_held]; first_held++)
+		;
+	if (t.completed[0] != queued || t.completed[1] != 5 ||
+	    first_held != 5 || !engine.stats.rate_holds ||
+	    ms < 0.8 * queued * 1000 / rate) {
+		fprintf(stderr, "rate: %d and %d completed, destination 0 "
+			"first sent to %u, %u holds in %.1f ms\n",
+			t.completed[0], t.completed[1], first_held,
+			engine.stats.rate_holds, ms);
+		rc = 1;
+	}
+
+	smp_engine_destroy(&engine);
+	free(t.resp);
+	return rc;
+}
+
+static int benchmark(unsigned total, unsigned window)
+{
+	struct ibnd_config config = { 0 };
+	loop_transport_t l;
+	smp_engine_t engine;
+	double secs;
+	int flags, rc;
+
+	memset(&l, 0, sizeof(l));
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, l.fd)) {
+		perror("socketpair");
+		return -1;
+	}
+	flags = fcntl(l.fd[0], F_GETFL);
+	fcntl(l.fd[0], F_SETFL, flags | O_NONBLOCK);
+
+	config.max_smps = window;
+	config.timeout_ms = 1000;
+	config.retries = 1;
+	if (smp_engine_init_transport(&engine, &loop_ops, &l, NULL, &config)) {
+		fprintf(stderr, "engine init failed\n");
+		return -1;
+	}
+
+	l.total = total;
+	secs = synth_now();
+	for (l.issued = 0; l.issued < window && l.issued < total; l.issued++)
+		test_issue_cb(&engine, "0,1", 0, loop_cb);
+	rc = process_mads(&engine);
+	secs = synth_now() - secs;
+	printf("window %3u: %u MADs in %.3fs, %.0f MADs/sec, "
+	       "%u waits, peak batch %u\n", window, l.completed, secs,
+	       l.completed / secs, engine.stats.rx_wakeups,
+	       engine.stats.peak_rx_batch);
+
+	smp_engine_destroy(&engine);
+	close(l.fd[0]);
+	close(l.fd[1]);
+	return rc || l.completed != total ? -1 : 0;
+}
+
+static void setup_build_smp(ibnd_smp_t * smp, unsigned i)
+{
+	static const unsigned attrs[] = { IB_ATTR_NODE_INFO, IB_ATTR_PORT_INFO,
+		IB_ATTR_NODE_DESC, IB_ATTR_SWITCH_INFO
+	};
+	char dr[64];
+
+	memset(smp, 0, sizeof(*smp));
+	smp->rpc.method = IB_MAD_METHOD_GET;
+	smp->rpc.attr.id = attrs[i % 4];
+	smp->rpc.attr.mod = i % 37;
+	smp->rpc.datasz = IB_SMP_DATA_SIZE;
+	smp->rpc.dataoffs = IB_SMP_DATA_OFFS;
+	smp->rpc.mkey = 0x1234;
+	smp->rpc.trid = i + 1;
+	if (i & 1) {
+		smp->rpc.mgtclass = IB_SMI_CLASS;
+		smp->path.lid = i % 0xbfff + 1;
+	} else {
+		smp->rpc.mgtclass = IB_SMI_DIRECT_CLASS;
+		snprintf(dr, sizeof(dr), "0,1,%u,%u", i % 36 + 1, i % 7 + 1);
+		str2drpath(&smp->path.drpath, dr, 0, 0);
+	}
+}
+
+/* Check the engine's template based SMP encoding against mad_build_pkt()
+ * on a zeroed buffer, then time both. */
+static int build_benchmark(unsigned count)
+{
+	struct ibnd_config config = { 0 };
+	smp_engine_t engine;
+	ibnd_smp_t smps[256], *smp;
+	uint8_t ref[1024], umad[SMP_RX_BUF_SIZE];
+	double t, build_ns, tmpl_ns;
+	unsigned i;
+	int rc = 0;
+
+	config.max_smps = 4;
+	config.timeout_ms = 20;
+	config.retries = 1;
+	if (smp_engine_init_transport(&engine, &test_ops, NULL, NULL,
+				      &config)) {
+		fprintf(stderr, "engine init failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < 256; i++) {
+		smp = &smps[i];
+		setup_build_smp(smp, i);
+		memset(ref, 0, sizeof(ref));
+		mad_build_pkt(ref, &smp->rpc, &smp->path, NULL, NULL);
+		if (smp_build_umad(&engine, smp, umad) ||
+		    memcmp(ref, umad, SMP_RX_BUF_SIZE)) {
+			fprintf(stderr, "SMP %u (attr 0x%x) encodes differently\n",
+				i, smp->rpc.attr.id);
+			rc = -1;
+		}
+	}
+
+	t = synth_now();
+	for (i = 0; i < count; i++) {
+		smp = &smps[i & 255];
+		memset(ref, 0, SMP_RX_BUF_SIZE);
+		mad_build_pkt(ref, &smp->rpc, &smp->path, NULL, NULL);
+	}
+	build_ns = (synth_now() - t) * 1e9 / count;
+
+	t = synth_now();
+	for (i = 0; i < count; i++)
+		smp_build_umad(&engine, &smps[i & 255], umad);
+	tmpl_ns = (synth_now() - t) * 1e9 / count;
+
+	printf("memset + mad_build_pkt: %.1f ns/SMP, template: %.1f ns/SMP\n",
+	       build_ns, tmpl_ns);
+	smp_engine_destroy(&engine);
+	return rc;
+}
+
+/* Simulated fabric for the priority benchmark: a tree of switches, each
+ * with SIM_SWITCHES child switches down to sim_depth hops and SIM_CAS CAs.
+ * An SMP is answered after SIM_BASE_US plus SIM_HOP_US for every hop of
+ * its DR path.  The callbacks issue what a discovery would: NodeDesc,
+ * SwitchInfo and port 0 PortInfo for a new switch, then the PortInfo of
+ * every port, and NodeInfo for every PortInfo of a down link.  CAs get
+ * NodeDesc and PortInfo. */
+#define SIM_SWITCHES 1
+#define SIM_CAS 30
+#define SIM_BASE_US 100
+#define SIM_HOP_US 100
+
+typedef struct sim_resp {
+	uint64_t due_us;
+	uint8_t umad[UMAD_LEN];
+} sim_resp_t;
+
+typedef struct sim_transport {
+	unsigned depth;
+	int fifo;		/* issue everything in one priority class */
+	unsigned completed;
+	uint64_t switches_us;	/* when the last switch was found */
+	sim_resp_t *resp;
+	unsigned num_resp, resp_size;
+} sim_transport_t;
+
+static uint64_t sim_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int sim_send(smp_engine_t * engine, int agent, void *umad, int len,
+		    int timeout_ms)
+{
+	sim_transport_t *sim = engine->transport_data;
+	unsigned hops;
+	sim_resp_t *r;
+	uint8_t *mad;
+
+	if (sim->num_resp == sim->resp_size)
+		return -ENOBUFS;
+	r = &sim->resp[sim->num_resp++];
+	memcpy(r->umad, umad, UMAD_LEN);
+	mad = umad_get_mad(r->umad);
+	hops = mad_get_field(mad, 0, IB_DRSMP_HOPCNT_F);
+	r->due_us = sim_now_us() + SIM_BASE_US + hops * SIM_HOP_US;
+	mad_set_field(mad, 0, IB_MAD_METHOD_F, IB_MAD_METHOD_GET_RESPONSE);
+	mad_set_field(mad, 0, IB_DRSMP_DIRECTION_F, 1);
+	return 0;
+}
+
+/* the response due first, or NULL if there is none */
+static sim_resp_t *sim_next(sim_transport_t * sim)
+{
+	sim_resp_t *next = NULL;
+	unsigned i;
+
+	for (i = 0; i < sim->num_resp; i++)
+		if (!next || sim->resp[i].due_us < next->due_us)
+			next = &sim->resp[i];
+	return next;
+}
+
+static int sim_recv(smp_engine_t * engine, void *umad, int *len)
+{
+	sim_transport_t *sim = engine->transport_data;
+	sim_resp_t *r = sim_next(sim);
+
+	if (!r || r->due_us > sim_now_us())
+		return -EAGAIN;
+	memcpy(umad, r->umad, UMAD_LEN);
+	*r = sim->resp[--sim->num_resp];
+	*len = IB_MAD_SIZE;
+	return 0;
+}
+
+static int sim_wait(smp_engine_t * engine, int timeout_ms)
+{
+	sim_transport_t *sim = engine->transport_data;
+	sim_resp_t *r = sim_next(sim);
+	uint64_t now = sim_now_us(), wait_us;
+
+	wait_us = timeout_ms < 0 ? UINT64_MAX : timeout_ms * 1000ULL;
+	if (r && r->due_us <= now)
+		return 1;
+	if (r && r->due_us - now < wait_us) {
+		usleep(r->due_us - now);
+		return 1;
+	}
+	if (timeout_ms > 0)
+		usleep(wait_us);
+	return 0;
+}
+
+static const smp_transport_ops_t sim_ops = {
+	sim_send,
+	sim_recv,
+	sim_wait,
+	test_close
+};
+
+static int sim_issue(smp_engine_t * engine, ib_portid_t * portid,
+		     unsigned attrid, unsigned mod, unsigned prio);
+
+static int sim_cb(smp_engine_t * engine, ibnd_smp_t * smp, uint8_t * mad,
+		  void *cb_data)
+{
+	sim_transport_t *sim = engine->transport_data;
+	ib_portid_t portid = smp->path;
+	unsigned hops = smp->path.drpath.cnt, mod = smp->rpc.attr.mod, p;
+	int is_ca = hops && smp->path.drpath.p[hops] > SIM_SWITCHES;
+	int rc = 0;
+
+	sim->completed++;
+	switch (smp->rpc.attr.id) {
+	case IB_ATTR_NODE_INFO:
+		if (!is_ca)
+			sim->switches_us = sim_now_us();
+		rc = sim_issue(engine, &portid, IB_ATTR_NODE_DESC, 0,
+			       SMP_PRIO_ATTR);
+		if (!rc && !is_ca)
+			rc = sim_issue(engine, &portid, IB_ATTR_SWITCH_INFO, 0,
+				       SMP_PRIO_ATTR);
+		if (!rc)
+			rc = sim_issue(engine, &portid, IB_ATTR_PORT_INFO,
+				       is_ca, is_ca ? SMP_PRIO_ATTR :
+				       SMP_PRIO_PORT);
+		break;
+	case IB_ATTR_PORT_INFO:
+		if (is_ca)
+			break;
+		if (!mod) {
+			for (p = 1; p <= SIM_SWITCHES + SIM_CAS + 1 && !rc; p++)
+				rc = sim_issue(engine, &portid,
+					       IB_ATTR_PORT_INFO, p,
+					       SMP_PRIO_PORT);
+			break;
+		}
+		if (mod > SIM_SWITCHES + SIM_CAS ||
+		    (mod <= SIM_SWITCHES && hops == sim->depth))
+			break;
+		portid.drpath.p[++portid.drpath.cnt] = mod;
+		rc = sim_issue(engine, &portid, IB_ATTR_NODE_INFO, 0,
+			       SMP_PRIO_LINK);
+		break;
+	}
+	return rc;
+}
+
+static int sim_issue(smp_engine_t * engine, ib_portid_t * portid,
+		     unsigned attrid, unsigned mod, unsigned prio)
+{
+	sim_transport_t *sim = engine->transport_data;
+
+	return issue_smp(engine, portid, attrid, mod,
+			 sim->fifo ? SMP_PRIO_LINK : prio, sim_cb, NULL);
+}
+
+/* Discover the simulated fabric; returns the time taken in seconds or a
+ * negative value if it did not complete.  The time until every switch
+ * was found goes to *switches. */
+static double sim_discover(unsigned depth, unsigned window, int fifo,
+			   unsigned *mads, double *switches)
+{
+	struct ibnd_config config = { 0 };
+	sim_transport_t sim;
+	smp_engine_t engine;
+	ib_portid_t portid;
+	uint64_t start;
+	double secs;
+	int rc;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.depth = depth;
+	sim.fifo = fifo;
+	sim.resp_size = window;
+	if (!(sim.resp = calloc(sim.resp_size, sizeof(*sim.resp))))
+		return -1;
+
+	config.max_smps = window;
+	config.timeout_ms = 1000;
+	config.retries = 1;
+	if (smp_engine_init_transport(&engine, &sim_ops, &sim, NULL, &config)) {
+		fprintf(stderr, "engine init failed\n");
+		free(sim.resp);
+		return -1;
+	}
+
+	memset(&portid, 0, sizeof(portid));
+	start = sim_now_us();
+	rc = sim_issue(&engine, &portid, IB_ATTR_NODE_INFO, 0, SMP_PRIO_LINK);
+	if (!rc)
+		rc = process_mads(&engine);
+	secs = (sim_now_us() - start) / 1e6;
+	*switches = (sim.switches_us - start) / 1e6;
+
+	smp_engine_destroy(&engine);
+	free(sim.resp);
+	*mads = sim.completed;
+	return rc ? -1 : secs;
+}
+
+/* Every switch costs NodeInfo, NodeDesc, SwitchInfo and the PortInfo of
+ * all its ports and port 0, every CA NodeInfo, NodeDesc and PortInfo. */
+static int prio_benchmark(unsigned depth)
+{
+	static const unsigned windows[] = { 8, 16, 32, 48, 64 };
+	unsigned switches = 0, level = 1, expect, mads[2], i, h;
+	double secs[2], found[2];
+	int rc = 0;
+
+	for (h = 0; h <= depth; h++) {
+		switches += level;
+		level *= SIM_SWITCHES;
+	}
+	expect = switches * (SIM_SWITCHES + SIM_CAS + 5) +
+		 switches * SIM_CAS * 3;
+
+	for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+		secs[0] = sim_discover(depth, windows[i], 1, &mads[0],
+				       &found[0]);
+		secs[1] = sim_discover(depth, windows[i], 0, &mads[1],
+				       &found[1]);
+		if (secs[0] < 0 || secs[1] < 0 || mads[0] != expect ||
+		    mads[1] != expect) {
+			fprintf(stderr, "window %u: %u/%u of %u MADs "
+				"completed\n", windows[i], mads[0], mads[1],
+				expect);
+			rc = -1;
+			continue;
+		}
+		printf("window %2u: %u MADs, fifo %.3fs (switches %.3fs), "
+		       "priority %.3fs (switches %.3fs), %.2fx\n", windows[i],
+		       expect, secs[0], found[0], secs[1], found[1],
+		       secs[0] / secs[1]);
+	}
+	return rc;
+}
+
+/* The discovery entry points against a simulated fabric of about this
+ * many ports, see synth_sim_open() */
+#define SIM_FABRIC_PORTS 200
+
+/* NodeInfo and PortInfo tell which port they were read through */
+static int same_info(uint8_t * a, uint8_t * b, int local_port_field)
+{
+	uint8_t ca[IB_SMP_DATA_SIZE], cb[IB_SMP_DATA_SIZE];
+
+	memcpy(ca, a, sizeof(ca));
+	memcpy(cb, b, sizeof(cb));
+	mad_set_field(ca, 0, local_port_field, 0);
+	mad_set_field(cb, 0, local_port_field, 0);
+	return !memcmp(ca, cb, sizeof(ca));
+}
+
+static int same_port(ibnd_port_t * a, ibnd_port_t * b)
+{
+	if (!a || !b)
+		return a == b;
+	if (a->guid != b->guid || a->base_lid != b->base_lid ||
+	    a->lmc != b->lmc ||
+	    !same_info(a->info, b->info, IB_PORT_LOCAL_PORT_F))
+		return 0;
+	if (!a->remoteport || !b->remoteport)
+		return a->remoteport == b->remoteport;
+	return a->remoteport->node->guid == b->remoteport->node->guid &&
+	       a->remoteport->portnum == b->remoteport->portnum;
+}
+
+static int same_node(ibnd_node_t * a, ibnd_node_t * b)
+{
+	int p;
+
+	if (!b || a->type != b->type || a->numports != b->numports ||
+	    a->smalid != b->smalid ||
+	    memcmp(a->nodedesc, b->nodedesc, sizeof(a->nodedesc)) ||
+	    memcmp(a->switchinfo, b->switchinfo, sizeof(a->switchinfo)) ||
+	    !same_info(a->info, b->info, IB_NODE_LOCAL_PORT_F))
+		return 0;
+	for (p = 0; p <= a->numports; p++)
+		if (!same_port(a->ports[p], b->ports[p]))
+			return 0;
+	return 1;
+}
+
+static unsigned count_nodes(ibnd_fabric_t * fabric)
+{
+	ibnd_node_t *node;
+	unsigned n = 0;
+
+	for (node = fabric->nodes; node; node = node->next)
+		n++;
+	return n;
+}
+
+/* a and b hold the same nodes, ports and links; DR paths may differ */
+static int same_fabric(ibnd_fabric_t * a, ibnd_fabric_t * b, const char *what)
+{
+	ibnd_node_t *node;
+	unsigned diffs = 0;
+
+	for (node = a->nodes; node; node = node->next)
+		if (!same_node(node, ibnd_find_node_guid(b, node->guid)) &&
+		    diffs++ < 5)
+			fprintf(stderr, "%s: node 0x%" PRIx64 " differs\n",
+				what, node->guid);
+	if (count_nodes(a) != count_nodes(b)) {
+		fprintf(stderr, "%s: %u nodes, expected %u\n", what,
+			count_nodes(b), count_nodes(a));
+		diffs++;
+	}
+	if (!a->from_node || !b->from_node ||
+	    a->from_node->guid != b->from_node->guid ||
+	    a->from_portnum != b->from_portnum) {
+		fprintf(stderr, "%s: discovered from another port\n", what);
+		diffs++;
+	}
+	return diffs ? 1 : 0;
+}
+
+/* every node is where its DR path from the first local port leads */
+static int check_paths(synth_sim_t * sim, ibnd_fabric_t * fabric,
+		       const char *what)
+{
+	ibnd_node_t *node, *found;
+
+	for (node = fabric->nodes; node; node = node->next) {
+		found = synth_sim_route(sim, 0, &node->path_portid.drpath);
+		if (node->path_portid.lid || !found ||
+		    found->guid != node->guid) {
+			fprintf(stderr, "%s: DR path %s of 0x%" PRIx64
+				" leads to 0x%" PRIx64 "\n", what,
+				portid2str(&node->path_portid), node->guid,
+				found ? found->guid : 0);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* A fabric built from SA records is the one a DR sweep finds */
+static int sa_test(synth_sim_t * sim, struct ibnd_config *cfg)
+{
+	ibnd_fabric_t *dr, *sa;
+	int rc = 1;
+
+	dr = ibnd_discover_fabric(NULL, 0, NULL, cfg);
+	sa = ibnd_discover_fabric_sa(NULL, 0, cfg);
+	if (!dr || !sa)
+		fprintf(stderr, "sa: discovery failed\n");
+	else if (count_nodes(dr) != count_nodes(sim->model))
+		fprintf(stderr, "sa: DR sweep found %u of %u nodes\n",
+			count_nodes(dr), count_nodes(sim->model));
+	else
+		rc = same_fabric(dr, sa, "sa") | check_paths(sim, dr, "dr") |
+		     check_paths(sim, sa, "sa");
+	ibnd_destroy_fabric(dr);
+	ibnd_destroy_fabric(sa);
+	return rc;
+}
+
+/* DR paths are shortest paths, whichever port found the node first */
+static int same_hops(ibnd_fabric_t * a, ibnd_fabric_t * b, const char *what)
+{
+	ibnd_node_t *node, *other;
+
+	for (node = a->nodes; node; node = node->next) {
+		other = ibnd_find_node_guid(b, node->guid);
+		if (other &&
+		    other->path_portid.drpath.cnt != node->path_portid.drpath.cnt) {
+			fprintf(stderr, "%s: 0x%" PRIx64 " is %d hops away, "
+				"expected %d\n", what, node->guid,
+				other->path_portid.drpath.cnt,
+				node->path_portid.drpath.cnt);
+			return 1;
+		}
+	}
+	return a->maxhops_discovered != b->maxhops_discovered;
+}
+
+/* Scanning from two ports of the fabric finds what one port does */
+static int ports_test(synth_sim_t * sim, struct ibnd_config *cfg)
+{
+	ibnd_local_port_t ports[] = { {"sim0", 1}, {"sim1", 1} };
+	ibnd_fabric_t *single, *merged;
+	ibnd_node_t *node, *far = NULL;
+	int rc = 1;
+
+	/* the second port is on another CA of the fabric */
+	for (node = sim->model->nodes; node; node = node->next)
+		if (node->type == IB_NODE_CA && node != sim->model->from_node)
+			far = node;
+	if (!far || synth_sim_add_port(sim, ports[1].ca_name,
+				       far->ports[1]) < 0) {
+		fprintf(stderr, "ports: no second local port\n");
+		return 1;
+	}
+
+	single = ibnd_discover_fabric(ports[0].ca_name, ports[0].ca_port,
+				      NULL, cfg);
+	merged = ibnd_discover_fabric_ports(ports, 2, cfg);
+	if (!single || !merged)
+		fprintf(stderr, "ports: discovery failed\n");
+	else
+		rc = same_fabric(single, merged, "ports") |
+		     check_paths(sim, merged, "ports") |
+		     same_hops(single, merged, "ports");
+	ibnd_destroy_fabric(single);
+	ibnd_destroy_fabric(merged);
+	return rc;
+}
+
+/* Bring fabric up to date with the simulated one and check that it then
+ * is what a new discovery finds, with refetched set on expect nodes and
+ * fewer SMPs spent than on the discovery */
+static int check_rediscover(synth_sim_t * sim, struct ibnd_config *cfg,
+			    ibnd_fabric_t * fabric, const char *what,
+			    unsigned expect)
+{
+	ibnd_fabric_t *fresh;
+	ibnd_node_t *node;
+	unsigned smps = sim->smps, refetched = 0;
+	int rc;
+
+	if ((rc = ibnd_rediscover_fabric(fabric, "sim0", 1, cfg))) {
+		fprintf(stderr, "%s: rediscovery failed: %s\n", what,
+			strerror(-rc));
+		return 1;
+	}
+	smps = sim->smps - smps;
+	for (node = fabric->nodes; node; node = node->next)
+		refetched += node->refetched;
+	if (!(fresh = ibnd_discover_fabric("sim0", 1, NULL, cfg))) {
+		fprintf(stderr, "%s: discovery failed\n", what);
+		return 1;
+	}
+	rc = same_fabric(fresh, fabric, what) | check_paths(sim, fabric, what);
+	if (refetched != expect) {
+		fprintf(stderr, "%s: %u nodes refetched, expected %u\n", what,
+			refetched, expect);
+		rc = 1;
+	}
+	if (smps >= sim->smps - smps) {
+		fprintf(stderr, "%s: %u SMPs, a discovery takes %u\n", what,
+			smps, sim->smps - smps);
+		rc = 1;
+	}
+	ibnd_destroy_fabric(fresh);
+	return rc;
+}
+
+static void set_guids(ibnd_node_t * node, uint64_t guid)
+{
+	node->guid = guid;
+	node->ports[1]->guid = guid + 1;
+	mad_set_field64(node->info, 0, IB_NODE_GUID_F, guid);
+	mad_set_field64(node->info, 0, IB_NODE_PORT_GUID_F, guid + 1);
+}
+
+/* Rediscover the simulated fabric as it stays the same, as a CA link goes
+ * down and as a CA is replaced by one which is given the same LID */
+static int rediscover_test(synth_sim_t * sim, struct ibnd_config *cfg)
+{
+	ibnd_node_t *node, *down = NULL, *swapped = NULL;
+	ibnd_port_t *down_port = NULL;
+	ibnd_fabric_t *fabric;
+	uint64_t guid = 0;
+	int rc = 1;
+
+	for (node = sim->model->nodes; node; node = node->next)
+		if (node->type == IB_NODE_CA && node != sim->model->from_node &&
+		    node->ports[1] != sim->local[1].port) {
+			swapped = down;
+			down = node;
+		}
+	if (!swapped) {
+		fprintf(stderr, "rediscover: too few CAs\n");
+		return 1;
+	}
+
+	if (!(fabric = ibnd_discover_fabric("sim0", 1, NULL, cfg))) {
+		fprintf(stderr, "rediscover: discovery failed\n");
+		return 1;
+	}
+	if (check_rediscover(sim, cfg, fabric, "unchanged", 0))
+		goto out;
+
+	down_port = down->ports[1]->remoteport;
+	down_port->remoteport = NULL;
+	down->ports[1]->remoteport = NULL;
+	if (check_rediscover(sim, cfg, fabric, "link down", 0))
+		goto out;
+
+	guid = swapped->guid;
+	set_guids(swapped, guid ^ (1ULL << 40));
+	rc = check_rediscover(sim, cfg, fabric, "swapped", 1) ||
+	     ibnd_find_node_guid(fabric, guid) != NULL;
+out:
+	if (guid)
+		set_guids(swapped, guid);
+	if (down_port)
+		down_port->remoteport = down->ports[1];
+	if (down_port)
+		down->ports[1]->remoteport = down_port;
+	ibnd_destroy_fabric(fabric);
+	return rc;
+}
+
+/* A cache does not keep DR paths, so attributes fetched into a fabric
+ * loaded from one must still reach the right nodes */
+static int fetch_test(synth_sim_t * sim, struct ibnd_config *cfg)
+{
+	struct ibnd_config topo = *cfg;
+	ibnd_fabric_t *full = NULL, *loaded = NULL;
+	char cache_file[64];
+	int fd, rc = 1;
+
+	topo.flags |= IBND_CONFIG_TOPOLOGY_ONLY;
+	snprintf(cache_file, sizeof(cache_file), "/tmp/testengine.XXXXXX");
+	if ((fd = mkstemp(cache_file)) < 0) {
+		perror(cache_file);
+		return 1;
+	}
+	close(fd);
+
+	if (!(full = ibnd_discover_fabric("sim0", 1, NULL, &topo)) ||
+	    ibnd_cache_fabric(full, cache_file,
+			      IBND_CACHE_FABRIC_FLAG_DEFAULT) < 0 ||
+	    !(loaded = ibnd_load_fabric(cache_file, 0))) {
+		fprintf(stderr, "fetch: caching the fabric failed\n");
+		goto out;
+	}
+	ibnd_destroy_fabric(full);
+	if (!(full = ibnd_discover_fabric("sim0", 1, NULL, cfg)))
+		fprintf(stderr, "fetch: discovery failed\n");
+	else if ((rc = ibnd_node_fetch_attrs(loaded, NULL,
+					     IBND_FETCH_NODE_DESC |
+					     IBND_FETCH_SWITCH_INFO,
+					     "sim0", 1, cfg)) != 0)
+		fprintf(stderr, "fetch: %s\n", strerror(-rc));
+	else
+		rc = same_fabric(full, loaded, "fetch") |
+		     check_paths(sim, loaded, "fetch");
+out:
+	ibnd_destroy_fabric(full);
+	ibnd_destroy_fabric(loaded);
+	unlink(cache_file);
+	return rc ? 1 : 0;
+}
+
+static int sim_tests(void)
+{
+	struct ibnd_config config = { 0 };
+	ibnd_fabric_t *model;
+	synth_sim_t *sim;
+	unsigned nports;
+	int rc = 0;
+
+	config.max_smps = 8;
+	config.timeout_ms = 100;
+	config.retries = 1;
+	if (!(model = synth_build(SIM_FABRIC_PORTS, 0, NULL, &nports)) ||
+	    !(sim = synth_sim_open(model))) {
+		fprintf(stderr, "failed to build the simulated fabric\n");
+		ibnd_destroy_fabric(model);
+		return 1;
+	}
+
+	if (sa_test(sim, &config) || ports_test(sim, &config) ||
+	    fetch_test(sim, &config) || rediscover_test(sim, &config))
+		rc = 1;
+
+	printf("simulated fabric of %u ports: %u SMPs answered\n", nports,
+	       sim->smps);
+	synth_sim_close(sim);
+	ibnd_destroy_fabric(model);
+	return rc;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-h -n <targets> -t <timeout_ms> -r <retries> "
+		"-b <mads> -p <smps> -f <depth>]\n"
+		"   Exercise SMP engine timeouts, retries, dead targets and LID\n"
+		"   routed SMPs falling back to DR\n"
+		"   -h This help message\n"
+		"   -n <targets> number of responding destinations (default 32)\n"
+		"   -t <timeout_ms> timeout for a single attempt (default 20)\n"
+		"   -r <retries> retries per SMP (default 2)\n"
+		"   -b <mads> benchmark the receive path over a loopback socket\n"
+		"   -p <smps> check and benchmark SMP packet building\n"
+		"   -f <depth> compare FIFO and priority ordered discovery\n"
+		"      of a simulated fabric <depth> hops deep\n"
+		"   --debug print debug messages\n", argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	struct ibnd_config config = { 0 };
+	test_transport_t t;
+	smp_engine_t engine;
+	unsigned n_ok = 32, flaky, dead, i, bench = 0, build = 0, depth = 0;
+	char dr[64];
+	int rc = 0;
+
+	static char const str_opts[] = "n:t:r:b:p:f:h";
+	static const struct option long_opts[] = {
+		{"targets", 1, NULL, 'n'},
+		{"timeout", 1, NULL, 't'},
+		{"retries", 1, NULL, 'r'},
+		{"benchmark", 1, NULL, 'b'},
+		{"build", 1, NULL, 'p'},
+		{"fabric", 1, NULL, 'f'},
+		{"help", 0, NULL, 'h'},
+		{"debug", 0, NULL, 2},
+		{}
+	};
+
+	argv0 = argv[0];
+	config.max_smps = 4;
+	config.max_smps_per_target = 1;
+	config.timeout_ms = 20;
+	config.retries = 2;
+
+	while (1) {
+		int ch = getopt_long(argc, argv, str_opts, long_opts, NULL);
+		if (ch == -1)
+			break;
+		switch (ch) {
+		case 2:
+			ibdebug++;
+			break;
+		case 'n':
+			n_ok = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			config.timeout_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			config.retries = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bench = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			build = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (n_ok + 2 > MAX_TARGETS || !config.timeout_ms || !config.retries)
+		usage();
+
+	if (build) {
+		rc = build_benchmark(build) ? 1 : 0;
+		printf("%s\n", rc ? "FAILED" : "PASSED");
+		exit(rc);
+	}
+
+	if (depth) {
+		rc = prio_benchmark(depth) ? 1 : 0;
+		printf("%s\n", rc ? "FAILED" : "PASSED");
+		exit(rc);
+	}
+
+	if (bench) {
+		static const unsigned windows[] = { 1, 4, 16, 64 };
+
+		for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++)
+			if (benchmark(bench, windows[i]))
+				rc = 1;
+		printf("%s\n", rc ? "FAILED" : "PASSED");
+		exit(rc);
+	}
+
+	memset(&t, 0, sizeof(t));
+	t.resp_size = 2 * config.max_smps;
+	if (!(t.resp = calloc(t.resp_size, UMAD_LEN))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	flaky = n_ok;
+	dead = n_ok + 1;
+	t.behaviour[flaky] = TARGET_FLAKY;
+	t.behaviour[dead] = TARGET_DEAD;
+
+	if (smp_engine_init_transport(&engine, &test_ops, &t, NULL, &config)) {
+		fprintf(stderr, "engine init failed\n");
+		exit(1);
+	}
+
+	/* several SMPs to the dead target; only the first reaches the wire */
+	for (i = 0; i < 3; i++)
+		test_issue(&engine, "0,1,2", dead);
+	test_issue(&engine, "0,1,3", flaky);
+	for (i = 0; i < n_ok; i++) {
+		snprintf(dr, sizeof(dr), "0,1,4,%u", i + 1);
+		test_issue(&engine, dr, i);
+	}
+
+	if (process_mads(&engine)) {
+		fprintf(stderr, "process_mads failed\n");
+		rc = 1;
+	}
+
+	for (i = 0; i < n_ok; i++)
+		if (t.completed[i] != 1) {
+			fprintf(stderr, "target %u completed %d times\n", i,
+				t.completed[i]);
+			rc = 1;
+		}
+	if (t.completed[flaky] != 1 || t.sent[flaky] != 2) {
+		fprintf(stderr, "flaky target: %d sent, %d completed\n",
+			t.sent[flaky], t.completed[flaky]);
+		rc = 1;
+	}
+	if (t.completed[dead] || engine.stats.dead_targets != 1 ||
+	    engine.stats.fast_failed != 2 ||
+	    engine.stats.retries != config.retries + 1) {
+		fprintf(stderr, "dead target: %u dead, %u fast failed, "
+			"%u retries\n", engine.stats.dead_targets,
+			engine.stats.fast_failed, engine.stats.retries);
+		rc = 1;
+	}
+
+	/* anything behind the dead target fails without being sent */
+	if (test_issue(&engine, "0,1,2,5", 0) != -EHOSTUNREACH) {
+		fprintf(stderr, "SMP behind dead target was queued\n");
+		rc = 1;
+	}
+
+	/* a LID routed SMP which is lost goes again along its DR path */
+	test_issue_lid(&engine, 10, 0);
+	if (process_mads(&engine) || t.completed[0] != 2 || t.lid_sent != 1) {
+		fprintf(stderr, "LID routed SMP failed\n");
+		rc = 1;
+	}
+	t.drop_lid = 1;
+	test_issue_lid(&engine, 11, 1);
+	if (process_mads(&engine) || t.completed[1] != 2 ||
+	    t.lid_sent != 2 || engine.stats.lid_fallbacks != 1) {
+		fprintf(stderr, "LID routed SMP did not fall back to DR\n");
+		rc = 1;
+	}
+
+	if (deadline_test(&config, dead))
+		rc = 1;
+	if (window_test(&config))
+		rc = 1;
+	if (fairness_test(&config, 1) || fairness_test(&config, 3))
+		rc = 1;
+	if (rate_test(&config))
+		rc = 1;
+	if (sim_tests())
+		rc = 1;
+
+	printf("%u timeouts, %u retries, %u dead targets, %u fast failed, "
+	       "%u LID fallbacks\n", engine.stats.timeouts,
+	       engine.stats.retries, engine.stats.dead_targets,
+	       engine.stats.fast_failed, engine.stats.lid_fallbacks);
+
+	smp_engine_destroy(&engine);
+	free(t.resp);
+	printf("%s\n", rc ? "FAILED" : "PASSED");
+	exit(rc);
+}
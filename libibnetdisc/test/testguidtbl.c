@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2004-2007 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2007 Xsigo Systems Inc.  All rights reserved.
+ * Copyright (c) 2008 Lawrence Livermore National Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+
+/*
+ * Check the GUID tables behind ibnd_find_node_guid() and
+ * ibnd_find_port_guid() on the synthetic fabrics of synth.c and time
+ * lookups against the 137 bucket chained tables they replaced.  The ports
+ * of a switch share the switch GUID.  The LID table behind
+ * ibnd_find_port_lid() and filling the port table from several threads
+ * are checked along the way.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <infiniband/ibnetdisc.h>
+
+#include "internal.h"
+#include "synth.h"
+
+#define LEGACY_HASHGUID(guid) ((uint32_t)(((uint32_t)(guid) * 101) ^ \
+				((uint32_t)((guid) >> 32) * 103)))
+
+static const char *argv0 = "ibndtestguidtbl";
+
+/* the old fixed tables, for comparison */
+typedef struct legacy_ent {
+	ibnd_port_t *port;
+	struct legacy_ent *next;
+} legacy_ent_t;
+
+typedef struct synth_fabric {
+	f_internal_t *f_int;
+	ibnd_node_t **nodes;
+	ibnd_port_t **ports;
+	unsigned num_nodes, num_ports;
+	legacy_ent_t *legacy_tbl[HTSZ];
+	legacy_ent_t *legacy_ents;
+} synth_fabric_t;
+
+static int build(synth_fabric_t * sf, unsigned num_ports)
+{
+	ibnd_fabric_t *fabric;
+	ibnd_node_t *node;
+	legacy_ent_t *ent;
+	unsigned n, h;
+	int p;
+
+	memset(sf, 0, sizeof(*sf));
+	if (!(fabric = synth_build(num_ports, 0, NULL, &n)))
+		return -1;
+	sf->f_int = (f_internal_t *)fabric;
+	for (node = fabric->nodes; node; node = node->next)
+		sf->num_nodes++;
+	sf->nodes = calloc(sf->num_nodes, sizeof(*sf->nodes));
+	sf->ports = calloc(n, sizeof(*sf->ports));
+	sf->legacy_ents = calloc(n, sizeof(*sf->legacy_ents));
+	if (!sf->nodes || !sf->ports || !sf->legacy_ents)
+		return -1;
+
+	n = 0;
+	for (node = fabric->nodes; node; node = node->next) {
+		sf->nodes[n++] = node;
+		for (p = 0; p <= node->numports; p++) {
+			if (!node->ports[p])
+				continue;
+			ent = &sf->legacy_ents[sf->num_ports];
+			sf->ports[sf->num_ports++] = node->ports[p];
+			h = LEGACY_HASHGUID(node->ports[p]->guid) % HTSZ;
+			ent->port = node->ports[p];
+			ent->next = sf->legacy_tbl[h];
+			sf->legacy_tbl[h] = ent;
+		}
+	}
+	return 0;
+}
+
+static void destroy(synth_fabric_t * sf)
+{
+	if (sf->f_int)
+		ibnd_destroy_fabric(&sf->f_int->fabric);
+	free(sf->nodes);
+	free(sf->ports);
+	free(sf->legacy_ents);
+}
+
+static ibnd_port_t *legacy_find_port(synth_fabric_t * sf, uint64_t guid)
+{
+	legacy_ent_t *ent = sf->legacy_tbl[LEGACY_HASHGUID(guid) % HTSZ];
+
+	for ( /* */ ; ent; ent = ent->next)
+		if (ent->port->guid == guid)
+			return ent->port;
+	return NULL;
+}
+
+static int check(synth_fabric_t * sf)
+{
+	ibnd_fabric_t *fabric = &sf->f_int->fabric;
+	ibnd_port_t *port;
+	unsigned i, n = 0;
+
+	for (i = 0; i < sf->num_nodes; i++)
+		if (ibnd_find_node_guid(fabric, sf->nodes[i]->guid) !=
+		    sf->nodes[i]) {
+			fprintf(stderr, "node %u not found\n", i);
+			return -1;
+		}
+	for (i = 0; i < sf->num_ports; i++) {
+		port = ibnd_find_port_guid(fabric, sf->ports[i]->guid);
+		if (!port || port->node != sf->ports[i]->node) {
+			fprintf(stderr, "port %u not found\n", i);
+			return -1;
+		}
+	}
+	if (ibnd_find_port_guid(fabric, synth_guid(4 * sf->num_nodes)) ||
+	    ibnd_find_node_guid(fabric, 1)) {
+		fprintf(stderr, "found a GUID which is not there\n");
+		return -1;
+	}
+	/* the ports of a switch share its LID, which finds port 0 */
+	for (i = 0; i < sf->num_ports; i++) {
+		port = sf->ports[i];
+		if (port->base_lid < IBND_LID_TBL_SIZE &&
+		    (port->portnum == 0 || port->node->type != IB_NODE_SWITCH) &&
+		    ibnd_find_port_lid(fabric, port->base_lid) != port) {
+			fprintf(stderr, "port %u not found by LID\n", i);
+			return -1;
+		}
+	}
+	if (ibnd_find_port_lid(fabric, 0) ||
+	    ibnd_find_port_lid(fabric, 0xc000) ||
+	    (2 * sf->num_nodes < IBND_LID_TBL_SIZE &&
+	     ibnd_find_port_lid(fabric, 2 * sf->num_nodes))) {
+		fprintf(stderr, "found a LID which is not there\n");
+		return -1;
+	}
+	if (add_to_portguid_hash(sf->ports[0], sf->f_int) != 1) {
+		fprintf(stderr, "duplicate port not detected\n");
+		return -1;
+	}
+	for (i = 0; i < sf->f_int->ports_tbl.size; i++)
+		for (port = sf->f_int->ports_tbl.ents[i].item; port;
+		     port = port->htnext)
+			n++;
+	if (n != sf->num_ports) {
+		fprintf(stderr, "%u of %u ports in the table\n", n,
+			sf->num_ports);
+		return -1;
+	}
+	return 0;
+}
+
+/* Filling a table with guid_tbl_add_all() in threads must leave every
+ * GUID with the chain guid_tbl_add() one port at a time gave it.  The
+ * ports are chained through htnext either way, so the chains of the
+ * fabric table are saved first.  *secs is how long the fill took. */
+static int check_add_all(synth_fabric_t * sf, unsigned threads, double *secs)
+{
+	guid_tbl_t *ports_tbl = &sf->f_int->ports_tbl;
+	ibnd_port_t **head = NULL, **next = NULL;
+	guid_tbl_t tbl;
+	void **items;
+	unsigned i;
+	double t;
+	int rc = -1;
+
+	guid_tbl_init(&tbl, offsetof(ibnd_port_t, htnext));
+	items = calloc(sf->num_ports, sizeof(*items));
+	head = calloc(sf->num_ports, sizeof(*head));
+	next = calloc(sf->num_ports, sizeof(*next));
+	if (!items || !head || !next)
+		goto out;
+	for (i = 0; i < sf->num_ports; i++) {
+		items[i] = sf->ports[i];
+		head[i] = guid_tbl_find(ports_tbl, sf->ports[i]->guid);
+		next[i] = sf->ports[i]->htnext;
+	}
+
+	if (guid_tbl_reserve(&tbl, sf->num_nodes)) {
+		fprintf(stderr, "guid_tbl_reserve failed\n");
+		goto out;
+	}
+	t = synth_now();
+	if (guid_tbl_add_all(&tbl, items, sf->num_ports,
+			     offsetof(ibnd_port_t, guid), threads)) {
+		fprintf(stderr, "guid_tbl_add_all failed\n");
+		goto out;
+	}
+	*secs = synth_now() - t;
+	if (tbl.count != ports_tbl->count) {
+		fprintf(stderr, "%u threads: %u GUIDs instead of %u\n",
+			threads, tbl.count, ports_tbl->count);
+		goto out;
+	}
+	for (i = 0; i < sf->num_ports; i++)
+		if (guid_tbl_find(&tbl, sf->ports[i]->guid) != head[i] ||
+		    sf->ports[i]->htnext != next[i]) {
+			fprintf(stderr, "%u threads: port %u chained "
+				"differently\n", threads, i);
+			goto out;
+		}
+	rc = 0;
+out:
+	guid_tbl_destroy(&tbl);
+	free(items);
+	free(head);
+	free(next);
+	return rc;
+}
+
+static int benchmark(unsigned num_ports, unsigned lookups)
+{
+	static const unsigned fill_threads[] = { 1, 4, 16, 255 };
+	synth_fabric_t sf;
+	ibnd_fabric_t *fabric;
+	uint64_t *keys;
+	double t, t_new, t_old, t_fill[4];
+	unsigned i, found = 0;
+	int rc = -1;
+
+	if (build(&sf, num_ports)) {
+		fprintf(stderr, "failed to build a fabric of %u ports\n",
+			num_ports);
+		goto out;
+	}
+	fabric = &sf.f_int->fabric;
+	if (check(&sf))
+		goto out;
+	for (i = 0; i < 4; i++)
+		if (check_add_all(&sf, fill_threads[i], &t_fill[i]))
+			goto out;
+
+	if (!(keys = malloc(lookups * sizeof(*keys))))
+		goto out;
+	srandom(num_ports);
+	for (i = 0; i < lookups; i++)
+		keys[i] = sf.ports[random() % sf.num_ports]->guid;
+
+	t = synth_now();
+	for (i = 0; i < lookups; i++)
+		found += ibnd_find_port_guid(fabric, keys[i]) != NULL;
+	t_new = synth_now() - t;
+
+	t = synth_now();
+	for (i = 0; i < lookups; i++)
+		found += legacy_find_port(&sf, keys[i]) != NULL;
+	t_old = synth_now() - t;
+
+	printf("%7u ports %6u nodes: %8.1f ns/lookup (table of %u), "
+	       "%9.1f ns/lookup with %u buckets\n", sf.num_ports,
+	       sf.num_nodes, t_new * 1e9 / lookups, sf.f_int->ports_tbl.size,
+	       t_old * 1e9 / lookups, HTSZ);
+	printf("%7u ports fill:", sf.num_ports);
+	for (i = 0; i < 4; i++)
+		printf(" %u threads %7.2f ms%s", fill_threads[i],
+		       t_fill[i] * 1e3, i < 3 ? "," : "\n");
+	rc = found == 2 * lookups ? 0 : -1;
+	free(keys);
+out:
+	destroy(&sf);
+	return rc;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-h -l <lookups>] [<ports> ...]\n"
+		"   Check the node and port GUID tables and benchmark lookups\n"
+		"   on fabrics of <ports> ports (default 1000 10000 100000)\n"
+		"   -h This help message\n"
+		"   -l <lookups> lookups per fabric (default 1000000)\n",
+		argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned sizes[] = { 1000, 10000, 100000 };
+	unsigned lookups = 1000000, i;
+	int ch, rc = 0;
+
+	argv0 = argv[0];
+	while ((ch = getopt(argc, argv, "l:h")) != -1) {
+		switch (ch) {
+		case 'l':
+			lookups = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (!lookups)
+		usage();
+
+	if (optind < argc) {
+		for (i = optind; i < (unsigned)argc; i++)
+			if (benchmark(strtoul(argv[i], NULL, 0), lookups))
+				rc = 1;
+	} else {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+			if (benchmark(sizes[i], lookups))
+				rc = 1;
+	}
+
+	printf("%s\n", rc ? "FAILED" : "PASSED");
+	exit(rc);
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2004-2007 Voltaire Inc.  All rights reserved.
+ * Copyright (c) 2007 Xsigo Systems Inc.  All rights reserved.
+ * Copyright (c) 2008 Lawrence Livermore National Lab.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Check the MAD rate limits of libibmad: that a bucket holds 10ms worth of
+ * MADs, and at least one, that it then lets MADs through at the rate it
+ * was set to, and that a destination over its own limit is held back
+ * apart from the others while the global limit holds back all of them.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif				/* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <infiniband/mad.h>
+
+/* as in rate.c */
+#define BURST_MS 10
+
+static const char *argv0 = "ibndtestrate";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* longer than any bucket here is deep, so all of them are full again */
+static void refill(void)
+{
+	usleep(50000);
+}
+
+static unsigned burst(unsigned rate)
+{
+	unsigned n = rate * BURST_MS / 1000;
+
+	return n ? n : 1;
+}
+
+static void lid_portid(ib_portid_t * portid, int lid)
+{
+	memset(portid, 0, sizeof(*portid));
+	portid->lid = lid;
+}
+
+/* take tokens for dport until refused; returns how many were taken */
+static unsigned take_all(ib_portid_t * dport, int *limit, unsigned *wait_us)
+{
+	unsigned n = 0;
+
+	while (!(*limit = mad_rate_limit_take(dport, wait_us)))
+		n++;
+	return n;
+}
+
+/* A full bucket lets its depth through at once, then asks to wait about
+ * one interval. */
+static int burst_test(unsigned rate, int dest)
+{
+	ib_portid_t dport;
+	unsigned n, wait_us, interval_us = 1000000 / rate;
+	int limit;
+
+	madrpc_set_rate_limit(dest ? 0 : rate, dest ? rate : 0);
+	refill();
+	lid_portid(&dport, 1);
+	n = take_all(&dport, &limit, &wait_us);
+	/* tokens come back while the loop runs */
+	if (n < burst(rate) || n > burst(rate) + burst(rate) / 10 + 1 ||
+	    limit != (dest ? MAD_RATE_LIMIT_DEST : MAD_RATE_LIMIT_GLOBAL) ||
+	    !wait_us || wait_us > interval_us + 1) {
+		fprintf(stderr, "burst: %s rate %u let %u through, expected "
+			"%u, then %d for %u us\n", dest ? "destination" :
+			"global", rate, n, burst(rate), limit, wait_us);
+		return 1;
+	}
+	return 0;
+}
+
+/* After the burst MADs get through at the rate, taking them as fast as
+ * they come. */
+static int steady_test(unsigned rate, double secs)
+{
+	ib_portid_t dport;
+	unsigned n = 0, wait_us;
+	double start, elapsed, expected;
+
+	madrpc_set_rate_limit(rate, 0);
+	refill();
+	lid_portid(&dport, 1);
+	start = now();
+	while ((elapsed = now() - start) < secs)
+		if (!mad_rate_limit_take(&dport, &wait_us))
+			n++;
+	expected = burst(rate) + rate * elapsed;
+	if (n > expected + 1 || n < 0.9 * expected) {
+		fprintf(stderr, "steady: rate %u let %u through in %.0f ms, "
+			"expected %.0f\n", rate, n, elapsed * 1e3, expected);
+		return 1;
+	}
+	return 0;
+}
+
+/* Each destination has its own bucket; the global one is shared and what
+ * it refuses does not count against the destination. */
+static int dest_test(void)
+{
+	ib_portid_t a, b, dr;
+	unsigned n, i, wait_us;
+	int limit, rc = 0;
+
+	lid_portid(&a, 1);
+	lid_portid(&b, 2);
+	memset(&dr, 0, sizeof(dr));
+	str2drpath(&dr.drpath, "0,1,3", 0, 0);
+
+	madrpc_set_rate_limit(0, 1000);
+	refill();
+	if ((n = take_all(&a, &limit, &wait_us)) != burst(1000) ||
+	    limit != MAD_RATE_LIMIT_DEST ||
+	    take_all(&b, &limit, &wait_us) != burst(1000) ||
+	    take_all(&dr, &limit, &wait_us) != burst(1000)) {
+		fprintf(stderr, "dest: destinations share a bucket\n");
+		rc = 1;
+	}
+
+	/* a global bucket of one */
+	madrpc_set_rate_limit(100, 1000);
+	refill();
+	if (mad_rate_limit_take(&a, &wait_us) ||
+	    mad_rate_limit_take(&b, &wait_us) != MAD_RATE_LIMIT_GLOBAL) {
+		fprintf(stderr, "dest: global limit not shared\n");
+		rc = 1;
+	}
+	for (i = 0; i < 2 * burst(1000); i++)
+		if (mad_rate_limit_take(&a, &wait_us) !=
+		    MAD_RATE_LIMIT_GLOBAL) {
+			fprintf(stderr, "dest: global limit let %u through\n",
+				i);
+			rc = 1;
+			break;
+		}
+	/* only the first one counted against a */
+	madrpc_set_rate_limit(0, 1000);
+	if ((n = take_all(&a, &limit, &wait_us)) < burst(1000) - 1 ||
+	    n > burst(1000)) {
+		fprintf(stderr, "dest: %u left for a after the global limit "
+			"held it back, expected %u\n", n, burst(1000) - 1);
+		rc = 1;
+	}
+	return rc;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-h]\n"
+		"   Check the MAD rate limits of libibmad\n"
+		"   -h This help message\n", argv0);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned rates[] = { 50, 1000, 20000, 200000 };
+	unsigned i;
+	int ch, rc = 0;
+
+	argv0 = argv[0];
+	while ((ch = getopt(argc, argv, "h")) != -1)
+		usage();
+
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		if (burst_test(rates[i], 0) || burst_test(rates[i], 1))
+			rc = 1;
+	if (steady_test(1000, 0.2) || steady_test(50000, 0.2))
+		rc = 1;
+	if (dest_test())
+		rc = 1;
+	madrpc_set_rate_limit(0, 0);
+
+	printf("%s\n", rc ? "FAILED" : "PASSED");
+	return rc;
+}
@@ -63,6 +63,10 @@ static uint64_t portguid_before;
 static uint64_t portguid_after;
 static int portguid_flag;
 
+static char **delta_files;
+static unsigned num_delta_files;
+static char *delta_base_file;
+
 struct guids {
 	uint64_t searchguid;
 	int searchguid_found;
@@ -157,6 +161,16 @@ static int process_opt(void *context, int ch)
 			return -1;
 		portguid_flag++;
 		break;
+	case 5:
+		delta_files = realloc(delta_files, (num_delta_files + 1) *
+				      sizeof(*delta_files));
+		if (!delta_files)
+			return -1;
+		delta_files[num_delta_files++] = optarg;
+		break;
+	case 6:
+		delta_base_file = optarg;
+		break;
 	default:
 		return -1;
 	}
@@ -251,6 +265,7 @@ static void replace_portguid(ibnd_node_t *node, void *user_data)
 int main(int argc, char **argv)
 {
 	ibnd_fabric_t *fabric = NULL;
+	ibnd_fabric_t *base = NULL;
 	char *orig_cache_file = NULL;
 	char *new_cache_file = NULL;
 	struct guids guids;
@@ -264,6 +279,10 @@ int main(int argc, char **argv)
 		 "Specify before and after sysimgguid to edit"},
 		{"portguid", 4, 1, "NODEGUID:BEFOREGUID:AFTERGUID",
 		 "Specify before and after port guid to edit"},
+		{"delta", 5, 1, "<file>",
+		 "Apply a delta to orig.cache; repeat for a chain"},
+		{"delta-base", 6, 1, "<base.cache>",
+		 "Write new.cache as a delta against base.cache"},
 		{}
 	};
 	const char *usage_args = "<orig.cache> <new.cache>";
@@ -284,7 +303,8 @@ int main(int argc, char **argv)
 	if (!new_cache_file)
 		IBEXIT("new cache file not specified");
 
-	if ((fabric = ibnd_load_fabric(orig_cache_file, 0)) == NULL)
+	if ((fabric = ibnd_load_fabric_chain(orig_cache_file, delta_files,
+					     num_delta_files, 0)) == NULL)
 		IBEXIT("loading original cached fabric failed");
 
 	if (switchguid_flag) {
@@ -347,9 +367,16 @@ int main(int argc, char **argv)
 				portguid_before);
 	}
 
-	if (ibnd_cache_fabric(fabric, new_cache_file, 0) < 0)
+	if (delta_base_file) {
+		if ((base = ibnd_load_fabric(delta_base_file, 0)) == NULL)
+			IBEXIT("loading base cached fabric failed");
+		if (ibnd_cache_fabric_delta(base, fabric, new_cache_file, 0) < 0)
+			IBEXIT("caching new delta failed");
+		ibnd_destroy_fabric(base);
+	} else if (ibnd_cache_fabric(fabric, new_cache_file, 0) < 0)
 		IBEXIT("caching new cache data failed");
 
 	ibnd_destroy_fabric(fabric);
+	free(delta_files);
 	exit(0);
 }
@@ -42,6 +42,7 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
@@ -75,6 +76,8 @@ uint64_t ibd_mkey;
 uint64_t ibd_sakey = 0;
 int show_keys = 0;
 char *ibd_nd_format = NULL;
+unsigned ibd_mad_rate = 0;
+unsigned ibd_mad_dest_rate = 0;
 
 static const char *prog_name;
 static const char *prog_args;
@@ -159,6 +162,12 @@ static void read_ibdiag_config(const char *file)
 			} else {
 				ibd_ibnetdisc_flags &= ~IBND_CONFIG_MLX_EPI;
 			}
+		} else if (strncmp(name, "HYBRID_LID",
+				   strlen("HYBRID_LID")) == 0) {
+			if (val_str_true(val_str))
+				ibd_ibnetdisc_flags |= IBND_CONFIG_HYBRID_LID;
+			else
+				ibd_ibnetdisc_flags &= ~IBND_CONFIG_HYBRID_LID;
 		} else if (strncmp(name, "m_key", strlen("m_key")) == 0) {
 			ibd_mkey = strtoull(val_str, NULL, 0);
 		} else if (strncmp(name, "sa_key",
@@ -167,6 +176,12 @@ static void read_ibdiag_config(const char *file)
 		} else if (strncmp(name, "nd_format",
 				   strlen("nd_format")) == 0) {
 			ibd_nd_format = strdup(val_str);
+		} else if (strncmp(name, "mad_rate",
+				   strlen("mad_rate")) == 0) {
+			ibd_mad_rate = strtoul(val_str, NULL, 0);
+		} else if (strncmp(name, "mad_dest_rate",
+				   strlen("mad_dest_rate")) == 0) {
+			ibd_mad_dest_rate = strtoul(val_str, NULL, 0);
 		}
 	}
 
@@ -287,6 +302,20 @@ static int process_opt(int ch)
 			}
                 }
                 break;
+	case 0x1e:
+	case 0x1f:
+		errno = 0;
+		val = strtol(optarg, &endp, 0);
+		if (errno || (endp && *endp != '\0') || val < 0 ||
+		    val > INT_MAX)
+			IBEXIT("Invalid MAD rate \"%s\".  The rate requires a "
+				"non negative integer value < %d.", optarg,
+				INT_MAX);
+		if (ch == 0x1e)
+			ibd_mad_rate = (unsigned)val;
+		else
+			ibd_mad_dest_rate = (unsigned)val;
+		break;
 	default:
 		return -1;
 	}
@@ -305,6 +334,10 @@ static const struct ibdiag_opt common_opts[] = {
 	{"sm_port", 's', 1, "<lid>", "SM port lid"},
 	{"show_keys", 'K', 0, NULL, "display security keys in output"},
 	{"m_key", 'y', 1, "<key>", "M_Key to use in request"},
+	{"mad_rate", 0x1e, 1, "<MADs/s>",
+	 "send at most this many MADs per second, 0 for no limit"},
+	{"mad_dest_rate", 0x1f, 1, "<MADs/s>",
+	 "send at most this many MADs per second to any one port"},
 	{"errors", 'e', 0, NULL, "show send and receive errors"},
 	{"verbose", 'v', 0, NULL, "increase verbosity level"},
 	{"debug", 'd', 0, NULL, "raise debug level"},
@@ -409,6 +442,7 @@ int ibdiag_process_opts(int argc, char *const argv[], void *cxt,
 			ibdiag_show_usage();
 	}
 
+	madrpc_set_rate_limit(ibd_mad_rate, ibd_mad_dest_rate);
 	return 0;
 }
 
@@ -783,60 +817,31 @@ void get_max_msg(char *width_msg, char *speed_msg, int msg_size, ibnd_port_t * p
 	char buf[64];
 	uint32_t max_speed = 0;
 	uint32_t cap_mask, rem_cap_mask, fdr10;
-	uint8_t *info = NULL;
-
-	uint32_t max_width = get_max_width(mad_get_field(port->info, 0,
-						   IB_PORT_LINK_WIDTH_SUPPORTED_F)
-				     & mad_get_field(port->remoteport->info, 0,
-						     IB_PORT_LINK_WIDTH_SUPPORTED_F));
-	if ((max_width & mad_get_field(port->info, 0,
-				       IB_PORT_LINK_WIDTH_ACTIVE_F)) == 0)
+	ibnd_port_attrs_t *a = &port->attrs;
+	ibnd_port_attrs_t *rem = &port->remoteport->attrs;
+
+	uint32_t max_width = get_max_width(a->width_supported
+					   & rem->width_supported);
+	if ((max_width & a->width_active) == 0)
 		// we are not at the max supported width
 		// print what we could be at.
 		snprintf(width_msg, msg_size, "Could be %s",
 			 mad_dump_val(IB_PORT_LINK_WIDTH_ACTIVE_F,
 				      buf, 64, &max_width));
 
-	if (port->node->type == IB_NODE_SWITCH) {
-		if (port->node->ports[0])
-			info = (uint8_t *)&port->node->ports[0]->info;
-	}
-	else
-		info = (uint8_t *)&port->info;
-
-	if (info)
-		cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
-	else
-		cap_mask = 0;
-
-	info = NULL;
-	if (port->remoteport->node->type == IB_NODE_SWITCH) {
-		if (port->remoteport->node->ports[0])
-			info = (uint8_t *)&port->remoteport->node->ports[0]->info;
-	} else
-		info = (uint8_t *)&port->remoteport->info;
-
-	if (info)
-		rem_cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
-	else
-		rem_cap_mask = 0;
+	cap_mask = a->cap_mask;
+	rem_cap_mask = rem->cap_mask;
 	if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS) &&
 	    rem_cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
 		goto check_ext_speed;
 check_fdr10_supp:
-	fdr10 = (mad_get_field(port->ext_info, 0,
-			       IB_MLNX_EXT_PORT_LINK_SPEED_SUPPORTED_F) & FDR10)
-		&& (mad_get_field(port->remoteport->ext_info, 0,
-				  IB_MLNX_EXT_PORT_LINK_SPEED_SUPPORTED_F) & FDR10);
+	fdr10 = (a->mlnx_speed_supported & FDR10)
+		&& (rem->mlnx_speed_supported & FDR10);
 	if (fdr10)
 		goto check_fdr10_active;
 
-	max_speed = get_max(mad_get_field(port->info, 0,
-					  IB_PORT_LINK_SPEED_SUPPORTED_F)
-			    & mad_get_field(port->remoteport->info, 0,
-					    IB_PORT_LINK_SPEED_SUPPORTED_F));
-	if ((max_speed & mad_get_field(port->info, 0,
-				       IB_PORT_LINK_SPEED_ACTIVE_F)) == 0)
+	max_speed = get_max(a->speed_supported & rem->speed_supported);
+	if ((max_speed & a->speed_active) == 0)
 		// we are not at the max supported speed
 		// print what we could be at.
 		snprintf(speed_msg, msg_size, "Could be %s",
@@ -845,17 +850,10 @@ check_fdr10_supp:
 	return;
 
 check_ext_speed:
-	if (mad_get_field(port->info, 0,
-			  IB_PORT_LINK_SPEED_EXT_SUPPORTED_F) == 0 ||
-	    mad_get_field(port->remoteport->info, 0,
-			  IB_PORT_LINK_SPEED_EXT_SUPPORTED_F) == 0)
+	if (a->espeed_supported == 0 || rem->espeed_supported == 0)
 		goto check_fdr10_supp;
-	max_speed = get_max(mad_get_field(port->info, 0,
-					  IB_PORT_LINK_SPEED_EXT_SUPPORTED_F)
-			    & mad_get_field(port->remoteport->info, 0,
-					    IB_PORT_LINK_SPEED_EXT_SUPPORTED_F));
-	if ((max_speed & mad_get_field(port->info, 0,
-				       IB_PORT_LINK_SPEED_EXT_ACTIVE_F)) == 0)
+	max_speed = get_max(a->espeed_supported & rem->espeed_supported);
+	if ((max_speed & a->espeed_active) == 0)
 		// we are not at the max supported extended speed
 		// print what we could be at.
 		snprintf(speed_msg, msg_size, "Could be %s",
@@ -864,10 +862,9 @@ check_ext_speed:
 	return;
 
 check_fdr10_active:
-	if ((mad_get_field(port->ext_info, 0,
-			   IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F) & FDR10) == 0) {
+	if ((a->mlnx_speed_active & FDR10) == 0) {
 		/* Special case QDR to try to avoid confusion with FDR10 */
-		if (mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F) == 4)	/* QDR (10.0 Gbps) */
+		if (a->speed_active == 4)	/* QDR (10.0 Gbps) */
 			snprintf(speed_msg, msg_size,
 				 "Could be FDR10 (Found link at QDR but expected speed is FDR10)");
 		else
@@ -940,6 +937,67 @@ void dump_portinfo(void *pi, int tabs)
 	}
 }
 
+static void dump_rtt_hist(FILE *f, const char *name, ibnd_rtt_hist_t *hist)
+{
+	int b;
+
+	if (!hist->count)
+		return;
+	fprintf(f, "#   %-16s count %-7u avg %-7" PRIu64 " max %-7u",
+		name, hist->count, hist->total_us / hist->count,
+		hist->max_us);
+	for (b = 0; b < IBND_RTT_BUCKETS; b++) {
+		if (!hist->buckets[b])
+			continue;
+		if (b == IBND_RTT_BUCKETS - 1)
+			fprintf(f, " >=%u:%u", 1U << (b - 1), hist->buckets[b]);
+		else
+			fprintf(f, " <%u:%u", 1U << b, hist->buckets[b]);
+	}
+	fprintf(f, "\n");
+}
+
+void dump_discovery_stats(FILE *f, ibnd_fabric_t *fabric)
+{
+	static const char *attr_names[IBND_STATS_NUM_ATTRS] = {
+		[IBND_STATS_ATTR_NODE_INFO] = "NodeInfo",
+		[IBND_STATS_ATTR_NODE_DESC] = "NodeDesc",
+		[IBND_STATS_ATTR_PORT_INFO] = "PortInfo",
+		[IBND_STATS_ATTR_SWITCH_INFO] = "SwitchInfo",
+		[IBND_STATS_ATTR_MLNX_EXT_PORT_INFO] = "MlnxExtPortInfo",
+		[IBND_STATS_ATTR_OTHER] = "Other",
+	};
+	ibnd_discovery_stats_t stats;
+	char name[32];
+	int i;
+
+	if (ibnd_get_discovery_stats(fabric, &stats, sizeof(stats)))
+		return;
+
+	fprintf(f, "# Discovery statistics\n");
+	fprintf(f, "#   SMPs sent %u responses %u timeouts %u retries %u "
+		"status errors %u\n", stats.smps_sent, stats.responses,
+		stats.timeouts, stats.retries, stats.status_errors);
+	fprintf(f, "#   stale responses %u dead targets %u fast failed %u\n",
+		stats.stale_responses, stats.dead_targets, stats.fast_failed);
+	fprintf(f, "#   peak queue depth %u peak window %u\n",
+		stats.peak_queue_depth, stats.peak_window);
+	if (stats.lid_routed)
+		fprintf(f, "#   LID routed %u fallbacks to DR %u\n",
+			stats.lid_routed, stats.lid_fallbacks);
+	if (stats.rate_holds)
+		fprintf(f, "#   held by MAD rate limits %u\n",
+			stats.rate_holds);
+	fprintf(f, "# RTT (us) by attribute\n");
+	for (i = 0; i < IBND_STATS_NUM_ATTRS; i++)
+		dump_rtt_hist(f, attr_names[i], &stats.attr_rtt[i]);
+	fprintf(f, "# RTT (us) by DR hop count\n");
+	for (i = 0; i < IBND_STATS_MAX_HOPS; i++) {
+		snprintf(name, sizeof(name), "%d hops", i);
+		dump_rtt_hist(f, name, &stats.hop_rtt[i]);
+	}
+}
+
 op_fn_t *match_op(const match_rec_t match_tbl[], char *name)
 {
 	const match_rec_t *r;
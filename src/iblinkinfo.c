@@ -80,6 +80,8 @@ static int line_mode = 0;
 static int add_sw_settings = 0;
 static int only_flag = 0;
 static int only_type = 0;
+static int report_stats = 0;
+static int via_sa = 0;
 
 static int filterdownport_check(ibnd_node_t *node, ibnd_port_t *port)
 {
@@ -100,7 +102,7 @@ static int filterdownport_check(ibnd_node_t *node, ibnd_port_t *port)
 	if (!fport)
 		return 0;
 
-	fistate = mad_get_field(fport->info, 0, IB_PORT_STATE_F);
+	fistate = fport->attrs.state;
 
 	return (fistate == IB_LINK_DOWN) ? 1 : 0;
 }
@@ -115,41 +117,26 @@ static void print_port(ibnd_node_t *node, ibnd_port_t *port,
 	char width_msg[256];
 	char speed_msg[256];
 	char ext_port_str[256];
-	int iwidth, ispeed, fdr10, espeed, istate, iphystate, cap_mask;
+	int iwidth, ispeed, fdr10, espeed, istate, iphystate;
 	int n = 0;
-	uint8_t *info = NULL;
 	int rc;
 
 	if (!port)
 		return;
 
-	iwidth = mad_get_field(port->info, 0, IB_PORT_LINK_WIDTH_ACTIVE_F);
-	ispeed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
-	fdr10 = mad_get_field(port->ext_info, 0,
-			      IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F) & FDR10;
+	iwidth = port->attrs.width_active;
+	ispeed = port->attrs.speed_active;
+	fdr10 = port->attrs.mlnx_speed_active & FDR10;
+	espeed = port->attrs.espeed_active;
 
-	if (port->node->type == IB_NODE_SWITCH) {
-		if (port->node->ports[0])
-			info = (uint8_t *)&port->node->ports[0]->info;
-	}
-	else
-		info = (uint8_t *)&port->info;
-
-	if (info) {
-		cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
-		if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
-			espeed = mad_get_field(port->info, 0,
-					       IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
-		else
-			espeed = 0;
-	} else {
+	/* no port 0 to tell whether these are valid */
+	if (port->node->type == IB_NODE_SWITCH && !port->node->ports[0]) {
 		ispeed = 0;
 		iwidth = 0;
-		espeed = 0;
 	}
 
-	istate = mad_get_field(port->info, 0, IB_PORT_STATE_F);
-	iphystate = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F);
+	istate = port->attrs.state;
+	iphystate = port->attrs.phys_state;
 
 	remote_guid_str[0] = '\0';
 	remote_str[0] = '\0';
@@ -194,10 +181,7 @@ static void print_port(ibnd_node_t *node, ibnd_port_t *port,
 	if (add_sw_settings && istate != IB_LINK_DOWN) {
 		snprintf(link_str + n, 256 - n,
 			" (HOQ:%d VL_Stall:%d)",
-			mad_get_field(port->info, 0,
-				IB_PORT_HOQ_LIFE_F),
-			mad_get_field(port->info, 0,
-				IB_PORT_VL_STALL_COUNT_F));
+			port->attrs.hoq_life, port->attrs.vl_stall_count);
 	}
 
 	if (port->remoteport) {
@@ -316,8 +300,7 @@ static void print_node(ibnd_node_t *node, void *user_data)
 		if (!port)
 			continue;
 		if (!down_links_only ||
-		    mad_get_field(port->info, 0,
-				  IB_PORT_STATE_F) == IB_LINK_DOWN) {
+		    port->attrs.state == IB_LINK_DOWN) {
 			print_node_header(node, &head_print, out_prefix);
 			print_port(node, port, out_prefix);
 		}
@@ -370,10 +353,8 @@ static void diff_node_ports(ibnd_node_t *fabric1_node,
 		    && fabric2_port) {
 			int state1, state2;
 
-			state1 = mad_get_field(fabric1_port->info, 0,
-					       IB_PORT_STATE_F);
-			state2 = mad_get_field(fabric2_port->info, 0,
-					       IB_PORT_STATE_F);
+			state1 = fabric1_port->attrs.state;
+			state2 = fabric2_port->attrs.state;
 
 			if (state1 != state2)
 				output_diff++;
@@ -560,6 +541,12 @@ static int process_opt(void *context, int ch)
 		only_flag = 1;
 		only_type = IB_NODE_CA;
 		break;
+	case 8:
+		report_stats = 1;
+		break;
+	case 9:
+		via_sa = 1;
+		break;
 	case 'S':
 	case 'G':
 		node_label.guid_str = optarg;
@@ -640,6 +627,10 @@ int main(int argc, char **argv)
 		 "Output only switches"},
 		{"cas-only", 7, 0, NULL,
 		 "Output only CAs"},
+		{"stats", 8, 0, NULL,
+		 "report SMP counters and RTT histograms of the scan"},
+		{"via-sa", 9, 0, NULL,
+		 "build the topology from SA records instead of an SMP scan"},
 		{}
 	};
 	char usage_args[] = "";
@@ -713,6 +704,14 @@ int main(int argc, char **argv)
 			fprintf(stderr, "loading cached fabric failed\n");
 			exit(1);
 		}
+	} else if (via_sa) {
+		/* the whole fabric; the node asked for is picked out below */
+		if (!(fabric = ibnd_discover_fabric_sa(ibd_ca, ibd_ca_port,
+						       &config))) {
+			fprintf(stderr, "discover via SA failed\n");
+			rc = 1;
+			goto close_port;
+		}
 	} else {
 		if (resolved >= 0) {
 			if (!config.max_hops)
@@ -768,6 +767,9 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (report_stats && !load_cache_file)
+		dump_discovery_stats(stdout, fabric);
+
 	ibnd_destroy_fabric(fabric);
 	if (diff_fabric)
 		ibnd_destroy_fabric(diff_fabric);
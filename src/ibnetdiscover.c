@@ -77,6 +77,10 @@ static char *diff_cache_file = NULL;
 static unsigned diffcheck_flags = DIFF_FLAG_DEFAULT;
 
 static int report_max_hops = 0;
+static int report_stats = 0;
+static int via_sa = 0;
+static ibnd_local_port_t *local_ports = NULL;
+static int num_local_ports = 0;
 static int full_info;
 
 /**
@@ -220,6 +224,35 @@ static void list_nodes(ibnd_fabric_t *fabric, int list)
 		ibnd_iter_nodes_type(fabric, list_node, IB_NODE_ROUTER, NULL);
 }
 
+/* List straight off a version 2 cache, one pass over it per node type,
+ * without building the fabric */
+static int list_cache(const char *file, int list)
+{
+	static const int types[] = { IB_NODE_CA, IB_NODE_SWITCH,
+				     IB_NODE_ROUTER };
+	ibnd_cache_t *cache;
+	ibnd_node_t *node;
+	int listed = 0;
+	unsigned i;
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (!(list & (1 << types[i])))
+			continue;
+		if (!(cache = ibnd_cache_open(file, 0))) {
+			if (!listed)
+				return -1;
+			IBEXIT("reading cached fabric failed\n");
+		}
+		while ((node = ibnd_cache_next_node(cache)))
+			if (node->type == types[i])
+				list_node(node, NULL);
+		if (ibnd_cache_close(cache))
+			IBEXIT("reading cached fabric failed\n");
+		listed = 1;
+	}
+	return 0;
+}
+
 static void out_ids(ibnd_node_t *node, int group, char *chname,
 		    const char *out_prefix)
 {
@@ -365,15 +398,11 @@ static void out_switch_port(ibnd_port_t *port, int group,
 {
 	char *ext_port_str = NULL;
 	char *rem_nodename = NULL;
-	uint32_t iwidth = mad_get_field(port->info, 0,
-					IB_PORT_LINK_WIDTH_ACTIVE_F);
-	uint32_t ispeed = mad_get_field(port->info, 0,
-					IB_PORT_LINK_SPEED_ACTIVE_F);
-	uint32_t vlcap = mad_get_field(port->info, 0,
-				       IB_PORT_VL_CAP_F);
-	uint32_t fdr10 = mad_get_field(port->ext_info, 0,
-				       IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F);
-	uint32_t cap_mask, espeed;
+	uint32_t iwidth = port->attrs.width_active;
+	uint32_t ispeed = port->attrs.speed_active;
+	uint32_t vlcap = port->attrs.vl_cap;
+	uint32_t fdr10 = port->attrs.mlnx_speed_active;
+	uint32_t espeed = port->attrs.espeed_active;
 
 	DEBUG("port %p:%d remoteport %p\n", port, port->portnum,
 	      port->remoteport);
@@ -389,19 +418,8 @@ static void out_switch_port(ibnd_port_t *port, int group,
 
 	ext_port_str = out_ext_port(port->remoteport, group);
 
-	if (!port->node->ports[0]) {
-		cap_mask = 0;
+	if (!port->node->ports[0])
 		ispeed = 0;
-		espeed = 0;
-	} else {
-		cap_mask = mad_get_field(port->node->ports[0]->info, 0,
-					 IB_PORT_CAPMASK_F);
-		if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
-			espeed = mad_get_field(port->info, 0,
-					       IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
-		else
-			espeed = 0;
-	}
 	fprintf(f, "\t%s[%d]%s",
 		node_name(port->remoteport->node), port->remoteport->portnum,
 		ext_port_str ? ext_port_str : "");
@@ -433,15 +451,11 @@ static void out_ca_port(ibnd_port_t *port, int group, const char *out_prefix)
 {
 	char *str = NULL;
 	char *rem_nodename = NULL;
-	uint32_t iwidth = mad_get_field(port->info, 0,
-					IB_PORT_LINK_WIDTH_ACTIVE_F);
-	uint32_t ispeed = mad_get_field(port->info, 0,
-					IB_PORT_LINK_SPEED_ACTIVE_F);
-	uint32_t vlcap = mad_get_field(port->info, 0,
-				       IB_PORT_VL_CAP_F);
-	uint32_t fdr10 = mad_get_field(port->ext_info, 0,
-				       IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F);
-	uint32_t cap_mask, espeed;
+	uint32_t iwidth = port->attrs.width_active;
+	uint32_t ispeed = port->attrs.speed_active;
+	uint32_t vlcap = port->attrs.vl_cap;
+	uint32_t fdr10 = port->attrs.mlnx_speed_active;
+	uint32_t espeed = port->attrs.espeed_active;
 
 	fprintf(f, "%s[%d]", out_prefix ? out_prefix : "", port->portnum);
 	if (port->node->type != IB_NODE_SWITCH)
@@ -458,13 +472,6 @@ static void out_ca_port(ibnd_port_t *port, int group, const char *out_prefix)
 				       port->remoteport->node->guid,
 				       port->remoteport->node->nodedesc);
 
-	cap_mask = mad_get_field(port->info, 0, IB_PORT_CAPMASK_F);
-	if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
-		espeed = mad_get_field(port->info, 0,
-				       IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
-	else
-		espeed = 0;
-
 	fprintf(f, "\t\t# lid %d lmc %d \"%s\" lid %d %s%s",
 		port->base_lid, port->lmc, rem_nodename,
 		port->remoteport->node->type == IB_NODE_SWITCH ?
@@ -558,8 +565,10 @@ static int dump_topology(int group, ibnd_fabric_t *fabric)
 	fprintf(f, "#\n# Topology file: generated on %s#\n", ctime(&t));
 	if (report_max_hops)
 		fprintf(f, "# Reported max hops discovered: %u\n"
-			"# Total MADs used: %u\n",
-			fabric->maxhops_discovered, fabric->total_mads_used);
+			"# Total MADs used: %u\n"
+			"# SMP window final: %u peak: %u\n",
+			fabric->maxhops_discovered, fabric->total_mads_used,
+			fabric->smp_window_final, fabric->smp_window_peak);
 	fprintf(f, "# Initiated from node %016" PRIx64 " port %016" PRIx64 "\n",
 		fabric->from_node->guid,
 		mad_get_field64(fabric->from_node->info, 0,
@@ -697,34 +706,18 @@ static void dump_ports_report(ibnd_node_t *node, void *user_data)
 	/* for each port */
 	for (p = node->numports, port = node->ports[p]; p > 0;
 	     port = node->ports[--p]) {
-		uint32_t iwidth, ispeed, fdr10, espeed, cap_mask;
-		uint8_t *info = NULL;
+		uint32_t iwidth, ispeed, fdr10, espeed;
 		if (port == NULL)
 			continue;
-		iwidth =
-		    mad_get_field(port->info, 0, IB_PORT_LINK_WIDTH_ACTIVE_F);
-		ispeed =
-		    mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
-		if (port->node->type == IB_NODE_SWITCH) {
-			if (port->node->ports[0])
-				info = (uint8_t *)&port->node->ports[0]->info;
-		}
-		else
-			info = (uint8_t *)&port->info;
-		if (info) {
-			cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
-			if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
-				espeed = mad_get_field(port->info, 0,
-						       IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
-			else
-				espeed = 0;
-		} else {
+		iwidth = port->attrs.width_active;
+		ispeed = port->attrs.speed_active;
+		espeed = port->attrs.espeed_active;
+		fdr10 = port->attrs.mlnx_speed_active;
+		if (port->node->type == IB_NODE_SWITCH &&
+		    !port->node->ports[0]) {
 			ispeed = 0;
 			iwidth = 0;
-			espeed = 0;
 		}
-		fdr10 = mad_get_field(port->ext_info, 0,
-				      IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F);
 		nodename = remap_node_name(node_name_map,
 					   port->node->guid,
 					   port->node->nodedesc);
@@ -1034,6 +1027,31 @@ static int process_opt(void *context, int ch)
 			p = strtok(NULL, ",");
 		}
 		break;
+	case 6:
+		cfg->smp_window_mode = IBND_SMP_WINDOW_ADAPTIVE;
+		cfg->min_smps = strtoul(optarg, &p, 0);
+		if (*p == ',')
+			cfg->max_smps_limit = strtoul(p + 1, NULL, 0);
+		break;
+	case 7:
+		for (p = strtok(optarg, ","); p; p = strtok(NULL, ",")) {
+			char *port = strchr(p, ':');
+
+			if (!port)
+				return -1;
+			*port++ = '\0';
+			local_ports = realloc(local_ports, (num_local_ports + 1)
+					      * sizeof(*local_ports));
+			if (!local_ports)
+				IBEXIT("out of memory");
+			local_ports[num_local_ports].ca_name = strdup(p);
+			if (!local_ports[num_local_ports].ca_name)
+				IBEXIT("out of memory");
+			local_ports[num_local_ports].ca_port =
+			    strtoul(port, NULL, 0);
+			num_local_ports++;
+		}
+		break;
 	case 's':
 		cfg->show_progress = 1;
 		break;
@@ -1064,6 +1082,12 @@ static int process_opt(void *context, int ch)
 	case 'o':
 		cfg->max_smps = strtoul(optarg, NULL, 0);
 		break;
+	case 8:
+		report_stats = 1;
+		break;
+	case 9:
+		via_sa = 1;
+		break;
 	default:
 		return -1;
 	}
@@ -1100,6 +1124,15 @@ int main(int argc, char **argv)
 		{"outstanding_smps", 'o', 1, NULL,
 		 "specify the number of outstanding SMP's which should be "
 		 "issued during the scan"},
+		{"adaptive_smps", 6, 1, "<min>[,<max>]",
+		 "adapt the number of outstanding SMP's between min and max "
+		 "during the scan"},
+		{"local-ports", 7, 1, "<ca>:<port>[,<ca>:<port>...]",
+		 "discover from several local ports in parallel"},
+		{"stats", 8, 0, NULL,
+		 "report SMP counters and RTT histograms of the scan"},
+		{"via-sa", 9, 0, NULL,
+		 "build the topology from SA records instead of an SMP scan"},
 		{}
 	};
 	char usage_args[] = "[topology-file]";
@@ -1124,6 +1157,13 @@ int main(int argc, char **argv)
 
 	node_name_map = open_node_name_map(node_name_map_file);
 
+	/* older caches, and what cannot be streamed, load the whole fabric */
+	if (load_cache_file && list && !ports_report && !cache_file &&
+	    !list_cache(load_cache_file, list)) {
+		close_node_name_map(node_name_map);
+		exit(0);
+	}
+
 	if (diff_cache_file &&
 	    !(diff_fabric = ibnd_load_fabric(diff_cache_file, 0)))
 		IBEXIT("loading cached fabric for diff failed\n");
@@ -1131,6 +1171,15 @@ int main(int argc, char **argv)
 	if (load_cache_file) {
 		if ((fabric = ibnd_load_fabric(load_cache_file, 0)) == NULL)
 			IBEXIT("loading cached fabric failed\n");
+	} else if (via_sa) {
+		if ((fabric = ibnd_discover_fabric_sa(ibd_ca, ibd_ca_port,
+						      &config)) == NULL)
+			IBEXIT("discover via SA failed\n");
+	} else if (num_local_ports) {
+		if ((fabric = ibnd_discover_fabric_ports(local_ports,
+							 num_local_ports,
+							 &config)) == NULL)
+			IBEXIT("discover failed\n");
 	} else {
 		if ((fabric =
 		     ibnd_discover_fabric(ibd_ca, ibd_ca_port, NULL, &config)) == NULL)
@@ -1146,6 +1195,9 @@ int main(int argc, char **argv)
 	else
 		dump_topology(group, fabric);
 
+	if (report_stats && !load_cache_file)
+		dump_discovery_stats(f, fabric);
+
 	if (cache_file)
 		if (ibnd_cache_fabric(fabric, cache_file, 0) < 0)
 			IBEXIT("caching ibnetdiscover data failed\n");
@@ -1153,6 +1205,9 @@ int main(int argc, char **argv)
 	ibnd_destroy_fabric(fabric);
 	if (diff_fabric)
 		ibnd_destroy_fabric(diff_fabric);
+	while (num_local_ports--)
+		free(local_ports[num_local_ports].ca_name);
+	free(local_ports);
 	close_node_name_map(node_name_map);
 	exit(0);
 }
@@ -62,6 +62,7 @@ static nn_map_t *node_name_map = NULL;
 static char *load_cache_file = NULL;
 static uint16_t lid2sl_table[sizeof(uint8_t) * 1024 * 48] = { 0 };
 static int obtain_sl = 1;
+static int via_sa = 0;
 
 static int data_counters;
 static int data_counters_only;
@@ -180,8 +181,7 @@ static void print_port_config(ibnd_node_t * node, int portnum)
 	char width_msg[256];
 	char speed_msg[256];
 	char ext_port_str[256];
-	int iwidth, ispeed, fdr10, espeed, istate, iphystate, cap_mask;
-	uint8_t *info;
+	int iwidth, ispeed, fdr10, espeed, istate, iphystate;
 	int rc;
 
 	ibnd_port_t *port = node->ports[portnum];
@@ -189,23 +189,12 @@ static void print_port_config(ibnd_node_t * node, int portnum)
 	if (!port)
 		return;
 
-	iwidth = mad_get_field(port->info, 0, IB_PORT_LINK_WIDTH_ACTIVE_F);
-	ispeed = mad_get_field(port->info, 0, IB_PORT_LINK_SPEED_ACTIVE_F);
-	fdr10 = mad_get_field(port->ext_info, 0,
-			      IB_MLNX_EXT_PORT_LINK_SPEED_ACTIVE_F) & FDR10;
-
-	if (port->node->type == IB_NODE_SWITCH)
-		info = (uint8_t *)&port->node->ports[0]->info;
-	else
-		info = (uint8_t *)&port->info;
-	cap_mask = mad_get_field(info, 0, IB_PORT_CAPMASK_F);
-	if (cap_mask & be32toh(IB_PORT_CAP_HAS_EXT_SPEEDS))
-		espeed = mad_get_field(port->info, 0,
-				       IB_PORT_LINK_SPEED_EXT_ACTIVE_F);
-	else
-		espeed = 0;
-	istate = mad_get_field(port->info, 0, IB_PORT_STATE_F);
-	iphystate = mad_get_field(port->info, 0, IB_PORT_PHYS_STATE_F);
+	iwidth = port->attrs.width_active;
+	ispeed = port->attrs.speed_active;
+	fdr10 = port->attrs.mlnx_speed_active & FDR10;
+	espeed = port->attrs.espeed_active;
+	istate = port->attrs.state;
+	iphystate = port->attrs.phys_state;
 
 	remote_str[0] = '\0';
 	link_str[0] = '\0';
@@ -941,6 +930,9 @@ static int process_opt(void *context, int ch)
 	case 10:
 		obtain_sl = 0;
 		break;
+	case 11:
+		via_sa = 1;
+		break;
 	case 'G':
 	case 'S':
 		port_guid_str = optarg;
@@ -1019,6 +1011,8 @@ int main(int argc, char **argv)
 		{"outstanding_smps", 'o', 1, NULL,
 		 "specify the number of outstanding SMP's which should be "
 		 "issued during the scan"},
+		{"via-sa", 11, 0, NULL,
+		 "build the topology from SA records instead of an SMP scan"},
 		{}
 	};
 	char usage_args[] = "";
@@ -1086,6 +1080,14 @@ int main(int argc, char **argv)
 			rc = -1;
 			goto close_name_map;
 		}
+	} else if (via_sa) {
+		/* the whole fabric; the node asked for is picked out below */
+		if (!(fabric = ibnd_discover_fabric_sa(ibd_ca, ibd_ca_port,
+						       &config))) {
+			fprintf(stderr, "discover via SA failed\n");
+			rc = -1;
+			goto close_name_map;
+		}
 	} else {
 		if (resolved >= 0) {
 			if (!config.max_hops)